@@ -0,0 +1,70 @@
+// Echo server for the variants that ship a network.h and an accepting
+// net_run: network-without-threadsafety, network-with-threadsafety and the
+// phantomid copy (built with -DNETBENCH_PHANTOMID). Everything a client
+// sends comes straight back through the variant's own net_send, so the
+// driver measures the variant's event loop and nothing else.
+//
+// network-with-threadsafety declares net_send but never defines it; build
+// it with -DNETBENCH_RAW_SEND to echo with send(2) on the client socket.
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "network.h"
+#ifdef NETBENCH_PHANTOMID
+#include "log.h"
+#endif
+
+// The driver writes each message in one send and waits for the echo, so
+// Nagle would only add delayed-ACK stalls to the large payloads
+static void on_client_connected(NetworkEndpoint* endpoint) {
+    int one = 1;
+    setsockopt(endpoint->socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void on_data_received(NetworkEndpoint* endpoint, NetworkPacket* packet) {
+#ifdef NETBENCH_RAW_SEND
+    send(endpoint->socket_fd, packet->data, packet->size, 0);
+#else
+    net_send(endpoint, packet);
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 8080;
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Usage: %s [PORT]\n", argv[0]);
+        return 1;
+    }
+
+    // A client that hangs up mid-echo must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+#ifdef NETBENCH_PHANTOMID
+    log_start(LOG_LEVEL_ERROR);
+#endif
+
+    NetworkEndpoint server = {
+        .address = "0.0.0.0",
+        .port = (uint16_t)port,
+        .protocol = NET_TCP,
+        .role = NET_SERVER,
+        .mode = NET_BLOCKING
+    };
+
+    NetworkProgram program = {
+        .endpoints = &server,
+        .count = 1,
+        .on_receive = on_data_received,
+        .on_connect = on_client_connected
+    };
+
+    if (!net_init(&server)) {
+        fprintf(stderr, "Failed to listen on port %d\n", port);
+        return 1;
+    }
+
+    net_run(&program);
+    return 0;
+}
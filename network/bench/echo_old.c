@@ -0,0 +1,80 @@
+// Echo server for old-network. That variant is a single translation unit
+// with no header, and its net_run only reads endpoints it is handed: it
+// never accepts. The server therefore accepts with the variant's
+// net_accept and serves each connection from its own thread with the
+// variant's net_receive/net_send, which is the closest that code comes to
+// a server. Compare its numbers with that in mind.
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include "network.c"
+
+static void* serve_connection(void* arg) {
+    NetworkEndpoint* client = arg;
+    char buffer[4096];
+
+    for (;;) {
+        NetworkPacket packet = { .data = buffer, .size = sizeof(buffer) };
+        ssize_t received = net_receive(client, &packet);
+        if (received <= 0) break;
+
+        // net_receive leaves packet.size at the buffer size
+        packet.size = (size_t)received;
+        if (net_send(client, &packet) < 0) break;
+    }
+
+    net_close(client);
+    free(client);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    int port = argc > 1 ? atoi(argv[1]) : 8080;
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Usage: %s [PORT]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    NetworkEndpoint server = {
+        .address = "0.0.0.0",
+        .port = (uint16_t)port,
+        .protocol = NET_TCP,
+        .role = NET_SERVER,
+        .mode = NET_BLOCKING
+    };
+
+    // old-network's net_init ignores bind and listen failures, so check
+    // that the socket really ended up on the requested port
+    struct sockaddr_in bound = {0};
+    socklen_t bound_len = sizeof(bound);
+    if (!net_init(&server) ||
+        getsockname(server.socket_fd, (struct sockaddr*)&bound, &bound_len) < 0 ||
+        ntohs(bound.sin_port) != port) {
+        fprintf(stderr, "Failed to listen on port %d\n", port);
+        return 1;
+    }
+
+    for (;;) {
+        NetworkEndpoint* client = calloc(1, sizeof(NetworkEndpoint));
+        if (!client) return 1;
+        if (!net_accept(&server, client)) {
+            free(client);
+            continue;
+        }
+        // As in echo.c: no Nagle on the echo
+        int one = 1;
+        setsockopt(client->socket_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, client) != 0) {
+            net_close(client);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
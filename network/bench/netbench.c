@@ -0,0 +1,667 @@
+// Common driver for the network variant echo servers. Runs a fixed set of
+// scenarios against one server, writes a flat JSON report and, given a
+// baseline report, flags metrics that moved the wrong way by more than a
+// threshold.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "metrics.h"
+
+#define BENCH_MAX_CONNECTIONS 64   // Busy connections in the small-message scenario
+#define BENCH_MAX_IDLE 4096
+#define BENCH_MAX_METRICS 64
+#define BENCH_MAX_PAYLOAD (16 << 20)
+#define BENCH_TIMEOUT_MS 2000      // Per read or write; a stuck echo is a failure
+#define BENCH_STARTUP_MS 5000      // How long to wait for the server to listen
+#define BENCH_MAX_RUNS 15
+#define BENCH_SETTLE_MS 250        // Between runs, for the server to reap the last one's connections
+
+typedef struct {
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t count;            // Completed round trips or connections
+    uint64_t failures;         // Refused, reset or timed out
+    uint64_t bytes;            // Payload echoed
+    uint64_t max_ns;
+} BenchHistogram;
+
+// Metrics whose names end in _per_sec are better higher and those ending in
+// _us or .failures are better lower; anything else is informational and
+// never compared
+typedef struct {
+    char name[64];
+    double value;
+} BenchMetric;
+
+typedef struct {
+    BenchMetric items[BENCH_MAX_METRICS];
+    size_t count;
+} BenchMetrics;
+
+typedef struct {
+    pthread_t thread;
+    int fd;
+    uint64_t deadline_ns;
+    BenchHistogram histogram;
+} BenchWorker;
+
+static struct {
+    const char* host;
+    uint16_t port;
+    const char* variant;
+    uint32_t duration_s;       // Per scenario
+    size_t runs;               // Each metric reported is the median over this many
+    size_t connections;
+    size_t idle;
+    size_t small_size;
+    size_t large_size;
+    const char* output;
+    const char* baseline;
+    double threshold;          // Fraction, e.g. 0.10
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} g_bench = {
+    .host = "127.0.0.1",
+    .port = 9100,
+    .variant = "unnamed",
+    .duration_s = 3,
+    .runs = 3,
+    .connections = 4,
+    .idle = 200,
+    .small_size = 32,
+    .large_size = 65536,
+    .threshold = 0.10
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record(BenchHistogram* histogram, uint64_t latency) {
+    histogram->counts[metrics_bucket(latency)]++;
+    histogram->count++;
+    if (latency > histogram->max_ns) histogram->max_ns = latency;
+}
+
+static void merge(BenchHistogram* into, const BenchHistogram* from) {
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) into->counts[b] += from->counts[b];
+    into->count += from->count;
+    into->failures += from->failures;
+    into->bytes += from->bytes;
+    if (from->max_ns > into->max_ns) into->max_ns = from->max_ns;
+}
+
+static void add_metric(BenchMetrics* metrics, const char* scenario, const char* name, double value) {
+    if (metrics->count == BENCH_MAX_METRICS) return;
+    BenchMetric* metric = &metrics->items[metrics->count++];
+    snprintf(metric->name, sizeof(metric->name), "%s.%s", scenario, name);
+    metric->value = value;
+}
+
+static void add_latency(BenchMetrics* metrics, const char* scenario, const BenchHistogram* h) {
+    add_metric(metrics, scenario, "p50_us", metrics_percentile(h->counts, h->count, h->max_ns, 0.50) / 1e3);
+    add_metric(metrics, scenario, "p99_us", metrics_percentile(h->counts, h->count, h->max_ns, 0.99) / 1e3);
+    add_metric(metrics, scenario, "failures", (double)h->failures);
+}
+
+static int open_connection(void) {
+    int fd = socket(g_bench.addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    // Bounds connect as well as every later send and recv
+    struct timeval timeout = { BENCH_TIMEOUT_MS / 1000, (BENCH_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr*)&g_bench.addr, g_bench.addr_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, data, size, 0);
+        if (received <= 0) return false;
+        data += received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+// One request, one echo; the servers echo in whatever chunks they read, so
+// the reply is complete once as many bytes came back as went out
+static bool round_trip(int fd, const char* message, char* reply, size_t size) {
+    return send_all(fd, message, size) && recv_all(fd, reply, size) &&
+           memcmp(message, reply, size) == 0;
+}
+
+static void fill(char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) data[i] = (char)('a' + i % 26);
+}
+
+// Closed-loop ping-pong on one connection until the deadline
+static void* run_small(void* arg) {
+    BenchWorker* worker = arg;
+    char message[4096], reply[4096];
+    fill(message, g_bench.small_size);
+
+    while (now_ns() < worker->deadline_ns) {
+        uint64_t start = now_ns();
+        if (!round_trip(worker->fd, message, reply, g_bench.small_size)) {
+            worker->histogram.failures++;
+            break;
+        }
+        record(&worker->histogram, now_ns() - start);
+        worker->histogram.bytes += g_bench.small_size;
+    }
+    return NULL;
+}
+
+// Small messages over the busy connections at once, one thread each. The
+// connections are opened by the caller so the idle scenario can reuse this.
+static bool scenario_small(BenchMetrics* metrics, const char* scenario, int* busy_fds) {
+    BenchWorker workers[BENCH_MAX_CONNECTIONS] = {0};
+    BenchHistogram total = {0};
+    uint64_t start = now_ns();
+    uint64_t deadline = start + g_bench.duration_s * 1000000000ull;
+
+    for (size_t i = 0; i < g_bench.connections; i++) {
+        workers[i].fd = busy_fds[i];
+        workers[i].deadline_ns = deadline;
+        if (workers[i].fd < 0) {
+            workers[i].histogram.failures++;
+            continue;
+        }
+        if (pthread_create(&workers[i].thread, NULL, run_small, &workers[i]) != 0) {
+            fprintf(stderr, "Cannot start worker thread\n");
+            return false;
+        }
+    }
+    for (size_t i = 0; i < g_bench.connections; i++) {
+        if (workers[i].fd >= 0) pthread_join(workers[i].thread, NULL);
+        merge(&total, &workers[i].histogram);
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    add_metric(metrics, scenario, "ops_per_sec", total.count / elapsed);
+    add_latency(metrics, scenario, &total);
+    return true;
+}
+
+// Connect, echo one small message, half-close and wait for the server to
+// hang up: the full lifecycle of a short connection, serially
+static bool scenario_churn(BenchMetrics* metrics) {
+    BenchHistogram h = {0};
+    char message[4096], reply[4096];
+    fill(message, g_bench.small_size);
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + g_bench.duration_s * 1000000000ull;
+    while (now_ns() < deadline) {
+        uint64_t begin = now_ns();
+        int fd = open_connection();
+        bool ok = fd >= 0 && round_trip(fd, message, reply, g_bench.small_size);
+        if (ok) {
+            shutdown(fd, SHUT_WR);
+            ok = recv(fd, reply, sizeof(reply), 0) == 0;
+        }
+        if (fd >= 0) close(fd);
+
+        if (ok) {
+            record(&h, now_ns() - begin);
+        } else {
+            // A server that stops accepting would otherwise be hammered
+            h.failures++;
+            usleep(1000);
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    add_metric(metrics, "churn", "connections_per_sec", h.count / elapsed);
+    add_latency(metrics, "churn", &h);
+    return true;
+}
+
+// Write and read concurrently: a payload larger than the socket buffers
+// would deadlock a client that sends it all before reading
+static bool echo_large(int fd, const char* message, char* reply, size_t size) {
+    size_t sent = 0, received = 0;
+    int flags = fcntl(fd, F_GETFL);
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return false;
+
+    while (received < size) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN | (sent < size ? POLLOUT : 0) };
+        if (poll(&pfd, 1, BENCH_TIMEOUT_MS) <= 0) break;
+
+        if ((pfd.revents & POLLOUT) && sent < size) {
+            ssize_t n = send(fd, message + sent, size - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN) break;
+            if (n > 0) sent += (size_t)n;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(fd, reply + received, size - received, 0);
+            if (n == 0 || (n < 0 && errno != EAGAIN)) break;
+            if (n > 0) received += (size_t)n;
+        }
+    }
+
+    fcntl(fd, F_SETFL, flags);
+    return received == size && memcmp(message, reply, size) == 0;
+}
+
+static bool scenario_large(BenchMetrics* metrics) {
+    BenchHistogram h = {0};
+    char* message = malloc(g_bench.large_size);
+    char* reply = malloc(g_bench.large_size);
+    if (!message || !reply) {
+        free(message);
+        free(reply);
+        fprintf(stderr, "Out of memory for %zu byte payloads\n", g_bench.large_size);
+        return false;
+    }
+    fill(message, g_bench.large_size);
+
+    int fd = open_connection();
+    uint64_t start = now_ns();
+    uint64_t deadline = start + g_bench.duration_s * 1000000000ull;
+    if (fd < 0) h.failures++;
+    while (fd >= 0 && now_ns() < deadline) {
+        uint64_t begin = now_ns();
+        if (!echo_large(fd, message, reply, g_bench.large_size)) {
+            h.failures++;
+            break;
+        }
+        record(&h, now_ns() - begin);
+        h.bytes += g_bench.large_size;
+    }
+    if (fd >= 0) close(fd);
+
+    double elapsed = (now_ns() - start) / 1e9;
+    add_metric(metrics, "large", "mb_per_sec", h.bytes / elapsed / 1e6);
+    add_metric(metrics, "large", "echoes_per_sec", h.count / elapsed);
+    add_latency(metrics, "large", &h);
+    free(message);
+    free(reply);
+    return true;
+}
+
+// The busy connections open first so servers with a fixed client table
+// still serve them; then the idle ones pile up behind. A server that
+// cannot hold them all either refuses them or leaves them unread, and
+// idle.refused counts the ones it closed.
+static bool scenario_idle(BenchMetrics* metrics) {
+    int busy[BENCH_MAX_CONNECTIONS];
+    int* idle = malloc(g_bench.idle * sizeof(int));
+    size_t opened = 0, refused = 0;
+    if (!idle) return false;
+
+    for (size_t i = 0; i < g_bench.connections; i++) busy[i] = open_connection();
+    // Once the server stops taking connections each further attempt would
+    // sit out the connect timeout, so the first failure ends the pile-up
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < g_bench.idle; i++) {
+        idle[i] = opened == i ? open_connection() : -1;
+        if (idle[i] >= 0) opened++;
+    }
+    double setup = (now_ns() - start) / 1e9;
+
+    bool result = scenario_small(metrics, "idle", busy);
+
+    for (size_t i = 0; i < g_bench.idle; i++) {
+        if (idle[i] < 0) continue;
+        struct pollfd pfd = { .fd = idle[i], .events = POLLIN };
+        if (poll(&pfd, 1, 0) > 0) refused++;
+        close(idle[i]);
+    }
+    for (size_t i = 0; i < g_bench.connections; i++) {
+        if (busy[i] >= 0) close(busy[i]);
+    }
+    free(idle);
+
+    // A short listen backlog shows up here as whole seconds of SYN retries.
+    // Too bimodal to compare, so it is reported but never flagged.
+    add_metric(metrics, "idle", "setup_ms", setup * 1e3);
+    add_metric(metrics, "idle", "connected", (double)opened);
+    add_metric(metrics, "idle", "refused", (double)refused);
+    return result;
+}
+
+static bool run_small_scenario(BenchMetrics* metrics) {
+    int busy[BENCH_MAX_CONNECTIONS];
+    for (size_t i = 0; i < g_bench.connections; i++) busy[i] = open_connection();
+    bool result = scenario_small(metrics, "small", busy);
+    for (size_t i = 0; i < g_bench.connections; i++) {
+        if (busy[i] >= 0) close(busy[i]);
+    }
+    return result;
+}
+
+static bool resolve(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* info;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", g_bench.port);
+    if (getaddrinfo(g_bench.host, port, &hints, &info) != 0) return false;
+    memcpy(&g_bench.addr, info->ai_addr, info->ai_addrlen);
+    g_bench.addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+    return true;
+}
+
+static bool ends_with(const char* text, const char* suffix) {
+    size_t length = strlen(text), suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(text + length - suffix_length, suffix) == 0;
+}
+
+// The harness starts the server just before the driver. The probe that
+// finds it is returned and stays open for the whole run: network-with-
+// threadsafety deadlocks on the first disconnect it sees, and a probe that
+// hung up at once would leave every scenario measuring a stuck server.
+static int wait_for_server(void) {
+    uint64_t deadline = now_ns() + BENCH_STARTUP_MS * 1000000ull;
+    while (now_ns() < deadline) {
+        int fd = open_connection();
+        if (fd >= 0) return fd;
+        usleep(20000);
+    }
+    return -1;
+}
+
+// Idle runs last: some variants never close the connections they
+// cannot hold, and those would crowd the other scenarios
+static bool run_scenarios(BenchMetrics* metrics) {
+    return run_small_scenario(metrics) && scenario_large(metrics) &&
+           scenario_churn(metrics) && scenario_idle(metrics);
+}
+
+static int compare_values(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Every run records the same metrics in the same order. Failures add up
+// across runs so a single bad one still shows; everything else takes the
+// median, which a one-off stall in a single run cannot move.
+static void combine_runs(const BenchMetrics* runs, size_t count, BenchMetrics* metrics) {
+    double values[BENCH_MAX_RUNS];
+
+    *metrics = runs[0];
+    for (size_t i = 0; i < metrics->count; i++) {
+        BenchMetric* metric = &metrics->items[i];
+        for (size_t r = 0; r < count; r++) values[r] = runs[r].items[i].value;
+
+        if (ends_with(metric->name, ".failures")) {
+            metric->value = 0;
+            for (size_t r = 0; r < count; r++) metric->value += values[r];
+            continue;
+        }
+        qsort(values, count, sizeof(double), compare_values);
+        metric->value = count % 2 ? values[count / 2] :
+                        (values[count / 2 - 1] + values[count / 2]) / 2;
+    }
+}
+
+// A run with failures or a scenario that completed nothing measured a
+// broken server, not a slow one, and must not pass or become a baseline
+static bool check_run(const BenchMetrics* metrics) {
+    bool ok = true;
+    for (size_t i = 0; i < metrics->count; i++) {
+        const BenchMetric* metric = &metrics->items[i];
+        if (ends_with(metric->name, ".failures") && metric->value > 0) {
+            fprintf(stderr, "%s: %s %.0f\n", g_bench.variant, metric->name, metric->value);
+            ok = false;
+        } else if (ends_with(metric->name, "_per_sec") && metric->value <= 0) {
+            fprintf(stderr, "%s: %s completed no operations\n", g_bench.variant, metric->name);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+static void report(FILE* out, const BenchMetrics* metrics) {
+    fprintf(out, "{\n  \"variant\": \"%s\",\n  \"duration_s\": %u,\n  \"runs\": %zu,\n",
+            g_bench.variant, g_bench.duration_s, g_bench.runs);
+    fprintf(out, "  \"connections\": %zu,\n  \"idle\": %zu,\n", g_bench.connections, g_bench.idle);
+    fprintf(out, "  \"small_size\": %zu,\n  \"large_size\": %zu,\n", g_bench.small_size, g_bench.large_size);
+    fprintf(out, "  \"metrics\": {\n");
+    for (size_t i = 0; i < metrics->count; i++) {
+        fprintf(out, "    \"%s\": %.3f%s\n", metrics->items[i].name, metrics->items[i].value,
+                i + 1 < metrics->count ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+}
+
+// Baselines are this program's own reports, one metric per line. One with
+// a zero throughput or latency was recorded against a broken server and
+// would make every later comparison meaningless, so it is refused.
+static bool load_baseline(const char* path, BenchMetrics* baseline) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot read baseline %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[256];
+    bool in_metrics = false;
+    baseline->count = 0;
+    while (fgets(line, sizeof(line), file) && baseline->count < BENCH_MAX_METRICS) {
+        if (strstr(line, "\"metrics\"")) {
+            in_metrics = true;
+            continue;
+        }
+        BenchMetric* metric = &baseline->items[baseline->count];
+        if (in_metrics && sscanf(line, " \"%63[^\"]\": %lf", metric->name, &metric->value) == 2) {
+            baseline->count++;
+        }
+    }
+    fclose(file);
+
+    for (size_t i = 0; i < baseline->count; i++) {
+        const BenchMetric* metric = &baseline->items[i];
+        if ((ends_with(metric->name, "_per_sec") || ends_with(metric->name, "_us")) && metric->value <= 0) {
+            fprintf(stderr, "Baseline %s is invalid: %s is 0; record it again with --update\n",
+                    path, metric->name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Prints one line per compared metric; returns how many regressed
+static size_t compare(const BenchMetrics* current, const BenchMetrics* baseline) {
+    size_t regressions = 0;
+
+    fprintf(stderr, "%-28s %12s %12s %8s\n", g_bench.variant, "baseline", "current", "change");
+    for (size_t i = 0; i < current->count; i++) {
+        const BenchMetric* metric = &current->items[i];
+        bool higher_better = ends_with(metric->name, "_per_sec");
+        bool failures = ends_with(metric->name, ".failures");
+        if (!higher_better && !failures && !ends_with(metric->name, "_us")) continue;
+
+        const BenchMetric* base = NULL;
+        for (size_t j = 0; j < baseline->count && !base; j++) {
+            if (strcmp(baseline->items[j].name, metric->name) == 0) base = &baseline->items[j];
+        }
+        if (!base) continue;
+
+        // Failures have no scale to be relative to: any rise from none regressed
+        bool regressed;
+        if (base->value <= 0) {
+            regressed = metric->value > 0;
+            fprintf(stderr, "%-28s %12.1f %12.1f %8s%s\n", metric->name, base->value,
+                    metric->value, regressed ? "new" : "", regressed ? "  REGRESSION" : "");
+        } else {
+            double change = (metric->value - base->value) / base->value;
+            regressed = higher_better ? change < -g_bench.threshold : change > g_bench.threshold;
+            fprintf(stderr, "%-28s %12.1f %12.1f %+7.1f%%%s\n", metric->name, base->value,
+                    metric->value, change * 100, regressed ? "  REGRESSION" : "");
+        }
+        if (regressed) regressions++;
+    }
+    return regressions;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -H, --host HOST         Echo server address (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT         Echo server port (default: 9100)\n");
+    printf("  -n, --name NAME         Variant name recorded in the report\n");
+    printf("  -d, --duration SEC      Length of each scenario (default: 3)\n");
+    printf("  -r, --runs N            Run every scenario N times and report medians (default: 3)\n");
+    printf("  -c, --connections N     Busy connections in the message scenarios (default: 4)\n");
+    printf("  -i, --idle N            Idle connections in the idle scenario (default: 200)\n");
+    printf("  -s, --small BYTES       Small message size (default: 32)\n");
+    printf("  -l, --large BYTES       Large payload size (default: 65536)\n");
+    printf("  -o, --output PATH       Write the JSON report to PATH instead of stdout\n");
+    printf("  -b, --baseline PATH     Compare against an earlier report\n");
+    printf("  -T, --threshold PCT     Change that counts as a regression (default: 10)\n");
+    printf("  -h, --help              Show this help message\n");
+    printf("Exits with 2 when a metric regressed against the baseline and with 1 when\n");
+    printf("a scenario failed or completed nothing.\n");
+}
+
+// Parses a count option into *target, reporting out-of-range values
+static bool parse_count(const char* value, const char* what, size_t min, size_t max, size_t* target) {
+    long count = atol(value);
+    if (count < (long)min || count > (long)max) {
+        fprintf(stderr, "%s must be between %zu and %zu\n", what, min, max);
+        return false;
+    }
+    *target = (size_t)count;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (!value) {
+            fprintf(stderr, "Unknown option or missing value: %s\n", arg);
+            return 1;
+        }
+        i++;
+
+        if (strcmp(arg, "-H") == 0 || strcmp(arg, "--host") == 0) {
+            g_bench.host = value;
+        }
+        else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            int port = atoi(value);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "Invalid port number. Must be between 1 and 65535\n");
+                return 1;
+            }
+            g_bench.port = (uint16_t)port;
+        }
+        else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--name") == 0) {
+            g_bench.variant = value;
+        }
+        else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) {
+            int seconds = atoi(value);
+            if (seconds <= 0) {
+                fprintf(stderr, "Duration must be at least 1 second\n");
+                return 1;
+            }
+            g_bench.duration_s = (uint32_t)seconds;
+        }
+        else if (strcmp(arg, "-r") == 0 || strcmp(arg, "--runs") == 0) {
+            if (!parse_count(value, "Runs", 1, BENCH_MAX_RUNS, &g_bench.runs)) return 1;
+        }
+        else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--connections") == 0) {
+            if (!parse_count(value, "Connections", 1, BENCH_MAX_CONNECTIONS, &g_bench.connections)) return 1;
+        }
+        else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--idle") == 0) {
+            if (!parse_count(value, "Idle connections", 0, BENCH_MAX_IDLE, &g_bench.idle)) return 1;
+        }
+        else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--small") == 0) {
+            if (!parse_count(value, "Small message size", 1, 4096, &g_bench.small_size)) return 1;
+        }
+        else if (strcmp(arg, "-l") == 0 || strcmp(arg, "--large") == 0) {
+            if (!parse_count(value, "Large payload size", 1, BENCH_MAX_PAYLOAD, &g_bench.large_size)) return 1;
+        }
+        else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            g_bench.output = value;
+        }
+        else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--baseline") == 0) {
+            g_bench.baseline = value;
+        }
+        else if (strcmp(arg, "-T") == 0 || strcmp(arg, "--threshold") == 0) {
+            double percent = atof(value);
+            if (percent <= 0) {
+                fprintf(stderr, "Threshold must be a positive percentage\n");
+                return 1;
+            }
+            g_bench.threshold = percent / 100.0;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return 1;
+        }
+    }
+
+    BenchMetrics baseline = {0};
+    if (g_bench.baseline && !load_baseline(g_bench.baseline, &baseline)) return 1;
+    if (!resolve()) {
+        fprintf(stderr, "Cannot resolve %s\n", g_bench.host);
+        return 1;
+    }
+    int probe = wait_for_server();
+    if (probe < 0) {
+        fprintf(stderr, "No echo server on %s:%u\n", g_bench.host, g_bench.port);
+        return 1;
+    }
+
+    static BenchMetrics runs[BENCH_MAX_RUNS];
+    BenchMetrics metrics;
+    for (size_t r = 0; r < g_bench.runs; r++) {
+        // The fixed-table variants accept a connection they have no slot for
+        // and never serve it, so the idle pile-up has to be gone first
+        if (r > 0) usleep(BENCH_SETTLE_MS * 1000);
+        if (!run_scenarios(&runs[r])) return 1;
+    }
+    combine_runs(runs, g_bench.runs, &metrics);
+    close(probe);
+
+    FILE* out = stdout;
+    if (g_bench.output && !(out = fopen(g_bench.output, "w"))) {
+        fprintf(stderr, "Cannot write %s: %s\n", g_bench.output, strerror(errno));
+        return 1;
+    }
+    report(out, &metrics);
+    if (out != stdout) fclose(out);
+
+    if (!check_run(&metrics)) return 1;
+    if (g_bench.baseline && compare(&metrics, &baseline) > 0) return 2;
+    return 0;
+}
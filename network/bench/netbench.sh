@@ -0,0 +1,102 @@
+#!/bin/sh
+# Builds an echo server from each network variant, runs the netbench driver
+# against it and compares the report with the stored baseline.
+#
+#   ./netbench.sh [--update] [--threshold PCT] [--duration SEC] [--runs N] [VARIANT...]
+#
+# Variants: old-network, network-without-threadsafety,
+# network-with-threadsafety and phantomid (all by default). Each metric is
+# the median of --runs runs (default 3). Reports go to results/<variant>.json
+# and baselines live in baselines/<variant>.json; --update replaces the
+# baselines with this run. A run with failures or a scenario that completed
+# nothing fails and is never saved as a baseline. Exits non-zero when any
+# variant failed or regressed by more than the threshold (default 10%).
+# network-with-threadsafety deadlocks on the first client that disconnects,
+# so it fails every run after its first small scenario until that is fixed.
+set -u
+
+cd "$(dirname "$0")" || exit 1
+
+UPDATE=0
+THRESHOLD=10
+DURATION=3
+RUNS=3
+PORT=${NETBENCH_PORT:-9100}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --update) UPDATE=1 ;;
+        --threshold) THRESHOLD=$2; shift ;;
+        --duration) DURATION=$2; shift ;;
+        --runs) RUNS=$2; shift ;;
+        -h|--help) sed -n '2,15p' "$0" | cut -c3-; exit 0 ;;
+        -*) echo "Unknown option: $1" >&2; exit 1 ;;
+        *) break ;;
+    esac
+    shift
+done
+
+VARIANTS=${*:-old-network network-without-threadsafety network-with-threadsafety phantomid}
+PHANTOMID="../phantomid/network.c ../phantomid/nettls.c ../phantomid/netpipe.c ../phantomid/log.c \
+    ../phantomid/metrics.c ../phantomid/lockprof.c ../phantomid/trace.c ../phantomid/affinity.c"
+
+mkdir -p build results baselines
+
+build() {
+    case "$1" in
+        old-network)
+            $CC $CFLAGS -I../old-network -o build/echo-$1 echo_old.c -pthread ;;
+        network-without-threadsafety)
+            $CC $CFLAGS -I../$1 -o build/echo-$1 echo.c ../$1/network.c ;;
+        network-with-threadsafety)
+            $CC $CFLAGS -DNETBENCH_RAW_SEND -I../$1 -o build/echo-$1 echo.c ../$1/network.c -pthread ;;
+        phantomid)
+            $CC $CFLAGS -DNETBENCH_PHANTOMID -I../phantomid -o build/echo-$1 echo.c $PHANTOMID -pthread -lssl -lcrypto ;;
+        *)
+            echo "Unknown variant: $1" >&2; return 1 ;;
+    esac
+}
+
+$CC $CFLAGS -I../phantomid -o build/netbench netbench.c ../phantomid/metrics.c ../phantomid/log.c ../phantomid/affinity.c -pthread || exit 1
+
+STATUS=0
+PORT=$((PORT - 1))
+for VARIANT in $VARIANTS; do
+    # A fresh port per variant keeps clear of the last one's TIME_WAITs
+    PORT=$((PORT + 1))
+    if ! build "$VARIANT"; then
+        STATUS=1
+        continue
+    fi
+
+    # The variants print a line per connection; that cost stays in the run
+    ./build/echo-$VARIANT "$PORT" > /dev/null 2>&1 &
+    SERVER=$!
+
+    BASELINE=""
+    if [ "$UPDATE" -eq 0 ] && [ -f "baselines/$VARIANT.json" ]; then
+        BASELINE="-b baselines/$VARIANT.json"
+    fi
+
+    ./build/netbench -p "$PORT" -n "$VARIANT" -d "$DURATION" -r "$RUNS" -T "$THRESHOLD" \
+        -o "results/$VARIANT.json" $BASELINE
+    RESULT=$?
+
+    kill "$SERVER" 2> /dev/null
+    wait "$SERVER" 2> /dev/null
+
+    case $RESULT in
+        0) ;;
+        2) echo "$VARIANT: regression over $THRESHOLD%" >&2; STATUS=2 ;;
+        *) echo "$VARIANT: benchmark failed" >&2; STATUS=1; continue ;;
+    esac
+
+    if [ "$UPDATE" -eq 1 ] || [ ! -f "baselines/$VARIANT.json" ]; then
+        cp "results/$VARIANT.json" "baselines/$VARIANT.json"
+        echo "$VARIANT: baseline saved"
+    fi
+done
+
+exit $STATUS
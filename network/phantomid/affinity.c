@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+#include "log.h"
+
+// From linux/mempolicy.h, which not every toolchain installs
+#define AFFINITY_MPOL_PREFERRED 1
+#define AFFINITY_MPOL_F_NODE (1 << 0)
+#define AFFINITY_MPOL_F_ADDR (1 << 1)
+#define AFFINITY_MAX_NODES 64      // Nodes a preference can name
+
+static struct {
+    cpu_set_t sets[THREAD_ROLE_COUNT];
+    bool pinned[THREAD_ROLE_COUNT];
+    cpu_set_t process;             // Mask at startup, for unpinned roles
+    bool have_process;
+    bool configured;               // Any role pinned
+} g_affinity;
+
+static const char* role_names[THREAD_ROLE_COUNT] = {
+    "reactor", "logger", "metrics", "wal", "checkpoint", "replication"
+};
+
+bool affinity_parse_role(const char* name, ThreadRole* role) {
+    for (int i = 0; i < THREAD_ROLE_COUNT; i++) {
+        if (strcmp(name, role_names[i]) == 0) {
+            *role = (ThreadRole)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// NUMA node of a CPU from sysfs, -1 when the kernel has no NUMA support
+static int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (!dir) return -1;
+
+    int node = -1;
+    struct dirent* entry;
+    while (node < 0 && (entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// Bit n set for each node n that has a CPU in set
+static unsigned long set_nodes(const cpu_set_t* set) {
+    unsigned long nodes = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int node = cpu_node(cpu);
+        if (node >= 0 && node < AFFINITY_MAX_NODES) nodes |= 1ul << node;
+    }
+    return nodes;
+}
+
+// Writes ranges such as "0-3,8"
+static void format_cpus(const cpu_set_t* set, char* out, size_t size) {
+    size_t offset = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && offset < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+        int n = last > cpu
+            ? snprintf(out + offset, size - offset, "%s%d-%d", offset ? "," : "", cpu, last)
+            : snprintf(out + offset, size - offset, "%s%d", offset ? "," : "", cpu);
+        offset += n > 0 ? (size_t)n : 0;
+        cpu = last;
+    }
+}
+
+static void format_nodes(unsigned long nodes, char* out, size_t size) {
+    size_t offset = 0;
+    out[0] = '\0';
+    for (int node = 0; node < AFFINITY_MAX_NODES && offset < size; node++) {
+        if (!(nodes & (1ul << node))) continue;
+        int n = snprintf(out + offset, size - offset, "%s%d", offset ? "," : "", node);
+        offset += n > 0 ? (size_t)n : 0;
+    }
+    if (offset == 0) snprintf(out, size, "unknown");
+}
+
+bool affinity_set(ThreadRole role, const char* cpus) {
+    if (!g_affinity.have_process) {
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &g_affinity.process) != 0) return false;
+        g_affinity.have_process = true;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    const char* p = cpus;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) return false;
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (!CPU_ISSET(cpu, &g_affinity.process)) return false;
+            CPU_SET(cpu, &set);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return false;
+        p = end;
+    }
+    if (CPU_COUNT(&set) == 0) return false;
+
+    g_affinity.sets[role] = set;
+    g_affinity.pinned[role] = true;
+    g_affinity.configured = true;
+    return true;
+}
+
+void affinity_apply(ThreadRole role) {
+    if (!g_affinity.configured) return;
+
+    const cpu_set_t* set = g_affinity.pinned[role] ? &g_affinity.sets[role] : &g_affinity.process;
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), set);
+    if (result != 0) {
+        log_warn("Cannot pin %s thread: %s", role_names[role], strerror(result));
+        return;
+    }
+    if (!g_affinity.pinned[role]) return;
+
+    // Pinning alone keeps first-touch allocations local; the preference
+    // also covers pages faulted while the kernel is short on that node
+    unsigned long nodes = set_nodes(set);
+    if (nodes == 0 || (nodes & (nodes - 1)) != 0) return;
+    if (syscall(SYS_set_mempolicy, AFFINITY_MPOL_PREFERRED, &nodes, AFFINITY_MAX_NODES + 1) != 0) {
+        log_warn("Cannot prefer local memory for %s thread: %s", role_names[role], strerror(errno));
+    }
+}
+
+void affinity_report(const void* table) {
+    char cpus[256], nodes[128];
+
+    if (!g_affinity.configured) {
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            format_cpus(&set, cpus, sizeof(cpus));
+            format_nodes(set_nodes(&set), nodes, sizeof(nodes));
+            log_info("Placement: no CPU sets configured, threads share CPUs %s (NUMA nodes %s)", cpus, nodes);
+        }
+    }
+    for (int i = 0; g_affinity.configured && i < THREAD_ROLE_COUNT; i++) {
+        const cpu_set_t* set = g_affinity.pinned[i] ? &g_affinity.sets[i] : &g_affinity.process;
+        format_cpus(set, cpus, sizeof(cpus));
+        format_nodes(set_nodes(set), nodes, sizeof(nodes));
+        log_info("Placement: %s %s CPUs %s (NUMA nodes %s)", role_names[i],
+                 g_affinity.pinned[i] ? "pinned to" : "unpinned on", cpus, nodes);
+    }
+
+    // Asking for the node of an address faults the page in if it was not yet
+    int node = -1;
+    if (table && syscall(SYS_get_mempolicy, &node, NULL, 0, table,
+                         AFFINITY_MPOL_F_NODE | AFFINITY_MPOL_F_ADDR) == 0) {
+        log_info("Placement: account table on NUMA node %d", node);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdbool.h>
+
+// Daemon threads, grouped by what they do. Each role can be pinned to its
+// own CPU set.
+typedef enum {
+    THREAD_REACTOR,            // net_run: accepting and serving clients
+    THREAD_LOGGER,             // Log flusher
+    THREAD_METRICS,            // Prometheus listener
+    THREAD_WAL,                // Group-commit flusher
+    THREAD_CHECKPOINT,         // Background snapshots
+    THREAD_REPLICATION,        // Acceptor, senders and follower
+    THREAD_ROLE_COUNT
+} ThreadRole;
+
+// Pin role to cpus, a list such as "0-3,8". Call before any thread starts.
+// Fails on CPUs this process may not run on.
+bool affinity_set(ThreadRole role, const char* cpus);
+bool affinity_parse_role(const char* name, ThreadRole* role);
+
+// Called by each thread as it starts. A pinned role moves onto its CPU set
+// and, when the set lies on one NUMA node, prefers that node for memory, so
+// buffers it allocates and first touches stay local. Other roles get the
+// mask the process started with rather than their creator's. Does nothing
+// unless some role was pinned.
+void affinity_apply(ThreadRole role);
+
+// Log each role's CPUs and nodes, and the node holding table (which may be
+// NULL), once the daemon has allocated it
+void affinity_report(const void* table);
+
+#endif // AFFINITY_H
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+bool arena_init(Arena* arena, size_t size) {
+    memset(arena, 0, sizeof(*arena));
+    arena->base = malloc(size);
+    if (!arena->base) return false;
+    arena->size = size;
+    return true;
+}
+
+void arena_destroy(Arena* arena) {
+    free(arena->base);
+    memset(arena, 0, sizeof(*arena));
+}
+
+void* arena_alloc(Arena* arena, size_t size) {
+    size_t start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (start > arena->size || size > arena->size - start) {
+        arena->failures++;
+        return NULL;
+    }
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+void arena_reset(Arena* arena) {
+    if (arena->used > arena->high_water) {
+        arena->high_water = arena->used;
+    }
+    arena->used = 0;
+}
+
+static void free_thread_arena(void* arg) {
+    arena_destroy(arg);
+    free(arg);
+}
+
+static void create_thread_key(void) {
+    pthread_key_create(&thread_key, free_thread_arena);
+}
+
+Arena* arena_thread(void) {
+    pthread_once(&thread_key_once, create_thread_key);
+
+    Arena* arena = pthread_getspecific(thread_key);
+    if (arena) return arena;
+
+    arena = malloc(sizeof(Arena));
+    if (!arena || !arena_init(arena, ARENA_DEFAULT_SIZE)) {
+        free(arena);
+        return NULL;
+    }
+    pthread_setspecific(thread_key, arena);
+    return arena;
+}
+
+static const char* page_names[ARENA_PAGES_COUNT] = { "default", "transparent", "hugetlb" };
+
+const char* arena_pages_name(ArenaPages pages) {
+    return page_names[pages];
+}
+
+// madvise succeeds even when the administrator disabled THP, so ask sysfs
+static bool transparent_enabled(void) {
+    char mode[128] = "";
+    FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!file) return false;
+    bool read = fgets(mode, sizeof(mode), file) != NULL;
+    fclose(file);
+    return read && strstr(mode, "[never]") == NULL;
+}
+
+void* arena_map(size_t* length, bool huge, ArenaPages* pages) {
+    size_t huge_length = (*length + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+    void* base;
+
+    *pages = ARENA_PAGES_DEFAULT;
+    if (!huge) {
+        base = mmap(NULL, *length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        return base == MAP_FAILED ? NULL : base;
+    }
+
+    // Without MAP_NORESERVE a short hugetlb pool fails here rather than
+    // with SIGBUS on first touch
+    base = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (base != MAP_FAILED) {
+        *length = huge_length;
+        *pages = ARENA_PAGES_HUGETLB;
+        return base;
+    }
+
+    // Over-map by one huge page and trim to a huge page boundary, so each
+    // 2 MB of the table can fault in as a single page
+    uint8_t* raw = mmap(NULL, huge_length + ARENA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    uint8_t* start = (uint8_t*)(((uintptr_t)raw + ARENA_HUGE_PAGE_SIZE - 1) &
+                                ~(uintptr_t)(ARENA_HUGE_PAGE_SIZE - 1));
+    if (start > raw) munmap(raw, (size_t)(start - raw));
+    munmap(start + huge_length, (size_t)(raw + ARENA_HUGE_PAGE_SIZE - start));
+    *length = huge_length;
+
+    if (transparent_enabled() && madvise(start, huge_length, MADV_HUGEPAGE) == 0) {
+        *pages = ARENA_PAGES_TRANSPARENT;
+    }
+    return start;
+}
+
+void arena_unmap(void* base, size_t length) {
+    munmap(base, length);
+}
@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ARENA_DEFAULT_SIZE (256 * 1024) // Per-thread request arena
+#define ARENA_ALIGN 16
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Pages behind a mapping from arena_map
+typedef enum {
+    ARENA_PAGES_DEFAULT,       // Base pages
+    ARENA_PAGES_TRANSPARENT,   // Anonymous memory madvised for transparent huge pages
+    ARENA_PAGES_HUGETLB,       // Explicit huge pages reserved from the hugetlbfs pool
+    ARENA_PAGES_COUNT
+} ArenaPages;
+
+// Bump allocator for memory that lives exactly as long as one request
+typedef struct {
+    uint8_t* base;             // Backing block
+    size_t size;               // Block size
+    size_t used;               // Bytes handed out since the last reset
+    size_t high_water;         // Largest used seen at any reset
+    uint64_t failures;         // Allocations that did not fit
+} Arena;
+
+bool arena_init(Arena* arena, size_t size);
+void arena_destroy(Arena* arena);
+
+// Aligned allocation, NULL when the arena is exhausted
+void* arena_alloc(Arena* arena, size_t size);
+
+// Release everything allocated since init or the last reset
+void arena_reset(Arena* arena);
+
+// The calling thread's request arena, created on first use
+Arena* arena_thread(void);
+
+// Map *length bytes of zeroed memory for a large long-lived table. With huge
+// set, explicit huge pages are tried first, then transparent huge pages, and
+// *length is rounded up to a whole number of huge pages. Base pages are the
+// fallback, and *pages reports which backing was granted. Base-page mappings
+// reserve no swap, so untouched slots cost nothing.
+void* arena_map(size_t* length, bool huge, ArenaPages* pages);
+void arena_unmap(void* base, size_t length);
+const char* arena_pages_name(ArenaPages pages);
+
+#endif // ARENA_H
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "libphantom.h"
+
+// Ways a client can send the same lookups, from what hand-rolled callers
+// do today to libphantom's pipelining
+typedef enum {
+    MODE_CONNECT,              // New connection per request
+    MODE_CALL,                 // phantom_client_call, one request at a time
+    MODE_PIPELINE,             // phantom_client_submit with a window of requests in flight
+    MODE_COUNT
+} BenchMode;
+
+static const char* mode_names[MODE_COUNT] = { "connect", "call", "pipeline" };
+
+static struct {
+    const char* host;
+    uint16_t port;
+    size_t requests;           // Per mode
+    size_t window;             // Pipeline depth
+    size_t connections;        // Pool size
+    char request[128];         // The lookup every mode sends
+    size_t outstanding;        // Pipeline: submitted, not yet completed
+    size_t submitted;
+    size_t failures;
+} g_bench = {
+    .host = "127.0.0.1",
+    .port = 8888,
+    .requests = 20000,
+    .window = 32,
+    .connections = 2
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// One request over a fresh connection; the unframed reply is one read
+static bool connect_request(const struct sockaddr_in* addr) {
+    char line[sizeof(g_bench.request) + 1];
+    char reply[4096];
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+
+    int length = snprintf(line, sizeof(line), "%s\n", g_bench.request);
+    bool ok = connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) == 0 &&
+              send(fd, line, (size_t)length, MSG_NOSIGNAL) == length &&
+              recv(fd, reply, sizeof(reply), 0) > 0;
+    close(fd);
+    return ok;
+}
+
+static void on_reply(void* arg, PhantomStatus status, const char* reply, size_t length) {
+    PhantomClient* client = arg;
+    g_bench.outstanding--;
+    if (status != PHANTOM_OK || strncmp(reply, "\nID: ", 5) != 0) g_bench.failures++;
+
+    // Keep the window full
+    if (g_bench.submitted < g_bench.requests) {
+        if (phantom_client_submit(client, g_bench.request, on_reply, client)) {
+            g_bench.submitted++;
+            g_bench.outstanding++;
+        } else {
+            g_bench.failures++;
+        }
+    }
+}
+
+static void run_mode(BenchMode mode, PhantomClient* client, const struct sockaddr_in* addr) {
+    PhantomClientStats before, after;
+    char reply[4096];
+    size_t failures = 0;
+
+    phantom_client_stats(client, &before);
+    uint64_t start = now_ns();
+    if (mode == MODE_CONNECT) {
+        for (size_t i = 0; i < g_bench.requests; i++) {
+            if (!connect_request(addr)) failures++;
+        }
+    } else if (mode == MODE_CALL) {
+        for (size_t i = 0; i < g_bench.requests; i++) {
+            if (phantom_client_call(client, g_bench.request, reply, sizeof(reply)) != PHANTOM_OK) failures++;
+        }
+    } else {
+        g_bench.submitted = g_bench.outstanding = g_bench.failures = 0;
+        while (g_bench.submitted < g_bench.window && g_bench.submitted < g_bench.requests) {
+            if (!phantom_client_submit(client, g_bench.request, on_reply, client)) break;
+            g_bench.submitted++;
+            g_bench.outstanding++;
+        }
+
+        // Completions arrive through the client's eventfd, as in an event loop
+        struct pollfd ready = { .fd = phantom_client_fd(client), .events = POLLIN };
+        while (g_bench.outstanding > 0) {
+            if (poll(&ready, 1, 1000) > 0) phantom_client_dispatch(client);
+        }
+        failures = g_bench.failures;
+    }
+    uint64_t elapsed = now_ns() - start;
+    phantom_client_stats(client, &after);
+
+    uint64_t writes = after.writes - before.writes;
+    printf("%-9s %10.0f req/s %9.1f us/req  %5zu failed", mode_names[mode],
+           g_bench.requests / (elapsed / 1e9), elapsed / 1e3 / g_bench.requests, failures);
+    if (mode != MODE_CONNECT && writes > 0) {
+        printf("  %.1f requests/write", (double)(after.requests - before.requests) / writes);
+    }
+    printf("\n");
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -H, --host HOST         Daemon address (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT         Daemon port (default: 8888)\n");
+    printf("  -n, --requests N        Lookups per mode (default: 20000)\n");
+    printf("  -w, --window N          Requests in flight when pipelining (default: 32)\n");
+    printf("  -c, --connections N     Pool size (default: 2)\n");
+    printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Unknown option or missing value: %s\n", argv[i]);
+            return 1;
+        }
+        char* value = argv[++i];
+        long number = atol(value);
+
+        if (strcmp(argv[i - 1], "-H") == 0 || strcmp(argv[i - 1], "--host") == 0) {
+            g_bench.host = value;
+        }
+        else if (strcmp(argv[i - 1], "-p") == 0 || strcmp(argv[i - 1], "--port") == 0) {
+            if (number <= 0 || number > 65535) {
+                fprintf(stderr, "Invalid port number. Must be between 1 and 65535\n");
+                return 1;
+            }
+            g_bench.port = (uint16_t)number;
+        }
+        else if (strcmp(argv[i - 1], "-n") == 0 || strcmp(argv[i - 1], "--requests") == 0) {
+            if (number <= 0) {
+                fprintf(stderr, "Request count must be positive\n");
+                return 1;
+            }
+            g_bench.requests = (size_t)number;
+        }
+        else if (strcmp(argv[i - 1], "-w") == 0 || strcmp(argv[i - 1], "--window") == 0) {
+            if (number <= 0) {
+                fprintf(stderr, "Window must be positive\n");
+                return 1;
+            }
+            g_bench.window = (size_t)number;
+        }
+        else if (strcmp(argv[i - 1], "-c") == 0 || strcmp(argv[i - 1], "--connections") == 0) {
+            if (number <= 0 || number > PHANTOM_CLIENT_MAX_CONNECTIONS) {
+                fprintf(stderr, "Connections must be between 1 and %d\n", PHANTOM_CLIENT_MAX_CONNECTIONS);
+                return 1;
+            }
+            g_bench.connections = (size_t)number;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i - 1]);
+            return 1;
+        }
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(g_bench.port) };
+    PhantomClientConfig config = {
+        .host = g_bench.host,
+        .port = g_bench.port,
+        .connections = g_bench.connections,
+        .max_in_flight = g_bench.window
+    };
+    PhantomClient* client = inet_pton(AF_INET, g_bench.host, &addr.sin_addr) == 1
+        ? phantom_client_open(&config) : NULL;
+    if (!client) {
+        fprintf(stderr, "Invalid daemon address: %s\n", g_bench.host);
+        return 1;
+    }
+
+    // Every mode looks up the same account
+    char reply[4096];
+    PhantomStatus status = phantom_client_call(client, "create", reply, sizeof(reply));
+    char* id = status == PHANTOM_OK ? strstr(reply, "ID: ") : NULL;
+    if (!id || strlen(id) < 4 + 64) {
+        fprintf(stderr, "Cannot create an account on %s:%d (%s)\n", g_bench.host, g_bench.port,
+                phantom_status_name(status));
+        phantom_client_close(client);
+        return 1;
+    }
+    snprintf(g_bench.request, sizeof(g_bench.request), "lookup %.64s", id + 4);
+
+    for (int mode = 0; mode < MODE_COUNT; mode++) {
+        run_mode((BenchMode)mode, client, &addr);
+    }
+
+    phantom_client_close(client);
+    return 0;
+}
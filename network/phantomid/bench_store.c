@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "phantomid.h"
+#include "log.h"
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_THREAD_COUNTS 16
+#define BENCH_ID_POOL 65536        // Sampled IDs for lookups and deletes
+
+// Account store operations, timed without any networking
+typedef enum {
+    BENCH_LOOKUP,              // Existing ID, random position
+    BENCH_SCAN,                // Missing ID, so every slot is visited
+    BENCH_REQUEST,             // A lookup command through net_serve over a memory pipe
+    BENCH_DELETE,
+    BENCH_CREATE,
+    BENCH_OP_COUNT
+} BenchOp;
+
+static const char* bench_op_names[BENCH_OP_COUNT] = { "lookup", "scan", "request", "delete", "create" };
+
+typedef struct {
+    double ops_per_sec;
+    double ns_per_op;          // Mean latency of one call on one thread
+    double efficiency;         // ops_per_sec over the first thread count's, scaled linearly
+    double tlb_misses;         // Data TLB read misses per operation, negative if not counted
+} BenchResult;
+
+typedef struct {
+    pthread_t thread;
+    BenchOp op;
+    size_t index;              // Thread number within the run
+    size_t threads;
+    uint64_t quota;            // Most operations this thread may run
+    uint64_t seed;
+    uint64_t ops;              // Completed operations
+    uint64_t busy_ns;          // Time inside store calls
+    uint64_t elapsed_ns;       // Start to finish of this thread's run
+} BenchWorker;
+
+// One measurement, kept for the JSON report
+typedef struct {
+    size_t size;
+    size_t threads;
+    BenchOp op;
+    BenchResult result;
+} BenchRecord;
+
+// Cost of holding a store of one size
+typedef struct {
+    size_t size;
+    double fill_s;             // Time to create every account
+    double bytes_per_account;  // Resident memory growth divided by accounts
+    ArenaPages pages;          // Backing the table was granted
+} BenchStore;
+
+static PhantomDaemon store;
+static BenchRecord records[BENCH_MAX_SIZES * BENCH_MAX_THREAD_COUNTS * BENCH_OP_COUNT];
+static size_t record_count;
+static BenchStore stores[BENCH_MAX_SIZES];
+static size_t store_count;
+static uint64_t thread_ops[256]; // Operations per thread in the last measurement
+static char (*id_pool)[65];
+static size_t id_count;
+static volatile bool stop;
+static size_t finished;          // Workers done with the current measurement
+
+static struct {
+    size_t sizes[BENCH_MAX_SIZES];
+    size_t size_count;
+    size_t threads[BENCH_MAX_THREAD_COUNTS];
+    size_t thread_count;
+    double seconds;            // Length of each measurement
+    const char* output;
+    bool huge_pages;           // Ask for a huge-page account table
+} g_bench = {
+    .sizes = { 1000, 10000, 100000, 1000000, 10000000 },
+    .size_count = 5,
+    .seconds = 1.0
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t* seed) {
+    uint64_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *seed = x;
+}
+
+// Resident set size from /proc, in bytes
+static size_t resident_bytes(void) {
+    unsigned long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) resident = 0;
+    fclose(statm);
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Count data TLB read misses in this process and the threads it starts
+// next; -1 where the CPU or a VM exposes no such counter
+static int open_tlb_counter(void) {
+    struct perf_event_attr attr = {
+        .size = sizeof(attr),
+        .type = PERF_TYPE_HW_CACHE,
+        .config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        .disabled = 1,
+        .inherit = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1
+    };
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Create count accounts in bulk batches, sampling every stride-th ID into
+// the pool starting at pool_slot; returns how many were created
+static size_t fill(size_t count, size_t stride, size_t pool_slot) {
+    PhantomAccount batch[PHANTOM_BULK_MAX];
+    size_t created = 0;
+
+    while (created < count) {
+        size_t want = count - created < PHANTOM_BULK_MAX ? count - created : PHANTOM_BULK_MAX;
+        size_t got = phantom_create_accounts(&store, batch, want);
+        for (size_t i = 0; i < got; i++, created++) {
+            if (created % stride == 0 && pool_slot < BENCH_ID_POOL) {
+                memcpy(id_pool[pool_slot++], batch[i].id, sizeof(batch[i].id));
+            }
+        }
+        if (got < want) break;
+    }
+    return created;
+}
+
+static void* run_worker(void* arg) {
+    BenchWorker* worker = arg;
+    PhantomAccount account;
+    const char* missing = "0000000000000000000000000000000000000000000000000000000000000000";
+
+    // Deletes take distinct IDs from this thread's slice of the pool
+    size_t slice = id_count / worker->threads;
+    size_t next_delete = worker->index * slice;
+
+    // Requests go from client to server over an in-process pipe, so the
+    // path above net_send/net_receive is exactly what a socket client hits
+    NetworkEndpoint client = {0}, server = {0};
+    char request[80], reply[PHANTOM_RESPONSE_SIZE];
+    if (worker->op == BENCH_REQUEST && !net_pipe_open(&client, &server)) return NULL;
+
+    uint64_t begin = now_ns();
+
+    while (!stop && worker->ops < worker->quota) {
+        uint64_t start = now_ns();
+        bool ok = true;
+
+        switch (worker->op) {
+            case BENCH_LOOKUP:
+                ok = phantom_lookup_account(&store, id_pool[next_random(&worker->seed) % id_count],
+                                            &account);
+                break;
+            case BENCH_SCAN:
+                phantom_lookup_account(&store, missing, &account);
+                break;
+            case BENCH_REQUEST: {
+                NetworkPacket packet = { .data = request };
+                packet.size = (size_t)snprintf(request, sizeof(request), "lookup %s\n",
+                                               id_pool[next_random(&worker->seed) % id_count]);
+                NetworkPacket response = { .data = reply, .size = sizeof(reply) };
+                ok = net_send(&client, &packet) > 0 &&
+                     net_serve(&store.network, &server, 0) > 0 &&
+                     net_receive(&client, &response) > 0 &&
+                     strncmp(reply, "\nID: ", 5) == 0;
+                break;
+            }
+            case BENCH_DELETE:
+                if (next_delete == (worker->index + 1) * slice) {
+                    ok = false;
+                    break;
+                }
+                ok = phantom_delete_account(&store, id_pool[next_delete++]);
+                break;
+            case BENCH_CREATE:
+                ok = phantom_create_account(&store, &account);
+                break;
+            default:
+                break;
+        }
+
+        worker->busy_ns += now_ns() - start;
+        if (!ok) break;
+        worker->ops++;
+    }
+
+    worker->elapsed_ns = now_ns() - begin;
+    if (worker->op == BENCH_REQUEST) {
+        net_close(&client);
+        net_close(&server);
+    }
+    __atomic_fetch_add(&finished, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Run op on the given number of threads for g_bench.seconds, or until the
+// threads use up quota operations between them
+static BenchResult measure(BenchOp op, size_t threads, uint64_t quota) {
+    BenchWorker workers[256];
+    BenchResult result = {0};
+    uint64_t ops = 0, busy_ns = 0, elapsed_ns = 0;
+
+    memset(workers, 0, sizeof(workers));
+    stop = false;
+    finished = 0;
+
+    int tlb = open_tlb_counter();
+    if (tlb >= 0) ioctl(tlb, PERF_EVENT_IOC_ENABLE, 0);
+
+    for (size_t t = 0; t < threads; t++) {
+        workers[t] = (BenchWorker){
+            .op = op,
+            .index = t,
+            .threads = threads,
+            .quota = quota / threads,
+            .seed = 0x9e3779b97f4a7c15ull * (t + 1)
+        };
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    }
+
+    // Stop at the deadline, or sooner when every thread used up its quota
+    uint64_t deadline = now_ns() + (uint64_t)(g_bench.seconds * 1e9);
+    struct timespec tick = { 0, 1000000 };
+    while (now_ns() < deadline && __atomic_load_n(&finished, __ATOMIC_ACQUIRE) < threads) {
+        nanosleep(&tick, NULL);
+    }
+    stop = true;
+
+    for (size_t t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        thread_ops[t] = workers[t].ops;
+        ops += workers[t].ops;
+        busy_ns += workers[t].busy_ns;
+        if (workers[t].elapsed_ns > elapsed_ns) elapsed_ns = workers[t].elapsed_ns;
+    }
+
+    // Exited threads fold their counts into the inherited counter
+    uint64_t tlb_misses = 0;
+    result.tlb_misses = -1.0;
+    if (tlb >= 0) {
+        if (read(tlb, &tlb_misses, sizeof(tlb_misses)) == sizeof(tlb_misses) && ops > 0) {
+            result.tlb_misses = (double)tlb_misses / ops;
+        }
+        close(tlb);
+    }
+
+    result.ops_per_sec = elapsed_ns ? ops / (elapsed_ns / 1e9) : 0.0;
+    result.ns_per_op = ops ? (double)busy_ns / ops : 0.0;
+    return result;
+}
+
+// Replace the pool entries the last delete run consumed with fresh accounts
+static void refill_deleted(size_t threads) {
+    size_t slice = id_count / threads;
+    for (size_t t = 0; t < threads; t++) {
+        fill(thread_ops[t], 1, t * slice);
+    }
+}
+
+// Fill in scaling efficiency against the run on the fewest threads, then
+// print and keep the result
+static void add_result(size_t size, size_t threads, BenchOp op, BenchResult r, const BenchResult* base) {
+    double ideal = base->ops_per_sec * threads / g_bench.threads[0];
+    r.efficiency = ideal > 0 ? r.ops_per_sec / ideal : 0.0;
+    printf("%-9zu %7zu %-7s %14.0f %12.1f %9.0f%%", size, threads, bench_op_names[op],
+           r.ops_per_sec, r.ns_per_op, r.efficiency * 100.0);
+    if (r.tlb_misses >= 0) {
+        printf(" %11.1f\n", r.tlb_misses);
+    } else {
+        printf(" %11s\n", "-");
+    }
+    records[record_count++] = (BenchRecord){ size, threads, op, r };
+}
+
+static bool run_size(size_t size) {
+    BenchResult base[BENCH_OP_COUNT] = {0};
+
+    // Headroom for the create runs, shared between the thread counts
+    size_t headroom = size / 4 + 4096;
+    PhantomConfig config = {
+        .port = 0,
+        .max_accounts = size + headroom,
+        .huge_pages = g_bench.huge_pages
+    };
+
+    memset(&store, 0, sizeof(store));
+    size_t rss_before = resident_bytes();
+    if (!phantom_init(&store, &config)) {
+        fprintf(stderr, "Cannot create a store of %zu accounts\n", size);
+        return false;
+    }
+
+    uint64_t fill_start = now_ns();
+    size_t stride = size / BENCH_ID_POOL + 1;
+    id_count = 0;
+    if (fill(size, stride, 0) < size) {
+        fprintf(stderr, "Filled fewer than %zu accounts\n", size);
+        phantom_cleanup(&store);
+        return false;
+    }
+    id_count = (size + stride - 1) / stride;
+
+    // Pool order is table order; shuffle so deletes hit random positions
+    uint64_t seed = 0x2545f4914f6cdd1dull;
+    for (size_t i = id_count - 1; i > 0; i--) {
+        size_t j = next_random(&seed) % (i + 1);
+        char id[65];
+        memcpy(id, id_pool[i], sizeof(id));
+        memcpy(id_pool[i], id_pool[j], sizeof(id));
+        memcpy(id_pool[j], id, sizeof(id));
+    }
+    double fill_s = (now_ns() - fill_start) / 1e9;
+    double bytes_per_account = (double)(resident_bytes() - rss_before) / size;
+
+    printf("\n%zu accounts: filled in %.2f s, %.0f resident bytes per account "
+           "(%zu-byte records, %s pages)\n", size, fill_s, bytes_per_account, sizeof(PhantomAccount),
+           arena_pages_name(store.table.pages));
+    printf("%-9s %7s %-7s %14s %12s %10s %11s\n", "size", "threads", "op", "ops/sec", "ns/op", "scaling",
+           "dTLB/op");
+    stores[store_count++] = (BenchStore){ size, fill_s, bytes_per_account, store.table.pages };
+
+    for (size_t i = 0; i < g_bench.thread_count; i++) {
+        size_t threads = g_bench.threads[i];
+        for (BenchOp op = BENCH_LOOKUP; op <= BENCH_DELETE; op++) {
+            // Never delete more than half the table, so size stays meaningful
+            uint64_t quota = op == BENCH_DELETE ? (id_count < size / 2 ? id_count : size / 2) : UINT64_MAX;
+            BenchResult r = measure(op, threads, quota);
+            if (i == 0) base[op] = r;
+            add_result(size, threads, op, r, &base[op]);
+            if (op == BENCH_DELETE) refill_deleted(threads);
+        }
+    }
+
+    // Creates grow the table, so they run last and share the headroom
+    for (size_t i = 0; i < g_bench.thread_count; i++) {
+        size_t threads = g_bench.threads[i];
+        BenchResult r = measure(BENCH_CREATE, threads, headroom / g_bench.thread_count);
+        if (i == 0) base[BENCH_CREATE] = r;
+        add_result(size, threads, BENCH_CREATE, r, &base[BENCH_CREATE]);
+    }
+
+    phantom_cleanup(&store);
+    return true;
+}
+
+static bool write_json(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) return false;
+
+    fprintf(out, "{\n  \"seconds\": %.3f,\n  \"record_bytes\": %zu,\n  \"huge_pages\": %s,\n"
+            "  \"stores\": [\n", g_bench.seconds, sizeof(PhantomAccount),
+            g_bench.huge_pages ? "true" : "false");
+    for (size_t i = 0; i < store_count; i++) {
+        fprintf(out, "    { \"size\": %zu, \"fill_s\": %.3f, \"bytes_per_account\": %.1f, "
+                "\"pages\": \"%s\" }%s\n", stores[i].size, stores[i].fill_s, stores[i].bytes_per_account,
+                arena_pages_name(stores[i].pages), i + 1 < store_count ? "," : "");
+    }
+    fprintf(out, "  ],\n  \"results\": [\n");
+    for (size_t i = 0; i < record_count; i++) {
+        const BenchRecord* r = &records[i];
+        fprintf(out, "    { \"size\": %zu, \"threads\": %zu, \"op\": \"%s\", \"ops_per_sec\": %.1f, "
+                "\"ns_per_op\": %.1f, \"efficiency\": %.3f, ",
+                r->size, r->threads, bench_op_names[r->op], r->result.ops_per_sec,
+                r->result.ns_per_op, r->result.efficiency);
+        if (r->result.tlb_misses >= 0) {
+            fprintf(out, "\"dtlb_misses_per_op\": %.2f }%s\n", r->result.tlb_misses,
+                    i + 1 < record_count ? "," : "");
+        } else {
+            fprintf(out, "\"dtlb_misses_per_op\": null }%s\n", i + 1 < record_count ? "," : "");
+        }
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out) == 0;
+}
+
+// Comma-separated positive numbers
+static size_t parse_list(char* text, size_t* values, size_t max) {
+    size_t count = 0;
+    for (char* item = strtok(text, ","); item; item = strtok(NULL, ",")) {
+        long long value = atoll(item);
+        if (value <= 0 || count == max) return 0;
+        values[count++] = (size_t)value;
+    }
+    return count;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -s, --sizes LIST        Store sizes (default: 1000,10000,100000,1000000,10000000)\n");
+    printf("  -t, --threads LIST      Thread counts (default: powers of two up to all cores)\n");
+    printf("  -d, --seconds SEC       Length of each measurement (default: 1)\n");
+    printf("  -o, --output PATH       Also write the results to PATH as JSON\n");
+    printf("  -H, --huge-pages        Back the account table with huge pages where available\n");
+    printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--huge-pages") == 0) {
+            g_bench.huge_pages = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Unknown option or missing value: %s\n", argv[i]);
+            return 1;
+        }
+        char* value = argv[++i];
+
+        if (strcmp(argv[i - 1], "-s") == 0 || strcmp(argv[i - 1], "--sizes") == 0) {
+            g_bench.size_count = parse_list(value, g_bench.sizes, BENCH_MAX_SIZES);
+            if (g_bench.size_count == 0) {
+                fprintf(stderr, "Sizes must be a list of positive numbers\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i - 1], "-t") == 0 || strcmp(argv[i - 1], "--threads") == 0) {
+            g_bench.thread_count = parse_list(value, g_bench.threads, BENCH_MAX_THREAD_COUNTS);
+            for (size_t t = 0; t < g_bench.thread_count; t++) {
+                if (g_bench.threads[t] > 256) g_bench.thread_count = 0;
+            }
+            if (g_bench.thread_count == 0) {
+                fprintf(stderr, "Thread counts must be a list of numbers up to 256\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i - 1], "-d") == 0 || strcmp(argv[i - 1], "--seconds") == 0) {
+            g_bench.seconds = atof(value);
+            if (g_bench.seconds <= 0) {
+                fprintf(stderr, "Measurement length must be positive\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i - 1], "-o") == 0 || strcmp(argv[i - 1], "--output") == 0) {
+            g_bench.output = value;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i - 1]);
+            return 1;
+        }
+    }
+
+    // 1, 2, 4, ... up to every online core
+    if (g_bench.thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores < 1) cores = 1;
+        for (size_t t = 1; t < (size_t)cores && g_bench.thread_count < BENCH_MAX_THREAD_COUNTS - 1; t *= 2) {
+            g_bench.threads[g_bench.thread_count++] = t;
+        }
+        g_bench.threads[g_bench.thread_count++] = (size_t)(cores > 256 ? 256 : cores);
+    }
+
+    id_pool = calloc(BENCH_ID_POOL, sizeof(*id_pool));
+    if (!id_pool) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    metrics_enable(false);
+    if (!log_start(LOG_LEVEL_WARN)) {
+        fprintf(stderr, "Failed to start logger\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < g_bench.size_count; i++) {
+        if (!run_size(g_bench.sizes[i])) return 1;
+    }
+
+    if (g_bench.output && !write_json(g_bench.output)) {
+        fprintf(stderr, "Cannot write %s\n", g_bench.output);
+        return 1;
+    }
+
+    free(id_pool);
+    log_stop();
+    return 0;
+}
@@ -0,0 +1,329 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include "command.h"
+#include "log.h"
+
+// FNV-1a over the verb, mixed with the table's seed
+static uint32_t verb_hash(uint32_t seed, const char* verb, size_t length) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)verb[i];
+        hash *= 16777619u;
+    }
+    return hash & (COMMAND_TABLE_SIZE - 1);
+}
+
+// Place every command in its own slot, trying seeds until none collide
+static bool build_table(CommandRegistry* registry) {
+    for (uint32_t seed = 0; seed < 100000; seed++) {
+        bool collision = false;
+        memset(registry->slots, 0, sizeof(registry->slots));
+
+        for (size_t i = 0; i < registry->count && !collision; i++) {
+            const char* verb = registry->commands[i]->verb;
+            uint32_t slot = verb_hash(seed, verb, strlen(verb));
+            collision = registry->slots[slot] != 0;
+            registry->slots[slot] = (uint8_t)(i + 1);
+        }
+        if (!collision) {
+            registry->seed = seed;
+            return true;
+        }
+    }
+    return false;
+}
+
+void command_init(CommandRegistry* registry, void* ctx) {
+    memset(registry, 0, sizeof(*registry));
+    registry->ctx = ctx;
+}
+
+bool command_register(CommandRegistry* registry, const CommandSpec* spec) {
+    size_t length = strlen(spec->verb);
+
+    if (length == 0 || registry->count == COMMAND_MAX_COMMANDS ||
+        command_lookup(registry, spec->verb, length)) {
+        log_error("Cannot register command '%s'", spec->verb);
+        return false;
+    }
+
+    registry->commands[registry->count++] = spec;
+    if (!build_table(registry)) {
+        registry->count--;
+        build_table(registry);
+        log_error("No collision-free slot for command '%s'", spec->verb);
+        return false;
+    }
+    return true;
+}
+
+bool command_register_all(CommandRegistry* registry, const CommandSpec* specs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!command_register(registry, &specs[i])) return false;
+    }
+    return true;
+}
+
+const CommandSpec* command_lookup(const CommandRegistry* registry, const char* verb, size_t length) {
+    uint8_t index = registry->slots[verb_hash(registry->seed, verb, length)];
+    if (index == 0) return NULL;
+
+    const CommandSpec* spec = registry->commands[index - 1];
+    if (strncmp(spec->verb, verb, length) != 0 || spec->verb[length] != '\0') return NULL;
+    return spec;
+}
+
+RateClass command_class(const CommandSpec* spec) {
+    return !spec ? RATE_READ
+        : (spec->flags & CMD_BULK) ? RATE_BULK
+        : (spec->flags & CMD_WRITE) ? RATE_WRITE : RATE_READ;
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+RateClass command_classify(const CommandRegistry* registry, const char* request, size_t length) {
+    size_t start = 0;
+    while (start < length && is_blank(request[start])) start++;
+    size_t end = start;
+    while (end < length && !is_blank(request[end])) end++;
+    return command_class(command_lookup(registry, request + start, end - start));
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Convert one token to its declared type
+static bool parse_arg(CommandArgType type, char* token, CommandArg* arg) {
+    size_t length = strlen(token);
+    arg->text = token;
+    arg->value = 0;
+
+    switch (type) {
+        case ARG_WORD:
+            return true;
+
+        case ARG_ID:
+            if (length != 64) return false;
+            for (size_t i = 0; i < length; i++) {
+                if (hex_digit(token[i]) < 0) return false;
+            }
+            return true;
+
+        case ARG_HEX:
+            if (length == 0 || length > 16) return false;
+            for (size_t i = 0; i < length; i++) {
+                int digit = hex_digit(token[i]);
+                if (digit < 0) return false;
+                arg->value = (arg->value << 4) | (uint64_t)digit;
+            }
+            return true;
+
+        case ARG_UINT:
+            if (length == 0 || length > 19) return false;
+            for (size_t i = 0; i < length; i++) {
+                if (token[i] < '0' || token[i] > '9') return false;
+                arg->value = arg->value * 10 + (uint64_t)(token[i] - '0');
+            }
+            return true;
+
+        case ARG_SEED:
+            if (length != 2 * sizeof(arg->bytes)) return false;
+            for (size_t i = 0; i < sizeof(arg->bytes); i++) {
+                int high = hex_digit(token[i * 2]);
+                int low = hex_digit(token[i * 2 + 1]);
+                if (high < 0 || low < 0) return false;
+                arg->bytes[i] = (uint8_t)(high << 4 | low);
+            }
+            return true;
+
+        case ARG_ENDPOINT: {
+            char* colon = strrchr(token, ':');
+            if (!colon || colon == token) return false;
+            CommandArg port;
+            if (!parse_arg(ARG_UINT, colon + 1, &port) || port.value == 0 || port.value > 65535) {
+                return false;
+            }
+            *colon = '\0';
+            arg->value = port.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Split the rest of the request into arguments matching spec->args
+static bool parse_args(const CommandSpec* spec, char* cursor, CommandArg* args, size_t* argc) {
+    const char* signature = spec->args ? spec->args : "";
+    bool optional = false;
+    char type = 0;
+    *argc = 0;
+
+    for (;;) {
+        cursor += strspn(cursor, " \t\r\n");
+        if (*cursor == '\0') break;
+
+        char* token = cursor;
+        cursor += strcspn(cursor, " \t\r\n");
+        if (*cursor != '\0') *cursor++ = '\0';
+
+        // Advance through the signature unless the last type repeats
+        if (*signature == '|') {
+            optional = true;
+            signature++;
+        }
+        if (*signature == '*') {
+            if (type == 0) return false;
+        } else if (*signature != '\0') {
+            type = *signature++;
+        } else {
+            return false;
+        }
+
+        if (*argc == COMMAND_MAX_ARGS || !parse_arg((CommandArgType)type, token, &args[*argc])) {
+            return false;
+        }
+        (*argc)++;
+    }
+
+    // Anything left besides optional or repeated arguments was required
+    if (*signature == '|') optional = true;
+    return optional || *signature == '\0' || *signature == '*';
+}
+
+// Charge a request to its class, before any parsing or locking
+static bool admit(CommandRegistry* registry, const CommandSpec* spec, RateBuckets* rate) {
+    RateClass rate_class = command_class(spec);
+    const RateLimit* limit = &registry->limits[rate_class];
+    if (limit->rate == 0) return true;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    if (!ratelimit_take(rate, rate_class, limit, now)) {
+        registry->rate_rejected[rate_class]++;
+        return false;
+    }
+
+    uint64_t wait = registry->rate_reject ? 0 : ratelimit_wait_ns(rate, rate_class, limit);
+    if (wait > 0) {
+        rate->resume_ns = now + wait;
+        registry->rate_deferred[rate_class]++;
+    }
+    return true;
+}
+
+static void dispatch(CommandRegistry* registry, char* request, CommandOutput* out) {
+    CommandArg args[COMMAND_MAX_ARGS];
+    size_t argc;
+
+    char* verb = request + strspn(request, " \t\r\n");
+    size_t length = strcspn(verb, " \t\r\n");
+    const CommandSpec* spec = command_lookup(registry, verb, length);
+
+    if (out->rate && !admit(registry, spec, out->rate)) {
+        command_printf(out, "\nRate limit exceeded, slow down\n");
+        return;
+    }
+    if (!spec) {
+        registry->unknown++;
+        command_printf(out, "\nUnknown command. Type 'help' for available commands.\n");
+        return;
+    }
+    if ((spec->flags & CMD_WRITE) && registry->write_denied) {
+        command_printf(out, "%s", registry->write_denied);
+        return;
+    }
+    if (!parse_args(spec, verb + length, args, &argc)) {
+        command_printf(out, "\nUsage: %s%s%s\n", spec->verb, spec->usage ? " " : "",
+                       spec->usage ? spec->usage : "");
+        return;
+    }
+
+    registry->calls[registry->slots[verb_hash(registry->seed, verb, length)] - 1]++;
+    spec->handler(registry->ctx, args, argc, out);
+}
+
+void command_dispatch(CommandRegistry* registry, char* request, CommandOutput* out) {
+    dispatch(registry, request, out);
+
+    // The terminator is part of the reply; a full buffer gives up its
+    // last byte of text for it
+    if (out->session && (*out->session & SESSION_FRAMED) && out->size > 0) {
+        if (out->length >= out->size) out->length = out->size - 1;
+        out->data[out->length++] = '\0';
+    }
+}
+
+// Append formatted text, truncating at the end of the buffer
+size_t command_printf(CommandOutput* out, const char* format, ...) {
+    size_t available;
+    char* tail = command_space(out, &available);
+    if (available == 0) return 0;
+
+    va_list ap;
+    va_start(ap, format);
+    int written = vsnprintf(tail, available, format, ap);
+    va_end(ap);
+
+    if (written < 0) return 0;
+    command_advance(out, (size_t)written);
+    return (size_t)written;
+}
+
+// Free space at the end of the buffer, for writers that take a buffer
+// and size; the caller follows up with command_advance
+char* command_space(CommandOutput* out, size_t* available) {
+    *available = out->length < out->size ? out->size - out->length : 0;
+    return out->data + out->length;
+}
+
+void command_advance(CommandOutput* out, size_t length) {
+    out->length += length;
+    if (out->length >= out->size) {
+        out->length = out->size > 0 ? out->size - 1 : 0;
+    }
+}
+
+bool command_full(const CommandOutput* out) {
+    return out->length + 1 >= out->size;
+}
+
+void command_help(const CommandRegistry* registry, CommandOutput* out) {
+    command_printf(out, "\nAvailable commands:\n");
+    for (size_t i = 0; i < registry->count; i++) {
+        const CommandSpec* spec = registry->commands[i];
+        command_printf(out, "%s%s%s - %s\n", spec->verb, spec->usage ? " " : "",
+                       spec->usage ? spec->usage : "", spec->help);
+    }
+    command_printf(out, "quit - Disconnect from server\n\n");
+}
+
+void command_stats(const CommandRegistry* registry, CommandOutput* out) {
+    for (size_t i = 0; i < registry->count; i++) {
+        command_printf(out, "cmd_%s %lu\n", registry->commands[i]->verb, registry->calls[i]);
+    }
+    command_printf(out, "cmd_unknown %lu\n", registry->unknown);
+    for (int i = 0; i < RATE_CLASS_COUNT; i++) {
+        if (registry->limits[i].rate == 0) continue;
+        command_printf(out, "rate_%s_deferred %lu\nrate_%s_rejected %lu\n",
+                       ratelimit_class_name(i), registry->rate_deferred[i],
+                       ratelimit_class_name(i), registry->rate_rejected[i]);
+    }
+}
+
+void command_pipeline(CommandOutput* out) {
+    if (!out->session) {
+        command_printf(out, "\nPipelining needs a client connection\n");
+        return;
+    }
+    *out->session |= SESSION_FRAMED;
+    command_printf(out, "\nPipelining on, each reply ends with a NUL byte\n");
+}
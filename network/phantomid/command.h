@@ -0,0 +1,116 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+#include "ratelimit.h"
+
+#define COMMAND_MAX_COMMANDS 32
+#define COMMAND_TABLE_SIZE 128     // Power of two, well above the command count
+#define COMMAND_MAX_ARGS 16
+
+// Argument types, one letter each in CommandSpec.args
+typedef enum {
+    ARG_WORD = 'w',                // Any token
+    ARG_ID = 'i',                  // Account ID, 64 hex digits
+    ARG_HEX = 'x',                 // 64-bit hex number
+    ARG_UINT = 'u',                // Decimal unsigned number
+    ARG_SEED = 's',                // 64 hex digits decoded into bytes
+    ARG_ENDPOINT = 'e'             // host:port, text holds the host and value the port
+} CommandArgType;
+
+// A parsed argument; text points into the request buffer
+typedef struct {
+    const char* text;              // NUL-terminated token
+    uint64_t value;                // ARG_HEX, ARG_UINT, ARG_ENDPOINT
+    uint8_t bytes[32];             // ARG_SEED
+} CommandArg;
+
+struct NetworkStream;
+
+// Response buffer handlers append to directly
+typedef struct {
+    char* data;                    // Start of the connection's response buffer
+    size_t size;                   // Buffer capacity
+    size_t length;                 // Bytes written so far, excluding the NUL
+    Arena* arena;                  // Scratch memory released when the request ends
+    RateBuckets* rate;             // Connection's rate buckets, NULL is never limited
+    uint32_t* session;             // Connection's SESSION_* flags, NULL outside a connection
+    struct NetworkStream* stream;  // Bulk data sent after the reply, NULL if none
+} CommandOutput;
+
+#define SESSION_FRAMED 0x1         // Every reply ends with a NUL byte, for pipelining clients
+
+typedef void (*CommandHandler)(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out);
+
+#define CMD_WRITE 0x1              // Mutates state; refused while write_denied is set
+#define CMD_BULK 0x2               // Touches many accounts; charged to RATE_BULK
+
+// One verb. args lists the argument types in order: letters after '|' are
+// optional, and a trailing '*' repeats the last type up to COMMAND_MAX_ARGS.
+typedef struct {
+    const char* verb;              // Exact command word
+    const char* args;              // Type signature, e.g. "|xx" or "i*"
+    const char* usage;             // Argument synopsis shown in help and errors
+    const char* help;              // One-line description
+    uint32_t flags;                // CMD_*
+    CommandHandler handler;        // Called with the parsed arguments
+} CommandSpec;
+
+// Verb table built at init. Lookup is a single probe: the hash seed is
+// re-chosen on every registration so no two verbs share a slot.
+typedef struct {
+    const CommandSpec* commands[COMMAND_MAX_COMMANDS]; // Registration order
+    uint64_t calls[COMMAND_MAX_COMMANDS];              // Dispatches per command
+    size_t count;                  // Registered commands
+    uint8_t slots[COMMAND_TABLE_SIZE]; // Hash slot -> command index + 1
+    uint32_t seed;                 // Hash seed that keeps slots collision-free
+    uint64_t unknown;              // Requests with no matching verb
+    void* ctx;                     // Passed to every handler
+    const char* write_denied;      // Reply to CMD_WRITE commands; NULL allows them
+    RateLimit limits[RATE_CLASS_COUNT]; // Per-connection limits by command class
+    bool rate_reject;              // Refuse over-limit requests instead of pacing the connection
+    uint64_t rate_deferred[RATE_CLASS_COUNT]; // Connections paused to let a bucket refill
+    uint64_t rate_rejected[RATE_CLASS_COUNT]; // Requests refused with an empty bucket
+} CommandRegistry;
+
+// Registry setup
+void command_init(CommandRegistry* registry, void* ctx);
+bool command_register(CommandRegistry* registry, const CommandSpec* spec);
+bool command_register_all(CommandRegistry* registry, const CommandSpec* specs, size_t count);
+const CommandSpec* command_lookup(const CommandRegistry* registry, const char* verb, size_t length);
+
+// Class a command is charged to, RATE_READ for NULL (unknown verbs)
+RateClass command_class(const CommandSpec* spec);
+
+// Class of a request line not yet dispatched, from its verb alone. request
+// need not be NUL-terminated.
+RateClass command_classify(const CommandRegistry* registry, const char* request, size_t length);
+
+// Parse one request in place and run its handler, then end the reply with
+// a NUL byte if the connection asked for framed replies. With a connection's
+// buckets in out->rate, the request is first charged to its command class.
+// An empty bucket gets the request refused. Otherwise, unless rate_reject
+// is set, a request that leaves the bucket empty sets the connection's
+// resume time, and net_run does not read the connection again until the
+// bucket has refilled.
+void command_dispatch(CommandRegistry* registry, char* request, CommandOutput* out);
+
+// Output helpers
+size_t command_printf(CommandOutput* out, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+char* command_space(CommandOutput* out, size_t* available);
+void command_advance(CommandOutput* out, size_t length);
+bool command_full(const CommandOutput* out);
+
+// Built-in reports
+void command_help(const CommandRegistry* registry, CommandOutput* out);
+void command_stats(const CommandRegistry* registry, CommandOutput* out);
+
+// Switch the connection to framed replies, so a client can send requests
+// without waiting for each reply and still tell the replies apart
+void command_pipeline(CommandOutput* out);
+
+#endif // COMMAND_H
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+#include "log.h"
+
+#define HANDOFF_REQUEST 'R'        // Successor asks for the listener
+#define HANDOFF_LISTENER 'L'       // Carries the listener as SCM_RIGHTS
+#define HANDOFF_CLIENT 'C'         // Carries a client mid-request as SCM_RIGHTS, then its input
+#define HANDOFF_DONE 'D'           // Predecessor has flushed and is exiting
+#define HANDOFF_TIMEOUT_S 5        // For the request/listener exchange
+
+static bool set_path(Handoff* handoff, const char* path, struct sockaddr_un* addr) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("Handoff socket path too long: %s", path);
+        return false;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    strcpy(handoff->path, path);
+    return true;
+}
+
+static void set_timeout(int fd, int seconds) {
+    struct timeval tv = { .tv_sec = seconds, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// What follows a HANDOFF_CLIENT tag, ahead of length bytes of input
+typedef struct {
+    uint32_t session;
+    uint32_t length;
+} HandoffClient;
+
+// Send a tag with a descriptor attached, then size bytes of data in the
+// same message
+static bool send_descriptor(int fd, char tag, int passed, const void* data, size_t size) {
+    struct iovec iov[2] = {
+        { .iov_base = &tag, .iov_len = 1 },
+        { .iov_base = (void*)data, .iov_len = size }
+    };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = size > 0 ? 2 : 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space)
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &passed, sizeof(int));
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)(1 + size);
+}
+
+// Read one tag, and the descriptor that came with it into *passed, -1 if
+// none did. 0 at end of stream, -1 on error.
+static ssize_t receive_tag(int fd, char* tag, int* passed) {
+    struct iovec iov = { .iov_base = tag, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space)
+    };
+    ssize_t result;
+    do {
+        result = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (result < 0 && errno == EINTR);
+
+    *passed = -1;
+    struct cmsghdr* cmsg = result == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(passed, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return result;
+}
+
+static int receive_listener(int fd) {
+    char tag = 0;
+    int listener;
+    if (receive_tag(fd, &tag, &listener) != 1 || tag != HANDOFF_LISTENER) {
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+static bool recv_all(int fd, void* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        data = (char*)data + received;
+        size -= (size_t)received;
+    }
+    return true;
+}
+
+// Read the rest of a HANDOFF_CLIENT message into the next adoption, or
+// close the connection if every slot is taken
+static bool receive_client(Handoff* handoff, int client_fd) {
+    HandoffClient header;
+    char input[BUFFER_SIZE];
+    if (!recv_all(handoff->predecessor_fd, &header, sizeof(header)) || header.length >= BUFFER_SIZE ||
+        !recv_all(handoff->predecessor_fd, input, header.length)) {
+        close(client_fd);
+        return false;
+    }
+    if (handoff->adopted_count == MAX_CLIENTS) {
+        log_warn("Too many handed-over connections, closing one");
+        close(client_fd);
+        return true;
+    }
+
+    NetworkAdoption* adoption = &handoff->adopted[handoff->adopted_count++];
+    adoption->socket_fd = client_fd;
+    adoption->session = header.session;
+    adoption->input_length = header.length;
+    memcpy(adoption->input, input, header.length);
+    return true;
+}
+
+// The reactor's hand_over: the successor gets its own reference to the
+// socket, so the reactor closing ours leaves the connection open
+static bool pass_client(void* ctx, NetworkEndpoint* endpoint, const char* input, size_t length,
+                        uint32_t session) {
+    Handoff* handoff = ctx;
+    char message[sizeof(HandoffClient) + BUFFER_SIZE];
+    HandoffClient header = { .session = session, .length = (uint32_t)length };
+    if (length >= BUFFER_SIZE) return false;
+
+    memcpy(message, &header, sizeof(header));
+    memcpy(message + sizeof(header), input, length);
+    return send_descriptor(handoff->successor_fd, HANDOFF_CLIENT, endpoint->socket_fd,
+                           message, sizeof(header) + length);
+}
+
+bool handoff_acquire(Handoff* handoff, const char* path, int* listen_fd) {
+    struct sockaddr_un addr;
+    memset(handoff, 0, sizeof(*handoff));
+    handoff->predecessor_fd = -1;
+    handoff->successor_fd = -1;
+    *listen_fd = -1;
+    if (!set_path(handoff, path, &addr)) return false;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_error("Handoff socket failed: %s", strerror(errno));
+        return false;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int error = errno;
+        close(fd);
+        // Nobody to take over from: a first start, or a stale socket file
+        if (error == ENOENT || error == ECONNREFUSED) return true;
+        log_error("Cannot reach the running daemon at %s: %s", path, strerror(error));
+        return false;
+    }
+
+    set_timeout(fd, HANDOFF_TIMEOUT_S);
+    char request = HANDOFF_REQUEST;
+    int listener = send(fd, &request, 1, MSG_NOSIGNAL) == 1 ? receive_listener(fd) : -1;
+    if (listener < 0) {
+        log_error("Running daemon at %s did not hand over its listener", path);
+        close(fd);
+        return false;
+    }
+
+    // Draining may take as long as the predecessor was told to allow
+    set_timeout(fd, 0);
+    handoff->predecessor_fd = fd;
+    *listen_fd = listener;
+    log_info("Took over the listener from the running daemon at %s", path);
+    return true;
+}
+
+bool handoff_await(Handoff* handoff) {
+    if (handoff->predecessor_fd < 0) return true;
+
+    // Either the done byte or the predecessor exiting ends the wait;
+    // connections handed over arrive ahead of it
+    char tag;
+    int passed;
+    ssize_t result;
+    while ((result = receive_tag(handoff->predecessor_fd, &tag, &passed)) == 1 && tag == HANDOFF_CLIENT) {
+        if (passed < 0 || !receive_client(handoff, passed)) {
+            result = -1;
+            errno = EPROTO;
+            break;
+        }
+    }
+    if (result == 1 && passed >= 0) close(passed);
+    close(handoff->predecessor_fd);
+    handoff->predecessor_fd = -1;
+
+    if (result < 0) {
+        log_error("Lost the previous daemon while it drained: %s", strerror(errno));
+        return false;
+    }
+    if (result == 0) log_warn("Previous daemon exited without confirming its state was flushed");
+    return true;
+}
+
+// Serves at most one successor per generation
+static void* handoff_thread(void* arg) {
+    Handoff* handoff = arg;
+
+    while (handoff->listening) {
+        int fd = accept4(handoff->control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        set_timeout(fd, HANDOFF_TIMEOUT_S);
+        char request = 0;
+        int listener = handoff->program->endpoints[0].socket_fd;
+        if (recv(fd, &request, 1, 0) != 1 || request != HANDOFF_REQUEST ||
+            !send_descriptor(fd, HANDOFF_LISTENER, listener, NULL, 0)) {
+            log_warn("Ignoring a handoff request that did not complete");
+            close(fd);
+            continue;
+        }
+
+        // Set before the drain starts, which publishes them to the reactor
+        handoff->successor_fd = fd;
+        handoff->program->hand_over_ctx = handoff;
+        handoff->program->hand_over = pass_client;
+        log_info("Listener handed to a new daemon, draining for up to %u ms", handoff->drain_ms);
+        net_drain(handoff->program, handoff->drain_ms);
+        break;
+    }
+    return NULL;
+}
+
+bool handoff_listen(Handoff* handoff, NetworkProgram* program, uint32_t drain_ms) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, handoff->path, sizeof(addr.sun_path));
+
+    handoff->program = program;
+    handoff->drain_ms = drain_ms;
+    handoff->control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff->control_fd < 0) {
+        log_error("Handoff socket failed: %s", strerror(errno));
+        handoff->control_fd = 0;
+        return false;
+    }
+
+    // The predecessor, if any, removed its socket before letting go
+    unlink(handoff->path);
+    if (bind(handoff->control_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(handoff->control_fd, 1) < 0) {
+        log_error("Cannot listen for handoffs at %s: %s", handoff->path, strerror(errno));
+        close(handoff->control_fd);
+        handoff->control_fd = 0;
+        return false;
+    }
+
+    handoff->listening = true;
+    if (pthread_create(&handoff->thread, NULL, handoff_thread, handoff) != 0) {
+        log_error("Failed to start handoff thread");
+        handoff->listening = false;
+        close(handoff->control_fd);
+        handoff->control_fd = 0;
+        unlink(handoff->path);
+        return false;
+    }
+    return true;
+}
+
+void handoff_release(Handoff* handoff) {
+    if (handoff->listening) {
+        // shutdown wakes the accept that close alone would leave blocked
+        handoff->listening = false;
+        shutdown(handoff->control_fd, SHUT_RDWR);
+        pthread_join(handoff->thread, NULL);
+        close(handoff->control_fd);
+        handoff->control_fd = 0;
+
+        // Unlinked before the successor hears from us, since it binds
+        // the same path as soon as it does
+        unlink(handoff->path);
+    }
+
+    if (handoff->successor_fd >= 0) {
+        char done = HANDOFF_DONE;
+        if (send(handoff->successor_fd, &done, 1, MSG_NOSIGNAL) != 1) {
+            log_warn("New daemon went away before the handoff completed");
+        }
+        close(handoff->successor_fd);
+        handoff->successor_fd = -1;
+    }
+}
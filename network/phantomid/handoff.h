@@ -0,0 +1,51 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include "network.h"
+
+#define HANDOFF_DEFAULT_DRAIN_MS 2000
+
+// Hot restart. Each daemon generation listens on a Unix socket at the
+// same path. A new generation connects to it, and the old one passes its
+// client listener over with SCM_RIGHTS, so connections queue in the
+// listen backlog instead of being refused. The old one then stops
+// accepting and drains its clients. It hands over the plaintext ones left
+// holding a partial request line, with what they had buffered, so only
+// requests already complete hold the new one back. Once it has flushed its
+// state it says it is done, and only then does the new one load the state
+// and start serving, taking on the connections it was handed.
+typedef struct {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int control_fd;            // Our Unix listener, 0 until handoff_listen
+    int predecessor_fd;        // Link to the generation being replaced
+    int successor_fd;          // Link to the generation replacing us
+    NetworkProgram* program;   // Reactor to drain once the listener is given away
+    uint32_t drain_ms;
+    pthread_t thread;          // Waits for a successor
+    bool listening;
+    NetworkAdoption adopted[MAX_CLIENTS]; // Connections the predecessor handed over
+    size_t adopted_count;
+} Handoff;
+
+// Take the listener from a running predecessor at path. *listen_fd is the
+// inherited socket, or -1 when nothing is listening at path and the daemon
+// starts cold.
+bool handoff_acquire(Handoff* handoff, const char* path, int* listen_fd);
+
+// Block until the predecessor has flushed its state and let go, collecting
+// the connections it hands over meanwhile in adopted
+bool handoff_await(Handoff* handoff);
+
+// Offer program's listener to the next generation. When one asks, the
+// listener is sent and program drains for up to drain_ms.
+bool handoff_listen(Handoff* handoff, NetworkProgram* program, uint32_t drain_ms);
+
+// After the daemon has shut down and flushed: remove our socket and tell a
+// waiting successor it may load the state
+void handoff_release(Handoff* handoff);
+
+#endif // HANDOFF_H
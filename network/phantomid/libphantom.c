@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "libphantom.h"
+
+#define CLIENT_HANDSHAKE "pipeline\n"  // Switches the connection to NUL-framed replies
+#define CLIENT_MAX_BACKOFF_MS 1000
+#define CLIENT_BUFFER_SIZE 16384       // Initial size of each connection's buffers
+
+// Completion handshake between the I/O thread and phantom_client_call
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+} Waiter;
+
+typedef struct Request {
+    struct Request* next;
+    PhantomCallback callback;
+    void* arg;
+    Waiter* waiter;            // Set for phantom_client_call, which owns the request
+    uint64_t deadline_ns;
+    uint64_t start;            // Offset in its connection's output stream
+    PhantomStatus status;
+    char* reply;               // Owned by the request once complete
+    size_t reply_length;
+    size_t length;             // Bytes of text, including the newline
+    char text[];
+} Request;
+
+typedef struct {
+    Request* head;
+    Request* tail;
+} RequestList;
+
+typedef enum {
+    CONN_DOWN,
+    CONN_CONNECTING,
+    CONN_READY
+} ConnectionState;
+
+// Owned by the I/O thread
+typedef struct {
+    int fd;                    // -1 while down
+    ConnectionState state;
+    uint32_t events;           // As registered with epoll
+    uint64_t retry_ns;         // Down: next attempt. Connecting: give up.
+    uint32_t backoff_ms;
+    bool handshake;            // Reply to the handshake is due before any in sent
+    RequestList sent;          // Written or queued for writing, in stream order
+    size_t in_flight;
+    char* out;                 // Stream bytes from out_base on
+    size_t out_length;
+    size_t out_written;        // Bytes of out already written
+    size_t out_capacity;
+    uint64_t out_base;         // Stream offset of out[0]
+    char* in;                  // Reply bytes not yet matched
+    size_t in_length;
+    size_t in_capacity;
+} Connection;
+
+struct PhantomClient {
+    PhantomClientConfig config;
+    struct sockaddr_in addr;
+    Connection connections[PHANTOM_CLIENT_MAX_CONNECTIONS];
+    pthread_t thread;
+    int epoll_fd;
+    int wake_fd;               // Tells the I/O thread about new requests or stop
+    int done_fd;               // Tells the application about completions
+    pthread_mutex_t lock;      // Protects queue, done and stopping
+    RequestList queue;         // Submitted, not yet on a connection
+    RequestList done;          // Completed, callbacks not yet run
+    bool stopping;
+    PhantomClientStats stats;  // Written by the I/O thread with relaxed atomics
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void count(uint64_t* counter, uint64_t amount) {
+    __atomic_add_fetch(counter, amount, __ATOMIC_RELAXED);
+}
+
+static void list_push(RequestList* list, Request* request) {
+    request->next = NULL;
+    if (list->tail) list->tail->next = request;
+    else list->head = request;
+    list->tail = request;
+}
+
+static Request* list_pop(RequestList* list) {
+    Request* request = list->head;
+    if (request) {
+        list->head = request->next;
+        if (!list->head) list->tail = NULL;
+    }
+    return request;
+}
+
+// Move all of from to the end of to
+static void list_append(RequestList* to, RequestList* from) {
+    if (!from->head) return;
+    if (to->tail) to->tail->next = from->head;
+    else to->head = from->head;
+    to->tail = from->tail;
+    from->head = from->tail = NULL;
+}
+
+static void signal_fd(int fd) {
+    uint64_t one = 1;
+    ssize_t ignored = write(fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+// Record the outcome. A blocking caller is woken at once; callback
+// requests are collected in finished and published together.
+static void complete(PhantomClient* client, Request* request, PhantomStatus status,
+                     const char* reply, size_t length, RequestList* finished) {
+    count(&client->stats.requests, 1);
+    if (status != PHANTOM_OK) count(&client->stats.failures, 1);
+
+    request->status = status;
+    request->reply = malloc(length + 1);
+    request->reply_length = request->reply ? length : 0;
+    if (request->reply) {
+        memcpy(request->reply, reply, length);
+        request->reply[length] = '\0';
+    }
+
+    if (request->waiter) {
+        Waiter* waiter = request->waiter;
+        pthread_mutex_lock(&waiter->lock);
+        waiter->done = true;
+        pthread_cond_signal(&waiter->cond);
+        pthread_mutex_unlock(&waiter->lock);
+    } else {
+        list_push(finished, request);
+    }
+}
+
+static void publish(PhantomClient* client, RequestList* finished) {
+    if (!finished->head) return;
+    pthread_mutex_lock(&client->lock);
+    list_append(&client->done, finished);
+    pthread_mutex_unlock(&client->lock);
+    signal_fd(client->done_fd);
+}
+
+static bool reserve(char** buffer, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) return true;
+    size_t size = *capacity ? *capacity : CLIENT_BUFFER_SIZE;
+    while (size < needed) size *= 2;
+    char* grown = realloc(*buffer, size);
+    if (!grown) return false;
+    *buffer = grown;
+    *capacity = size;
+    return true;
+}
+
+static bool append(Connection* conn, const char* data, size_t length) {
+    if (!reserve(&conn->out, &conn->out_capacity, conn->out_length + length)) return false;
+    memcpy(conn->out + conn->out_length, data, length);
+    conn->out_length += length;
+    return true;
+}
+
+static void set_events(PhantomClient* client, Connection* conn) {
+    uint32_t events = conn->state == CONN_CONNECTING ? EPOLLOUT
+        : EPOLLIN | (conn->out_written < conn->out_length ? EPOLLOUT : 0);
+    if (events == conn->events) return;
+
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    epoll_ctl(client->epoll_fd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &event);
+    conn->events = events;
+}
+
+// Close the connection and settle what was on it. Requests whose bytes
+// never left go back to the front of the queue; the rest may have run and
+// fail with status (the first) or PHANTOM_DISCONNECTED.
+static void drop(PhantomClient* client, Connection* conn, PhantomStatus status, RequestList* finished) {
+    uint64_t written = conn->out_base + conn->out_written;
+    RequestList unsent = {0};
+    Request* request;
+
+    while ((request = list_pop(&conn->sent))) {
+        if (request->start >= written) {
+            list_push(&unsent, request);
+        } else {
+            complete(client, request, status, "", 0, finished);
+            status = PHANTOM_DISCONNECTED;
+        }
+    }
+    if (unsent.head) {
+        pthread_mutex_lock(&client->lock);
+        list_append(&unsent, &client->queue);
+        client->queue = unsent;
+        pthread_mutex_unlock(&client->lock);
+    }
+
+    if (conn->fd >= 0) {
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->state = CONN_DOWN;
+    conn->events = 0;
+    conn->handshake = false;
+    conn->in_flight = 0;
+    conn->out_base += conn->out_length;
+    conn->out_length = conn->out_written = 0;
+    conn->in_length = 0;
+    conn->retry_ns = now_ns() + conn->backoff_ms * 1000000ull;
+    conn->backoff_ms = conn->backoff_ms * 2 < CLIENT_MAX_BACKOFF_MS ? conn->backoff_ms * 2 : CLIENT_MAX_BACKOFF_MS;
+}
+
+// The handshake goes out ahead of the first requests, in the same write
+static void connected(PhantomClient* client, Connection* conn, RequestList* finished) {
+    conn->state = CONN_READY;
+    conn->handshake = true;
+    count(&client->stats.connects, 1);
+    if (!append(conn, CLIENT_HANDSHAKE, strlen(CLIENT_HANDSHAKE))) {
+        drop(client, conn, PHANTOM_DISCONNECTED, finished);
+        return;
+    }
+    set_events(client, conn);
+}
+
+static void start_connect(PhantomClient* client, Connection* conn, RequestList* finished) {
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn->fd < 0) {
+        drop(client, conn, PHANTOM_DISCONNECTED, finished);
+        return;
+    }
+
+    // Requests are already batched here, so Nagle would only add delay
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(conn->fd, (struct sockaddr*)&client->addr, sizeof(client->addr)) == 0) {
+        connected(client, conn, finished);
+    } else if (errno == EINPROGRESS) {
+        conn->state = CONN_CONNECTING;
+        conn->retry_ns = now_ns() + client->config.timeout_ms * 1000000ull;
+        set_events(client, conn);
+    } else {
+        drop(client, conn, PHANTOM_DISCONNECTED, finished);
+    }
+}
+
+// Write what is pending; usually everything queued goes in one call
+static void flush(PhantomClient* client, Connection* conn, RequestList* finished) {
+    while (conn->out_written < conn->out_length) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_written,
+                            conn->out_length - conn->out_written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        count(&client->stats.writes, 1);
+        if (sent <= 0) {
+            drop(client, conn, PHANTOM_DISCONNECTED, finished);
+            return;
+        }
+        conn->out_written += (size_t)sent;
+    }
+    if (conn->out_written == conn->out_length) {
+        conn->out_base += conn->out_length;
+        conn->out_length = conn->out_written = 0;
+    }
+    set_events(client, conn);
+}
+
+// Match each NUL-terminated reply to the oldest request on the connection
+static void receive(PhantomClient* client, Connection* conn, RequestList* finished) {
+    if (!reserve(&conn->in, &conn->in_capacity, conn->in_length + CLIENT_BUFFER_SIZE / 2)) {
+        drop(client, conn, PHANTOM_DISCONNECTED, finished);
+        return;
+    }
+    ssize_t got = recv(conn->fd, conn->in + conn->in_length, conn->in_capacity - conn->in_length,
+                       MSG_DONTWAIT);
+    if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (got <= 0) {
+        drop(client, conn, PHANTOM_DISCONNECTED, finished);
+        return;
+    }
+    conn->in_length += (size_t)got;
+
+    size_t offset = 0;
+    char* end;
+    while ((end = memchr(conn->in + offset, '\0', conn->in_length - offset))) {
+        size_t length = (size_t)(end - (conn->in + offset));
+        if (conn->handshake) {
+            conn->handshake = false;
+            conn->backoff_ms = client->config.reconnect_ms;
+        } else {
+            Request* request = list_pop(&conn->sent);
+            if (!request) {
+                // A reply nobody asked for: the stream can no longer be trusted
+                drop(client, conn, PHANTOM_DISCONNECTED, finished);
+                return;
+            }
+            conn->in_flight--;
+            complete(client, request, PHANTOM_OK, conn->in + offset, length, finished);
+        }
+        offset += length + 1;
+    }
+    conn->in_length -= offset;
+    memmove(conn->in, conn->in + offset, conn->in_length);
+}
+
+// Hand queued requests to the ready connections with the fewest in flight.
+// Called with client->lock held.
+static void assign(PhantomClient* client) {
+    while (client->queue.head) {
+        Connection* best = NULL;
+        for (size_t i = 0; i < client->config.connections; i++) {
+            Connection* conn = &client->connections[i];
+            if (conn->state != CONN_READY || conn->in_flight >= client->config.max_in_flight) continue;
+            if (!best || conn->in_flight < best->in_flight) best = conn;
+        }
+        if (!best) return;
+
+        Request* request = client->queue.head;
+        request->start = best->out_base + best->out_length;
+        if (!append(best, request->text, request->length)) return;
+        list_pop(&client->queue);
+        list_push(&best->sent, request);
+        best->in_flight++;
+    }
+}
+
+// Milliseconds until the next deadline or reconnect, -1 for none
+static int next_timeout(PhantomClient* client, uint64_t now) {
+    uint64_t next = 0;
+    for (size_t i = 0; i < client->config.connections; i++) {
+        Connection* conn = &client->connections[i];
+        uint64_t due = conn->state != CONN_READY ? conn->retry_ns
+            : conn->sent.head ? conn->sent.head->deadline_ns : 0;
+        if (due && (!next || due < next)) next = due;
+    }
+    pthread_mutex_lock(&client->lock);
+    if (client->queue.head && (!next || client->queue.head->deadline_ns < next)) {
+        next = client->queue.head->deadline_ns;
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    if (!next) return -1;
+    return next <= now ? 0 : (int)((next - now + 999999) / 1000000);
+}
+
+static void* io_thread(void* arg) {
+    PhantomClient* client = arg;
+    struct epoll_event events[PHANTOM_CLIENT_MAX_CONNECTIONS + 1];
+
+    for (;;) {
+        RequestList finished = {0};
+        uint64_t now = now_ns();
+
+        // Reconnect, and give up on connections that stopped answering
+        for (size_t i = 0; i < client->config.connections; i++) {
+            Connection* conn = &client->connections[i];
+            if (conn->state == CONN_DOWN && now >= conn->retry_ns) {
+                start_connect(client, conn, &finished);
+            } else if (conn->state == CONN_CONNECTING && now >= conn->retry_ns) {
+                drop(client, conn, PHANTOM_DISCONNECTED, &finished);
+            } else if (conn->state == CONN_READY && conn->sent.head && now >= conn->sent.head->deadline_ns) {
+                drop(client, conn, PHANTOM_TIMEOUT, &finished);
+            }
+        }
+
+        pthread_mutex_lock(&client->lock);
+        bool stopping = client->stopping;
+        while (client->queue.head && now >= client->queue.head->deadline_ns) {
+            complete(client, list_pop(&client->queue), PHANTOM_TIMEOUT, "", 0, &finished);
+        }
+        if (!stopping) assign(client);
+        pthread_mutex_unlock(&client->lock);
+
+        if (stopping) {
+            publish(client, &finished);
+            break;
+        }
+        for (size_t i = 0; i < client->config.connections; i++) {
+            Connection* conn = &client->connections[i];
+            if (conn->state == CONN_READY && conn->out_written < conn->out_length) {
+                flush(client, conn, &finished);
+            }
+        }
+        publish(client, &finished);
+
+        int ready = epoll_wait(client->epoll_fd, events, PHANTOM_CLIENT_MAX_CONNECTIONS + 1,
+                               next_timeout(client, now_ns()));
+        for (int i = 0; i < ready; i++) {
+            Connection* conn = events[i].data.ptr;
+            if (!conn) {
+                uint64_t ignored;
+                ssize_t result = read(client->wake_fd, &ignored, sizeof(ignored));
+                (void)result;
+                continue;
+            }
+            if (conn->state == CONN_CONNECTING) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                if (error == 0) connected(client, conn, &finished);
+                else drop(client, conn, PHANTOM_DISCONNECTED, &finished);
+                continue;
+            }
+            if (conn->state == CONN_READY && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                receive(client, conn, &finished);
+            }
+            if (conn->state == CONN_READY && (events[i].events & EPOLLOUT)) {
+                flush(client, conn, &finished);
+            }
+        }
+        publish(client, &finished);
+    }
+    return NULL;
+}
+
+PhantomClient* phantom_client_open(const PhantomClientConfig* config) {
+    PhantomClient* client = calloc(1, sizeof(PhantomClient));
+    if (!client) return NULL;
+
+    client->config = *config;
+    if (!client->config.host) client->config.host = "127.0.0.1";
+    if (!client->config.port) client->config.port = 8888;
+    if (!client->config.connections) client->config.connections = 2;
+    if (!client->config.max_in_flight) client->config.max_in_flight = 64;
+    if (!client->config.timeout_ms) client->config.timeout_ms = 5000;
+    if (!client->config.reconnect_ms) client->config.reconnect_ms = 50;
+    if (client->config.connections > PHANTOM_CLIENT_MAX_CONNECTIONS) {
+        client->config.connections = PHANTOM_CLIENT_MAX_CONNECTIONS;
+    }
+
+    client->addr.sin_family = AF_INET;
+    client->addr.sin_port = htons(client->config.port);
+    if (inet_pton(AF_INET, client->config.host, &client->addr.sin_addr) != 1) {
+        free(client);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < client->config.connections; i++) {
+        client->connections[i].fd = -1;
+        client->connections[i].backoff_ms = client->config.reconnect_ms;
+    }
+    pthread_mutex_init(&client->lock, NULL);
+    client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    client->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    client->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event wake = { .events = EPOLLIN, .data.ptr = NULL };
+    if (client->epoll_fd < 0 || client->wake_fd < 0 || client->done_fd < 0 ||
+        epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, client->wake_fd, &wake) < 0 ||
+        pthread_create(&client->thread, NULL, io_thread, client) != 0) {
+        if (client->epoll_fd >= 0) close(client->epoll_fd);
+        if (client->wake_fd >= 0) close(client->wake_fd);
+        if (client->done_fd >= 0) close(client->done_fd);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+static Request* new_request(PhantomClient* client, const char* text) {
+    size_t length = strlen(text);
+    if (length == 0 || length > PHANTOM_CLIENT_MAX_REQUEST || memchr(text, '\n', length)) return NULL;
+
+    Request* request = calloc(1, sizeof(Request) + length + 1);
+    if (!request) return NULL;
+    memcpy(request->text, text, length);
+    request->text[length] = '\n';
+    request->length = length + 1;
+    request->deadline_ns = now_ns() + client->config.timeout_ms * 1000000ull;
+    return request;
+}
+
+static bool enqueue(PhantomClient* client, Request* request) {
+    pthread_mutex_lock(&client->lock);
+    if (client->stopping) {
+        pthread_mutex_unlock(&client->lock);
+        return false;
+    }
+
+    // A non-empty queue already has a wakeup on its way
+    bool idle = client->queue.head == NULL;
+    list_push(&client->queue, request);
+    pthread_mutex_unlock(&client->lock);
+    if (idle) signal_fd(client->wake_fd);
+    return true;
+}
+
+bool phantom_client_submit(PhantomClient* client, const char* request_text,
+                           PhantomCallback callback, void* arg) {
+    Request* request = new_request(client, request_text);
+    if (!request) return false;
+    request->callback = callback;
+    request->arg = arg;
+    if (!enqueue(client, request)) {
+        free(request);
+        return false;
+    }
+    return true;
+}
+
+PhantomStatus phantom_client_call(PhantomClient* client, const char* request_text,
+                                  char* reply, size_t size) {
+    Request* request = new_request(client, request_text);
+    if (!request) return PHANTOM_INVALID;
+
+    Waiter waiter = { .done = false };
+    pthread_mutex_init(&waiter.lock, NULL);
+    pthread_cond_init(&waiter.cond, NULL);
+    request->waiter = &waiter;
+
+    PhantomStatus status = PHANTOM_CLOSED;
+    if (enqueue(client, request)) {
+        pthread_mutex_lock(&waiter.lock);
+        while (!waiter.done) pthread_cond_wait(&waiter.cond, &waiter.lock);
+        pthread_mutex_unlock(&waiter.lock);
+
+        status = request->status;
+        if (size > 0) {
+            size_t length = request->reply_length < size - 1 ? request->reply_length : size - 1;
+            if (length) memcpy(reply, request->reply, length);
+            reply[length] = '\0';
+        }
+        free(request->reply);
+    }
+    free(request);
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_destroy(&waiter.lock);
+    return status;
+}
+
+int phantom_client_fd(const PhantomClient* client) {
+    return client->done_fd;
+}
+
+size_t phantom_client_dispatch(PhantomClient* client) {
+    uint64_t ignored;
+    ssize_t result = read(client->done_fd, &ignored, sizeof(ignored));
+    (void)result;
+
+    pthread_mutex_lock(&client->lock);
+    RequestList done = client->done;
+    client->done.head = client->done.tail = NULL;
+    pthread_mutex_unlock(&client->lock);
+
+    size_t ran = 0;
+    Request* request;
+    while ((request = list_pop(&done))) {
+        if (request->callback) {
+            request->callback(request->arg, request->status,
+                              request->reply ? request->reply : "", request->reply_length);
+        }
+        free(request->reply);
+        free(request);
+        ran++;
+    }
+    return ran;
+}
+
+void phantom_client_close(PhantomClient* client) {
+    pthread_mutex_lock(&client->lock);
+    client->stopping = true;
+    pthread_mutex_unlock(&client->lock);
+    signal_fd(client->wake_fd);
+    pthread_join(client->thread, NULL);
+
+    // The I/O thread is gone, so its state is ours now
+    RequestList finished = {0};
+    Request* request;
+    for (size_t i = 0; i < client->config.connections; i++) {
+        Connection* conn = &client->connections[i];
+        while ((request = list_pop(&conn->sent))) {
+            complete(client, request, PHANTOM_CLOSED, "", 0, &finished);
+        }
+        if (conn->fd >= 0) close(conn->fd);
+        free(conn->out);
+        free(conn->in);
+    }
+    pthread_mutex_lock(&client->lock);
+    RequestList queue = client->queue;
+    client->queue.head = client->queue.tail = NULL;
+    pthread_mutex_unlock(&client->lock);
+    while ((request = list_pop(&queue))) {
+        complete(client, request, PHANTOM_CLOSED, "", 0, &finished);
+    }
+    publish(client, &finished);
+    phantom_client_dispatch(client);
+
+    close(client->epoll_fd);
+    close(client->wake_fd);
+    close(client->done_fd);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
+
+void phantom_client_stats(const PhantomClient* client, PhantomClientStats* out) {
+    out->requests = __atomic_load_n(&client->stats.requests, __ATOMIC_RELAXED);
+    out->failures = __atomic_load_n(&client->stats.failures, __ATOMIC_RELAXED);
+    out->writes = __atomic_load_n(&client->stats.writes, __ATOMIC_RELAXED);
+    out->connects = __atomic_load_n(&client->stats.connects, __ATOMIC_RELAXED);
+}
+
+const char* phantom_status_name(PhantomStatus status) {
+    switch (status) {
+    case PHANTOM_OK: return "ok";
+    case PHANTOM_TIMEOUT: return "timeout";
+    case PHANTOM_DISCONNECTED: return "disconnected";
+    case PHANTOM_CLOSED: return "closed";
+    case PHANTOM_INVALID: return "invalid";
+    }
+    return "unknown";
+}
@@ -0,0 +1,78 @@
+#ifndef LIBPHANTOM_H
+#define LIBPHANTOM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Client library for phantomid and phantom-router. A pool of persistent
+// connections, each switched to framed replies with the `pipeline`
+// command, so many requests can be outstanding on one connection. A
+// background I/O thread writes whatever is queued for a connection in
+// one write and matches replies to requests in order.
+
+#define PHANTOM_CLIENT_MAX_CONNECTIONS 64
+#define PHANTOM_CLIENT_MAX_REQUEST 1022 // Longest request line the daemon reads whole
+
+typedef struct {
+    const char* host;              // IPv4 address, NULL for 127.0.0.1
+    uint16_t port;                 // 0 for 8888
+    size_t connections;            // Pool size, 0 for 2
+    size_t max_in_flight;          // Requests outstanding per connection, 0 for 64
+    uint32_t timeout_ms;           // A request not answered by then fails, 0 for 5000
+    uint32_t reconnect_ms;         // First reconnect delay, doubled up to 1 s; 0 for 50
+} PhantomClientConfig;
+
+typedef enum {
+    PHANTOM_OK,
+    PHANTOM_TIMEOUT,               // No reply within timeout_ms
+    PHANTOM_DISCONNECTED,          // Connection lost after the request may have been sent
+    PHANTOM_CLOSED,                // Client closed first
+    PHANTOM_INVALID                // Empty, too long or containing a newline
+} PhantomStatus;
+
+// reply is NUL-terminated and valid only during the call
+typedef void (*PhantomCallback)(void* arg, PhantomStatus status, const char* reply, size_t length);
+
+typedef struct {
+    uint64_t requests;             // Completed, successfully or not
+    uint64_t failures;             // Completed with a status other than PHANTOM_OK
+    uint64_t writes;               // write calls; requests / writes is the batching factor
+    uint64_t connects;             // Connections established, including reconnects
+} PhantomClientStats;
+
+typedef struct PhantomClient PhantomClient;
+
+// Start the I/O thread and begin connecting. Returns NULL if the address
+// is invalid or resources run out; an unreachable daemon is not an error,
+// requests simply wait for a connection until they time out.
+PhantomClient* phantom_client_open(const PhantomClientConfig* config);
+
+// Stop the I/O thread and fail outstanding requests with PHANTOM_CLOSED.
+// Their callbacks run here, on the caller's thread.
+void phantom_client_close(PhantomClient* client);
+
+// Queue a request without waiting. The callback runs later from
+// phantom_client_dispatch, on whichever thread calls it. Requests sent on
+// one connection are answered in order. A request that fails with
+// PHANTOM_DISCONNECTED is not retried, since it may have run; ones not yet
+// written when a connection drops go out on another.
+bool phantom_client_submit(PhantomClient* client, const char* request,
+                           PhantomCallback callback, void* arg);
+
+// eventfd that is readable while completed requests wait for dispatch, for
+// an application's own poll or epoll loop
+int phantom_client_fd(const PhantomClient* client);
+
+// Run the callbacks of completed requests; returns how many ran
+size_t phantom_client_dispatch(PhantomClient* client);
+
+// Send a request and wait for its reply, copied NUL-terminated into reply
+// and truncated to size. Safe from any number of threads at once.
+PhantomStatus phantom_client_call(PhantomClient* client, const char* request,
+                                  char* reply, size_t size);
+
+void phantom_client_stats(const PhantomClient* client, PhantomClientStats* out);
+const char* phantom_status_name(PhantomStatus status);
+
+#endif // LIBPHANTOM_H
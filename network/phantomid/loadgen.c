@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "metrics.h"
+
+#define LOAD_MAX_CONNECTIONS 65536
+#define LOAD_MAX_THREADS 256
+#define LOAD_READ_SIZE 4096
+#define LOAD_HANDSHAKE "pipeline\n"  // Switches the connection to NUL-framed replies
+#define LOAD_HEAD_SIZE 96          // Start of each reply, kept for checks and IDs
+#define LOAD_ID_POOL 32            // Created IDs each connection keeps for lookup/delete
+#define LOAD_TIMEOUT_NS (5 * 1000000000ull)
+
+typedef enum {
+    OP_CREATE,
+    OP_DELETE,
+    OP_LIST,
+    OP_LOOKUP,
+    OP_COUNT
+} LoadOp;
+
+static const char* op_names[OP_COUNT] = { "create", "delete", "list", "lookup" };
+
+// Replies that count as success start with these
+static const char* op_replies[OP_COUNT] = {
+    "\nAccount created:", "\nAccount deleted:", "\nActive accounts:", "\nID: "
+};
+
+typedef struct {
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t count;            // Successful replies
+    uint64_t errors;           // Error replies and timeouts
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} LoadHistogram;
+
+// One connection with at most one request outstanding; it sends `pipeline`
+// when it connects, so each reply ends with a NUL byte
+typedef struct {
+    int fd;                    // -1 once failed or closed
+    bool busy;                 // Request sent, reply not complete
+    LoadOp op;
+    uint64_t intended_ns;      // When the request should have gone out
+    uint64_t sent_ns;
+    uint64_t next_ns;          // Open loop: next scheduled request
+    size_t received;           // Reply bytes so far
+    char head[LOAD_HEAD_SIZE + 1];
+    char ids[LOAD_ID_POOL][65];
+    size_t id_count;
+} LoadConnection;
+
+typedef struct {
+    pthread_t thread;
+    LoadConnection* connections;
+    size_t count;
+    size_t first;              // Index of connections[0] among all connections
+    uint64_t seed;             // xorshift state for the command mix
+    uint64_t interval_ns;      // Open loop: per-connection request spacing
+    uint64_t connect_failures;
+    uint64_t disconnects;
+    LoadHistogram ops[OP_COUNT];
+} LoadWorker;
+
+static struct {
+    const char* host;
+    uint16_t port;
+    size_t connections;
+    size_t threads;
+    uint32_t duration_s;
+    double rate;               // Requests per second in total, 0 for closed loop
+    size_t live;               // Connections that completed the handshake
+    uint32_t mix[OP_COUNT];    // Relative weights
+    uint32_t mix_total;
+    const char* output;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} g_load = {
+    .host = "127.0.0.1",
+    .port = 8888,
+    .connections = 8,
+    .threads = 4,
+    .duration_s = 10,
+    .mix = { 40, 10, 5, 45 },
+    .mix_total = 100
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(LoadWorker* worker) {
+    uint64_t x = worker->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return worker->seed = x;
+}
+
+static void record(LoadHistogram* histogram, uint64_t latency) {
+    histogram->counts[metrics_bucket(latency)]++;
+    histogram->count++;
+    histogram->sum_ns += latency;
+    if (latency > histogram->max_ns) histogram->max_ns = latency;
+}
+
+// Weighted pick; commands that need an ID fall back to create until one exists
+static LoadOp pick_op(LoadWorker* worker, const LoadConnection* conn) {
+    uint32_t roll = (uint32_t)(next_random(worker) % g_load.mix_total);
+    LoadOp op = OP_CREATE;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (roll < g_load.mix[i]) {
+            op = (LoadOp)i;
+            break;
+        }
+        roll -= g_load.mix[i];
+    }
+    if ((op == OP_DELETE || op == OP_LOOKUP) && conn->id_count == 0) return OP_CREATE;
+    return op;
+}
+
+static void drop_connection(LoadWorker* worker, LoadConnection* conn) {
+    close(conn->fd);
+    conn->fd = -1;
+    conn->busy = false;
+    worker->disconnects++;
+}
+
+static void send_request(LoadWorker* worker, LoadConnection* conn, uint64_t intended, uint64_t now) {
+    char request[128];
+    int length;
+
+    conn->op = pick_op(worker, conn);
+    switch (conn->op) {
+        case OP_DELETE:
+            // Forget the ID now; a failed delete is counted as an error
+            length = snprintf(request, sizeof(request), "delete %s\n", conn->ids[--conn->id_count]);
+            break;
+        case OP_LOOKUP:
+            length = snprintf(request, sizeof(request), "lookup %s\n",
+                              conn->ids[next_random(worker) % conn->id_count]);
+            break;
+        default:
+            length = snprintf(request, sizeof(request), "%s\n", op_names[conn->op]);
+            break;
+    }
+
+    conn->intended_ns = intended;
+    conn->sent_ns = now;
+    conn->received = 0;
+    conn->busy = true;
+    if (send(conn->fd, request, (size_t)length, MSG_NOSIGNAL) != length) {
+        drop_connection(worker, conn);
+    }
+}
+
+// Read what has arrived; returns true once the reply's NUL is in
+static bool read_reply(LoadWorker* worker, LoadConnection* conn) {
+    char buffer[LOAD_READ_SIZE];
+    ssize_t n = recv(conn->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        drop_connection(worker, conn);
+        return false;
+    }
+    if (n < 0) return false;
+
+    const char* end = memchr(buffer, '\0', (size_t)n);
+    if (end && end != buffer + n - 1) {
+        // Bytes past the reply nobody asked for: the stream is out of step
+        drop_connection(worker, conn);
+        return false;
+    }
+    if (end) n--;
+
+    if (conn->received < LOAD_HEAD_SIZE) {
+        size_t take = LOAD_HEAD_SIZE - conn->received;
+        if (take > (size_t)n) take = (size_t)n;
+        memcpy(conn->head + conn->received, buffer, take);
+        conn->head[conn->received + take] = '\0';
+    }
+    conn->received += (size_t)n;
+    return end != NULL;
+}
+
+static void complete(LoadWorker* worker, LoadConnection* conn, uint64_t now) {
+    LoadHistogram* histogram = &worker->ops[conn->op];
+    conn->busy = false;
+
+    if (strncmp(conn->head, op_replies[conn->op], strlen(op_replies[conn->op])) != 0) {
+        histogram->errors++;
+        return;
+    }
+    record(histogram, now - conn->intended_ns);
+
+    // Remember created IDs for lookups and deletes
+    const char* id = conn->op == OP_CREATE ? strstr(conn->head, "ID: ") : NULL;
+    if (id && strlen(id + 4) >= 64) {
+        size_t slot = conn->id_count < LOAD_ID_POOL ? conn->id_count++ :
+                      next_random(worker) % LOAD_ID_POOL;
+        memcpy(conn->ids[slot], id + 4, 64);
+        conn->ids[slot][64] = '\0';
+    }
+}
+
+// Wait for the NUL that ends the handshake reply; a daemon already at its
+// client limit closes the connection instead
+static bool await_handshake(int fd) {
+    char buffer[LOAD_READ_SIZE];
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t deadline = now_ns() + LOAD_TIMEOUT_NS;
+
+    for (;;) {
+        uint64_t now = now_ns();
+        if (now >= deadline || poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1) <= 0) return false;
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) return false;
+        const char* end = memchr(buffer, '\0', (size_t)n);
+        if (end) return end == buffer + n - 1;
+    }
+}
+
+static int open_connection(void) {
+    int fd = socket(g_load.addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*)&g_load.addr, g_load.addr_len) < 0 ||
+        send(fd, LOAD_HANDSHAKE, strlen(LOAD_HANDSHAKE), MSG_NOSIGNAL) != (ssize_t)strlen(LOAD_HANDSHAKE) ||
+        !await_handshake(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* run_worker(void* arg) {
+    LoadWorker* worker = arg;
+    struct pollfd* fds = calloc(worker->count, sizeof(struct pollfd));
+    if (!fds) return NULL;
+
+    // Open loop: spread the connections' first requests across one interval
+    for (size_t i = 0; i < worker->count; i++) {
+        worker->connections[i].next_ns = g_load.start_ns +
+            worker->interval_ns * (worker->first + i) / g_load.live;
+    }
+
+    for (;;) {
+        uint64_t now = now_ns();
+        uint64_t wait_ns = 10000000;  // Poll at least every 10 ms
+        if (now >= g_load.end_ns) break;
+
+        for (size_t i = 0; i < worker->count; i++) {
+            LoadConnection* conn = &worker->connections[i];
+            fds[i].fd = conn->fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (conn->fd < 0) continue;
+
+            if (conn->busy) {
+                if (now - conn->sent_ns > LOAD_TIMEOUT_NS) {
+                    worker->ops[conn->op].errors++;
+                    drop_connection(worker, conn);
+                }
+            } else if (worker->interval_ns == 0) {
+                send_request(worker, conn, now, now);
+            } else if (conn->next_ns <= now) {
+                // A request that fell due while the previous one was in
+                // flight is timed from when it was due, not when it went out
+                send_request(worker, conn, conn->next_ns, now);
+                conn->next_ns += worker->interval_ns;
+            } else if (conn->next_ns - now < wait_ns) {
+                wait_ns = conn->next_ns - now;
+            }
+            fds[i].fd = conn->fd;
+        }
+        if (g_load.end_ns - now < wait_ns) wait_ns = g_load.end_ns - now;
+
+        struct timespec timeout = { (time_t)(wait_ns / 1000000000ull), (long)(wait_ns % 1000000000ull) };
+        if (ppoll(fds, worker->count, &timeout, NULL) <= 0) continue;
+
+        now = now_ns();
+        for (size_t i = 0; i < worker->count; i++) {
+            LoadConnection* conn = &worker->connections[i];
+            if (!fds[i].revents || conn->fd < 0) continue;
+            if (!conn->busy) {
+                // Data nobody asked for; the daemon closed or misbehaved
+                drop_connection(worker, conn);
+            } else if (read_reply(worker, conn) && now <= g_load.end_ns) {
+                complete(worker, conn, now);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < worker->count; i++) {
+        if (worker->connections[i].fd >= 0) close(worker->connections[i].fd);
+    }
+    free(fds);
+    return NULL;
+}
+
+// "create=40,delete=10,list=5,lookup=45"; omitted commands get weight 0
+static bool parse_mix(char* text) {
+    uint32_t mix[OP_COUNT] = {0}, total = 0;
+
+    for (char* item = strtok(text, ","); item; item = strtok(NULL, ",")) {
+        char* equals = strchr(item, '=');
+        if (!equals) return false;
+        *equals = '\0';
+
+        int op = 0;
+        while (op < OP_COUNT && strcmp(op_names[op], item) != 0) op++;
+        int weight = atoi(equals + 1);
+        if (op == OP_COUNT || weight < 0) return false;
+        mix[op] = (uint32_t)weight;
+        total += (uint32_t)weight;
+    }
+    if (total == 0) return false;
+
+    memcpy(g_load.mix, mix, sizeof(mix));
+    g_load.mix_total = total;
+    return true;
+}
+
+static bool resolve(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* result;
+    char port[8];
+
+    snprintf(port, sizeof(port), "%u", g_load.port);
+    if (getaddrinfo(g_load.host, port, &hints, &result) != 0) return false;
+    memcpy(&g_load.addr, result->ai_addr, result->ai_addrlen);
+    g_load.addr_len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static void print_latency(FILE* out, const LoadHistogram* h) {
+    fprintf(out, "\"count\": %lu, \"errors\": %lu, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+            "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f",
+            h->count, h->errors, h->count ? h->sum_ns / 1e3 / h->count : 0.0,
+            metrics_percentile(h->counts, h->count, h->max_ns, 0.50) / 1e3,
+            metrics_percentile(h->counts, h->count, h->max_ns, 0.99) / 1e3,
+            metrics_percentile(h->counts, h->count, h->max_ns, 0.999) / 1e3,
+            h->max_ns / 1e3);
+}
+
+static void report(FILE* out, LoadWorker* workers) {
+    LoadHistogram ops[OP_COUNT] = {0}, total = {0};
+    uint64_t connect_failures = 0, disconnects = 0;
+
+    for (size_t w = 0; w < g_load.threads; w++) {
+        connect_failures += workers[w].connect_failures;
+        disconnects += workers[w].disconnects;
+        for (int op = 0; op < OP_COUNT; op++) {
+            const LoadHistogram* h = &workers[w].ops[op];
+            for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+                ops[op].counts[b] += h->counts[b];
+                total.counts[b] += h->counts[b];
+            }
+            ops[op].count += h->count;
+            ops[op].errors += h->errors;
+            ops[op].sum_ns += h->sum_ns;
+            if (h->max_ns > ops[op].max_ns) ops[op].max_ns = h->max_ns;
+        }
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        total.count += ops[op].count;
+        total.errors += ops[op].errors;
+        total.sum_ns += ops[op].sum_ns;
+        if (ops[op].max_ns > total.max_ns) total.max_ns = ops[op].max_ns;
+    }
+
+    fprintf(out, "{\n  \"mode\": \"%s\",\n  \"target_rate\": %.1f,\n",
+            g_load.rate > 0 ? "open" : "closed", g_load.rate);
+    fprintf(out, "  \"connections\": %zu,\n  \"live_connections\": %zu,\n  \"threads\": %zu,\n"
+            "  \"duration_s\": %u,\n", g_load.connections, g_load.live, g_load.threads, g_load.duration_s);
+    fprintf(out, "  \"connect_failures\": %lu,\n  \"disconnects\": %lu,\n",
+            connect_failures, disconnects);
+    fprintf(out, "  \"throughput\": %.1f,\n  \"latency\": { ",
+            total.count / (double)g_load.duration_s);
+    print_latency(out, &total);
+    fprintf(out, " },\n  \"ops\": {\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        fprintf(out, "    \"%s\": { \"weight\": %u, ", op_names[op], g_load.mix[op]);
+        print_latency(out, &ops[op]);
+        fprintf(out, " }%s\n", op + 1 < OP_COUNT ? "," : "");
+    }
+    fprintf(out, "  }\n}\n");
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -H, --host HOST         Daemon address (default: 127.0.0.1)\n");
+    printf("  -p, --port PORT         Daemon port (default: 8888)\n");
+    printf("  -c, --connections N     Connections in total (default: 8)\n");
+    printf("  -t, --threads N         Threads sharing the connections (default: 4)\n");
+    printf("  -d, --duration SEC      Length of the run (default: 10)\n");
+    printf("  -r, --rate N            Open loop at N requests/s in total (default: closed loop)\n");
+    printf("  -m, --mix MIX           Command weights (default: create=40,delete=10,list=5,lookup=45)\n");
+    printf("  -o, --output PATH       Write the JSON report to PATH instead of stdout\n");
+    printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        if (!value) {
+            fprintf(stderr, "Unknown option or missing value: %s\n", arg);
+            return 1;
+        }
+        i++;
+
+        if (strcmp(arg, "-H") == 0 || strcmp(arg, "--host") == 0) {
+            g_load.host = value;
+        }
+        else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--port") == 0) {
+            int port = atoi(value);
+            if (port <= 0 || port > 65535) {
+                fprintf(stderr, "Invalid port number. Must be between 1 and 65535\n");
+                return 1;
+            }
+            g_load.port = (uint16_t)port;
+        }
+        else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--connections") == 0) {
+            long count = atol(value);
+            if (count <= 0 || count > LOAD_MAX_CONNECTIONS) {
+                fprintf(stderr, "Connections must be between 1 and %d\n", LOAD_MAX_CONNECTIONS);
+                return 1;
+            }
+            g_load.connections = (size_t)count;
+        }
+        else if (strcmp(arg, "-t") == 0 || strcmp(arg, "--threads") == 0) {
+            long count = atol(value);
+            if (count <= 0 || count > LOAD_MAX_THREADS) {
+                fprintf(stderr, "Threads must be between 1 and %d\n", LOAD_MAX_THREADS);
+                return 1;
+            }
+            g_load.threads = (size_t)count;
+        }
+        else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--duration") == 0) {
+            int seconds = atoi(value);
+            if (seconds <= 0) {
+                fprintf(stderr, "Duration must be at least 1 second\n");
+                return 1;
+            }
+            g_load.duration_s = (uint32_t)seconds;
+        }
+        else if (strcmp(arg, "-r") == 0 || strcmp(arg, "--rate") == 0) {
+            g_load.rate = atof(value);
+            if (g_load.rate <= 0) {
+                fprintf(stderr, "Rate must be positive\n");
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--mix") == 0) {
+            char mix[256];
+            snprintf(mix, sizeof(mix), "%s", value);
+            if (!parse_mix(mix)) {
+                fprintf(stderr, "Mix must look like create=40,delete=10,list=5,lookup=45\n");
+                return 1;
+            }
+        }
+        else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+            g_load.output = value;
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return 1;
+        }
+    }
+
+    if (g_load.threads > g_load.connections) g_load.threads = g_load.connections;
+    if (!resolve()) {
+        fprintf(stderr, "Cannot resolve %s\n", g_load.host);
+        return 1;
+    }
+
+    LoadWorker* workers = calloc(g_load.threads, sizeof(LoadWorker));
+    LoadConnection* connections = calloc(g_load.connections, sizeof(LoadConnection));
+    if (!workers || !connections) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    // Connect everything before the clock starts, packing the connections
+    // that made it to the front so the threads share them evenly
+    for (size_t i = 0; i < g_load.connections; i++) {
+        connections[g_load.live].fd = open_connection();
+        if (connections[g_load.live].fd >= 0) g_load.live++;
+    }
+    workers[0].connect_failures = g_load.connections - g_load.live;
+    if (g_load.live == 0) {
+        fprintf(stderr, "No connection to %s:%u completed the handshake\n", g_load.host, g_load.port);
+        return 1;
+    }
+    if (g_load.live < g_load.connections) {
+        fprintf(stderr, "Only %zu of %zu connections were accepted%s\n", g_load.live, g_load.connections,
+                g_load.rate > 0 ? "; they share the whole open-loop rate" : "");
+    }
+    if (g_load.threads > g_load.live) g_load.threads = g_load.live;
+
+    // Every live connection gets the same share of the open-loop rate, so
+    // refused connections do not take theirs with them
+    uint64_t interval_ns = g_load.rate > 0 ?
+        (uint64_t)(1e9 * (double)g_load.live / g_load.rate) : 0;
+
+    g_load.start_ns = now_ns();
+    g_load.end_ns = g_load.start_ns + g_load.duration_s * 1000000000ull;
+
+    size_t offset = 0;
+    for (size_t w = 0; w < g_load.threads; w++) {
+        LoadWorker* worker = &workers[w];
+        worker->count = g_load.live / g_load.threads +
+                        (w < g_load.live % g_load.threads ? 1 : 0);
+        worker->connections = &connections[offset];
+        worker->first = offset;
+        worker->seed = 0x9e3779b97f4a7c15ull * (w + 1);
+        worker->interval_ns = interval_ns;
+        offset += worker->count;
+
+        if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+            fprintf(stderr, "Failed to start load thread\n");
+            return 1;
+        }
+    }
+    for (size_t w = 0; w < g_load.threads; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+
+    FILE* out = g_load.output ? fopen(g_load.output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot write %s\n", g_load.output);
+        return 1;
+    }
+    report(out, workers);
+    if (out != stdout) fclose(out);
+
+    free(connections);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "lockprof.h"
+
+static const char* lock_class_names[LOCK_CLASS_COUNT] = {
+    "state", "account", "checkpoint", "clients", "client_slot", "endpoint", "wal", "replication", "settle"
+};
+
+#ifdef PHANTOM_LOCK_PROFILE
+
+// Counters for one lock class, updated with relaxed atomics from every thread
+typedef struct {
+    uint64_t acquisitions;     // Successful locks
+    uint64_t contended;        // Locks that found the mutex taken
+    uint64_t wait_ns;          // Total time blocked acquiring
+    uint64_t hold_ns;          // Total time held
+    uint64_t hold_max_ns;      // Longest single hold
+    uint64_t wait_counts[LOCKPROF_BUCKETS];
+    uint64_t hold_counts[LOCKPROF_BUCKETS];
+} LockClassStats;
+
+// A lock the calling thread currently holds
+typedef struct {
+    pthread_mutex_t* mutex;
+    LockClass cls;
+    uint64_t since;            // Acquisition time
+} HeldLock;
+
+static LockClassStats lock_stats[LOCK_CLASS_COUNT];
+
+static __thread HeldLock tls_held[LOCKPROF_MAX_HELD];
+static __thread size_t tls_depth;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Bucket i holds durations in [2^i, 2^(i+1)) ns, with 0 in bucket 0
+static size_t bucket_of(uint64_t ns) {
+    return ns ? 63 - (size_t)__builtin_clzll(ns) : 0;
+}
+
+static void record(uint64_t* counts, uint64_t* total, uint64_t ns) {
+    __atomic_fetch_add(&counts[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(total, ns, __ATOMIC_RELAXED);
+}
+
+static void hold_begin(pthread_mutex_t* mutex, LockClass cls) {
+    if (tls_depth < LOCKPROF_MAX_HELD) {
+        tls_held[tls_depth] = (HeldLock){ mutex, cls, now_ns() };
+    }
+    tls_depth++;
+}
+
+// Close the newest hold of mutex; locks are not always released in
+// reverse order, so search down from the top
+static void hold_end(pthread_mutex_t* mutex) {
+    size_t depth = tls_depth < LOCKPROF_MAX_HELD ? tls_depth : LOCKPROF_MAX_HELD;
+    if (tls_depth == 0) return;
+    tls_depth--;
+
+    for (size_t i = depth; i-- > 0; ) {
+        if (tls_held[i].mutex != mutex) continue;
+
+        LockClassStats* stats = &lock_stats[tls_held[i].cls];
+        uint64_t held = now_ns() - tls_held[i].since;
+        record(stats->hold_counts, &stats->hold_ns, held);
+
+        uint64_t max = __atomic_load_n(&stats->hold_max_ns, __ATOMIC_RELAXED);
+        while (held > max && !__atomic_compare_exchange_n(&stats->hold_max_ns, &max, held, true,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+
+        for (; i + 1 < depth; i++) tls_held[i] = tls_held[i + 1];
+        return;
+    }
+}
+
+int lock_acquire(pthread_mutex_t* mutex, LockClass cls) {
+    LockClassStats* stats = &lock_stats[cls];
+    uint64_t waited = 0;
+
+    int result = pthread_mutex_trylock(mutex);
+    if (result == EBUSY) {
+        uint64_t start = now_ns();
+        result = pthread_mutex_lock(mutex);
+        waited = now_ns() - start;
+        __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+    }
+    if (result != 0) return result;
+
+    __atomic_fetch_add(&stats->acquisitions, 1, __ATOMIC_RELAXED);
+    record(stats->wait_counts, &stats->wait_ns, waited);
+    hold_begin(mutex, cls);
+    return 0;
+}
+
+int lock_release(pthread_mutex_t* mutex) {
+    hold_end(mutex);
+    return pthread_mutex_unlock(mutex);
+}
+
+// The mutex is released while waiting, so the hold ends before the wait
+// and a new one starts on wakeup under the same class
+static LockClass held_class(pthread_mutex_t* mutex) {
+    size_t depth = tls_depth < LOCKPROF_MAX_HELD ? tls_depth : LOCKPROF_MAX_HELD;
+    for (size_t i = depth; i-- > 0; ) {
+        if (tls_held[i].mutex == mutex) return tls_held[i].cls;
+    }
+    return LOCK_CLASS_COUNT;
+}
+
+int lock_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+    LockClass cls = held_class(mutex);
+    if (cls != LOCK_CLASS_COUNT) hold_end(mutex);
+    int result = pthread_cond_wait(cond, mutex);
+    if (cls != LOCK_CLASS_COUNT) hold_begin(mutex, cls);
+    return result;
+}
+
+int lock_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline) {
+    LockClass cls = held_class(mutex);
+    if (cls != LOCK_CLASS_COUNT) hold_end(mutex);
+    int result = pthread_cond_timedwait(cond, mutex, deadline);
+    if (cls != LOCK_CLASS_COUNT) hold_begin(mutex, cls);
+    return result;
+}
+
+// Upper bound of the bucket containing the given fraction of samples
+static uint64_t percentile(const uint64_t* counts, double fraction) {
+    uint64_t snapshot[LOCKPROF_BUCKETS], total = 0, seen = 0;
+    for (size_t i = 0; i < LOCKPROF_BUCKETS; i++) {
+        snapshot[i] = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+        total += snapshot[i];
+    }
+
+    uint64_t target = (uint64_t)(total * fraction);
+    for (size_t i = 0; i < LOCKPROF_BUCKETS && total; i++) {
+        seen += snapshot[i];
+        if (seen > target) return i == 0 ? 1 : 2ull << i;
+    }
+    return 0;
+}
+
+size_t lockprof_report(char* out, size_t size) {
+    size_t offset = 0, order[LOCK_CLASS_COUNT];
+    uint64_t waits[LOCK_CLASS_COUNT];
+
+    if (size == 0) return 0;
+    out[0] = '\0';
+
+    // Insertion sort by total wait, the best proxy for latency lost
+    for (size_t i = 0; i < LOCK_CLASS_COUNT; i++) {
+        uint64_t wait = __atomic_load_n(&lock_stats[i].wait_ns, __ATOMIC_RELAXED);
+        size_t j = i;
+        for (; j > 0 && waits[j - 1] < wait; j--) {
+            waits[j] = waits[j - 1];
+            order[j] = order[j - 1];
+        }
+        waits[j] = wait;
+        order[j] = i;
+    }
+
+    offset += snprintf(out, size, "\n%-12s %12s %10s %12s %10s %10s %10s\n",
+                       "lock", "acquired", "contended", "wait_ms", "wait_p99", "hold_p99", "hold_max");
+    for (size_t i = 0; i < LOCK_CLASS_COUNT && offset < size; i++) {
+        const LockClassStats* stats = &lock_stats[order[i]];
+        uint64_t acquired = __atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED);
+        uint64_t contended = __atomic_load_n(&stats->contended, __ATOMIC_RELAXED);
+        uint64_t hold_max = __atomic_load_n(&stats->hold_max_ns, __ATOMIC_RELAXED);
+        uint64_t hold_p99 = percentile(stats->hold_counts, 0.99);
+
+        offset += snprintf(out + offset, size - offset,
+                           "%-12s %12lu %9.2f%% %12.3f %8.1fus %8.1fus %8.1fus\n",
+                           lock_class_names[order[i]], acquired,
+                           acquired ? 100.0 * contended / acquired : 0.0,
+                           waits[i] / 1e6,
+                           percentile(stats->wait_counts, 0.99) / 1e3,
+                           (hold_p99 < hold_max ? hold_p99 : hold_max) / 1e3, hold_max / 1e3);
+    }
+    return offset < size ? offset : size - 1;
+}
+
+#else
+
+size_t lockprof_report(char* out, size_t size) {
+    (void)lock_class_names;
+    int written = snprintf(out, size, "\nLock profiling is not compiled in; rebuild with -DPHANTOM_LOCK_PROFILE\n");
+    if (written < 0 || size == 0) return 0;
+    return (size_t)written < size ? (size_t)written : size - 1;
+}
+
+#endif // PHANTOM_LOCK_PROFILE
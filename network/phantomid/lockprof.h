@@ -0,0 +1,51 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define LOCKPROF_BUCKETS 64        // Power-of-two nanosecond buckets
+#define LOCKPROF_MAX_HELD 16       // Locks one thread may hold at once
+
+// Locks are profiled per class: every stripe of the account table or
+// every client slot shares one set of counters
+typedef enum {
+    LOCK_STATE,                // PhantomDaemon.state_lock
+    LOCK_ACCOUNT,              // Striped account slot locks
+    LOCK_CHECKPOINT,           // PhantomDaemon.checkpoint_lock
+    LOCK_CLIENTS,              // NetworkProgram.clients_lock
+    LOCK_CLIENT_SLOT,          // Per-client state
+    LOCK_ENDPOINT,             // Per-endpoint send/recv
+    LOCK_WAL,                  // WriteAheadLog.lock
+    LOCK_REPLICATION,          // Replication stream state
+    LOCK_SETTLE,               // PhantomDaemon.settle_lock
+    LOCK_CLASS_COUNT
+} LockClass;
+
+#ifdef PHANTOM_LOCK_PROFILE
+
+// Instrumented replacements for the pthread calls. The wait is only timed
+// when a try-lock fails, so uncontended acquisitions cost two clock reads.
+int lock_acquire(pthread_mutex_t* mutex, LockClass cls);
+int lock_release(pthread_mutex_t* mutex);
+int lock_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+int lock_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline);
+
+#else
+
+// Without the profiler the wrappers are the pthread calls themselves
+#define lock_acquire(mutex, cls) pthread_mutex_lock(mutex)
+#define lock_release(mutex) pthread_mutex_unlock(mutex)
+#define lock_cond_wait(cond, mutex) pthread_cond_wait(cond, mutex)
+#define lock_cond_timedwait(cond, mutex, deadline) pthread_cond_timedwait(cond, mutex, deadline)
+
+#endif // PHANTOM_LOCK_PROFILE
+
+// Contention table, most total wait first; says how to enable profiling
+// when it is compiled out. Returns bytes written.
+size_t lockprof_report(char* out, size_t size);
+
+#endif // LOCKPROF_H
@@ -0,0 +1,491 @@
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "log.h"
+#include "affinity.h"
+
+#define LOG_SINK_BUFFER 65536
+
+// One message, captured at the call site and formatted by the flusher
+typedef struct {
+    uint64_t time_ns;              // CLOCK_REALTIME at the call
+    const char* format;            // Caller's string literal
+    uint8_t level;                 // LogLevel
+    uint8_t argc;                  // Captured arguments
+    uint16_t text_used;            // Bytes of text in use
+    uint64_t args[LOG_MAX_ARGS];   // Integers, pointers, double bits, text offsets
+    char text[LOG_TEXT_SIZE];      // Copies of %s arguments
+} LogEntry;
+
+// Single-producer, single-consumer ring owned by one thread
+typedef struct {
+    LogEntry* entries;             // LOG_RING_ENTRIES slots, kept for reuse
+    uint64_t head;                 // Next slot the owner fills
+    uint64_t tail;                 // Next slot the flusher reads
+    uint64_t dropped;              // Messages lost because the ring was full
+    bool in_use;                   // Claimed by a thread or still draining
+    bool orphaned;                 // Owner exited; released once drained
+} LogRing;
+
+// Buffered output for one file descriptor, touched only by the flusher
+typedef struct {
+    int fd;
+    size_t length;
+    char data[LOG_SINK_BUFFER];
+} LogSink;
+
+static struct {
+    LogRing rings[LOG_MAX_THREADS];
+    pthread_mutex_t registry_lock; // Claiming and releasing rings
+    pthread_key_t ring_key;        // Marks a ring orphaned when its thread exits
+    bool key_created;
+    pthread_t flusher;
+    volatile bool running;
+    LogLevel min_level;
+    uint64_t unringed;             // Messages dropped because no ring was free
+    uint64_t reported;             // Drops already announced
+    LogSink out;                   // Below LOG_LEVEL_WARN
+    LogSink err;                   // LOG_LEVEL_WARN and above
+} g_log = {
+    .registry_lock = PTHREAD_MUTEX_INITIALIZER,
+    .min_level = LOG_LEVEL_INFO,
+    .out = { .fd = STDOUT_FILENO },
+    .err = { .fd = STDERR_FILENO }
+};
+
+static __thread LogRing* tls_ring;
+
+static const char* level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Argument classes a conversion consumes
+typedef enum {
+    CONV_NONE,                     // %% or unsupported
+    CONV_SIGNED,
+    CONV_UNSIGNED,
+    CONV_CHAR,
+    CONV_STRING,
+    CONV_POINTER,
+    CONV_DOUBLE
+} ConversionClass;
+
+typedef struct {
+    const char* start;             // The '%'
+    const char* end;               // One past the conversion character
+    ConversionClass kind;
+    int stars;                     // '*' width/precision arguments
+    char length[3];                // Length modifier as written
+} Conversion;
+
+// Find the next conversion in format; returns false at the end of the string
+static bool next_conversion(const char* format, Conversion* conv) {
+    const char* p = strchr(format, '%');
+    if (!p) return false;
+
+    memset(conv, 0, sizeof(*conv));
+    conv->start = p++;
+    while (*p && strchr("-+ #0", *p)) p++;
+    if (*p == '*') { conv->stars++; p++; }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') { conv->stars++; p++; }
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    for (size_t n = 0; n < 2 && *p && strchr("hlzjt", *p); n++) {
+        conv->length[n] = *p++;
+    }
+
+    switch (*p) {
+        case 'd': case 'i': conv->kind = CONV_SIGNED; break;
+        case 'u': case 'x': case 'X': case 'o': conv->kind = CONV_UNSIGNED; break;
+        case 'c': conv->kind = CONV_CHAR; break;
+        case 's': conv->kind = CONV_STRING; break;
+        case 'p': conv->kind = CONV_POINTER; break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            conv->kind = CONV_DOUBLE; break;
+        default: conv->kind = CONV_NONE; break;
+    }
+    conv->end = *p ? p + 1 : p;
+    return true;
+}
+
+// Copy the arguments a format consumes into the entry
+static void capture(LogEntry* entry, const char* format, va_list ap) {
+    Conversion conv;
+
+    entry->format = format;
+    entry->argc = 0;
+    entry->text_used = 0;
+
+    while (next_conversion(format, &conv)) {
+        format = conv.end;
+        if (conv.kind == CONV_NONE) continue;
+        if (entry->argc + conv.stars + 1 > LOG_MAX_ARGS) break;
+
+        for (int i = 0; i < conv.stars; i++) {
+            entry->args[entry->argc++] = (uint64_t)(int64_t)va_arg(ap, int);
+        }
+
+        uint64_t value = 0;
+        const char* l = conv.length;
+        switch (conv.kind) {
+            case CONV_SIGNED:
+                value = (uint64_t)(strcmp(l, "hh") == 0 ? (signed char)va_arg(ap, int) :
+                                   strcmp(l, "h") == 0 ? (short)va_arg(ap, int) :
+                                   strcmp(l, "l") == 0 ? va_arg(ap, long) :
+                                   strcmp(l, "ll") == 0 ? va_arg(ap, long long) :
+                                   l[0] == 'z' ? (long long)va_arg(ap, ssize_t) :
+                                   l[0] == 'j' ? (long long)va_arg(ap, intmax_t) :
+                                   l[0] == 't' ? (long long)va_arg(ap, ptrdiff_t) :
+                                   va_arg(ap, int));
+                break;
+            case CONV_UNSIGNED:
+                value = strcmp(l, "hh") == 0 ? (unsigned char)va_arg(ap, unsigned int) :
+                        strcmp(l, "h") == 0 ? (unsigned short)va_arg(ap, unsigned int) :
+                        strcmp(l, "l") == 0 ? va_arg(ap, unsigned long) :
+                        strcmp(l, "ll") == 0 ? va_arg(ap, unsigned long long) :
+                        l[0] == 'z' ? va_arg(ap, size_t) :
+                        l[0] == 'j' ? (uint64_t)va_arg(ap, uintmax_t) :
+                        l[0] == 't' ? (uint64_t)va_arg(ap, ptrdiff_t) :
+                        va_arg(ap, unsigned int);
+                break;
+            case CONV_CHAR:
+                value = (uint64_t)va_arg(ap, int);
+                break;
+            case CONV_POINTER:
+                value = (uint64_t)(uintptr_t)va_arg(ap, void*);
+                break;
+            case CONV_DOUBLE: {
+                double d = va_arg(ap, double);
+                memcpy(&value, &d, sizeof(value));
+                break;
+            }
+            case CONV_STRING: {
+                // Strings may not outlive the call, so they are copied
+                const char* s = va_arg(ap, const char*);
+                size_t room = LOG_TEXT_SIZE - entry->text_used;
+                size_t n = strnlen(s ? s : "(null)", room > 0 ? room - 1 : 0);
+                value = entry->text_used;
+                if (room > 0) {
+                    memcpy(entry->text + entry->text_used, s ? s : "(null)", n);
+                    entry->text[entry->text_used + n] = '\0';
+                    entry->text_used += (uint16_t)(n + 1);
+                } else {
+                    value = LOG_TEXT_SIZE;
+                }
+                break;
+            }
+            case CONV_NONE:
+                break;
+        }
+        entry->args[entry->argc++] = value;
+    }
+}
+
+// snprintf one conversion, passing any '*' arguments ahead of the value
+#define RENDER(dst, room, ...) \
+    (conv.stars == 0 ? snprintf(dst, room, spec, __VA_ARGS__) : \
+     conv.stars == 1 ? snprintf(dst, room, spec, star[0], __VA_ARGS__) : \
+                       snprintf(dst, room, spec, star[0], star[1], __VA_ARGS__))
+
+// Format a captured entry into out; returns the length written
+static size_t render(const LogEntry* entry, char* out, size_t size) {
+    const char* format = entry->format;
+    size_t used = 0;
+    size_t arg = 0;
+    Conversion conv;
+
+    while (used + 1 < size) {
+        bool found = next_conversion(format, &conv);
+        const char* literal_end = found ? conv.start : format + strlen(format);
+        size_t literal = (size_t)(literal_end - format);
+        if (literal > size - used - 1) literal = size - used - 1;
+        memcpy(out + used, format, literal);
+        used += literal;
+        if (!found || used + 1 >= size) break;
+        format = conv.end;
+
+        if (conv.kind == CONV_NONE) {
+            if (conv.end[-1] == '%') out[used++] = '%';
+            continue;
+        }
+        if (arg + conv.stars + 1 > entry->argc) {
+            // Ran out of captured arguments: show the rest verbatim
+            format = conv.start;
+            size_t rest = strlen(format);
+            if (rest > size - used - 1) rest = size - used - 1;
+            memcpy(out + used, format, rest);
+            used += rest;
+            break;
+        }
+
+        // Rebuild the spec with a uniform length modifier for the stored width
+        char spec[32];
+        size_t spec_len = 0;
+        for (const char* p = conv.start; p < conv.end - 1 && spec_len < sizeof(spec) - 4; p++) {
+            if (!strchr("hlzjt", *p)) spec[spec_len++] = *p;
+        }
+        if (conv.kind == CONV_SIGNED || conv.kind == CONV_UNSIGNED) {
+            spec[spec_len++] = 'l';
+            spec[spec_len++] = 'l';
+        }
+        spec[spec_len++] = conv.end[-1];
+        spec[spec_len] = '\0';
+
+        int star[2] = {0, 0};
+        for (int i = 0; i < conv.stars; i++) {
+            star[i] = (int)(int64_t)entry->args[arg++];
+        }
+        uint64_t value = entry->args[arg++];
+
+        char* dst = out + used;
+        size_t room = size - used;
+        int written = 0;
+        switch (conv.kind) {
+            case CONV_SIGNED: written = RENDER(dst, room, (long long)value); break;
+            case CONV_UNSIGNED: written = RENDER(dst, room, (unsigned long long)value); break;
+            case CONV_CHAR: written = RENDER(dst, room, (int)value); break;
+            case CONV_POINTER: written = RENDER(dst, room, (void*)(uintptr_t)value); break;
+            case CONV_DOUBLE: {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                written = RENDER(dst, room, d);
+                break;
+            }
+            case CONV_STRING:
+                written = RENDER(dst, room, value < LOG_TEXT_SIZE ? entry->text + value : "...");
+                break;
+            case CONV_NONE:
+                break;
+        }
+        if (written > 0) {
+            used += (size_t)written < room ? (size_t)written : room - 1;
+        }
+    }
+
+    out[used] = '\0';
+    return used;
+}
+
+static void sink_flush(LogSink* sink) {
+    size_t offset = 0;
+    while (offset < sink->length) {
+        ssize_t n = write(sink->fd, sink->data + offset, sink->length - offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        offset += (size_t)n;
+    }
+    sink->length = 0;
+}
+
+// Write "<time> <LEVEL> <message>\n" into line; returns its length
+static size_t format_line(const LogEntry* entry, char* line, size_t size) {
+    struct tm tm;
+    time_t seconds = (time_t)(entry->time_ns / 1000000000);
+
+    gmtime_r(&seconds, &tm);
+    size_t length = strftime(line, size, "%Y-%m-%dT%H:%M:%S", &tm);
+    length += snprintf(line + length, size - length, ".%06luZ %-5s ",
+                       (unsigned long)(entry->time_ns % 1000000000 / 1000),
+                       level_names[entry->level]);
+    length += render(entry, line + length, size - length - 1);
+
+    // One line per message, whatever the caller's trailing newlines
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) length--;
+    line[length++] = '\n';
+    return length;
+}
+
+// Append an entry to the sink for its level
+static void emit(const LogEntry* entry) {
+    LogSink* sink = entry->level >= LOG_LEVEL_WARN ? &g_log.err : &g_log.out;
+    char line[1024];
+    size_t length = format_line(entry, line, sizeof(line));
+
+    if (sink->length + length > sizeof(sink->data)) {
+        sink_flush(sink);
+    }
+    memcpy(sink->data + sink->length, line, length);
+    sink->length += length;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Emit everything queued in every ring; returns the number of messages
+static size_t drain(void) {
+    size_t drained = 0;
+
+    for (size_t i = 0; i < LOG_MAX_THREADS; i++) {
+        LogRing* ring = &g_log.rings[i];
+        if (!__atomic_load_n(&ring->in_use, __ATOMIC_ACQUIRE)) continue;
+
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t t = ring->tail; t < head; t++) {
+            emit(&ring->entries[t & (LOG_RING_ENTRIES - 1)]);
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == head) {
+            pthread_mutex_lock(&g_log.registry_lock);
+            __atomic_store_n(&ring->in_use, false, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&g_log.registry_lock);
+        }
+    }
+
+    uint64_t dropped = log_dropped();
+    if (dropped != g_log.reported) {
+        LogEntry note = {
+            .time_ns = now_ns(),
+            .level = LOG_LEVEL_WARN,
+            .format = "log: dropped %lu messages, ring buffers full",
+            .argc = 1,
+            .args = { dropped - g_log.reported }
+        };
+        emit(&note);
+        g_log.reported = dropped;
+    }
+
+    sink_flush(&g_log.out);
+    sink_flush(&g_log.err);
+    return drained;
+}
+
+static void* log_flusher(void* arg) {
+    struct timespec idle = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L };
+    affinity_apply(THREAD_LOGGER);
+
+    while (g_log.running) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    drain();
+    return NULL;
+}
+
+static void release_ring(void* arg) {
+    LogRing* ring = arg;
+    __atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+// Give the calling thread a ring of its own
+static LogRing* claim_ring(void) {
+    LogRing* ring = NULL;
+
+    pthread_mutex_lock(&g_log.registry_lock);
+    for (size_t i = 0; i < LOG_MAX_THREADS && !ring; i++) {
+        LogRing* candidate = &g_log.rings[i];
+        if (candidate->in_use) continue;
+        if (!candidate->entries) {
+            candidate->entries = calloc(LOG_RING_ENTRIES, sizeof(LogEntry));
+            if (!candidate->entries) break;
+        }
+        candidate->head = candidate->tail = 0;
+        candidate->orphaned = false;
+        __atomic_store_n(&candidate->in_use, true, __ATOMIC_RELEASE);
+        ring = candidate;
+    }
+    pthread_mutex_unlock(&g_log.registry_lock);
+
+    if (ring) {
+        pthread_setspecific(g_log.ring_key, ring);
+    }
+    return ring;
+}
+
+void log_write(LogLevel level, const char* format, ...) {
+    va_list ap;
+
+    if (level < g_log.min_level) return;
+
+    if (!g_log.running) {
+        // No flusher: format and write synchronously, bypassing its sinks
+        LogEntry entry = { .time_ns = now_ns(), .level = (uint8_t)level };
+        LogSink direct = { .fd = STDERR_FILENO };
+        va_start(ap, format);
+        capture(&entry, format, ap);
+        va_end(ap);
+
+        direct.length = format_line(&entry, direct.data, sizeof(direct.data));
+        sink_flush(&direct);
+        return;
+    }
+
+    LogRing* ring = tls_ring;
+    if (!ring) {
+        ring = tls_ring = claim_ring();
+        if (!ring) {
+            __atomic_fetch_add(&g_log.unringed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_ENTRIES) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogEntry* entry = &ring->entries[head & (LOG_RING_ENTRIES - 1)];
+    entry->time_ns = now_ns();
+    entry->level = (uint8_t)level;
+    va_start(ap, format);
+    capture(entry, format, ap);
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t log_dropped(void) {
+    uint64_t dropped = __atomic_load_n(&g_log.unringed, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < LOG_MAX_THREADS; i++) {
+        dropped += __atomic_load_n(&g_log.rings[i].dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+bool log_start(LogLevel min_level) {
+    g_log.min_level = min_level;
+
+    if (!g_log.key_created) {
+        if (pthread_key_create(&g_log.ring_key, release_ring) != 0) return false;
+        g_log.key_created = true;
+    }
+
+    g_log.running = true;
+    if (pthread_create(&g_log.flusher, NULL, log_flusher, NULL) != 0) {
+        g_log.running = false;
+        return false;
+    }
+    return true;
+}
+
+// Stop the flusher after it has written everything queued so far
+void log_stop(void) {
+    if (!g_log.running) return;
+
+    g_log.running = false;
+    pthread_join(g_log.flusher, NULL);
+}
+
+bool log_parse_level(const char* name, LogLevel* level) {
+    for (int i = 0; i <= LOG_LEVEL_ERROR; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LOG_RING_ENTRIES 1024      // Entries per thread, power of two
+#define LOG_MAX_THREADS 64         // Threads that can hold a ring at once
+#define LOG_MAX_ARGS 8             // Conversions captured per message
+#define LOG_TEXT_SIZE 192          // Bytes of %s arguments copied per message
+#define LOG_FLUSH_INTERVAL_MS 5    // Flusher poll period when idle
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+} LogLevel;
+
+// Flusher lifecycle. Until log_start succeeds, and after log_stop,
+// messages are written synchronously to stderr.
+bool log_start(LogLevel min_level);
+void log_stop(void);
+bool log_parse_level(const char* name, LogLevel* level);
+
+// Record a message without formatting it. format must be a string literal:
+// only its pointer is kept, and the flusher formats it later from copies of
+// the arguments. Never blocks; a full ring drops the message.
+void log_write(LogLevel level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Messages lost to full rings since startup
+uint64_t log_dropped(void);
+
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif // LOG_H
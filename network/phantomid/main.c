@@ -3,24 +3,79 @@
 #include <stdlib.h>
 #include <string.h>
 #include "phantomid.h"
+#include "log.h"
+#include "trace.h"
+#include "affinity.h"
+#include "handoff.h"
 
 static PhantomDaemon daemon;
-static volatile bool running = true;
 
+// Signals can land on any thread, so the reactor is woken explicitly
+// rather than relying on its select being interrupted
 void handle_signal(int sig) {
-    running = false;
+    net_stop(&daemon.network);
 }
 
 void print_usage(const char* program_name) {
     printf("Usage: %s [OPTIONS]\n", program_name);
     printf("Options:\n");
     printf("  -p, --port PORT    Port to listen on (default: 8888)\n");
+    printf("  -n, --max-accounts N  Account table capacity (default: 1000)\n");
+    printf("  --huge-pages       Back the account table with huge pages where available\n");
+    printf("  -w, --wal PATH     Persist accounts to a write-ahead log at PATH\n");
+    printf("  --wal-window USEC  Group-commit window in microseconds (default: 0)\n");
+    printf("  -s, --snapshot PATH  Map and checkpoint the account table at PATH\n");
+    printf("  --checkpoint-interval SEC  Seconds between checkpoints (default: 60)\n");
+    printf("  --replication-port PORT  Stream mutations to replicas on PORT\n");
+    printf("  --replica-of HOST:PORT   Follow a primary as a read-only replica\n");
+    printf("  --log-level LEVEL  debug, info, warn or error (default: info)\n");
+    printf("  --metrics-port PORT  Serve Prometheus metrics over HTTP on PORT\n");
+    printf("  --no-metrics       Do not record latency histograms\n");
+    printf("  --trace-path PATH  Where the trace command writes (default: %s)\n", TRACE_DEFAULT_PATH);
+    printf("  --handoff PATH     Take over from the daemon at PATH, then accept a successor there\n");
+    printf("  --drain-timeout MS  Longest a replaced daemon serves TLS and streaming clients (default: %d)\n",
+           HANDOFF_DEFAULT_DRAIN_MS);
+    printf("  --busy-poll USEC   Spin this long on readiness before blocking (default: off)\n");
+    printf("  --socket-profile NAME  latency, throughput or none (default: latency)\n");
+    printf("  --rate-limit CLASS=RATE[/BURST]  Requests/s per connection; repeat per class.\n");
+    printf("                     Classes: read, write, bulk\n");
+    printf("  --rate-reject      Refuse over-limit requests instead of pacing the connection\n");
+    printf("  --lane-weight LANE=N  Requests a priority lane serves per pass, 0 for no limit;\n");
+    printf("                     repeat per lane. Lanes: interactive, standard, bulk\n");
+    printf("                     (default: interactive=0, standard=8, bulk=2)\n");
+    printf("  --no-lanes         Serve requests in arrival order, not by priority lane\n");
+    printf("  --tls-cert PATH    Serve clients over TLS with this PEM certificate chain\n");
+    printf("  --tls-key PATH     PEM private key of the TLS certificate\n");
+    printf("  --tls-ticket-key PATH  %d-byte session ticket key file, shared so resumption\n",
+           NET_TLS_TICKET_KEY_SIZE);
+    printf("                     survives restarts (default: random per process)\n");
+    printf("  --cpus ROLE=CPUS   Pin a thread role to CPUs such as 0-3,8; repeat per role.\n");
+    printf("                     Roles: reactor, logger, metrics, wal, checkpoint, replication\n");
     printf("  -h, --help         Show this help message\n");
 }
 
 int main(int argc, char* argv[]) {
-    // Default port
-    uint16_t port = 8888;
+    // Defaults
+    PhantomConfig config = {
+        .port = 8888,
+        .max_accounts = PHANTOM_DEFAULT_CAPACITY,
+        .wal_path = NULL,
+        .wal_commit_window_us = 0,
+        .snapshot_path = NULL,
+        .checkpoint_interval_s = 60,
+        .replication_port = 0,
+        .primary_host = NULL,
+        .primary_port = 0,
+        .metrics_port = 0,
+        .trace_path = NULL,
+        .busy_poll_us = 0,
+        .socket_tuning = &net_tuning_latency,
+        .lanes = true,
+        .lane_weights = { 0, 8, 2 }
+    };
+    LogLevel log_level = LOG_LEVEL_INFO;
+    const char* handoff_path = NULL;
+    uint32_t drain_ms = HANDOFF_DEFAULT_DRAIN_MS;
     
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
@@ -32,7 +87,7 @@ int main(int argc, char* argv[]) {
             if (i + 1 < argc) {
                 int temp_port = atoi(argv[i + 1]);
                 if (temp_port > 0 && temp_port < 65536) {
-                    port = (uint16_t)temp_port;
+                    config.port = (uint16_t)temp_port;
                     i++; // Skip the port number in next iteration
                 } else {
                     fprintf(stderr, "Invalid port number. Must be between 1 and 65535\n");
@@ -43,35 +98,311 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
         }
+        else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--max-accounts") == 0) {
+            if (i + 1 < argc) {
+                long long temp_capacity = atoll(argv[i + 1]);
+                if (temp_capacity > 0 && temp_capacity <= UINT32_MAX) {
+                    config.max_accounts = (size_t)temp_capacity;
+                    i++;
+                } else {
+                    fprintf(stderr, "Invalid account capacity. Must be between 1 and %u\n", UINT32_MAX);
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Account capacity not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--wal") == 0) {
+            if (i + 1 < argc) {
+                config.wal_path = argv[++i];
+            } else {
+                fprintf(stderr, "WAL path not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--wal-window") == 0) {
+            if (i + 1 < argc) {
+                int temp_window = atoi(argv[i + 1]);
+                if (temp_window >= 0) {
+                    config.wal_commit_window_us = (uint32_t)temp_window;
+                    i++;
+                } else {
+                    fprintf(stderr, "Invalid WAL window. Must be 0 or more microseconds\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "WAL window not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--snapshot") == 0) {
+            if (i + 1 < argc) {
+                config.snapshot_path = argv[++i];
+            } else {
+                fprintf(stderr, "Snapshot path not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0) {
+            if (i + 1 < argc) {
+                int temp_interval = atoi(argv[i + 1]);
+                if (temp_interval > 0) {
+                    config.checkpoint_interval_s = (uint32_t)temp_interval;
+                    i++;
+                } else {
+                    fprintf(stderr, "Invalid checkpoint interval. Must be at least 1 second\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Checkpoint interval not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--replication-port") == 0) {
+            if (i + 1 < argc) {
+                int temp_port = atoi(argv[i + 1]);
+                if (temp_port > 0 && temp_port < 65536) {
+                    config.replication_port = (uint16_t)temp_port;
+                    i++;
+                } else {
+                    fprintf(stderr, "Invalid replication port. Must be between 1 and 65535\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "Replication port not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--replica-of") == 0) {
+            char* colon = i + 1 < argc ? strrchr(argv[i + 1], ':') : NULL;
+            int temp_port = colon ? atoi(colon + 1) : 0;
+            if (colon && temp_port > 0 && temp_port < 65536) {
+                *colon = '\0';
+                config.primary_host = argv[++i];
+                config.primary_port = (uint16_t)temp_port;
+            } else {
+                fprintf(stderr, "Primary must be given as HOST:PORT\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--metrics-port") == 0) {
+            int temp_port = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            if (temp_port > 0 && temp_port < 65536) {
+                config.metrics_port = (uint16_t)temp_port;
+                i++;
+            } else {
+                fprintf(stderr, "Invalid metrics port. Must be between 1 and 65535\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--huge-pages") == 0) {
+            config.huge_pages = true;
+        }
+        else if (strcmp(argv[i], "--no-metrics") == 0) {
+            metrics_enable(false);
+        }
+        else if (strcmp(argv[i], "--trace-path") == 0) {
+            if (i + 1 < argc) {
+                config.trace_path = argv[++i];
+            } else {
+                fprintf(stderr, "Trace path not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--handoff") == 0) {
+            if (i + 1 < argc) {
+                handoff_path = argv[++i];
+            } else {
+                fprintf(stderr, "Handoff socket path not provided\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--drain-timeout") == 0) {
+            int temp_drain = i + 1 < argc ? atoi(argv[i + 1]) : -1;
+            if (temp_drain >= 0) {
+                drain_ms = (uint32_t)temp_drain;
+                i++;
+            } else {
+                fprintf(stderr, "Invalid drain timeout. Must be 0 or more milliseconds\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--busy-poll") == 0) {
+            int temp_budget = i + 1 < argc ? atoi(argv[i + 1]) : -1;
+            if (temp_budget >= 0 && temp_budget <= 1000000) {
+                config.busy_poll_us = (uint32_t)temp_budget;
+                i++;
+            } else {
+                fprintf(stderr, "Invalid busy-poll budget. Must be 0 to 1000000 microseconds\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--socket-profile") == 0) {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            config.socket_tuning = net_tuning_find(name);
+            if (!config.socket_tuning && strcmp(name, "none") != 0) {
+                fprintf(stderr, "Unknown socket profile: %s\n", name);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--tls-cert") == 0 || strcmp(argv[i], "--tls-key") == 0 ||
+                 strcmp(argv[i], "--tls-ticket-key") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "TLS file path not provided for %s\n", argv[i]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--tls-cert") == 0) config.tls_cert_path = argv[i + 1];
+            else if (strcmp(argv[i], "--tls-key") == 0) config.tls_key_path = argv[i + 1];
+            else config.tls_ticket_key_path = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "--cpus") == 0) {
+            char* equals = i + 1 < argc ? strchr(argv[i + 1], '=') : NULL;
+            ThreadRole role;
+            if (!equals) {
+                fprintf(stderr, "CPU sets must be given as ROLE=CPUS\n");
+                return 1;
+            }
+            *equals = '\0';
+            if (!affinity_parse_role(argv[i + 1], &role)) {
+                fprintf(stderr, "Unknown thread role: %s\n", argv[i + 1]);
+                return 1;
+            }
+            if (!affinity_set(role, equals + 1)) {
+                fprintf(stderr, "Invalid CPU set for %s: %s\n", argv[i + 1], equals + 1);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--rate-limit") == 0) {
+            RateClass rate_class;
+            RateLimit limit;
+            if (i + 1 >= argc || !ratelimit_parse(argv[i + 1], &rate_class, &limit)) {
+                fprintf(stderr, "Rate limits must be given as CLASS=RATE[/BURST], "
+                        "with CLASS read, write or bulk\n");
+                return 1;
+            }
+            config.rate_limits[rate_class] = limit;
+            i++;
+        }
+        else if (strcmp(argv[i], "--rate-reject") == 0) {
+            config.rate_reject = true;
+        }
+        else if (strcmp(argv[i], "--lane-weight") == 0) {
+            NetworkLane lane;
+            uint32_t weight;
+            if (i + 1 >= argc || !net_lane_parse(argv[i + 1], &lane, &weight)) {
+                fprintf(stderr, "Lane weights must be given as LANE=N, "
+                        "with LANE interactive, standard or bulk\n");
+                return 1;
+            }
+            config.lane_weights[lane] = weight;
+            i++;
+        }
+        else if (strcmp(argv[i], "--no-lanes") == 0) {
+            config.lanes = false;
+        }
+        else if (strcmp(argv[i], "--log-level") == 0) {
+            if (i + 1 >= argc || !log_parse_level(argv[i + 1], &log_level)) {
+                fprintf(stderr, "Log level must be debug, info, warn or error\n");
+                return 1;
+            }
+            i++;
+        }
+    }
+    
+    if (!config.tls_cert_path != !config.tls_key_path ||
+        (config.tls_ticket_key_path && !config.tls_cert_path)) {
+        fprintf(stderr, "TLS needs both --tls-cert and --tls-key\n");
+        return 1;
+    }
+    
+    if (config.primary_host && (config.replication_port || config.wal_path)) {
+        fprintf(stderr, "A replica cannot serve replicas or keep its own write-ahead log\n");
+        return 1;
+    }
+    
+    // The main thread becomes the reactor and allocates the account table,
+    // so it moves first; threads started from here on place themselves
+    affinity_apply(THREAD_REACTOR);
+    
+    // Log from a background thread so a slow stdout never stalls requests
+    if (!log_start(log_level)) {
+        fprintf(stderr, "Failed to start logger\n");
+        return 1;
     }
     
     // Set up signal handling
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
+    struct sigaction action = { .sa_handler = handle_signal };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    // A client that leaves mid-export must fail the sendfile, not kill us
+    struct sigaction ignore = { .sa_handler = SIG_IGN };
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, NULL);
+    
+    // Hot restart: take the listener from the running daemon, then load
+    // the state only once it has drained and flushed
+    Handoff handoff;
+    int inherited_fd = -1;
+    if (handoff_path) {
+        if (!handoff_acquire(&handoff, handoff_path, &inherited_fd)) {
+            log_stop();
+            return 1;
+        }
+        if (inherited_fd >= 0) {
+            log_info("Waiting for the previous daemon to drain");
+            if (!handoff_await(&handoff)) {
+                log_stop();
+                return 1;
+            }
+            config.listen_fd = inherited_fd;
+        }
+    }
     
-    // Initialize PhantomID daemon with specified port
-    if (!phantom_init(&daemon, port)) {
-        printf("Failed to initialize PhantomID daemon\n");
+    // Initialize PhantomID daemon with specified options
+    if (!phantom_init(&daemon, &config)) {
+        log_error("Failed to initialize PhantomID daemon");
+        log_stop();
         return 1;
     }
     
-    printf("PhantomID daemon initialized on port %d\n", port);
+    log_info("PhantomID daemon initialized on port %d", config.port);
+    affinity_report(daemon.accounts);
+    
+    // Connections the previous daemon handed over mid-request
+    if (handoff_path) {
+        daemon.network.adopt = handoff.adopted;
+        daemon.network.adopt_count = handoff.adopted_count;
+    }
+    
+    if (handoff_path && !handoff_listen(&handoff, &daemon.network, drain_ms)) {
+        phantom_cleanup(&daemon);
+        log_stop();
+        return 1;
+    }
     
-    // Create test account
+    // Create test account (replicas only receive the primary's accounts,
+    // a restarted daemon already has its predecessor's, and a persistent
+    // store would gain another one on every start)
     PhantomAccount account = {0};
-    if (phantom_create_account(&daemon, &account)) {
-        printf("Created anonymous account:\n");
-        printf("ID: %s\n", account.id);
-        printf("Creation Time: %lu\n", account.creation_time);
-        printf("Expiry Time: %lu\n", account.expiry_time);
+    if (!config.primary_host && inherited_fd < 0 && !config.wal_path && !config.snapshot_path &&
+        phantom_create_account(&daemon, &account)) {
+        log_info("Created anonymous account %s (created %lu, expires %lu)",
+                 account.id, account.creation_time, account.expiry_time);
     }
     
     // Run the daemon
     phantom_run(&daemon);
     
-    // Cleanup
+    // Cleanup; a successor waits for this before loading the state
     phantom_cleanup(&daemon);
-    printf("PhantomID daemon stopped\n");
+    if (handoff_path) handoff_release(&handoff);
+    log_info("PhantomID daemon stopped");
+    log_stop();
     
     return 0;
 }
\ No newline at end of file
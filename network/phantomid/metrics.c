@@ -0,0 +1,367 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "log.h"
+#include "affinity.h"
+
+#define METRICS_HALF (1 << (METRICS_SUB_BITS - 1))
+#define METRICS_SCRAPE_SIZE 65536
+#define METRICS_RATE_SECONDS 10    // Window for requests_per_second
+
+// One thread's histograms; only the owner writes, scrapes read
+typedef struct {
+    uint64_t counts[METRIC_COUNT][METRICS_BUCKETS];
+    uint64_t sum_ns[METRIC_COUNT];
+    uint64_t max_ns[METRIC_COUNT];
+    uint64_t second[METRICS_RATE_SECONDS + 1];     // Second each rate slot counts
+    uint64_t dispatches[METRICS_RATE_SECONDS + 1]; // Dispatches in that second
+    bool in_use;               // Claimed by a live thread
+} MetricsShard;
+
+static struct {
+    MetricsShard* shards[METRICS_MAX_THREADS];
+    pthread_mutex_t lock;      // Claiming shards
+    pthread_key_t key;
+    bool key_created;
+    volatile bool enabled;
+
+    // Prometheus listener
+    int listen_fd;
+    volatile bool serving;
+    pthread_t server;
+    MetricsGaugeFn gauges;
+    void* gauge_ctx;
+} g_metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .enabled = true,
+    .listen_fd = -1
+};
+
+static __thread MetricsShard* tls_shard;
+
+static const char* metric_names[METRIC_COUNT] = {
+    "accept", "recv", "dispatch", "create", "delete", "send",
+    "lane_interactive", "lane_standard", "lane_bulk"
+};
+
+// Upper bounds of the exported Prometheus buckets, in seconds
+static const double scrape_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+    1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Log-linear bucket: exact below 2^SUB_BITS, then 16 buckets per octave
+size_t metrics_bucket(uint64_t value) {
+    if (value < (1u << METRICS_SUB_BITS)) return (size_t)value;
+    int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BITS + 1;
+    return (size_t)shift * METRICS_HALF + (size_t)(value >> shift);
+}
+
+// Largest value that lands in a bucket
+uint64_t metrics_bucket_ceiling(size_t index) {
+    if (index < (1u << METRICS_SUB_BITS)) return index;
+    size_t shift = index / METRICS_HALF - 1;
+    uint64_t sub = index - shift * METRICS_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void release_shard(void* arg) {
+    MetricsShard* shard = arg;
+    __atomic_store_n(&shard->in_use, false, __ATOMIC_RELEASE);
+}
+
+// Give the calling thread a shard; a shard left by an exited thread is
+// reused, so its counts keep accumulating
+static MetricsShard* claim_shard(void) {
+    MetricsShard* shard = NULL;
+
+    pthread_mutex_lock(&g_metrics.lock);
+    if (!g_metrics.key_created) {
+        g_metrics.key_created = pthread_key_create(&g_metrics.key, release_shard) == 0;
+    }
+    for (size_t i = 0; i < METRICS_MAX_THREADS && !shard; i++) {
+        if (!g_metrics.shards[i]) {
+            g_metrics.shards[i] = calloc(1, sizeof(MetricsShard));
+            if (!g_metrics.shards[i]) break;
+        }
+        if (!g_metrics.shards[i]->in_use) {
+            shard = g_metrics.shards[i];
+            shard->in_use = true;
+        }
+    }
+    pthread_mutex_unlock(&g_metrics.lock);
+
+    if (shard && g_metrics.key_created) {
+        pthread_setspecific(g_metrics.key, shard);
+    }
+    return shard;
+}
+
+void metrics_enable(bool enabled) {
+    g_metrics.enabled = enabled;
+}
+
+uint64_t metrics_start(void) {
+    return g_metrics.enabled ? now_ns() : 0;
+}
+
+void metrics_record(MetricId id, uint64_t start) {
+    if (start == 0) return;
+
+    MetricsShard* shard = tls_shard;
+    if (!shard) {
+        shard = tls_shard = claim_shard();
+        if (!shard) return;
+    }
+
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - start;
+    uint64_t* count = &shard->counts[id][metrics_bucket(elapsed)];
+
+    // Single writer: plain read-modify-write, published with relaxed stores
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->sum_ns[id], shard->sum_ns[id] + elapsed, __ATOMIC_RELAXED);
+    if (elapsed > shard->max_ns[id]) {
+        __atomic_store_n(&shard->max_ns[id], elapsed, __ATOMIC_RELAXED);
+    }
+
+    // Per-second dispatch counts for the request rate
+    if (id == METRIC_DISPATCH) {
+        uint64_t second = now / 1000000000ull;
+        size_t slot = second % (METRICS_RATE_SECONDS + 1);
+        if (shard->second[slot] != second) {
+            __atomic_store_n(&shard->dispatches[slot], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&shard->second[slot], second, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&shard->dispatches[slot], shard->dispatches[slot] + 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Requests dispatched per second over the last complete seconds
+static double request_rate(void) {
+    uint64_t current = now_ns() / 1000000000ull;
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < METRICS_MAX_THREADS; i++) {
+        MetricsShard* shard = __atomic_load_n(&g_metrics.shards[i], __ATOMIC_ACQUIRE);
+        if (!shard) continue;
+
+        for (size_t slot = 0; slot <= METRICS_RATE_SECONDS; slot++) {
+            uint64_t second = __atomic_load_n(&shard->second[slot], __ATOMIC_ACQUIRE);
+            if (second < current && second + METRICS_RATE_SECONDS >= current) {
+                total += __atomic_load_n(&shard->dispatches[slot], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return (double)total / METRICS_RATE_SECONDS;
+}
+
+const char* metrics_name(MetricId id) {
+    return metric_names[id];
+}
+
+// Sum every shard's buckets for one operation into counts
+static void merge(MetricId id, uint64_t* counts, MetricSummary* summary) {
+    memset(summary, 0, sizeof(*summary));
+    memset(counts, 0, METRICS_BUCKETS * sizeof(uint64_t));
+
+    for (size_t i = 0; i < METRICS_MAX_THREADS; i++) {
+        MetricsShard* shard = __atomic_load_n(&g_metrics.shards[i], __ATOMIC_ACQUIRE);
+        if (!shard) continue;
+
+        for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+            uint64_t n = __atomic_load_n(&shard->counts[id][b], __ATOMIC_RELAXED);
+            counts[b] += n;
+            summary->count += n;
+        }
+        summary->sum_ns += __atomic_load_n(&shard->sum_ns[id], __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&shard->max_ns[id], __ATOMIC_RELAXED);
+        if (max > summary->max_ns) summary->max_ns = max;
+    }
+}
+
+// Nearest-rank percentile: the ceiling of the bucket holding sample
+// ceil(fraction * total), clamped to the largest sample seen
+uint64_t metrics_percentile(const uint64_t* counts, uint64_t total, uint64_t max_ns, double fraction) {
+    double exact = fraction * (double)total;
+    uint64_t rank = (uint64_t)exact;
+    uint64_t seen = 0;
+
+    if ((double)rank < exact) rank++;
+    if (rank == 0) rank = 1;
+    for (size_t b = 0; b < METRICS_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= rank) {
+            uint64_t ceiling = metrics_bucket_ceiling(b);
+            return ceiling < max_ns ? ceiling : max_ns;
+        }
+    }
+    return 0;
+}
+
+void metrics_summary(MetricId id, MetricSummary* summary) {
+    uint64_t counts[METRICS_BUCKETS];
+
+    merge(id, counts, summary);
+    if (summary->count == 0) return;
+
+    summary->p50_ns = metrics_percentile(counts, summary->count, summary->max_ns, 0.50);
+    summary->p90_ns = metrics_percentile(counts, summary->count, summary->max_ns, 0.90);
+    summary->p99_ns = metrics_percentile(counts, summary->count, summary->max_ns, 0.99);
+    summary->p999_ns = metrics_percentile(counts, summary->count, summary->max_ns, 0.999);
+}
+
+size_t metrics_report(char* out, size_t size) {
+    size_t offset = 0;
+    MetricSummary summaries[METRIC_COUNT];
+
+    if (size == 0) return 0;
+    out[0] = '\0';
+
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        metrics_summary((MetricId)id, &summaries[id]);
+    }
+
+    offset += snprintf(out + offset, size - offset, "requests_per_second %.1f\n", request_rate());
+
+    offset += snprintf(out + offset, size - offset,
+                       "%-16s %10s %9s %9s %9s %9s %9s %9s\n",
+                       "latency_us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int id = 0; id < METRIC_COUNT && offset < size; id++) {
+        const MetricSummary* s = &summaries[id];
+        offset += snprintf(out + offset, size - offset,
+                           "%-16s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                           metric_names[id], s->count,
+                           s->count ? s->sum_ns / 1e3 / s->count : 0.0,
+                           s->p50_ns / 1e3, s->p90_ns / 1e3, s->p99_ns / 1e3,
+                           s->p999_ns / 1e3, s->max_ns / 1e3);
+    }
+    return offset < size ? offset : size - 1;
+}
+
+// Render every histogram in Prometheus text format
+static size_t scrape(char* out, size_t size) {
+    uint64_t counts[METRICS_BUCKETS];
+    MetricSummary summary;
+    size_t offset = 0;
+
+#define EMIT(...) do { \
+        if (offset < size) offset += snprintf(out + offset, size - offset, __VA_ARGS__); \
+    } while (0)
+
+    EMIT("# HELP phantomid_latency_seconds Time spent in each request stage\n");
+    EMIT("# TYPE phantomid_latency_seconds histogram\n");
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        merge((MetricId)id, counts, &summary);
+
+        uint64_t cumulative = 0;
+        size_t b = 0;
+        for (size_t i = 0; i < sizeof(scrape_bounds) / sizeof(scrape_bounds[0]); i++) {
+            uint64_t bound_ns = (uint64_t)(scrape_bounds[i] * 1e9);
+            while (b < METRICS_BUCKETS && metrics_bucket_ceiling(b) <= bound_ns) {
+                cumulative += counts[b++];
+            }
+            EMIT("phantomid_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n",
+                 metric_names[id], scrape_bounds[i], cumulative);
+        }
+        EMIT("phantomid_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n",
+             metric_names[id], summary.count);
+        EMIT("phantomid_latency_seconds_sum{op=\"%s\"} %.9f\n", metric_names[id], summary.sum_ns / 1e9);
+        EMIT("phantomid_latency_seconds_count{op=\"%s\"} %lu\n", metric_names[id], summary.count);
+    }
+#undef EMIT
+
+    if (g_metrics.gauges && offset < size) {
+        offset += g_metrics.gauges(g_metrics.gauge_ctx, out + offset, size - offset);
+    }
+    return offset < size ? offset : size - 1;
+}
+
+static void* metrics_server(void* arg) {
+    affinity_apply(THREAD_METRICS);
+    char* body = malloc(METRICS_SCRAPE_SIZE);
+    char request[1024];
+
+    while (body && g_metrics.serving) {
+        int client = accept(g_metrics.listen_fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Any request gets the current scrape
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (recv(client, request, sizeof(request), 0) >= 0) {
+            size_t length = scrape(body, METRICS_SCRAPE_SIZE);
+            char header[128];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\n\r\n", length);
+            send(client, header, (size_t)header_len, MSG_NOSIGNAL);
+            send(client, body, length, MSG_NOSIGNAL);
+        }
+        close(client);
+    }
+
+    free(body);
+    return NULL;
+}
+
+bool metrics_serve(uint16_t port, MetricsGaugeFn gauges, void* ctx) {
+    struct sockaddr_in addr = {0};
+    int opt = 1;
+
+    g_metrics.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (g_metrics.listen_fd < 0) {
+        log_error("Metrics socket creation failed: %s", strerror(errno));
+        return false;
+    }
+    setsockopt(g_metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(g_metrics.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(g_metrics.listen_fd, 16) < 0) {
+        log_error("Metrics listen failed: %s", strerror(errno));
+        close(g_metrics.listen_fd);
+        g_metrics.listen_fd = -1;
+        return false;
+    }
+
+    g_metrics.gauges = gauges;
+    g_metrics.gauge_ctx = ctx;
+    g_metrics.serving = true;
+    if (pthread_create(&g_metrics.server, NULL, metrics_server, NULL) != 0) {
+        g_metrics.serving = false;
+        close(g_metrics.listen_fd);
+        g_metrics.listen_fd = -1;
+        return false;
+    }
+    log_info("Serving Prometheus metrics on port %u", port);
+    return true;
+}
+
+void metrics_stop(void) {
+    if (!g_metrics.serving) return;
+
+    g_metrics.serving = false;
+    shutdown(g_metrics.listen_fd, SHUT_RDWR);  // Wakes the blocked accept
+    pthread_join(g_metrics.server, NULL);
+    close(g_metrics.listen_fd);
+    g_metrics.listen_fd = -1;
+}
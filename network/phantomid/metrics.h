@@ -0,0 +1,64 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define METRICS_SUB_BITS 5         // 16 sub-buckets per power of two, ~6% resolution
+#define METRICS_BUCKETS ((66 - METRICS_SUB_BITS) * (1 << (METRICS_SUB_BITS - 1)))
+#define METRICS_MAX_THREADS 64
+
+// Timed operations
+typedef enum {
+    METRIC_ACCEPT,             // accept() of a new client
+    METRIC_RECV,               // Reading one request
+    METRIC_DISPATCH,           // Parsing and running a command
+    METRIC_CREATE,             // Creating one account, ID generation included
+    METRIC_DELETE,             // phantom_delete_account
+    METRIC_SEND,               // Writing one response
+    METRIC_LANE_INTERACTIVE,   // Request in a priority lane, from its read to its reply,
+    METRIC_LANE_STANDARD,      // in the order of NetworkLane
+    METRIC_LANE_BULK,
+    METRIC_COUNT
+} MetricId;
+
+// Latency summary of one operation, merged across threads
+typedef struct {
+    uint64_t count;            // Samples recorded
+    uint64_t sum_ns;           // Total time
+    uint64_t max_ns;           // Slowest sample
+    uint64_t p50_ns, p90_ns, p99_ns, p999_ns;
+} MetricSummary;
+
+// Appends extra Prometheus lines (gauges) to a scrape
+typedef size_t (*MetricsGaugeFn)(void* ctx, char* out, size_t size);
+
+// Turn recording on or off; off reduces every probe to one branch
+void metrics_enable(bool enabled);
+
+// Timestamp for the start of an operation, 0 when recording is off
+uint64_t metrics_start(void);
+
+// Record the time since start for the calling thread. Lock-free: each
+// thread writes only its own histograms.
+void metrics_record(MetricId id, uint64_t start);
+
+// Merge every thread's histogram for one operation
+void metrics_summary(MetricId id, MetricSummary* summary);
+const char* metrics_name(MetricId id);
+
+// The log-linear bucketing behind every histogram, for tools that keep
+// their own counts array of METRICS_BUCKETS
+size_t metrics_bucket(uint64_t value);
+uint64_t metrics_bucket_ceiling(size_t index);
+uint64_t metrics_percentile(const uint64_t* counts, uint64_t total, uint64_t max_ns, double fraction);
+
+// Human-readable latency table; returns bytes written
+size_t metrics_report(char* out, size_t size);
+
+// Prometheus text exposition on an HTTP port of its own
+bool metrics_serve(uint16_t port, MetricsGaugeFn gauges, void* ctx);
+void metrics_stop(void);
+
+#endif // METRICS_H
@@ -0,0 +1,193 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "network.h"
+
+// Bytes flowing one way. head and tail only grow; the data lives at their
+// offsets modulo NET_PIPE_SIZE.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t readable;       // Data arrived or the writer closed
+    pthread_cond_t writable;       // Space freed or the reader closed
+    uint64_t head;                 // Total bytes written
+    uint64_t tail;                 // Total bytes read
+    bool closed;                   // Either end has gone away
+    char data[NET_PIPE_SIZE];
+} PipeBuffer;
+
+// What one endpoint holds: it reads one buffer and writes the other
+typedef struct {
+    PipeBuffer* in;
+    PipeBuffer* out;
+    struct NetPipe* pipe;
+} PipeEnd;
+
+typedef struct NetPipe {
+    PipeBuffer buffers[2];
+    PipeEnd ends[2];
+    int open_ends;                 // Freed when both ends are closed
+    pthread_mutex_t lock;          // Protects open_ends
+} NetPipe;
+
+static void buffer_init(PipeBuffer* buffer) {
+    pthread_mutex_init(&buffer->lock, NULL);
+    pthread_cond_init(&buffer->readable, NULL);
+    pthread_cond_init(&buffer->writable, NULL);
+    buffer->head = buffer->tail = 0;
+    buffer->closed = false;
+}
+
+static void buffer_destroy(PipeBuffer* buffer) {
+    pthread_cond_destroy(&buffer->writable);
+    pthread_cond_destroy(&buffer->readable);
+    pthread_mutex_destroy(&buffer->lock);
+}
+
+static void buffer_close(PipeBuffer* buffer) {
+    pthread_mutex_lock(&buffer->lock);
+    buffer->closed = true;
+    pthread_cond_broadcast(&buffer->readable);
+    pthread_cond_broadcast(&buffer->writable);
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+// Copy out of or into the ring, split where it wraps
+static void ring_read(const PipeBuffer* buffer, char* dst, size_t size) {
+    size_t offset = buffer->tail % NET_PIPE_SIZE;
+    size_t first = NET_PIPE_SIZE - offset < size ? NET_PIPE_SIZE - offset : size;
+    memcpy(dst, buffer->data + offset, first);
+    memcpy(dst + first, buffer->data, size - first);
+}
+
+static void ring_write(PipeBuffer* buffer, const char* src, size_t size) {
+    size_t offset = buffer->head % NET_PIPE_SIZE;
+    size_t first = NET_PIPE_SIZE - offset < size ? NET_PIPE_SIZE - offset : size;
+    memcpy(buffer->data + offset, src, first);
+    memcpy(buffer->data, src + first, size - first);
+}
+
+// Blocking sends write everything, waiting for room as a socket would
+static ssize_t pipe_send(NetworkEndpoint* endpoint, const void* data, size_t size, int flags) {
+    PipeEnd* end = endpoint->channel;
+    PipeBuffer* buffer = end ? end->out : NULL;
+    size_t sent = 0;
+
+    if (!buffer) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    pthread_mutex_lock(&buffer->lock);
+    while (sent < size) {
+        size_t room = NET_PIPE_SIZE - (size_t)(buffer->head - buffer->tail);
+        if (buffer->closed) {
+            pthread_mutex_unlock(&buffer->lock);
+            if (sent > 0) return (ssize_t)sent;
+            errno = EPIPE;
+            return -1;
+        }
+        if (room == 0) {
+            if (flags & MSG_DONTWAIT) break;
+            pthread_cond_wait(&buffer->writable, &buffer->lock);
+            continue;
+        }
+
+        size_t chunk = size - sent < room ? size - sent : room;
+        ring_write(buffer, (const char*)data + sent, chunk);
+        buffer->head += chunk;
+        sent += chunk;
+        pthread_cond_signal(&buffer->readable);
+    }
+    pthread_mutex_unlock(&buffer->lock);
+
+    if (sent == 0 && size > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return (ssize_t)sent;
+}
+
+// Returns whatever is buffered, up to size, after waiting for anything at all
+static ssize_t pipe_recv(NetworkEndpoint* endpoint, void* data, size_t size, int flags) {
+    PipeEnd* end = endpoint->channel;
+    PipeBuffer* buffer = end ? end->in : NULL;
+
+    if (!buffer) {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    pthread_mutex_lock(&buffer->lock);
+    while (buffer->head == buffer->tail && !buffer->closed) {
+        if (flags & MSG_DONTWAIT) {
+            pthread_mutex_unlock(&buffer->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        pthread_cond_wait(&buffer->readable, &buffer->lock);
+    }
+
+    size_t available = (size_t)(buffer->head - buffer->tail);
+    size_t length = available < size ? available : size;
+    ring_read(buffer, data, length);
+    if (!(flags & MSG_PEEK)) {
+        buffer->tail += length;
+        pthread_cond_signal(&buffer->writable);
+    }
+    pthread_mutex_unlock(&buffer->lock);
+    return (ssize_t)length;
+}
+
+// Closing one end gives the other end EOF on read and EPIPE on write
+static void pipe_close(NetworkEndpoint* endpoint) {
+    PipeEnd* end = endpoint->channel;
+    if (!end) return;
+
+    NetPipe* pipe = end->pipe;
+    buffer_close(end->in);
+    buffer_close(end->out);
+    endpoint->channel = NULL;
+
+    pthread_mutex_lock(&pipe->lock);
+    bool last = --pipe->open_ends == 0;
+    pthread_mutex_unlock(&pipe->lock);
+
+    if (last) {
+        buffer_destroy(&pipe->buffers[0]);
+        buffer_destroy(&pipe->buffers[1]);
+        pthread_mutex_destroy(&pipe->lock);
+        free(pipe);
+    }
+}
+
+const NetworkTransport net_pipe_transport = {
+    .name = "pipe",
+    .send = pipe_send,
+    .recv = pipe_recv,
+    .close = pipe_close
+};
+
+bool net_pipe_open(NetworkEndpoint* a, NetworkEndpoint* b) {
+    NetPipe* pipe = malloc(sizeof(NetPipe));
+    if (!pipe) return false;
+
+    buffer_init(&pipe->buffers[0]);
+    buffer_init(&pipe->buffers[1]);
+    pthread_mutex_init(&pipe->lock, NULL);
+    pipe->open_ends = 2;
+    pipe->ends[0] = (PipeEnd){ &pipe->buffers[0], &pipe->buffers[1], pipe };
+    pipe->ends[1] = (PipeEnd){ &pipe->buffers[1], &pipe->buffers[0], pipe };
+
+    NetworkEndpoint* endpoints[2] = { a, b };
+    for (int i = 0; i < 2; i++) {
+        pthread_mutex_init(&endpoints[i]->lock, NULL);
+        endpoints[i]->protocol = NET_TCP;
+        endpoints[i]->mode = NET_BLOCKING;
+        endpoints[i]->socket_fd = -1;
+        endpoints[i]->transport = &net_pipe_transport;
+        endpoints[i]->channel = &pipe->ends[i];
+    }
+    return true;
+}
@@ -0,0 +1,290 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "network.h"
+#include "log.h"
+
+#define TLS_RECORD_SIZE 16384      // Largest TLS plaintext record
+
+struct NetworkTls {
+    SSL_CTX* context;
+    NetworkTlsStats stats;
+};
+
+struct NetworkTlsSession {
+    SSL* ssl;
+    NetworkTls* tls;
+    NetworkTlsStatus status;
+    bool kernel_send;              // Records are encrypted by the kernel, so sendfile works
+};
+
+// Log the reason OpenSSL queued for the last failure
+static void log_tls_error(const char* what) {
+    char reason[256];
+    unsigned long code = ERR_get_error();
+    ERR_error_string_n(code, reason, sizeof(reason));
+    log_error("%s: %s", what, code ? reason : strerror(errno));
+    ERR_clear_error();
+}
+
+static bool load_ticket_keys(SSL_CTX* context, const char* path) {
+    unsigned char keys[NET_TLS_TICKET_KEY_SIZE + 1];
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        log_error("Cannot open TLS ticket key file %s: %s", path, strerror(errno));
+        return false;
+    }
+    size_t length = fread(keys, 1, sizeof(keys), file);
+    fclose(file);
+
+    bool ok = length == NET_TLS_TICKET_KEY_SIZE &&
+              SSL_CTX_set_tlsext_ticket_keys(context, keys, NET_TLS_TICKET_KEY_SIZE) == 1;
+    OPENSSL_cleanse(keys, sizeof(keys));
+    if (!ok) log_error("TLS ticket key file %s must hold exactly %d bytes", path, NET_TLS_TICKET_KEY_SIZE);
+    return ok;
+}
+
+NetworkTls* net_tls_create(const char* cert_path, const char* key_path, const char* ticket_key_path) {
+    NetworkTls* tls = calloc(1, sizeof(NetworkTls));
+    if (!tls) return NULL;
+
+    tls->context = SSL_CTX_new(TLS_server_method());
+    if (!tls->context) {
+        log_tls_error("Cannot create TLS context");
+        free(tls);
+        return NULL;
+    }
+    SSL_CTX* context = tls->context;
+
+    // AES-128-GCM first: the cheapest record cipher with AES-NI, and one
+    // the kernel can take over
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                                 SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_ciphersuites(context, "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"
+                                      "TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_cipher_list(context, "ECDHE+AES128+AESGCM:ECDHE+AES256+AESGCM:ECDHE+CHACHA20");
+
+    // Partial writes let a full socket end a send at a record boundary; the
+    // retry after WANT_WRITE may come from a re-read copy of the same bytes
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // Read ahead takes a pipeline's records in one recv, not two per record;
+    // net_tls_pending tells net_run what is left over
+    SSL_CTX_set_read_ahead(context, 1);
+    // One TLS 1.3 ticket per handshake rather than two; a resumed client
+    // gets a fresh one each time anyway
+    SSL_CTX_set_num_tickets(context, 1);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(context, (const unsigned char*)"phantomid", 9);
+
+    if (SSL_CTX_use_certificate_chain_file(context, cert_path) != 1) {
+        log_tls_error("Cannot load TLS certificate");
+    } else if (SSL_CTX_use_PrivateKey_file(context, key_path, SSL_FILETYPE_PEM) != 1) {
+        log_tls_error("Cannot load TLS private key");
+    } else if (SSL_CTX_check_private_key(context) != 1) {
+        log_tls_error("TLS private key does not match the certificate");
+    } else if (!ticket_key_path || load_ticket_keys(context, ticket_key_path)) {
+        return tls;
+    }
+    net_tls_free(tls);
+    return NULL;
+}
+
+void net_tls_free(NetworkTls* tls) {
+    if (!tls) return;
+    SSL_CTX_free(tls->context);
+    free(tls);
+}
+
+// Single writer, so a relaxed store is enough for readers on other threads
+static void tls_count(uint64_t* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+void net_tls_stats(const NetworkTls* tls, NetworkTlsStats* out) {
+    out->handshakes = __atomic_load_n(&tls->stats.handshakes, __ATOMIC_RELAXED);
+    out->resumed = __atomic_load_n(&tls->stats.resumed, __ATOMIC_RELAXED);
+    out->failures = __atomic_load_n(&tls->stats.failures, __ATOMIC_RELAXED);
+    out->kernel_send = __atomic_load_n(&tls->stats.kernel_send, __ATOMIC_RELAXED);
+    out->kernel_recv = __atomic_load_n(&tls->stats.kernel_recv, __ATOMIC_RELAXED);
+}
+
+NetworkTlsSession* net_tls_accept(NetworkTls* tls, int socket_fd) {
+    NetworkTlsSession* session = calloc(1, sizeof(NetworkTlsSession));
+    if (!session) return NULL;
+
+    session->ssl = SSL_new(tls->context);
+    if (!session->ssl || SSL_set_fd(session->ssl, socket_fd) != 1) {
+        log_tls_error("Cannot start TLS session");
+        SSL_free(session->ssl);
+        free(session);
+        return NULL;
+    }
+    SSL_set_accept_state(session->ssl);
+    session->tls = tls;
+    session->status = NET_TLS_WANT_READ;
+    return session;
+}
+
+NetworkTlsStatus net_tls_handshake(NetworkTlsSession* session) {
+    if (session->status == NET_TLS_DONE || session->status == NET_TLS_FAILED) return session->status;
+
+    int result = SSL_do_handshake(session->ssl);
+    if (result != 1) {
+        int error = SSL_get_error(session->ssl, result);
+        if (error == SSL_ERROR_WANT_READ) {
+            session->status = NET_TLS_WANT_READ;
+        } else if (error == SSL_ERROR_WANT_WRITE) {
+            session->status = NET_TLS_WANT_WRITE;
+        } else {
+            // Scanners and clients that give up are routine, so no error
+            const char* reason = ERR_reason_error_string(ERR_peek_error());
+            log_info("TLS handshake failed: %s", reason ? reason : "connection closed");
+            ERR_clear_error();
+            session->status = NET_TLS_FAILED;
+            tls_count(&session->tls->stats.failures);
+        }
+        return session->status;
+    }
+
+    NetworkTlsStats* stats = &session->tls->stats;
+    session->status = NET_TLS_DONE;
+    session->kernel_send = BIO_get_ktls_send(SSL_get_wbio(session->ssl)) != 0;
+    tls_count(&stats->handshakes);
+    if (SSL_session_reused(session->ssl)) tls_count(&stats->resumed);
+    if (session->kernel_send) tls_count(&stats->kernel_send);
+    if (BIO_get_ktls_recv(SSL_get_rbio(session->ssl))) tls_count(&stats->kernel_recv);
+    return NET_TLS_DONE;
+}
+
+NetworkTlsStatus net_tls_status(const NetworkTlsSession* session) {
+    return session->status;
+}
+
+bool net_tls_pending(const NetworkTlsSession* session) {
+    return session->status == NET_TLS_DONE && SSL_has_pending(session->ssl);
+}
+
+// Map a failed SSL_read or SSL_write onto send(2)/recv(2) conventions:
+// -1 with errno EAGAIN while the socket is not ready, 0 for an orderly
+// close, -1 with errno set otherwise
+static ssize_t tls_result(NetworkTlsSession* session, int result) {
+    int error = SSL_get_error(session->ssl, result);
+    switch (error) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0) errno = ECONNRESET;
+        ERR_clear_error();
+        return -1;
+    default:
+        ERR_clear_error();
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+static ssize_t tls_send(NetworkEndpoint* endpoint, const void* data, size_t size, int flags) {
+    NetworkTlsSession* session = endpoint->channel;
+    const char* next = data;
+    size_t left = size;
+
+    while (left > 0) {
+        int written = SSL_write(session->ssl, next, left > INT32_MAX ? INT32_MAX : (int)left);
+        if (written > 0) {
+            next += written;
+            left -= (size_t)written;
+            continue;
+        }
+
+        // Retried with the same bytes, as OpenSSL requires, until the
+        // socket takes them or the wait runs out
+        int error = SSL_get_error(session->ssl, written);
+        if ((error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) && !(flags & MSG_DONTWAIT)) {
+            struct pollfd ready = {
+                .fd = endpoint->socket_fd,
+                .events = error == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN
+            };
+            int polled = poll(&ready, 1, NET_SEND_WAIT_MS);
+            if (polled > 0 || (polled < 0 && errno == EINTR)) continue;
+            if (polled == 0) {
+                shutdown(endpoint->socket_fd, SHUT_RDWR);
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        if (tls_result(session, written) == 0) errno = EPIPE;
+        return left < size && (flags & MSG_DONTWAIT) ? (ssize_t)(size - left) : -1;
+    }
+    return (ssize_t)size;
+}
+
+static ssize_t tls_recv(NetworkEndpoint* endpoint, void* data, size_t size, int flags) {
+    NetworkTlsSession* session = endpoint->channel;
+    (void)flags;
+
+    int got = SSL_read(session->ssl, data, size > INT32_MAX ? INT32_MAX : (int)size);
+    return got > 0 ? got : tls_result(session, got);
+}
+
+// net_run owns the socket and the session of its clients
+static void tls_close(NetworkEndpoint* endpoint) {
+    (void)endpoint;
+}
+
+const NetworkTransport net_tls_transport = {
+    .name = "tls",
+    .send = tls_send,
+    .recv = tls_recv,
+    .close = tls_close
+};
+
+ssize_t net_tls_sendfile(NetworkTlsSession* session, int fd, off_t offset, size_t size) {
+    if (session->kernel_send) {
+        ossl_ssize_t sent = SSL_sendfile(session->ssl, fd, offset, size, 0);
+        return sent >= 0 ? (ssize_t)sent : tls_result(session, (int)sent);
+    }
+
+    // Without kernel TLS the bytes pass through here a record at a time.
+    // A record the socket refused is read again for the retry.
+    char record[TLS_RECORD_SIZE];
+    size_t total = 0;
+    while (total < size) {
+        size_t want = size - total < sizeof(record) ? size - total : sizeof(record);
+        ssize_t got = pread(fd, record, want, offset + (off_t)total);
+        if (got <= 0) {
+            if (got == 0) errno = EIO;
+            return total > 0 ? (ssize_t)total : -1;
+        }
+
+        int written = SSL_write(session->ssl, record, (int)got);
+        if (written <= 0) {
+            if (tls_result(session, written) == 0) errno = EPIPE;
+            return total > 0 ? (ssize_t)total : -1;
+        }
+        total += (size_t)written;
+    }
+    return (ssize_t)total;
+}
+
+void net_tls_close(NetworkTlsSession* session) {
+    if (!session) return;
+
+    // A close_notify that cannot go out at once is skipped; the socket
+    // closes right after either way
+    if (session->status == NET_TLS_DONE) {
+        SSL_shutdown(session->ssl);
+        ERR_clear_error();
+    }
+    SSL_free(session->ssl);
+    free(session);
+}
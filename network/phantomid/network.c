@@ -1,36 +1,197 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include "network.h"
+#include "log.h"
+#include "metrics.h"
+#include "lockprof.h"
+#include "trace.h"
 
 // Initialize client state
 void net_init_client_state(ClientState* state) {
     pthread_mutex_init(&state->lock, NULL);
     state->is_active = false;
     state->socket_fd = 0;
+    state->stream = NULL;
+    state->tls = NULL;
+    state->held = state->held_tail = NULL;
+    state->held_count = 0;
     memset(&state->addr, 0, sizeof(state->addr));
 }
 
-// Clean up client state
-void net_cleanup_client_state(ClientState* state) {
-    pthread_mutex_lock(&state->lock);
+// Hand a client's stream back to its owner and return the socket to
+// blocking sends if it had them. Called with the slot lock held.
+static void end_stream(ClientState* state, bool sent) {
+    NetworkStream* stream = state->stream;
+    if (!stream) return;
+    
+    state->stream = NULL;
+    int flags = state->stream_blocking ? fcntl(state->socket_fd, F_GETFL) : -1;
+    if (flags >= 0) fcntl(state->socket_fd, F_SETFL, flags & ~O_NONBLOCK);
+    stream->release(stream, sent);
+}
+
+const NetworkTuning net_tuning_latency = {
+    .name = "latency",
+    .nodelay = true,
+    .defer_accept_s = 1,
+    .fastopen_queue = 256,
+    .keepalive_idle_s = 60,
+    .keepalive_interval_s = 10,
+    .keepalive_count = 5,
+    .backlog = 1024
+};
+
+const NetworkTuning net_tuning_throughput = {
+    .name = "throughput",
+    .nodelay = false,
+    .defer_accept_s = 1,
+    .fastopen_queue = 256,
+    .send_buffer = 4 * 1024 * 1024,
+    .receive_buffer = 256 * 1024,
+    .keepalive_idle_s = 60,
+    .keepalive_interval_s = 10,
+    .keepalive_count = 5,
+    .backlog = 1024
+};
+
+const NetworkTuning* net_tuning_find(const char* name) {
+    if (strcmp(name, net_tuning_latency.name) == 0) return &net_tuning_latency;
+    if (strcmp(name, net_tuning_throughput.name) == 0) return &net_tuning_throughput;
+    return NULL;
+}
+
+static bool set_option(int socket_fd, int level, int option, int value) {
+    return setsockopt(socket_fd, level, option, &value, sizeof(value)) == 0;
+}
+
+static bool set_nonblocking(int socket_fd) {
+    int flags = fcntl(socket_fd, F_GETFL);
+    return flags >= 0 && fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// Options set on the listener before listen(). An option the kernel
+// refuses is logged and skipped; the listener works without it.
+static void tune_listener(const NetworkEndpoint* endpoint) {
+    const NetworkTuning* tuning = endpoint->tuning;
+    int fd = endpoint->socket_fd;
+    if (!tuning) return;
+    
+    if (tuning->send_buffer > 0 && !set_option(fd, SOL_SOCKET, SO_SNDBUF, tuning->send_buffer)) {
+        log_warn("Cannot set SO_SNDBUF: %s", strerror(errno));
+    }
+    if (tuning->receive_buffer > 0 && !set_option(fd, SOL_SOCKET, SO_RCVBUF, tuning->receive_buffer)) {
+        log_warn("Cannot set SO_RCVBUF: %s", strerror(errno));
+    }
+    if (tuning->defer_accept_s > 0 &&
+        !set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, (int)tuning->defer_accept_s)) {
+        log_warn("Cannot set TCP_DEFER_ACCEPT: %s", strerror(errno));
+    }
+#ifdef TCP_FASTOPEN
+    if (tuning->fastopen_queue > 0 &&
+        !set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, (int)tuning->fastopen_queue)) {
+        log_warn("Cannot enable TCP Fast Open: %s", strerror(errno));
+    }
+#endif
+}
+
+// Options set on each accepted socket. Warned about once, since every
+// connection would fail the same way.
+static void tune_connection(const NetworkTuning* tuning, int socket_fd) {
+    static bool warned;
+    bool ok = true;
+    if (!tuning) return;
+    
+    if (tuning->nodelay) ok = set_option(socket_fd, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (ok && tuning->keepalive_idle_s > 0) {
+        ok = set_option(socket_fd, SOL_SOCKET, SO_KEEPALIVE, 1) &&
+             set_option(socket_fd, IPPROTO_TCP, TCP_KEEPIDLE, (int)tuning->keepalive_idle_s) &&
+             (tuning->keepalive_interval_s == 0 ||
+              set_option(socket_fd, IPPROTO_TCP, TCP_KEEPINTVL, (int)tuning->keepalive_interval_s)) &&
+             (tuning->keepalive_count == 0 ||
+              set_option(socket_fd, IPPROTO_TCP, TCP_KEEPCNT, (int)tuning->keepalive_count));
+    }
+    if (!ok && !warned) {
+        warned = true;
+        log_warn("Cannot apply %s socket profile to connections: %s", tuning->name, strerror(errno));
+    }
+}
+
+// Close a client's connection and free what it holds. Called with the
+// slot lock held.
+static void release_client(ClientState* state) {
+    end_stream(state, false);
+    while (state->held) {
+        NetworkHeld* held = state->held;
+        state->held = held->next;
+        if (held->stream) held->stream->release(held->stream, false);
+        free(held);
+    }
+    state->held_tail = NULL;
+    state->held_count = 0;
+    net_tls_close(state->tls);
+    state->tls = NULL;
     if (state->socket_fd > 0) {
         close(state->socket_fd);
         state->socket_fd = 0;
     }
     state->is_active = false;
-    pthread_mutex_unlock(&state->lock);
+}
+
+// Endpoint that serves a client slot, through TLS if the connection uses it
+static NetworkEndpoint client_endpoint(ClientState* client) {
+    NetworkEndpoint endpoint = {
+        .socket_fd = client->socket_fd,
+        .addr = client->addr,
+        .transport = client->tls ? &net_tls_transport : NULL,
+        .channel = client->tls,
+        .client = client
+    };
+    return endpoint;
+}
+
+// Clean up client state
+void net_cleanup_client_state(ClientState* state) {
+    lock_acquire(&state->lock, LOCK_CLIENT_SLOT);
+    release_client(state);
+    lock_release(&state->lock);
     pthread_mutex_destroy(&state->lock);
 }
 
+// Take over a listener opened by another process
+bool net_adopt(NetworkEndpoint* endpoint, int socket_fd) {
+    pthread_mutex_init(&endpoint->lock, NULL);
+    
+    socklen_t addr_len = sizeof(endpoint->addr);
+    if (getsockname(socket_fd, (struct sockaddr*)&endpoint->addr, &addr_len) < 0) {
+        log_error("Inherited socket %d is unusable: %s", socket_fd, strerror(errno));
+        return false;
+    }
+    if (endpoint->mode == NET_NONBLOCKING && !set_nonblocking(socket_fd)) {
+        log_error("Cannot make inherited socket %d non-blocking: %s", socket_fd, strerror(errno));
+        return false;
+    }
+    endpoint->socket_fd = socket_fd;
+    endpoint->port = ntohs(endpoint->addr.sin_port);
+    return true;
+}
+
 // Initialize network endpoint
 bool net_init(NetworkEndpoint* endpoint) {
     int result = true;
     pthread_mutex_init(&endpoint->lock, NULL);
     
-    pthread_mutex_lock(&endpoint->lock);
+    lock_acquire(&endpoint->lock, LOCK_ENDPOINT);
     
     // Create socket
     endpoint->socket_fd = socket(AF_INET, 
@@ -38,7 +199,7 @@ bool net_init(NetworkEndpoint* endpoint) {
         0);
     
     if (endpoint->socket_fd < 0) {
-        perror("Socket creation failed");
+        log_error("Socket creation failed: %s", strerror(errno));
         result = false;
         goto cleanup;
     }
@@ -46,7 +207,7 @@ bool net_init(NetworkEndpoint* endpoint) {
     // Set socket options
     int opt = 1;
     if (setsockopt(endpoint->socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt failed");
+        log_error("setsockopt failed: %s", strerror(errno));
         result = false;
         goto cleanup;
     }
@@ -61,22 +222,30 @@ bool net_init(NetworkEndpoint* endpoint) {
     // For server endpoints
     if (endpoint->role == NET_SERVER) {
         if (bind(endpoint->socket_fd, (struct sockaddr*)&endpoint->addr, sizeof(endpoint->addr)) < 0) {
-            perror("Bind failed");
+            log_error("Bind failed: %s", strerror(errno));
             result = false;
             goto cleanup;
         }
         
         if (endpoint->protocol == NET_TCP) {
-            if (listen(endpoint->socket_fd, 5) < 0) {
-                perror("Listen failed");
+            tune_listener(endpoint);
+            int backlog = endpoint->tuning && endpoint->tuning->backlog > 0
+                ? endpoint->tuning->backlog : NET_DEFAULT_BACKLOG;
+            if (listen(endpoint->socket_fd, backlog) < 0) {
+                log_error("Listen failed: %s", strerror(errno));
                 result = false;
                 goto cleanup;
             }
         }
     }
+    
+    if (endpoint->mode == NET_NONBLOCKING && !set_nonblocking(endpoint->socket_fd)) {
+        log_error("Cannot make socket non-blocking: %s", strerror(errno));
+        result = false;
+    }
 
 cleanup:
-    pthread_mutex_unlock(&endpoint->lock);
+    lock_release(&endpoint->lock);
     if (!result && endpoint->socket_fd > 0) {
         close(endpoint->socket_fd);
         endpoint->socket_fd = 0;
@@ -84,77 +253,250 @@ cleanup:
     return result;
 }
 
-// Close network endpoint
-void net_close(NetworkEndpoint* endpoint) {
-    pthread_mutex_lock(&endpoint->lock);
+// A peer that closes with replies still due must not take the process
+// down with SIGPIPE; the send fails with EPIPE instead. On a non-blocking
+// socket a reply larger than the free buffer space is finished by waiting
+// for the peer to read, for at most NET_SEND_WAIT_MS, so a client that
+// stops reading cannot hold the reactor for longer.
+static ssize_t socket_send(NetworkEndpoint* endpoint, const void* data, size_t size, int flags) {
+    const char* next = data;
+    size_t left = size;
+    
+    while (left > 0) {
+        ssize_t sent = send(endpoint->socket_fd, next, left, flags | MSG_NOSIGNAL);
+        if (sent > 0) {
+            next += sent;
+            left -= (size_t)sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && errno == EAGAIN && !(flags & MSG_DONTWAIT)) {
+            struct pollfd writable = { .fd = endpoint->socket_fd, .events = POLLOUT };
+            int ready = poll(&writable, 1, NET_SEND_WAIT_MS);
+            if (ready > 0 || (ready < 0 && errno == EINTR)) continue;
+            
+            // The reply is cut short, so nothing after it would parse;
+            // end the connection, which net_run sees on its next read
+            if (ready == 0) {
+                shutdown(endpoint->socket_fd, SHUT_RDWR);
+                errno = ETIMEDOUT;
+            }
+        }
+        return left < size && (flags & MSG_DONTWAIT) ? (ssize_t)(size - left) : -1;
+    }
+    return (ssize_t)size;
+}
+
+static ssize_t socket_recv(NetworkEndpoint* endpoint, void* data, size_t size, int flags) {
+    return recv(endpoint->socket_fd, data, size, flags);
+}
+
+static void socket_close(NetworkEndpoint* endpoint) {
     if (endpoint->socket_fd > 0) {
         close(endpoint->socket_fd);
         endpoint->socket_fd = 0;
     }
-    pthread_mutex_unlock(&endpoint->lock);
+}
+
+const NetworkTransport net_socket_transport = {
+    .name = "socket",
+    .send = socket_send,
+    .recv = socket_recv,
+    .close = socket_close
+};
+
+static const NetworkTransport* transport_of(const NetworkEndpoint* endpoint) {
+    return endpoint->transport ? endpoint->transport : &net_socket_transport;
+}
+
+// Close network endpoint
+void net_close(NetworkEndpoint* endpoint) {
+    lock_acquire(&endpoint->lock, LOCK_ENDPOINT);
+    transport_of(endpoint)->close(endpoint);
+    lock_release(&endpoint->lock);
 }
 
 // Send data through network endpoint
 ssize_t net_send(NetworkEndpoint* endpoint, NetworkPacket* packet) {
     ssize_t result;
-    pthread_mutex_lock(&endpoint->lock);
-    result = send(endpoint->socket_fd, packet->data, packet->size, packet->flags);
-    pthread_mutex_unlock(&endpoint->lock);
+    uint64_t start = metrics_start();
+    uint64_t span = trace_begin();
+    lock_acquire(&endpoint->lock, LOCK_ENDPOINT);
+    result = transport_of(endpoint)->send(endpoint, packet->data, packet->size, packet->flags);
+    lock_release(&endpoint->lock);
+    trace_end(TRACE_SEND, span);
+    metrics_record(METRIC_SEND, start);
     return result;
 }
 
 // Receive data through network endpoint
 ssize_t net_receive(NetworkEndpoint* endpoint, NetworkPacket* packet) {
     ssize_t result;
-    pthread_mutex_lock(&endpoint->lock);
-    result = recv(endpoint->socket_fd, packet->data, packet->size, packet->flags);
-    pthread_mutex_unlock(&endpoint->lock);
+    lock_acquire(&endpoint->lock, LOCK_ENDPOINT);
+    result = transport_of(endpoint)->recv(endpoint, packet->data, packet->size, packet->flags);
+    lock_release(&endpoint->lock);
     return result;
 }
 
+bool net_stream(NetworkEndpoint* endpoint, NetworkStream* stream) {
+    ClientState* client = endpoint->client;
+    if (!client || client->stream || (endpoint->transport && !client->tls)) return false;
+    
+    // Stream sends must never stall the reactor; a blocking socket goes
+    // back to blocking sends once the stream ends
+    int flags = fcntl(client->socket_fd, F_GETFL);
+    if (flags < 0) return false;
+    client->stream_blocking = !(flags & O_NONBLOCK);
+    if (client->stream_blocking && fcntl(client->socket_fd, F_SETFL, flags | O_NONBLOCK) < 0) return false;
+    client->stream = stream;
+    client->stream_sent = 0;
+    return true;
+}
+
+bool net_hold(NetworkEndpoint* endpoint, const void* data, size_t size, uint64_t ticket,
+              NetworkStream* stream) {
+    ClientState* client = endpoint->client;
+    if (!client) return false;
+    
+    NetworkHeld* held = malloc(sizeof(NetworkHeld) + size);
+    if (!held) return false;
+    held->next = NULL;
+    held->ticket = client->held_tail && client->held_tail->ticket > ticket ? client->held_tail->ticket : ticket;
+    held->stream = stream;
+    held->size = size;
+    memcpy(held->data, data, size);
+    
+    if (client->held_tail) {
+        client->held_tail->next = held;
+    } else {
+        client->held = held;
+    }
+    client->held_tail = held;
+    client->held_count++;
+    return true;
+}
+
+bool net_holding(const NetworkEndpoint* endpoint) {
+    return endpoint->client && endpoint->client->held;
+}
+
+// Send a client's held replies that have settled, oldest first, until one
+// has not or a stream must go out before the rest. Called with the slot
+// lock held.
+static void release_held(NetworkProgram* program, ClientState* client) {
+    while (client->held && !client->stream) {
+        NetworkHeld* held = client->held;
+        NetworkHeldStatus status = program->settle ? program->settle(held->ticket) : NET_HELD_SEND;
+        if (status == NET_HELD_WAIT) break;
+        
+        client->held = held->next;
+        if (!client->held) client->held_tail = NULL;
+        client->held_count--;
+        
+        NetworkEndpoint endpoint = client_endpoint(client);
+        if (status == NET_HELD_SEND) {
+            NetworkPacket packet = {
+                .data = held->data,
+                .size = held->size,
+                .flags = 0
+            };
+            if (net_send(&endpoint, &packet) < 0) {
+                log_warn("Failed to send held response to client");
+            }
+            if (held->stream && !net_stream(&endpoint, held->stream)) {
+                held->stream->release(held->stream, false);
+            }
+        } else {
+            if (held->stream) held->stream->release(held->stream, false);
+            if (program->on_held_failed) program->on_held_failed(&endpoint, held);
+        }
+        free(held);
+    }
+}
+
+// Send up to one chunk of the ready part of a client's stream. Returns
+// false if the connection has failed. Called with the slot lock held.
+static bool pump_stream(ClientState* client) {
+    NetworkStream* stream = client->stream;
+    size_t ready = stream->ready(stream);
+    if (ready == NET_STREAM_FAILED) return false;
+    if (ready > stream->length) ready = stream->length;
+    
+    if (client->stream_sent < ready) {
+        off_t offset = (off_t)client->stream_sent;
+        size_t want = ready - client->stream_sent;
+        if (want > NET_STREAM_CHUNK) want = NET_STREAM_CHUNK;
+        
+        uint64_t start = metrics_start();
+        ssize_t sent = client->tls ? net_tls_sendfile(client->tls, stream->fd, offset, want)
+                                   : sendfile(client->socket_fd, stream->fd, &offset, want);
+        metrics_record(METRIC_SEND, start);
+        if (sent < 0 && errno != EAGAIN && errno != EINTR) return false;
+        if (sent > 0) client->stream_sent += (size_t)sent;
+    }
+    
+    if (client->stream_sent == stream->length) end_stream(client, true);
+    return true;
+}
+
 // Add client to program
-bool net_add_client(NetworkProgram* program, int socket_fd, struct sockaddr_in addr) {
-    bool added = false;
-    pthread_mutex_lock(&program->clients_lock);
+static ClientState* add_client(NetworkProgram* program, int socket_fd, struct sockaddr_in addr,
+                              NetworkTlsSession* tls) {
+    ClientState* added = NULL;
+    lock_acquire(&program->clients_lock, LOCK_CLIENTS);
     
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_mutex_lock(&program->clients[i].lock);
+        lock_acquire(&program->clients[i].lock, LOCK_CLIENT_SLOT);
         if (!program->clients[i].is_active) {
             program->clients[i].socket_fd = socket_fd;
             program->clients[i].addr = addr;
+            memset(&program->clients[i].rate, 0, sizeof(program->clients[i].rate));
+            program->clients[i].session = 0;
+            program->clients[i].input_length = 0;
+            program->clients[i].stream = NULL;
+            program->clients[i].held = program->clients[i].held_tail = NULL;
+            program->clients[i].held_count = 0;
+            program->clients[i].tls = tls;
             program->clients[i].is_active = true;
-            added = true;
-            pthread_mutex_unlock(&program->clients[i].lock);
+            added = &program->clients[i];
+            lock_release(&program->clients[i].lock);
             break;
         }
-        pthread_mutex_unlock(&program->clients[i].lock);
+        lock_release(&program->clients[i].lock);
     }
     
-    pthread_mutex_unlock(&program->clients_lock);
+    lock_release(&program->clients_lock);
     return added;
 }
 
+bool net_add_client(NetworkProgram* program, int socket_fd, struct sockaddr_in addr) {
+    return add_client(program, socket_fd, addr, NULL);
+}
+
 // Remove client from program
 void net_remove_client(NetworkProgram* program, int socket_fd) {
-    pthread_mutex_lock(&program->clients_lock);
+    lock_acquire(&program->clients_lock, LOCK_CLIENTS);
     
     for (int i = 0; i < MAX_CLIENTS; i++) {
-        pthread_mutex_lock(&program->clients[i].lock);
+        lock_acquire(&program->clients[i].lock, LOCK_CLIENT_SLOT);
         if (program->clients[i].is_active && program->clients[i].socket_fd == socket_fd) {
-            close(program->clients[i].socket_fd);
-            program->clients[i].is_active = false;
-            program->clients[i].socket_fd = 0;
+            release_client(&program->clients[i]);
         }
-        pthread_mutex_unlock(&program->clients[i].lock);
+        lock_release(&program->clients[i].lock);
     }
     
-    pthread_mutex_unlock(&program->clients_lock);
+    lock_release(&program->clients_lock);
 }
 
 // Initialize network program
 void net_init_program(NetworkProgram* program) {
     pthread_mutex_init(&program->clients_lock, NULL);
-    program->running = true;
+    program->running = !program->stop_requested;
+    memset(&program->poll_stats, 0, sizeof(program->poll_stats));
+    if (pipe2(program->wake_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_warn("No wake pipe, stop and drain requests wait for socket activity: %s", strerror(errno));
+        program->wake_fds[0] = program->wake_fds[1] = 0;
+    }
     
     for (int i = 0; i < MAX_CLIENTS; i++) {
         net_init_client_state(&program->clients[i]);
@@ -163,108 +505,696 @@ void net_init_program(NetworkProgram* program) {
 
 // Clean up network program
 void net_cleanup_program(NetworkProgram* program) {
-    pthread_mutex_lock(&program->clients_lock);
+    lock_acquire(&program->clients_lock, LOCK_CLIENTS);
     program->running = false;
     
     for (int i = 0; i < MAX_CLIENTS; i++) {
         net_cleanup_client_state(&program->clients[i]);
     }
     
-    pthread_mutex_unlock(&program->clients_lock);
+    lock_release(&program->clients_lock);
     pthread_mutex_destroy(&program->clients_lock);
+    
+    if (program->wake_fds[0] > 0) {
+        close(program->wake_fds[0]);
+        close(program->wake_fds[1]);
+        program->wake_fds[0] = program->wake_fds[1] = 0;
+    }
+}
+
+static void wake(NetworkProgram* program) {
+    int fd = program->wake_fds[1];
+    if (fd > 0) {
+        char byte = 1;
+        ssize_t ignored = write(fd, &byte, 1);
+        (void)ignored;
+    }
+}
+
+void net_stop(NetworkProgram* program) {
+    program->stop_requested = true;
+    program->running = false;
+    wake(program);
+}
+
+void net_drain(NetworkProgram* program, uint32_t timeout_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    program->drain_deadline_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec +
+                                 timeout_ms * 1000000ull;
+    __atomic_store_n(&program->draining, true, __ATOMIC_RELEASE);
+    wake(program);
+}
+
+static uint64_t poll_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// A whole line is buffered, or a line too long for the buffer, which is
+// served as it stands
+static bool has_request(const ClientState* client) {
+    return client->input_length == BUFFER_SIZE - 1 ||
+           memchr(client->input, '\n', client->input_length) != NULL;
+}
+
+// Find the line request starting at offset in a client's input: one ending
+// in '\n', or a whole buffer without one. length excludes the newline,
+// consumed includes it.
+static bool next_line(const ClientState* client, size_t offset, size_t* length, size_t* consumed) {
+    const char* line = client->input + offset;
+    size_t left = client->input_length - offset;
+    const char* newline = memchr(line, '\n', left);
+    if (!newline && !(offset == 0 && left == BUFFER_SIZE - 1)) return false;
+    
+    *length = newline ? (size_t)(newline - line) : left;
+    *consumed = newline ? *length + 1 : left;
+    return true;
+}
+
+static bool rate_paused(const ClientState* client) {
+    return client->rate.resume_ns > 0 && client->rate.resume_ns > poll_clock();
+}
+
+// A client with NET_HELD_MAX replies held is served again once some leave
+static bool held_full(const ClientState* client) {
+    return client->held_count >= NET_HELD_MAX;
+}
+
+// Serve buffered line requests until none is complete, the pass's share
+// is used up or the rate limiter pauses the connection
+static void serve_lines(NetworkProgram* program, NetworkEndpoint* endpoint, uint64_t ready) {
+    ClientState* client = endpoint->client;
+    size_t offset = 0;
+    size_t length, consumed;
+    int served;
+    
+    // The caller began the first request's trace
+    for (served = 0; served < NET_REQUESTS_PER_PASS; served++) {
+        if (rate_paused(client) || held_full(client) ||
+            !next_line(client, offset, &length, &consumed)) {
+            break;
+        }
+        
+        // The receiver NUL-terminates over the newline
+        NetworkPacket packet = {
+            .data = client->input + offset,
+            .size = length,
+            .flags = 0
+        };
+        offset += consumed;
+        if (served > 0) trace_request_begin(ready);
+        if (program->on_receive) program->on_receive(endpoint, &packet);
+        trace_request_end();
+    }
+    if (served == 0) trace_request_end();
+    
+    client->input_length -= offset;
+    memmove(client->input, client->input + offset, client->input_length);
+}
+
+// Read what a line client has sent into its input buffer. Returns the
+// net_receive result, or 1 for a non-blocking read that found nothing.
+static ssize_t receive_input(NetworkEndpoint* endpoint, ClientState* client) {
+    // Leave room for receivers to NUL-terminate the request
+    NetworkPacket packet = {
+        .data = client->input + client->input_length,
+        .size = BUFFER_SIZE - 1 - client->input_length,
+        .flags = 0
+    };
+    
+    uint64_t start = metrics_start();
+    uint64_t span = trace_begin();
+    ssize_t valread = net_receive(endpoint, &packet);
+    bool would_block = valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    trace_end(TRACE_RECV, span);
+    metrics_record(METRIC_RECV, start);
+    
+    if (valread > 0) {
+        if (client->input_length == 0) client->input_ns = start;
+        client->input_length += (size_t)valread;
+    }
+    return would_block ? 1 : valread;
 }
 
 // Run network program
+ssize_t net_serve(NetworkProgram* program, NetworkEndpoint* endpoint, uint64_t ready) {
+    char buffer[BUFFER_SIZE];
+    ClientState* client = program->line_requests ? endpoint->client : NULL;
+    
+    // Buffered requests go first; the socket is read once they are served
+    if (client && has_request(client)) {
+        trace_request_begin(ready);
+        serve_lines(program, endpoint, ready);
+        return 1;
+    }
+    
+    trace_request_begin(ready);
+    if (client) {
+        ssize_t valread = receive_input(endpoint, client);
+        if (valread > 0) {
+            serve_lines(program, endpoint, ready);
+        } else {
+            trace_request_end();
+        }
+        return valread;
+    }
+    
+    // Leave room for receivers to NUL-terminate the request
+    NetworkPacket packet = {
+        .data = buffer,
+        .size = BUFFER_SIZE - 1,
+        .flags = 0
+    };
+    
+    uint64_t start = metrics_start();
+    uint64_t span = trace_begin();
+    ssize_t valread = net_receive(endpoint, &packet);
+    bool would_block = valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    trace_end(TRACE_RECV, span);
+    metrics_record(METRIC_RECV, start);
+    
+    if (valread > 0 && program->on_receive) {
+        packet.size = valread;
+        program->on_receive(endpoint, &packet);
+    }
+    trace_request_end();
+    if (would_block) return 1;
+    return valread;
+}
+
+// Single writer, so a relaxed store is enough for readers on other threads
+static void poll_count(uint64_t* counter, uint64_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+void net_poll_stats(const NetworkProgram* program, NetworkPollStats* out) {
+    out->spin_wakeups = __atomic_load_n(&program->poll_stats.spin_wakeups, __ATOMIC_RELAXED);
+    out->sleep_wakeups = __atomic_load_n(&program->poll_stats.sleep_wakeups, __ATOMIC_RELAXED);
+    out->spin_ns = __atomic_load_n(&program->poll_stats.spin_ns, __ATOMIC_RELAXED);
+    out->sleep_ns = __atomic_load_n(&program->poll_stats.sleep_ns, __ATOMIC_RELAXED);
+}
+
+static const char* lane_names[NET_LANE_COUNT] = { "interactive", "standard", "bulk" };
+
+const char* net_lane_name(NetworkLane lane) {
+    return lane_names[lane];
+}
+
+bool net_lane_parse(const char* spec, NetworkLane* lane, uint32_t* weight) {
+    const char* equals = strchr(spec, '=');
+    if (!equals || equals[1] < '0' || equals[1] > '9') return false;
+    
+    for (int i = 0; i < NET_LANE_COUNT; i++) {
+        if (strlen(lane_names[i]) == (size_t)(equals - spec) &&
+            strncmp(spec, lane_names[i], (size_t)(equals - spec)) == 0) {
+            char* end;
+            unsigned long value = strtoul(equals + 1, &end, 10);
+            if (*end != '\0' || value > UINT32_MAX) return false;
+            *lane = (NetworkLane)i;
+            *weight = (uint32_t)value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void net_lane_stats(const NetworkProgram* program, NetworkLaneStats out[NET_LANE_COUNT]) {
+    for (int i = 0; i < NET_LANE_COUNT; i++) {
+        const NetworkLaneStats* lane = &program->lane_stats[i];
+        out[i].served = __atomic_load_n(&lane->served, __ATOMIC_RELAXED);
+        out[i].deferred = __atomic_load_n(&lane->deferred, __ATOMIC_RELAXED);
+        out[i].depth = __atomic_load_n(&lane->depth, __ATOMIC_RELAXED);
+        out[i].max_depth = __atomic_load_n(&lane->max_depth, __ATOMIC_RELAXED);
+    }
+}
+
+// Close a net_run client. Called with the clients lock and the slot lock
+// held, which net_remove_client would take again.
+static void drop_client(NetworkProgram* program, int slot) {
+    ClientState* client = &program->clients[slot];
+    NetworkEndpoint endpoint = client_endpoint(client);
+    if (program->on_disconnect) {
+        program->on_disconnect(&endpoint);
+    }
+    release_client(client);
+}
+
+// Client slots waiting in one lane, oldest first. A slot waits in at most
+// one lane at a time, so MAX_CLIENTS entries always suffice.
+typedef struct {
+    int slots[MAX_CLIENTS];
+    size_t head;
+    size_t count;
+} LaneQueue;
+
+// Queue a client in the lane of its next request, if it has a complete one
+// and may be served. Called with the slot lock held.
+static void lane_enqueue(NetworkProgram* program, LaneQueue* lanes, int slot) {
+    ClientState* client = &program->clients[slot];
+    size_t length, consumed;
+    if (!client->is_active || client->stream || rate_paused(client) || held_full(client) ||
+        !next_line(client, 0, &length, &consumed)) {
+        return;
+    }
+    
+    NetworkLane lane = program->classify(client->input, length);
+    LaneQueue* queue = &lanes[lane < NET_LANE_COUNT ? lane : NET_LANE_BULK];
+    queue->slots[(queue->head + queue->count++) % MAX_CLIENTS] = slot;
+}
+
+// Serve the waiting line requests of every client, highest lane first.
+// Each lane serves at most its weight of requests per pass, and each
+// client at most NET_REQUESTS_PER_PASS; what is left waits for the next
+// pass, which starts without blocking once new arrivals are read. A served
+// client's next request joins the lane it belongs to, so a connection's
+// requests stay in order whatever lanes they fall in. Called with the
+// clients lock held.
+static void serve_lanes(NetworkProgram* program, size_t first, uint64_t ready) {
+    LaneQueue lanes[NET_LANE_COUNT] = {0};
+    uint32_t budget[NET_LANE_COUNT];
+    int served[MAX_CLIENTS] = {0};
+    
+    for (int n = 0; n < MAX_CLIENTS; n++) {
+        int i = (int)((first + n) % MAX_CLIENTS);
+        lock_acquire(&program->clients[i].lock, LOCK_CLIENT_SLOT);
+        lane_enqueue(program, lanes, i);
+        lock_release(&program->clients[i].lock);
+    }
+    for (int l = 0; l < NET_LANE_COUNT; l++) {
+        NetworkLaneStats* stats = &program->lane_stats[l];
+        budget[l] = program->lane_weights[l] > 0 ? program->lane_weights[l] : UINT32_MAX;
+        __atomic_store_n(&stats->depth, (uint32_t)lanes[l].count, __ATOMIC_RELAXED);
+        if (lanes[l].count > stats->max_depth) {
+            __atomic_store_n(&stats->max_depth, (uint32_t)lanes[l].count, __ATOMIC_RELAXED);
+        }
+    }
+    
+    for (;;) {
+        int l = 0;
+        while (l < NET_LANE_COUNT && (lanes[l].count == 0 || budget[l] == 0)) l++;
+        if (l == NET_LANE_COUNT) break;
+        
+        LaneQueue* queue = &lanes[l];
+        int i = queue->slots[queue->head];
+        queue->head = (queue->head + 1) % MAX_CLIENTS;
+        queue->count--;
+        budget[l]--;
+        
+        ClientState* client = &program->clients[i];
+        lock_acquire(&client->lock, LOCK_CLIENT_SLOT);
+        NetworkEndpoint endpoint = client_endpoint(client);
+        size_t length = 0, consumed = 0;
+        next_line(client, 0, &length, &consumed);
+        
+        // The receiver NUL-terminates over the newline
+        NetworkPacket packet = {
+            .data = client->input,
+            .size = length,
+            .flags = 0
+        };
+        trace_request_begin(ready);
+        if (program->on_receive) program->on_receive(&endpoint, &packet);
+        trace_request_end();
+        metrics_record((MetricId)(METRIC_LANE_INTERACTIVE + l), client->input_ns);
+        poll_count(&program->lane_stats[l].served, 1);
+        client->input_length -= consumed;
+        memmove(client->input, client->input + consumed, client->input_length);
+        if (++served[i] < NET_REQUESTS_PER_PASS) lane_enqueue(program, lanes, i);
+        lock_release(&client->lock);
+    }
+    
+    for (int l = 0; l < NET_LANE_COUNT; l++) {
+        if (lanes[l].count > 0) poll_count(&program->lane_stats[l].deferred, lanes[l].count);
+    }
+}
+
+// Ask the kernel to busy-poll the device queue for this client's reads too.
+// Raising SO_BUSY_POLL past net.core.busy_read needs CAP_NET_ADMIN, so a
+// refusal is reported once and the user-space spin carries on alone.
+static void enable_busy_poll(NetworkProgram* program, int socket_fd) {
+    static bool warned;
+    int result = 0;
+#ifdef SO_BUSY_POLL
+    int usec = (int)program->busy_poll_us;
+    result = setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    if (result == 0) {
+        result = setsockopt(socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+    }
+#endif
+    if (result != 0 && !warned) {
+        warned = true;
+        log_warn("Kernel busy polling unavailable (%s), spinning in user space only", strerror(errno));
+    }
+}
+
+// Accept one connection on the first endpoint, tune it and hand it to a
+// client slot, or refuse it if none is free. False once nothing is pending.
+static bool accept_client(NetworkProgram* program) {
+    NetworkEndpoint* listener = &program->endpoints[0];
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    uint64_t start = metrics_start();
+    // A TLS handshake must never block the loop, whatever the listener mode
+    int flags = listener->mode == NET_NONBLOCKING || listener->tls ? SOCK_NONBLOCK : 0;
+    int new_socket = accept4(listener->socket_fd, (struct sockaddr*)&client_addr, &addr_len, flags);
+    metrics_record(METRIC_ACCEPT, start);
+    if (new_socket < 0) return false;
+    
+    tune_connection(listener->tuning, new_socket);
+    if (program->busy_poll_us > 0) enable_busy_poll(program, new_socket);
+
+    // With deferred accept the ClientHello is usually waiting already, so
+    // the first handshake step need not wait for another select
+    NetworkTlsSession* tls = NULL;
+    if (listener->tls) {
+        tls = net_tls_accept(listener->tls, new_socket);
+        if (!tls || net_tls_handshake(tls) == NET_TLS_FAILED) {
+            net_tls_close(tls);
+            close(new_socket);
+            return true;
+        }
+    }
+    if (!add_client(program, new_socket, client_addr, tls)) {
+        log_warn("Client limit of %d reached, refusing connection", MAX_CLIENTS);
+        net_tls_close(tls);
+        close(new_socket);
+        return true;
+    }
+
+    NetworkEndpoint endpoint = {0};
+    endpoint.socket_fd = new_socket;
+    endpoint.addr = client_addr;
+    if (program->on_connect) {
+        program->on_connect(&endpoint);
+    }
+    return true;
+}
+
+// Wait for readiness on the sockets in readfds and writefds, blocking for at most limit
+// (NULL for no limit). In busy-poll mode the reactor first spins on
+// zero-timeout selects for up to busy_poll_us, trading a core for the
+// wakeup latency of a blocking select.
+static int wait_ready(NetworkProgram* program, int max_sd, fd_set* readfds, fd_set* writefds,
+                      struct timeval* limit) {
+    NetworkPollStats* stats = &program->poll_stats;
+    uint64_t start = poll_clock();
+
+    if (program->busy_poll_us > 0) {
+        fd_set watched = *readfds, watched_writes = *writefds;
+        uint64_t budget_end = start + program->busy_poll_us * 1000ull;
+        struct timeval zero = { 0, 0 };
+
+        for (;;) {
+            *readfds = watched;
+            *writefds = watched_writes;
+            int activity = select(max_sd + 1, readfds, writefds, NULL, &zero);
+            uint64_t now = poll_clock();
+            if (activity != 0) {
+                poll_count(&stats->spin_ns, now - start);
+                if (activity > 0) poll_count(&stats->spin_wakeups, 1);
+                return activity;
+            }
+            if (now >= budget_end || !program->running) {
+                poll_count(&stats->spin_ns, now - start);
+                start = now;
+                *readfds = watched;
+                *writefds = watched_writes;
+                break;
+            }
+        }
+    }
+
+    int activity = select(max_sd + 1, readfds, writefds, NULL, limit);
+    poll_count(&stats->sleep_ns, poll_clock() - start);
+    if (activity > 0) poll_count(&stats->sleep_wakeups, 1);
+    return activity;
+}
+
+// While draining, a client whose complete requests are all answered, with
+// no reply held or streaming, may be finished with. It is if it has nothing
+// buffered, or if hand_over can take a plaintext one holding a partial line.
+// Anything else carries on until it gets there or the deadline passes.
+static bool drain_ready(const NetworkProgram* program, const ClientState* client) {
+    return !client->held && !client->stream &&
+           (client->input_length == 0 ||
+            (!client->tls && program->hand_over && !has_request(client)));
+}
+
+// Finish with a drain_ready client: close it if it sent nothing further,
+// and otherwise hand a plaintext one over unread, so whatever it sends
+// next reaches the successor. False leaves it to be read as usual, for TLS
+// or once a hand-over failed. Called with the clients lock and the slot
+// lock held.
+static bool finish_draining(NetworkProgram* program, int slot, bool readable) {
+    ClientState* client = &program->clients[slot];
+    if (!readable && client->input_length == 0) {
+        drop_client(program, slot);
+        return true;
+    }
+    if (client->tls || !program->hand_over) return false;
+    
+    NetworkEndpoint endpoint = client_endpoint(client);
+    if (!program->hand_over(program->hand_over_ctx, &endpoint, client->input,
+                            client->input_length, client->session)) {
+        log_warn("Cannot hand over connections, they get until the drain deadline");
+        program->hand_over = NULL;
+        return false;
+    }
+    drop_client(program, slot);
+    return true;
+}
+
+// Take on a connection the process being replaced handed over, with the
+// partial line and session flags it had there
+static void adopt_client(NetworkProgram* program, const NetworkAdoption* adoption) {
+    struct sockaddr_in addr = {0};
+    socklen_t addr_len = sizeof(addr);
+    getpeername(adoption->socket_fd, (struct sockaddr*)&addr, &addr_len);
+    
+    ClientState* client = add_client(program, adoption->socket_fd, addr, NULL);
+    if (!client) {
+        log_warn("Client limit of %d reached, closing a handed-over connection", MAX_CLIENTS);
+        close(adoption->socket_fd);
+        return;
+    }
+    
+    NetworkEndpoint endpoint = {0};
+    endpoint.socket_fd = adoption->socket_fd;
+    endpoint.addr = addr;
+    if (program->on_connect) {
+        program->on_connect(&endpoint);
+    }
+    
+    lock_acquire(&client->lock, LOCK_CLIENT_SLOT);
+    memcpy(client->input, adoption->input, adoption->input_length);
+    client->input_length = adoption->input_length;
+    client->input_ns = metrics_start();
+    client->session = adoption->session;
+    lock_release(&client->lock);
+}
+
 void net_run(NetworkProgram* program) {
-    fd_set readfds;
+    fd_set readfds, writefds;
     int max_sd;
-    char buffer[BUFFER_SIZE];
     
     net_init_program(program);
-    printf("Server started, waiting for connections...\n");
+    for (size_t i = 0; i < program->adopt_count; i++) {
+        adopt_client(program, &program->adopt[i]);
+    }
+    if (program->adopt_count > 0) {
+        log_info("Took over %zu connections mid-request", program->adopt_count);
+    }
+    log_info("Server started, waiting for connections...");
 
     while (program->running) {
+        bool draining = __atomic_load_n(&program->draining, __ATOMIC_ACQUIRE);
+        uint64_t now = poll_clock();
+        uint64_t wake_at = 0;      // Earliest deadline the wait must end by, 0 for none
+        int active = 0;
         FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
         max_sd = 0;
 
-        // Add main server socket
-        pthread_mutex_lock(&program->endpoints[0].lock);
-        FD_SET(program->endpoints[0].socket_fd, &readfds);
-        max_sd = program->endpoints[0].socket_fd;
-        pthread_mutex_unlock(&program->endpoints[0].lock);
+        // Stop and drain requests arrive through the wake pipe, news of
+        // settled replies through settle_fd
+        if (program->wake_fds[0] > 0) {
+            FD_SET(program->wake_fds[0], &readfds);
+            max_sd = program->wake_fds[0];
+        }
+        if (program->settle_fd > 0) {
+            FD_SET(program->settle_fd, &readfds);
+            if (program->settle_fd > max_sd) max_sd = program->settle_fd;
+        }
+
+        // Add main server socket, unless a successor accepts from it now
+        if (!draining) {
+            lock_acquire(&program->endpoints[0].lock, LOCK_ENDPOINT);
+            FD_SET(program->endpoints[0].socket_fd, &readfds);
+            if (program->endpoints[0].socket_fd > max_sd) {
+                max_sd = program->endpoints[0].socket_fd;
+            }
+            lock_release(&program->endpoints[0].lock);
+        }
 
-        // Add client sockets
-        pthread_mutex_lock(&program->clients_lock);
+        // Add client sockets. A client over its rate limit is left out until
+        // its bucket refills, so its requests wait in the kernel, unread.
+        // One with requests left over from the last pass, or with TLS
+        // records already decrypted, needs no wait. A client with a stream
+        // is written, not read, and only once more of the stream is ready. A
+        // TLS handshake waits for whichever direction it is blocked on.
+        // Held replies that have settled go out first, and a client with
+        // too many still held is not read until some leave. While draining,
+        // a client that may be finished with is watched: the wait then only
+        // looks for what it has sent meanwhile.
+        bool queued[MAX_CLIENTS] = {false};
+        bool watched[MAX_CLIENTS] = {false};
+        bool any_queued = false, any_watched = false;
+        lock_acquire(&program->clients_lock, LOCK_CLIENTS);
         for (int i = 0; i < MAX_CLIENTS; i++) {
-            pthread_mutex_lock(&program->clients[i].lock);
+            lock_acquire(&program->clients[i].lock, LOCK_CLIENT_SLOT);
+            if (program->clients[i].is_active && program->clients[i].held) {
+                release_held(program, &program->clients[i]);
+            }
             if (program->clients[i].is_active) {
-                FD_SET(program->clients[i].socket_fd, &readfds);
-                if (program->clients[i].socket_fd > max_sd) {
-                    max_sd = program->clients[i].socket_fd;
+                uint64_t resume = program->clients[i].rate.resume_ns;
+                NetworkStream* stream = program->clients[i].stream;
+                NetworkTlsSession* tls = program->clients[i].tls;
+                if (tls && net_tls_status(tls) != NET_TLS_DONE) {
+                    bool reading = net_tls_status(tls) != NET_TLS_WANT_WRITE;
+                    FD_SET(program->clients[i].socket_fd, reading ? &readfds : &writefds);
+                    watched[i] = draining && reading && drain_ready(program, &program->clients[i]);
+                    if (program->clients[i].socket_fd > max_sd) {
+                        max_sd = program->clients[i].socket_fd;
+                    }
+                } else if (stream) {
+                    if (stream->ready(stream) != program->clients[i].stream_sent) {
+                        FD_SET(program->clients[i].socket_fd, &writefds);
+                        if (program->clients[i].socket_fd > max_sd) {
+                            max_sd = program->clients[i].socket_fd;
+                        }
+                    } else if (wake_at == 0 || now + NET_STREAM_POLL_NS < wake_at) {
+                        wake_at = now + NET_STREAM_POLL_NS;
+                    }
+                } else if (resume > now) {
+                    if (wake_at == 0 || resume < wake_at) wake_at = resume;
+                } else if (held_full(&program->clients[i])) {
+                    // Waits for settle_fd
+                } else if ((program->line_requests && has_request(&program->clients[i])) ||
+                           (tls && net_tls_pending(tls))) {
+                    queued[i] = any_queued = true;
+                } else {
+                    FD_SET(program->clients[i].socket_fd, &readfds);
+                    if (program->clients[i].socket_fd > max_sd) {
+                        max_sd = program->clients[i].socket_fd;
+                    }
+                    watched[i] = draining && drain_ready(program, &program->clients[i]);
                 }
+                any_watched |= watched[i];
+                active++;
             }
-            pthread_mutex_unlock(&program->clients[i].lock);
+            lock_release(&program->clients[i].lock);
         }
-        pthread_mutex_unlock(&program->clients_lock);
+        lock_release(&program->clients_lock);
 
-        // Wait for activity
-        int activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-        if (activity < 0) continue;
-
-        // Check server socket
-        if (FD_ISSET(program->endpoints[0].socket_fd, &readfds)) {
-            struct sockaddr_in client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            int new_socket = accept(program->endpoints[0].socket_fd,
-                                  (struct sockaddr*)&client_addr, 
-                                  &addr_len);
-
-            if (new_socket >= 0) {
-                if (net_add_client(program, new_socket, client_addr)) {
-                    NetworkEndpoint client_endpoint = {0};
-                    client_endpoint.socket_fd = new_socket;
-                    client_endpoint.addr = client_addr;
-                    if (program->on_connect) {
-                        program->on_connect(&client_endpoint);
-                    }
-                }
+        // A drain ends when every client has finished or the deadline passes
+        if (draining) {
+            if (active == 0 || now >= program->drain_deadline_ns) {
+                if (active > 0) log_warn("Drain deadline passed, closing %d connections mid-request", active);
+                break;
             }
+            if (wake_at == 0 || program->drain_deadline_ns < wake_at) wake_at = program->drain_deadline_ns;
+        }
+        bool finishing = any_watched;
+        struct timeval remaining, *limit = NULL;
+        if (any_queued || finishing) {
+            remaining.tv_sec = 0;
+            remaining.tv_usec = 0;
+            limit = &remaining;
+        } else if (wake_at > 0) {
+            uint64_t left_us = (wake_at - now) / 1000 + 1;
+            remaining.tv_sec = (time_t)(left_us / 1000000);
+            remaining.tv_usec = (suseconds_t)(left_us % 1000000);
+            limit = &remaining;
         }
 
-        // Check client sockets
-        pthread_mutex_lock(&program->clients_lock);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            pthread_mutex_lock(&program->clients[i].lock);
-            if (program->clients[i].is_active && 
-                FD_ISSET(program->clients[i].socket_fd, &readfds)) {
-                
-                NetworkEndpoint client_endpoint = {
-                    .socket_fd = program->clients[i].socket_fd,
-                    .addr = program->clients[i].addr
-                };
-                
-                NetworkPacket packet = {
-                    .data = buffer,
-                    .size = BUFFER_SIZE,
-                    .flags = 0
-                };
+        // Wait for activity
+        int activity = wait_ready(program, max_sd, &readfds, &writefds, limit);
+        if (activity < 0 || (activity == 0 && !any_queued && !finishing)) continue;
+        uint64_t ready = trace_clock();
 
-                ssize_t valread = net_receive(&client_endpoint, &packet);
-                
-                if (valread <= 0) {
-                    if (program->on_disconnect) {
-                        program->on_disconnect(&client_endpoint);
-                    }
-                    net_remove_client(program, program->clients[i].socket_fd);
+        if (program->wake_fds[0] > 0 && FD_ISSET(program->wake_fds[0], &readfds)) {
+            char drained[64];
+            while (read(program->wake_fds[0], drained, sizeof(drained)) > 0) {}
+        }
+        if (program->settle_fd > 0 && FD_ISSET(program->settle_fd, &readfds)) {
+            char drained[64];
+            while (read(program->settle_fd, drained, sizeof(drained)) > 0) {}
+        }
+
+        // Check server socket. A non-blocking listener is drained of up
+        // to MAX_CLIENTS pending connections per pass, a blocking one gives
+        // one, since a second accept could wait for a client not yet there.
+        if (!draining && FD_ISSET(program->endpoints[0].socket_fd, &readfds)) {
+            int accepts = program->endpoints[0].mode == NET_NONBLOCKING ? MAX_CLIENTS : 1;
+            while (accepts-- > 0 && accept_client(program)) {}
+        }
+
+        // Serve the ready clients one read each, so a client with a deep
+        // pipeline gets no more per pass than one with a single request.
+        // The pass starts one slot later each time, so no slot is always
+        // served first. With priority lanes, this only reads; the lanes
+        // then serve what every client has waiting.
+        bool lanes = program->classify && program->line_requests;
+        lock_acquire(&program->clients_lock, LOCK_CLIENTS);
+        size_t first = program->next_slot;
+        program->next_slot = (first + 1) % MAX_CLIENTS;
+        for (int n = 0; n < MAX_CLIENTS; n++) {
+            int i = (int)((first + n) % MAX_CLIENTS);
+            lock_acquire(&program->clients[i].lock, LOCK_CLIENT_SLOT);
+            NetworkTlsSession* tls = program->clients[i].tls;
+            if (program->clients[i].is_active && watched[i] &&
+                finish_draining(program, i, FD_ISSET(program->clients[i].socket_fd, &readfds))) {
+                // Closed or handed over
+            }
+            else if (program->clients[i].is_active && tls && net_tls_status(tls) != NET_TLS_DONE) {
+                if ((FD_ISSET(program->clients[i].socket_fd, &readfds) ||
+                     FD_ISSET(program->clients[i].socket_fd, &writefds)) &&
+                    net_tls_handshake(tls) == NET_TLS_FAILED) {
+                    drop_client(program, i);
+                }
+            }
+            else if (program->clients[i].is_active && program->clients[i].stream) {
+                // A failed stream ends the connection
+                if (FD_ISSET(program->clients[i].socket_fd, &writefds) &&
+                    !pump_stream(&program->clients[i])) {
+                    drop_client(program, i);
                 }
-                else if (program->on_receive) {
-                    packet.size = valread;
-                    program->on_receive(&client_endpoint, &packet);
+            }
+            else if (program->clients[i].is_active && lanes) {
+                NetworkEndpoint endpoint = client_endpoint(&program->clients[i]);
+                if (!has_request(&program->clients[i]) &&
+                    (queued[i] || FD_ISSET(program->clients[i].socket_fd, &readfds)) &&
+                    receive_input(&endpoint, &program->clients[i]) <= 0) {
+                    drop_client(program, i);
+                }
+            }
+            else if (program->clients[i].is_active && 
+                (queued[i] || FD_ISSET(program->clients[i].socket_fd, &readfds))) {
+                
+                NetworkEndpoint endpoint = client_endpoint(&program->clients[i]);
+                if (net_serve(program, &endpoint, ready) <= 0) {
+                    drop_client(program, i);
                 }
             }
-            pthread_mutex_unlock(&program->clients[i].lock);
+            lock_release(&program->clients[i].lock);
         }
-        pthread_mutex_unlock(&program->clients_lock);
+        if (lanes) serve_lanes(program, first, ready);
+        lock_release(&program->clients_lock);
     }
 
     net_cleanup_program(program);
@@ -6,9 +6,19 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include "ratelimit.h"
 
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 1024
+#define NET_PIPE_SIZE 65536        // Bytes buffered in each direction of a memory pipe
+#define NET_REQUESTS_PER_PASS 8    // Line requests served per client per net_run pass
+#define NET_STREAM_CHUNK (1024 * 1024) // Most stream bytes sent to a client per net_run pass
+#define NET_STREAM_POLL_NS 1000000 // How often a stream waiting on its producer is checked
+#define NET_STREAM_FAILED SIZE_MAX // Returned by NetworkStream.ready when no more will come
+#define NET_DEFAULT_BACKLOG 128    // listen() backlog when the tuning profile names none
+#define NET_SEND_WAIT_MS 1000      // How long a non-blocking reply waits on a full socket buffer
+#define NET_TLS_TICKET_KEY_SIZE 80 // Session ticket key file: 16 bytes name, 32 HMAC, 32 AES
+#define NET_HELD_MAX 64            // Held replies a connection may have before it is no longer read
 
 // Network types
 typedef enum {
@@ -28,24 +38,144 @@ typedef enum {
     NET_NONBLOCKING
 } NetworkMode;
 
+// Socket options for a listener and the connections it accepts. Zero
+// fields keep the kernel default. Buffer sizes and TCP_DEFER_ACCEPT are set
+// on the listener, before listen(), so accepted sockets inherit them and
+// advertise a window scale to match; the rest are set on each socket as
+// accept returns it.
+typedef struct {
+    const char* name;
+    bool nodelay;                   // TCP_NODELAY: send each reply at once instead of waiting on Nagle
+    uint32_t defer_accept_s;        // TCP_DEFER_ACCEPT: accept only once the client has sent data
+    uint32_t fastopen_queue;        // TCP_FASTOPEN: pending SYNs that may carry a request
+    int send_buffer;                // SO_SNDBUF bytes
+    int receive_buffer;             // SO_RCVBUF bytes
+    uint32_t keepalive_idle_s;      // Idle time before keepalive probes, 0 leaves keepalive off
+    uint32_t keepalive_interval_s;  // Between probes
+    uint32_t keepalive_count;       // Unanswered probes before the connection is dropped
+    int backlog;                    // Completed connections waiting for accept, 0 for NET_DEFAULT_BACKLOG
+} NetworkTuning;
+
+// Priority lanes for line requests, highest first. With a classifier set,
+// net_run serves the waiting requests of a pass lane by lane, so cheap
+// requests are not queued behind expensive ones from other connections.
+// A connection's own requests are still answered in order.
+typedef enum {
+    NET_LANE_INTERACTIVE,           // Cheap requests a client waits on
+    NET_LANE_STANDARD,              // Single mutations
+    NET_LANE_BULK,                  // Requests that touch many records
+    NET_LANE_COUNT
+} NetworkLane;
+
+// Per-lane scheduling accounting. Written by the reactor only.
+typedef struct {
+    uint64_t served;                // Requests served from the lane
+    uint64_t deferred;              // Requests left for a later pass once the lane's weight was used
+    uint32_t depth;                 // Connections waiting in the lane at the start of the last pass
+    uint32_t max_depth;             // Highest depth seen
+} NetworkLaneStats;
+
+// TLS for the connections a listener accepts (nettls.c). The context holds
+// the certificate and the resumption state every connection shares.
+typedef struct NetworkTls NetworkTls;
+typedef struct NetworkTlsSession NetworkTlsSession;
+
+// Where a connection's handshake stands
+typedef enum {
+    NET_TLS_DONE,                   // Established; application data flows
+    NET_TLS_WANT_READ,              // Waiting for the client to send
+    NET_TLS_WANT_WRITE,             // Waiting for room in the socket buffer
+    NET_TLS_FAILED
+} NetworkTlsStatus;
+
+// Handshake and offload counts of one context. Written by the reactor only.
+typedef struct {
+    uint64_t handshakes;            // Handshakes completed
+    uint64_t resumed;               // Of those, abbreviated by a session ticket or the session cache
+    uint64_t failures;              // Handshakes abandoned on an error
+    uint64_t kernel_send;           // Connections whose record encryption the kernel took over
+    uint64_t kernel_recv;           // Connections whose record decryption the kernel took over
+} NetworkTlsStats;
+
+// Bytes a connection sends after a reply, moved straight from a file into
+// the socket with sendfile(2) so they never pass through user space. The
+// file may still be growing; only the first ready(stream) bytes are sent so
+// far. Once net_stream accepts it, the stream belongs to the connection
+// until release is called, after the last byte or when the client leaves.
+typedef struct NetworkStream {
+    int fd;                         // Source file, sent from offset 0
+    size_t length;                  // Bytes to send in all
+    size_t (*ready)(struct NetworkStream* stream); // Bytes of fd complete so far, or NET_STREAM_FAILED
+    void (*release)(struct NetworkStream* stream, bool sent);
+} NetworkStream;
+
+// Whether the request behind a held reply has settled (NetworkProgram.settle)
+typedef enum {
+    NET_HELD_WAIT,                  // Not yet
+    NET_HELD_SEND,                  // Settled; the reply goes out as held
+    NET_HELD_FAILED                 // Never will; on_held_failed answers instead
+} NetworkHeldStatus;
+
+// A reply kept back until what its request did has settled, such as a log
+// write reaching disk, so the reactor serves other requests meanwhile. A
+// connection's held replies leave in order, and a reply held behind
+// another also waits for that one's ticket.
+typedef struct NetworkHeld {
+    struct NetworkHeld* next;       // Next newer reply of the connection
+    uint64_t ticket;                // What settle is asked about
+    NetworkStream* stream;          // Queued as by net_stream once the reply is sent, NULL if none
+    size_t size;                    // Bytes of data
+    char data[];
+} NetworkHeld;
+
 // Thread-safe client state
 typedef struct {
     pthread_mutex_t lock;           // Mutex for thread-safe access
     bool is_active;                 // Is this client slot active?
     int socket_fd;                  // Client socket
     struct sockaddr_in addr;        // Client address
+    RateBuckets rate;               // Per-class token buckets, reset on connect
+    uint32_t session;               // Protocol flags the layer above keeps per connection
+    char input[BUFFER_SIZE];        // Received bytes not yet served as line requests
+    size_t input_length;
+    NetworkStream* stream;          // Sent before the connection is read again, NULL if none
+    size_t stream_sent;             // Bytes of stream already sent
+    uint64_t input_ns;              // metrics_start() of the read that brought the oldest buffered request
+    bool stream_blocking;           // Socket returns to blocking sends when the stream ends
+    NetworkTlsSession* tls;         // TLS state of the connection, NULL for plaintext
+    NetworkHeld* held;              // Replies waiting to settle, oldest first
+    NetworkHeld* held_tail;         // Newest of them
+    size_t held_count;
 } ClientState;
 
-// Thread-safe endpoint structure
+struct NetworkEndpoint;
+
+// Byte transport under net_send/net_receive. Calls behave like send(2),
+// recv(2) and close(2), including MSG_DONTWAIT and errno, except that a
+// send without MSG_DONTWAIT sends everything or fails, on non-blocking
+// sockets too.
 typedef struct {
+    const char* name;
+    ssize_t (*send)(struct NetworkEndpoint* endpoint, const void* data, size_t size, int flags);
+    ssize_t (*recv)(struct NetworkEndpoint* endpoint, void* data, size_t size, int flags);
+    void (*close)(struct NetworkEndpoint* endpoint);
+} NetworkTransport;
+
+// Thread-safe endpoint structure
+typedef struct NetworkEndpoint {
     pthread_mutex_t lock;           // Mutex for thread-safe access
     char address[INET_ADDRSTRLEN];  // IP address
     uint16_t port;                  // Port number
     NetworkProtocol protocol;       // TCP/UDP
     NetworkRole role;               // Server/Client/Peer
-    NetworkMode mode;               // Blocking/Non-blocking
+    NetworkMode mode;               // Blocking/Non-blocking, for a listener also the sockets it accepts
+    const NetworkTuning* tuning;    // Socket options, NULL keeps kernel defaults
+    NetworkTls* tls;                // Serve accepted connections over TLS, NULL for plaintext
     int socket_fd;                  // Socket file descriptor
     struct sockaddr_in addr;        // Socket address
+    const NetworkTransport* transport; // NULL means net_socket_transport
+    void* channel;                  // Transport state, e.g. a memory pipe end
+    ClientState* client;            // Slot serving this endpoint in net_run, NULL elsewhere
 } NetworkEndpoint;
 
 // Network packet with thread safety
@@ -56,6 +186,23 @@ typedef struct {
     pthread_mutex_t lock;           // Mutex for thread-safe access
 } NetworkPacket;
 
+// A plaintext connection the process being replaced handed over with a
+// partial request line or requests it had not read
+typedef struct {
+    int socket_fd;
+    uint32_t session;               // Its ClientState session flags
+    size_t input_length;
+    char input[BUFFER_SIZE];        // The partial line it had buffered
+} NetworkAdoption;
+
+// Where net_run's waits for readiness went. Written by the reactor only.
+typedef struct {
+    uint64_t spin_wakeups;          // Readiness found while spinning
+    uint64_t sleep_wakeups;         // Readiness found after blocking
+    uint64_t spin_ns;               // Time spent spinning
+    uint64_t sleep_ns;              // Time spent blocked in select
+} NetworkPollStats;
+
 // Thread-safe program state
 typedef struct {
     NetworkEndpoint* endpoints;     // Array of endpoints
@@ -63,17 +210,121 @@ typedef struct {
     ClientState clients[MAX_CLIENTS]; // Array of client states
     pthread_mutex_t clients_lock;   // Mutex for client list access
     volatile bool running;          // Server running state
+    volatile bool stop_requested;   // net_stop was called, possibly before net_run
+    volatile bool draining;         // Not accepting; clients closed as they finish
+    uint64_t drain_deadline_ns;     // CLOCK_MONOTONIC time clients still mid-request are dropped
+    int wake_fds[2];                // Self-pipe that interrupts the wait in net_run
+    uint32_t busy_poll_us;          // Spin on readiness this long before blocking, 0 never spins
+    NetworkPollStats poll_stats;    // Spin-vs-sleep accounting of this reactor
+    size_t next_slot;               // Client slot the next serving pass starts at
+    bool line_requests;             // Requests end at '\n' and may share a read; else one read is one request
+    NetworkLane (*classify)(const char* request, size_t length); // Lane of a line request, NULL serves in arrival order
+    uint32_t lane_weights[NET_LANE_COUNT]; // Requests a lane may serve per pass, 0 for no limit
+    NetworkLaneStats lane_stats[NET_LANE_COUNT]; // Scheduling accounting of each lane
     void (*on_receive)(NetworkEndpoint*, NetworkPacket*);  // Receive callback
     void (*on_connect)(NetworkEndpoint*);                  // Connect callback
     void (*on_disconnect)(NetworkEndpoint*);               // Disconnect callback
+    NetworkHeldStatus (*settle)(uint64_t ticket);          // Whether a held reply may leave
+    void (*on_held_failed)(NetworkEndpoint*, NetworkHeld*); // Answers for a held reply that never settles
+    int settle_fd;                  // Readable once held replies may have settled, 0 for none
+    // While draining, takes over a plaintext client with a partial line or
+    // unread requests; true once it holds its own reference to the socket
+    bool (*hand_over)(void* ctx, NetworkEndpoint* endpoint, const char* input, size_t length,
+                      uint32_t session);
+    void* hand_over_ctx;
+    const NetworkAdoption* adopt;   // Clients net_run starts with, as handed over by a predecessor
+    size_t adopt_count;
 } NetworkProgram;
 
+// Tuning presets. Latency suits small request/response traffic such as
+// phantomid's: replies leave without Nagle delays, and idle clients are
+// found by keepalive. Throughput leaves Nagle on to coalesce back-to-back
+// replies and raises the socket buffers for bulk transfers like export.
+extern const NetworkTuning net_tuning_latency;
+extern const NetworkTuning net_tuning_throughput;
+
+// Preset by name, or NULL if there is none
+const NetworkTuning* net_tuning_find(const char* name);
+
 // Core network functions
 bool net_init(NetworkEndpoint* endpoint);
+
+// Serve an already listening socket, such as one inherited from the
+// process being replaced. Its listener options stay as its creator set
+// them; mode and the per-connection options of tuning apply from here on.
+bool net_adopt(NetworkEndpoint* endpoint, int socket_fd);
 void net_close(NetworkEndpoint* endpoint);
 ssize_t net_send(NetworkEndpoint* endpoint, NetworkPacket* packet);
 ssize_t net_receive(NetworkEndpoint* endpoint, NetworkPacket* packet);
 
+// Queue stream to follow the reply already sent on a net_run client. The
+// reactor sends it a chunk per pass as the socket drains, so other clients
+// keep being served, and reads no further requests from this client until
+// it is done. False for endpoints without a client slot or socket, in which
+// case the caller still owns the stream. sendfile has no MSG_NOSIGNAL, so
+// the process must ignore SIGPIPE.
+bool net_stream(NetworkEndpoint* endpoint, NetworkStream* stream);
+
+// Hold a reply on a net_run client until settle(ticket) lets it go, after
+// every reply the client already has held. stream, if any, follows the
+// reply as with net_stream. The reactor checks held replies each pass, so
+// whoever settles a ticket must make settle_fd readable. False for
+// endpoints without a client slot, or when out of memory, in which case
+// the caller still owns the reply and the stream.
+bool net_hold(NetworkEndpoint* endpoint, const void* data, size_t size, uint64_t ticket,
+              NetworkStream* stream);
+
+// Whether a client has replies held, which any later reply must queue behind
+bool net_holding(const NetworkEndpoint* endpoint);
+
+// Transports
+extern const NetworkTransport net_socket_transport;
+extern const NetworkTransport net_pipe_transport;
+
+// Join two endpoints with in-process pipes, one per direction, so the code
+// above net_send/net_receive runs without the kernel. Each end is released
+// by net_close.
+bool net_pipe_open(NetworkEndpoint* a, NetworkEndpoint* b);
+
+// TLS transport over a net_run client socket; channel is its
+// NetworkTlsSession. Sends wait out a full socket buffer as socket sends do.
+extern const NetworkTransport net_tls_transport;
+
+// Load a certificate chain and its private key, both PEM. TLS 1.2 and 1.3
+// are offered, with kernel TLS requested for every connection. Resumption
+// works from session tickets, and from a server-side session cache for
+// clients that do not take tickets. ticket_key_path names a file of
+// NET_TLS_TICKET_KEY_SIZE random bytes, so daemons sharing it, such as
+// the two sides of a hot restart, accept each other's tickets. NULL keys
+// tickets to this process alone. Returns NULL with the reason logged.
+NetworkTls* net_tls_create(const char* cert_path, const char* key_path, const char* ticket_key_path);
+void net_tls_free(NetworkTls* tls);
+
+// Copy of a context's counts, safe to take from any thread
+void net_tls_stats(const NetworkTls* tls, NetworkTlsStats* out);
+
+// Start the server side of a handshake on a non-blocking accepted socket.
+// The socket stays the caller's to close after net_tls_close.
+NetworkTlsSession* net_tls_accept(NetworkTls* tls, int socket_fd);
+
+// Advance the handshake as far as the socket allows. Once it is done,
+// record encryption moves into the kernel where the kernel and the
+// negotiated cipher allow it.
+NetworkTlsStatus net_tls_handshake(NetworkTlsSession* session);
+NetworkTlsStatus net_tls_status(const NetworkTlsSession* session);
+
+// Bytes OpenSSL has read from the socket but not yet returned, which
+// select cannot see
+bool net_tls_pending(const NetworkTlsSession* session);
+
+// Send up to size bytes of fd from offset, as sendfile(2) would: with
+// kernel TLS they go straight from the page cache, otherwise they are read
+// and encrypted here. -1 with errno EAGAIN when the socket is full.
+ssize_t net_tls_sendfile(NetworkTlsSession* session, int fd, off_t offset, size_t size);
+
+// Send close_notify if the socket takes it at once, and free the session
+void net_tls_close(NetworkTlsSession* session);
+
 // Client management functions
 void net_init_client_state(ClientState* state);
 void net_cleanup_client_state(ClientState* state);
@@ -85,4 +336,41 @@ void net_init_program(NetworkProgram* program);
 void net_cleanup_program(NetworkProgram* program);
 void net_run(NetworkProgram* program);
 
+// Make net_run return. Only sets a flag and writes to a pipe, so it is
+// safe from a signal handler and from any thread.
+void net_stop(NetworkProgram* program);
+
+// Stop accepting and wind down. A client with nothing buffered, held or
+// streaming is closed at once, and the others once every complete request
+// they sent is answered. With hand_over set, plaintext clients are read no
+// further: one holding a partial line, or with more on its socket, is
+// handed over instead. Other clients get until timeout_ms to finish.
+// net_run returns once no client remains.
+void net_drain(NetworkProgram* program, uint32_t timeout_ms);
+
+// Consistent copy of the reactor's spin-vs-sleep accounting, safe to take
+// from any thread
+void net_poll_stats(const NetworkProgram* program, NetworkPollStats* out);
+
+// Copy of each lane's accounting, safe to take from any thread
+void net_lane_stats(const NetworkProgram* program, NetworkLaneStats out[NET_LANE_COUNT]);
+const char* net_lane_name(NetworkLane lane);
+
+// Parse "bulk=2" into a lane and its weight
+bool net_lane_parse(const char* spec, NetworkLane* lane, uint32_t* weight);
+
+// Receive one request on a connected endpoint and pass it to on_receive, as
+// net_run does for each readable client. ready is the trace_clock() value
+// from when the endpoint became readable. Returns the net_receive result,
+// so 0 or less means the peer is gone; a non-blocking read that finds
+// nothing yet returns 1.
+//
+// With line_requests set and a client slot behind the endpoint, one read
+// may carry several requests: up to NET_REQUESTS_PER_PASS complete lines
+// are served, and the rest stay buffered for the next pass, as does a
+// line still being received. A client with buffered lines is not read
+// again until they are served.
+// Priority lanes are net_run's; here lines are served in arrival order.
+ssize_t net_serve(NetworkProgram* program, NetworkEndpoint* endpoint, uint64_t ready);
+
 #endif // NETWORK_H
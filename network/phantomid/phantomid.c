@@ -1,15 +1,140 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include "phantomid.h"
-
-#define MAX_ACCOUNTS 1000
+#include "log.h"
+#include "lockprof.h"
+#include "trace.h"
+#include "affinity.h"
 
 // Global daemon state
 static PhantomDaemon* g_daemon = NULL;
 
+// Set while the reactor dispatches a request whose reply it can hold:
+// mutations raise it to the log position to wait for instead of blocking
+static __thread uint64_t* reply_lsn = NULL;
+
+// Striped lock guarding an account slot
+static pthread_mutex_t* account_lock(PhantomDaemon* daemon, size_t slot) {
+    return &daemon->account_locks[slot % PHANTOM_LOCK_STRIPES];
+}
+
+// One account as `list` prints it
+static void print_listed(CommandOutput* out, const PhantomAccount* account) {
+    command_printf(out, "ID: %s\nCreated: %lu\nExpires: %lu\n\n",
+                   account->id, account->creation_time, account->expiry_time);
+}
+
+// Serialize accounts from the first slot until a response is full.
+// Called with state_lock held.
+static void build_list_cache(PhantomDaemon* daemon) {
+    ListCache* cache = &daemon->list_cache;
+    CommandOutput body = { .data = cache->body, .size = sizeof(cache->body) };
+    
+    cache->scanned = 0;
+    for (size_t i = 0; i < daemon->capacity && !command_full(&body); i++) {
+        lock_acquire(account_lock(daemon, i), LOCK_ACCOUNT);
+        if (daemon->accounts[i].creation_time != 0) {
+            print_listed(&body, &daemon->accounts[i]);
+            cache->scanned = i + 1;
+        }
+        lock_release(account_lock(daemon, i));
+    }
+    cache->length = body.length;
+    cache->complete = !command_full(&body);
+    cache->valid = true;
+    cache->version = daemon->version;
+}
+
+// A dump being built for `export`. The table as it stood when the export
+// began is copied into a memfd a chunk at a time. A mutation to a slot the
+// copy has not reached first appends the slot's old record and marks the
+// slot done, so the dump stays a consistent snapshot while writers carry on.
+// The builder thread and the client's stream each hold a reference.
+typedef struct PhantomExport {
+    NetworkStream stream;      // First member, so stream callbacks can cast back
+    PhantomDaemon* daemon;
+    uint64_t* done;            // Bitmap of slots at or past cursor already in the dump
+    size_t cursor;             // Slots below this are in the dump; state_lock
+    size_t written;            // Bytes in the file; state_lock
+    size_t published;          // written, for the reactor without state_lock
+    bool failed;               // A write to the file failed
+    bool abandoned;            // The client left; the builder stops early
+    int refs;
+    pthread_t builder;
+} PhantomExport;
+
+// Encode the account in slot; false for an empty slot
+static bool export_encode(const PhantomAccount* account, PhantomExportRecord* record) {
+    if (account->creation_time == 0) return false;
+    memcpy(record->seed, account->seed, sizeof(record->seed));
+    record->creation_time = account->creation_time;
+    record->expiry_time = account->expiry_time;
+    return true;
+}
+
+// Append count records to the dump. Called with state_lock held.
+static void export_write(PhantomExport* export, const PhantomExportRecord* records, size_t count) {
+    size_t size = count * sizeof(PhantomExportRecord);
+    if (count == 0 || export->failed) return;
+    
+    if (pwrite(export->stream.fd, records, size, (off_t)export->written) != (ssize_t)size) {
+        __atomic_store_n(&export->failed, true, __ATOMIC_RELEASE);
+        return;
+    }
+    export->written += size;
+    __atomic_store_n(&export->published, export->written, __ATOMIC_RELEASE);
+}
+
+// Keep a running export's view of slot before the slot changes. Called
+// with state_lock held.
+static void export_preserve(PhantomDaemon* daemon, size_t slot) {
+    PhantomExport* export = daemon->export;
+    if (!export || slot < export->cursor) return;
+    
+    uint64_t bit = 1ull << (slot % 64);
+    if (export->done[slot / 64] & bit) return;
+    export->done[slot / 64] |= bit;
+    
+    PhantomExportRecord record;
+    if (export_encode(&daemon->accounts[slot], &record)) {
+        export_write(export, &record, 1);
+    }
+}
+
+// Count a mutation of slot, which has already changed. Called with
+// state_lock held. A cached page that stops before the slot is unaffected,
+// and an account created past the end of a complete listing is appended;
+// anything else drops the cache until the next `list`.
+static void note_mutation(PhantomDaemon* daemon, size_t slot) {
+    ListCache* cache = &daemon->list_cache;
+    
+    daemon->version++;
+    if (!cache->valid) return;
+    if (slot < cache->scanned) {
+        cache->valid = false;
+        return;
+    }
+    if (cache->complete && daemon->accounts[slot].creation_time != 0) {
+        CommandOutput body = { .data = cache->body, .size = sizeof(cache->body), .length = cache->length };
+        print_listed(&body, &daemon->accounts[slot]);
+        cache->length = body.length;
+        cache->scanned = slot + 1;
+        cache->complete = !command_full(&body);
+    }
+    cache->version = daemon->version;
+    cache->patches++;
+}
+
 // Generate cryptographic seed
 static void generate_seed(uint8_t* seed) {
     RAND_bytes(seed, 32);
@@ -36,138 +161,911 @@ static void generate_id(const uint8_t* seed, char* id) {
     }
 }
 
+static void cmd_create(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    // Optional ring arc, used by the shard router
+    PhantomAccount account = {0};
+    uint64_t lo = argc > 0 ? args[0].value : 0;
+    uint64_t hi = argc > 1 ? args[1].value : 0;
+
+    if (phantom_create_account_in_range(ctx, &account, lo, hi)) {
+        command_printf(out, "\nAccount created:\nID: %s\nCreation Time: %lu\nExpiry Time: %lu\n",
+                       account.id, account.creation_time, account.expiry_time);
+    } else {
+        command_printf(out, "\nFailed to create account\n");
+    }
+}
+
+static void cmd_delete(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    if (phantom_delete_account(ctx, args[0].text)) {
+        command_printf(out, "\nAccount deleted: %s\n", args[0].text);
+    } else {
+        command_printf(out, "\nFailed to delete account or account not found\n");
+    }
+}
+
+static void cmd_lookup(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    PhantomAccount account;
+
+    if (phantom_lookup_account(ctx, args[0].text, &account)) {
+        command_printf(out, "\nID: %s\nCreated: %lu\nExpires: %lu\n",
+                       account.id, account.creation_time, account.expiry_time);
+    } else {
+        command_printf(out, "\nAccount not found\n");
+    }
+}
+
+static void cmd_list(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    PhantomDaemon* daemon = ctx;
+    ListCache* cache = &daemon->list_cache;
+
+    // Repeated listings copy the serialized records; only the count is
+    // printed afresh
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    command_printf(out, "\nActive accounts: %zu\n", daemon->account_count);
+    if (cache->valid && cache->version == daemon->version) {
+        cache->hits++;
+    } else {
+        build_list_cache(daemon);
+        cache->misses++;
+    }
+
+    size_t available;
+    char* tail = command_space(out, &available);
+    if (available > 0) {
+        size_t length = cache->length < available - 1 ? cache->length : available - 1;
+        memcpy(tail, cache->body, length);
+        tail[length] = '\0';
+        command_advance(out, length);
+    }
+    lock_release(&daemon->state_lock);
+}
+
+static void cmd_bulk_create(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    if (args[0].value == 0 || args[0].value > PHANTOM_BULK_MAX) {
+        command_printf(out, "\nBulk size must be between 1 and %d\n", PHANTOM_BULK_MAX);
+        return;
+    }
+
+    PhantomAccount* accounts = arena_alloc(out->arena, args[0].value * sizeof(PhantomAccount));
+    if (!accounts) {
+        command_printf(out, "\nOut of request memory\n");
+        return;
+    }
+
+    size_t created = phantom_create_accounts(ctx, accounts, (size_t)args[0].value);
+    command_printf(out, "\nAccounts created: %zu\n", created);
+    for (size_t i = 0; i < created; i++) {
+        command_printf(out, "%s\n", accounts[i].id);
+    }
+}
+
+static void cmd_bulk_delete(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    const char** ids = arena_alloc(out->arena, argc * sizeof(const char*));
+    if (!ids) {
+        command_printf(out, "\nOut of request memory\n");
+        return;
+    }
+
+    for (size_t i = 0; i < argc; i++) {
+        ids[i] = args[i].text;
+    }
+    command_printf(out, "\nAccounts deleted: %zu of %zu\n",
+                   phantom_delete_accounts(ctx, ids, argc), argc);
+}
+
+static void cmd_export_range(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    // Accounts on a ring arc, one per line as "<seed> <created> <expiry>"
+    PhantomAccount* accounts = arena_alloc(out->arena, PHANTOM_EXPORT_BATCH * sizeof(PhantomAccount));
+    if (!accounts) {
+        command_printf(out, "\nOut of request memory\n");
+        return;
+    }
+
+    size_t count = phantom_export_range(ctx, args[0].value, args[1].value,
+                                        accounts, PHANTOM_EXPORT_BATCH);
+
+    command_printf(out, "\nExported: %zu\n", count);
+    for (size_t i = 0; i < count; i++) {
+        for (int b = 0; b < 32; b++) {
+            command_printf(out, "%02x", accounts[i].seed[b]);
+        }
+        command_printf(out, " %lu %lu\n", accounts[i].creation_time, accounts[i].expiry_time);
+    }
+}
+
+static void cmd_export(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    uint64_t count = 0;
+
+    // The dump follows the reply on the client's socket
+    if (!out->session) {
+        command_printf(out, "\nExport needs a client connection\n");
+        return;
+    }
+    NetworkStream* stream = phantom_export(ctx, &count);
+    if (!stream) {
+        command_printf(out, "\nExport unavailable: one is already running or resources ran out\n");
+        return;
+    }
+    command_printf(out, "\nExport: %lu accounts, %zu bytes\n", count, stream->length);
+    out->stream = stream;
+}
+
+static void cmd_import(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    PhantomAccount account = {0};
+
+    memcpy(account.seed, args[0].bytes, sizeof(account.seed));
+    account.creation_time = args[1].value;
+    account.expiry_time = args[2].value;
+
+    if (account.creation_time != 0 && phantom_import_account(ctx, &account)) {
+        command_printf(out, "\nAccount imported: %s\n", account.id);
+    } else {
+        command_printf(out, "\nFailed to import account\n");
+    }
+}
+
+static void cmd_replication(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    size_t available;
+    char* tail = command_space(out, &available);
+    command_advance(out, replication_status(ctx, tail, available));
+}
+
+static void cmd_stats(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    PhantomDaemon* daemon = ctx;
+
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    command_printf(out, "\naccounts %zu\ncapacity %zu\nversion %lu\nlog_dropped %lu\n",
+                   daemon->account_count, daemon->capacity, daemon->version, log_dropped());
+    command_printf(out, "list_cache_hits %lu\nlist_cache_misses %lu\nlist_cache_patches %lu\n",
+                   daemon->list_cache.hits, daemon->list_cache.misses, daemon->list_cache.patches);
+    lock_release(&daemon->state_lock);
+    command_printf(out, "table_pages %s\narena_high_water %zu\narena_failures %lu\n",
+                   arena_pages_name(daemon->table.pages), out->arena->high_water, out->arena->failures);
+
+    const NetworkTuning* tuning = daemon->network.count > 0 ? daemon->network.endpoints[0].tuning : NULL;
+    command_printf(out, "socket_profile %s\n", tuning ? tuning->name : "none");
+
+    if (daemon->tls) {
+        NetworkTlsStats tls;
+        net_tls_stats(daemon->tls, &tls);
+        command_printf(out, "tls_handshakes %lu\ntls_resumed %lu\ntls_failures %lu\n"
+                       "tls_kernel_send %lu\ntls_kernel_recv %lu\n",
+                       tls.handshakes, tls.resumed, tls.failures, tls.kernel_send, tls.kernel_recv);
+    }
+
+    NetworkLaneStats lanes[NET_LANE_COUNT];
+    net_lane_stats(&daemon->network, lanes);
+    for (int i = 0; i < NET_LANE_COUNT && daemon->network.classify; i++) {
+        const char* name = net_lane_name(i);
+        command_printf(out, "lane_%s_weight %u\nlane_%s_depth %u\nlane_%s_max_depth %u\n"
+                       "lane_%s_served %lu\nlane_%s_deferred %lu\n",
+                       name, daemon->network.lane_weights[i], name, lanes[i].depth, name, lanes[i].max_depth,
+                       name, lanes[i].served, name, lanes[i].deferred);
+    }
+
+    NetworkPollStats poll;
+    net_poll_stats(&daemon->network, &poll);
+    command_printf(out, "busy_poll_us %u\npoll_spin_wakeups %lu\npoll_sleep_wakeups %lu\n"
+                   "poll_spin_ms %.1f\npoll_sleep_ms %.1f\n",
+                   daemon->network.busy_poll_us, poll.spin_wakeups, poll.sleep_wakeups,
+                   poll.spin_ns / 1e6, poll.sleep_ns / 1e6);
+
+    size_t available;
+    char* tail = command_space(out, &available);
+    command_advance(out, metrics_report(tail, available));
+    command_stats(&daemon->commands, out);
+}
+
+static void cmd_locks(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    size_t available;
+    char* tail = command_space(out, &available);
+    command_advance(out, lockprof_report(tail, available));
+}
+
+static void cmd_trace(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    PhantomDaemon* daemon = ctx;
+    size_t events;
+
+    if (argc == 0) {
+        if (trace_active()) {
+            command_printf(out, "\nTracing 1 in %u requests\n", trace_sample_every());
+        } else {
+            command_printf(out, "\nNot tracing\n");
+        }
+    } else if (strcmp(args[0].text, "start") == 0) {
+        trace_start(argc > 1 ? (uint32_t)args[1].value : 1);
+        command_printf(out, "\nTracing 1 in %u requests\n", trace_sample_every());
+    } else if (strcmp(args[0].text, "stop") == 0 && argc == 1) {
+        if (trace_stop(daemon->trace_path, &events)) {
+            command_printf(out, "\nWrote %zu events to %s\n", events, daemon->trace_path);
+        } else {
+            command_printf(out, "\nNo trace written\n");
+        }
+    } else {
+        command_printf(out, "\nUsage: trace [start [<every>] | stop]\n");
+    }
+}
+
+static void cmd_help(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    command_help(&((PhantomDaemon*)ctx)->commands, out);
+}
+
+static void cmd_pipeline(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    command_pipeline(out);
+}
+
+// Client command table, registered in phantom_init
+static const CommandSpec phantom_commands[] = {
+    { "create", "|xx", "[<lo> <hi>]", "Create a new anonymous account, optionally on a ring arc",
+      CMD_WRITE, cmd_create },
+    { "delete", "i", "<id>", "Delete an account by ID", CMD_WRITE, cmd_delete },
+    { "lookup", "i", "<id>", "Show one account", 0, cmd_lookup },
+    { "list", "", NULL, "List all active accounts", CMD_BULK, cmd_list },
+    { "bulk-create", "u", "<count>", "Create up to 32 accounts with one log sync",
+      CMD_WRITE | CMD_BULK, cmd_bulk_create },
+    { "bulk-delete", "i*", "<id>...", "Delete several accounts with one log sync",
+      CMD_WRITE | CMD_BULK, cmd_bulk_delete },
+    { "export-range", "xx", "<lo> <hi>", "Export accounts on a ring arc for migration",
+      CMD_BULK, cmd_export_range },
+    { "export", "", NULL, "Stream a binary snapshot of every account after the reply",
+      CMD_BULK, cmd_export },
+    { "import", "suu", "<seed> <created> <expiry>", "Import a migrated account",
+      CMD_WRITE, cmd_import },
+    { "replication", "", NULL, "Show replication role and lag", 0, cmd_replication },
+    { "stats", "", NULL, "Show counters, request rate and latency percentiles", 0, cmd_stats },
+    { "locks", "", NULL, "Show lock contention by lock class", 0, cmd_locks },
+    { "trace", "|wu", "[start [<every>] | stop]", "Capture 1 in <every> requests as a Chrome trace",
+      0, cmd_trace },
+    { "pipeline", "", NULL, "End every reply with a NUL byte so requests can be pipelined",
+      0, cmd_pipeline },
+    { "help", "", NULL, "Show this help message", 0, cmd_help },
+};
+
+// Replace a reply whose request the log lost, and rolled back
+static void print_wal_failed(CommandOutput* out) {
+    out->length = 0;
+    command_printf(out, "\nWrite-ahead log failed, the write was rolled back\n");
+    if (out->session && (*out->session & SESSION_FRAMED) && out->length < out->size) {
+        out->data[out->length++] = '\0';
+    }
+}
+
+// Network callback handlers
 static void on_client_data(NetworkEndpoint* endpoint, NetworkPacket* packet) {
     char* data = (char*)packet->data;
     data[packet->size] = '\0';
     
-    printf("Received command: %s", data);
+    log_info("Received command: %s", data);
     
-    char response[1024] = {0};
+    // Response and handler scratch come from the thread's arena and are
+    // released together once the response is sent
+    Arena* arena = arena_thread();
+    char* response = arena ? arena_alloc(arena, PHANTOM_RESPONSE_SIZE) : NULL;
+    if (!response) {
+        log_error("No request arena available");
+        return;
+    }
+    
+    CommandOutput out = {
+        .data = response,
+        .size = PHANTOM_RESPONSE_SIZE,
+        .length = 0,
+        .arena = arena,
+        .rate = endpoint->client ? &endpoint->client->rate : NULL,
+        .session = endpoint->client ? &endpoint->client->session : NULL
+    };
+    response[0] = '\0';
+    
+    // A client slot can hold the reply until the log has the request's
+    // mutations, and must once it holds any, so replies stay in order
+    uint64_t lsn = 0;
+    bool holdable = endpoint->client && g_daemon->settle_fds[1] > 0;
+    reply_lsn = holdable ? &lsn : NULL;
+    
+    uint64_t start = metrics_start();
+    uint64_t span = trace_begin();
+    command_dispatch(&g_daemon->commands, data, &out);
+    trace_end(TRACE_DISPATCH, span);
+    metrics_record(METRIC_DISPATCH, start);
+    reply_lsn = NULL;
+    
+    if ((lsn > 0 || net_holding(endpoint)) &&
+        net_hold(endpoint, response, out.length, lsn, out.stream)) {
+        arena_reset(arena);
+        return;
+    }
+    if (lsn > 0 && !wal_wait(&g_daemon->wal, lsn)) {
+        print_wal_failed(&out);
+    }
+    
+    // Send response with actual length
     NetworkPacket resp = {
         .data = response,
-        .size = sizeof(response),
+        .size = out.length,
         .flags = 0
     };
+    if (net_send(endpoint, &resp) < 0) {
+        log_warn("Failed to send response to client");
+    }
+    if (out.stream && !net_stream(endpoint, out.stream)) {
+        out.stream->release(out.stream, false);
+    }
+    arena_reset(arena);
+}
 
-    // Parse command
-    if (strncmp(data, "create", 6) == 0) {
-        PhantomAccount account = {0};
-        if (phantom_create_account(g_daemon, &account)) {
-            snprintf(response, sizeof(response), 
-                    "\nAccount created:\nID: %s\nCreation Time: %lu\nExpiry Time: %lu\n",
-                    account.id, account.creation_time, account.expiry_time);
-        } else {
-            snprintf(response, sizeof(response), "\nFailed to create account\n");
+// Re-apply a logged mutation to the account table during recovery
+static void apply_wal_record(const WalRecord* record, void* ctx) {
+    PhantomDaemon* daemon = ctx;
+    
+    if (record->slot >= daemon->capacity) {
+        log_error("WAL: record %lu targets slot %u beyond capacity",
+                record->lsn, record->slot);
+        return;
+    }
+    
+    export_preserve(daemon, record->slot);
+    PhantomAccount* slot = &daemon->accounts[record->slot];
+    if (record->type == WAL_CREATE) {
+        if (slot->creation_time == 0) {
+            daemon->account_count++;
         }
+        memcpy(slot->seed, record->seed, sizeof(slot->seed));
+        memcpy(slot->id, record->id, sizeof(record->id));
+        slot->id[64] = '\0';
+        slot->creation_time = record->creation_time;
+        slot->expiry_time = record->expiry_time;
     }
-    else if (strncmp(data, "delete", 6) == 0) {
-        // Skip "delete " and any whitespace
-        char* id = data + 6;
-        while (*id == ' ') id++;
+    else if (record->type == WAL_DELETE && slot->creation_time != 0) {
+        memset(slot, 0, sizeof(PhantomAccount));
+        daemon->account_count--;
+        if (record->slot < daemon->next_free) {
+            daemon->next_free = record->slot;
+        }
+    }
+    note_mutation(daemon, record->slot);
+}
+
+// Apply a mutation streamed from a primary
+void phantom_apply_record(PhantomDaemon* daemon, const WalRecord* record) {
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    apply_wal_record(record, daemon);
+    lock_release(&daemon->state_lock);
+}
+
+// Empty the table ahead of a full image from a primary
+void phantom_reset_accounts(PhantomDaemon* daemon) {
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    if (daemon->export) {
+        for (size_t i = daemon->export->cursor; i < daemon->capacity; i++) {
+            export_preserve(daemon, i);
+        }
+    }
+    memset(daemon->accounts, 0, daemon->capacity * sizeof(PhantomAccount));
+    daemon->account_count = 0;
+    daemon->next_free = 0;
+    note_mutation(daemon, 0);
+    lock_release(&daemon->state_lock);
+}
+
+// Publish the queued mutations the log has made durable, oldest first.
+// Called with settle_lock held.
+static void publish_durable(PhantomDaemon* daemon) {
+    while (daemon->unsettled_count > 0) {
+        const WalRecord* record = &daemon->unsettled[daemon->unsettled_head];
+        if (record->lsn > daemon->durable_lsn) break;
+        if (daemon->replication.role == REPL_PRIMARY) {
+            replication_publish(&daemon->replication, record);
+        }
+        daemon->unsettled_head = (daemon->unsettled_head + 1) % PHANTOM_UNSETTLED_RECORDS;
+        daemon->unsettled_count--;
+    }
+}
+
+// Hold an applied mutation back from replicas until the log has made it
+// durable; without a log it is published at once. Called with state_lock
+// held, so the ring fills in log order.
+static void settle_mutation(PhantomDaemon* daemon, const WalRecord* record) {
+    if (!daemon->wal_enabled) {
+        if (daemon->replication.role == REPL_PRIMARY) {
+            replication_publish(&daemon->replication, record);
+        }
+        return;
+    }
+    
+    lock_acquire(&daemon->settle_lock, LOCK_SETTLE);
+    size_t tail = (daemon->unsettled_head + daemon->unsettled_count) % PHANTOM_UNSETTLED_RECORDS;
+    daemon->unsettled[tail] = *record;
+    daemon->unsettled_count++;
+    // The flusher may already have passed this record
+    publish_durable(daemon);
+    lock_release(&daemon->settle_lock);
+}
+
+// Undo the mutations the log will never hold, newest first, so neither the
+// table nor any replica keeps a write its client was told had failed.
+// Called with state_lock and settle_lock held.
+static void roll_back_unlogged(PhantomDaemon* daemon) {
+    size_t count = daemon->unsettled_count;
+    
+    while (daemon->unsettled_count > 0) {
+        size_t last = (daemon->unsettled_head + daemon->unsettled_count - 1) % PHANTOM_UNSETTLED_RECORDS;
+        WalRecord undo = daemon->unsettled[last];
+        const PhantomAccount* slot = &daemon->accounts[undo.slot];
+        daemon->unsettled_count--;
         
-        if (phantom_delete_account(g_daemon, id)) {
-            snprintf(response, sizeof(response), "\nAccount deleted: %s\n", id);
-        } else {
-            snprintf(response, sizeof(response), "\nFailed to delete account or account not found\n");
+        if (undo.type == WAL_CREATE && slot->creation_time != 0 &&
+            memcmp(slot->id, undo.id, sizeof(undo.id)) == 0) {
+            undo.type = WAL_DELETE;
+            apply_wal_record(&undo, daemon);
+        } else if (undo.type == WAL_DELETE && slot->creation_time == 0) {
+            undo.type = WAL_CREATE;
+            apply_wal_record(&undo, daemon);
         }
     }
-    else if (strncmp(data, "list", 4) == 0) {
-        pthread_mutex_lock(&g_daemon->state_lock);
-        snprintf(response, sizeof(response), "\nActive accounts: %zu\n", g_daemon->account_count);
-        size_t offset = strlen(response);
+    log_error("WAL failed, rolled back %zu mutations it never logged; writes are refused from here on", count);
+}
+
+// Whether a reply held on log position lsn may leave
+static NetworkHeldStatus settle_reply(uint64_t lsn) {
+    PhantomDaemon* daemon = g_daemon;
+    
+    lock_acquire(&daemon->settle_lock, LOCK_SETTLE);
+    NetworkHeldStatus status = lsn <= daemon->durable_lsn ? NET_HELD_SEND :
+                               daemon->wal_failed ? NET_HELD_FAILED : NET_HELD_WAIT;
+    lock_release(&daemon->settle_lock);
+    return status;
+}
+
+static void on_held_failed(NetworkEndpoint* endpoint, NetworkHeld* held) {
+    char response[128];
+    CommandOutput out = {
+        .data = response,
+        .size = sizeof(response),
+        .session = &endpoint->client->session
+    };
+    print_wal_failed(&out);
+    
+    NetworkPacket resp = {
+        .data = response,
+        .size = out.length,
+        .flags = 0
+    };
+    if (net_send(endpoint, &resp) < 0) {
+        log_warn("Failed to send response to client");
+    }
+}
+
+// Flusher callback: publish what became durable, or roll back what never will
+static void on_wal_flush(void* ctx, uint64_t durable_lsn, bool failed) {
+    PhantomDaemon* daemon = ctx;
+    
+    if (failed) lock_acquire(&daemon->state_lock, LOCK_STATE);
+    lock_acquire(&daemon->settle_lock, LOCK_SETTLE);
+    daemon->durable_lsn = durable_lsn;
+    publish_durable(daemon);
+    if (failed && !daemon->wal_failed) {
+        roll_back_unlogged(daemon);
+        daemon->wal_failed = true;
+    }
+    lock_release(&daemon->settle_lock);
+    if (failed) lock_release(&daemon->state_lock);
+    
+    // Replies held on the log may leave now
+    if (daemon->settle_fds[1] > 0) {
+        char byte = 1;
+        ssize_t ignored = write(daemon->settle_fds[1], &byte, 1);
+        (void)ignored;
+    }
+}
+
+// Copy one chunk of the table for a checkpoint. state_lock excludes every
+// mutator, so each chunk is internally consistent and writers only wait for
+// a single chunk at a time.
+static size_t copy_accounts(void* ctx, size_t first, size_t count, void* dst, size_t* first_free) {
+    PhantomDaemon* daemon = ctx;
+    PhantomAccount* out = dst;
+    size_t occupied = 0;
+    
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    memcpy(out, &daemon->accounts[first], count * sizeof(PhantomAccount));
+    lock_release(&daemon->state_lock);
+    
+    for (size_t i = 0; i < count; i++) {
+        if (out[i].creation_time != 0) {
+            occupied++;
+        } else if (*first_free == SIZE_MAX) {
+            *first_free = first + i;
+        }
+    }
+    
+    // Mutations copied from later chunks must be durable in the log before
+    // the snapshot replaces the old one; a failed log may be rolling some back
+    if (first + count == daemon->capacity && daemon->wal_enabled) {
+        uint64_t lsn = wal_last_lsn(&daemon->wal);
+        if (lsn > 0 && !wal_wait(&daemon->wal, lsn)) {
+            log_error("Checkpoint abandoned: the WAL failed before its mutations were durable");
+            return SNAPSHOT_COPY_FAILED;
+        }
+    }
+    
+    return occupied;
+}
+
+// Background checkpoint loop
+static void* checkpoint_thread(void* arg) {
+    PhantomDaemon* daemon = arg;
+    affinity_apply(THREAD_CHECKPOINT);
+    
+    lock_acquire(&daemon->checkpoint_lock, LOCK_CHECKPOINT);
+    while (daemon->checkpoint_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += daemon->checkpoint_interval_s;
+        lock_cond_timedwait(&daemon->checkpoint_cond, &daemon->checkpoint_lock, &deadline);
+        if (!daemon->checkpoint_running) break;
+        lock_release(&daemon->checkpoint_lock);
         
-        for (size_t i = 0; i < MAX_ACCOUNTS; i++) {
-            pthread_mutex_lock(&g_daemon->accounts[i].lock);
-            if (g_daemon->accounts[i].creation_time != 0) {
-                offset += snprintf(response + offset, sizeof(response) - offset,
-                        "ID: %s\nCreated: %lu\nExpires: %lu\n\n",
-                        g_daemon->accounts[i].id,
-                        g_daemon->accounts[i].creation_time,
-                        g_daemon->accounts[i].expiry_time);
-            }
-            pthread_mutex_unlock(&g_daemon->accounts[i].lock);
+        lock_acquire(&daemon->state_lock, LOCK_STATE);
+        bool changed = daemon->version != daemon->checkpoint_version;
+        lock_release(&daemon->state_lock);
+        
+        if (changed) {
+            phantom_checkpoint(daemon);
         }
-        pthread_mutex_unlock(&g_daemon->state_lock);
+        lock_acquire(&daemon->checkpoint_lock, LOCK_CHECKPOINT);
     }
-    else if (strncmp(data, "help", 4) == 0) {
-        snprintf(response, sizeof(response),
-                "\nAvailable commands:\n"
-                "create - Create a new anonymous account\n"
-                "delete <id> - Delete an account by ID\n"
-                "list - List all active accounts\n"
-                "help - Show this help message\n"
-                "quit - Disconnect from server\n\n");
+    lock_release(&daemon->checkpoint_lock);
+    
+    return NULL;
+}
+
+// Append to a scrape, stopping quietly once out is full
+static void scrape_append(char* out, size_t size, size_t* length, const char* format, ...) {
+    if (*length >= size) return;
+    
+    va_list ap;
+    va_start(ap, format);
+    int written = vsnprintf(out + *length, size - *length, format, ap);
+    va_end(ap);
+    if (written > 0) *length += (size_t)written;
+}
+
+// Table gauges appended to each Prometheus scrape
+static size_t scrape_gauges(void* ctx, char* out, size_t size) {
+    PhantomDaemon* daemon = ctx;
+    NetworkPollStats poll;
+    net_poll_stats(&daemon->network, &poll);
+    
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    int written = snprintf(out, size,
+                           "# TYPE phantomid_accounts gauge\nphantomid_accounts %zu\n"
+                           "# TYPE phantomid_capacity gauge\nphantomid_capacity %zu\n"
+                           "# TYPE phantomid_mutations_total counter\nphantomid_mutations_total %lu\n"
+                           "# TYPE phantomid_log_dropped_total counter\nphantomid_log_dropped_total %lu\n"
+                           "# TYPE phantomid_poll_wakeups_total counter\n"
+                           "phantomid_poll_wakeups_total{mode=\"spin\"} %lu\n"
+                           "phantomid_poll_wakeups_total{mode=\"sleep\"} %lu\n"
+                           "# TYPE phantomid_poll_seconds_total counter\n"
+                           "phantomid_poll_seconds_total{mode=\"spin\"} %.6f\n"
+                           "phantomid_poll_seconds_total{mode=\"sleep\"} %.6f\n",
+                           daemon->account_count, daemon->capacity, daemon->version, log_dropped(),
+                           poll.spin_wakeups, poll.sleep_wakeups, poll.spin_ns / 1e9, poll.sleep_ns / 1e9);
+    lock_release(&daemon->state_lock);
+    if (written < 0) return 0;
+    
+    // Counted by the reactor as it dispatches
+    const CommandRegistry* commands = &daemon->commands;
+    size_t length = (size_t)written;
+    bool typed = false;
+    for (int i = 0; i < RATE_CLASS_COUNT && length < size; i++) {
+        if (commands->limits[i].rate == 0) continue;
+        const char* name = ratelimit_class_name(i);
+        written = snprintf(out + length, size - length,
+                           "%sphantomid_rate_limited_total{class=\"%s\",action=\"defer\"} %lu\n"
+                           "phantomid_rate_limited_total{class=\"%s\",action=\"reject\"} %lu\n",
+                           typed ? "" : "# TYPE phantomid_rate_limited_total counter\n", name,
+                           __atomic_load_n(&commands->rate_deferred[i], __ATOMIC_RELAXED), name,
+                           __atomic_load_n(&commands->rate_rejected[i], __ATOMIC_RELAXED));
+        if (written < 0) break;
+        length += (size_t)written;
+        typed = true;
     }
-    else {
-        snprintf(response, sizeof(response), 
-                "\nUnknown command. Type 'help' for available commands.\n");
+    
+    if (daemon->tls) {
+        NetworkTlsStats tls;
+        net_tls_stats(daemon->tls, &tls);
+        scrape_append(out, size, &length,
+                      "# TYPE phantomid_tls_handshakes_total counter\nphantomid_tls_handshakes_total %lu\n"
+                      "# TYPE phantomid_tls_resumed_total counter\nphantomid_tls_resumed_total %lu\n"
+                      "# TYPE phantomid_tls_failures_total counter\nphantomid_tls_failures_total %lu\n",
+                      tls.handshakes, tls.resumed, tls.failures);
     }
     
-    // Send response with actual length
-    resp.size = strlen(response);
-    if (net_send(endpoint, &resp) < 0) {
-        printf("Failed to send response to client\n");
+    // Each family's samples must be contiguous in the exposition format
+    if (daemon->network.classify) {
+        NetworkLaneStats lanes[NET_LANE_COUNT];
+        net_lane_stats(&daemon->network, lanes);
+        scrape_append(out, size, &length, "# TYPE phantomid_lane_depth gauge\n");
+        for (int i = 0; i < NET_LANE_COUNT; i++) {
+            scrape_append(out, size, &length, "phantomid_lane_depth{lane=\"%s\"} %u\n",
+                          net_lane_name(i), lanes[i].depth);
+        }
+        scrape_append(out, size, &length, "# TYPE phantomid_lane_served_total counter\n");
+        for (int i = 0; i < NET_LANE_COUNT; i++) {
+            scrape_append(out, size, &length, "phantomid_lane_served_total{lane=\"%s\"} %lu\n",
+                          net_lane_name(i), lanes[i].served);
+        }
+        scrape_append(out, size, &length, "# TYPE phantomid_lane_deferred_total counter\n");
+        for (int i = 0; i < NET_LANE_COUNT; i++) {
+            scrape_append(out, size, &length, "phantomid_lane_deferred_total{lane=\"%s\"} %lu\n",
+                          net_lane_name(i), lanes[i].deferred);
+        }
     }
+    
+    return length < size ? length : size - 1;
 }
 
 // Network callbacks
+
+// Priority lane of a request, from the rate class of its command
+static NetworkLane classify_request(const char* request, size_t length) {
+    switch (command_classify(&g_daemon->commands, request, length)) {
+    case RATE_WRITE:
+        return NET_LANE_STANDARD;
+    case RATE_BULK:
+        return NET_LANE_BULK;
+    default:
+        return NET_LANE_INTERACTIVE;
+    }
+}
+
 static void on_client_connect(NetworkEndpoint* endpoint) {
-    printf("New client connected for account creation\n");
+    log_info("New client connected for account creation");
 }
 
 static void on_client_disconnect(NetworkEndpoint* endpoint) {
-    printf("Client disconnected\n");
+    log_info("Client disconnected");
+}
+
+static void close_settle_pipe(PhantomDaemon* daemon) {
+    if (daemon->settle_fds[0] > 0) {
+        close(daemon->settle_fds[0]);
+        close(daemon->settle_fds[1]);
+        daemon->settle_fds[0] = daemon->settle_fds[1] = 0;
+    }
+}
+
+// Flush and close the log, if there is one
+static void close_wal(PhantomDaemon* daemon) {
+    if (!daemon->wal_enabled) return;
+    wal_close(&daemon->wal);
+    close_settle_pipe(daemon);
+    free(daemon->unsettled);
+    daemon->unsettled = NULL;
+    daemon->wal_enabled = false;
 }
 
-bool phantom_init(PhantomDaemon* daemon, uint16_t port) {
+bool phantom_init(PhantomDaemon* daemon, const PhantomConfig* config) {
+    struct timespec load_start, load_end;
+    
     g_daemon = daemon;  // Store global reference
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
     
     pthread_mutex_init(&daemon->state_lock, NULL);
+    pthread_mutex_init(&daemon->settle_lock, NULL);
+    for (int i = 0; i < PHANTOM_LOCK_STRIPES; i++) {
+        pthread_mutex_init(&daemon->account_locks[i], NULL);
+    }
     
-    daemon->accounts = calloc(MAX_ACCOUNTS, sizeof(PhantomAccount));
-    if (!daemon->accounts) return false;
-    
-    for (int i = 0; i < MAX_ACCOUNTS; i++) {
-        pthread_mutex_init(&daemon->accounts[i].lock, NULL);
+    // Map the account table, backed by the last snapshot if there is one
+    size_t capacity = config->max_accounts ? config->max_accounts : PHANTOM_DEFAULT_CAPACITY;
+    if (!snapshot_map(config->snapshot_path, sizeof(PhantomAccount), capacity,
+                      config->huge_pages, &daemon->table)) {
+        return false;
+    }
+    if (config->huge_pages && daemon->table.pages == ARENA_PAGES_DEFAULT) {
+        log_warn("Huge pages unavailable, account table uses base pages");
     }
+    log_info("Account table: %zu slots, %zu MB on %s pages", daemon->table.capacity,
+             daemon->table.length >> 20, arena_pages_name(daemon->table.pages));
     
-    daemon->account_count = 0;
+    daemon->accounts = daemon->table.records;
+    daemon->capacity = daemon->table.capacity;
+    daemon->account_count = daemon->table.header.record_count;
+    daemon->next_free = daemon->table.header.next_free;
+    daemon->version = 0;
+    daemon->checkpoint_version = 0;
+    daemon->list_cache.valid = false;
+    daemon->snapshot_path = config->snapshot_path;
+    daemon->trace_path = config->trace_path ? config->trace_path : TRACE_DEFAULT_PATH;
+    daemon->checkpoint_interval_s = config->checkpoint_interval_s ? config->checkpoint_interval_s : 60;
     daemon->running = true;
     
+    // Replay log records newer than the snapshot
+    daemon->wal_enabled = false;
+    if (config->wal_path) {
+        daemon->unsettled = calloc(PHANTOM_UNSETTLED_RECORDS, sizeof(WalRecord));
+        if (!daemon->unsettled || !wal_open(&daemon->wal, config->wal_path, config->wal_commit_window_us)) {
+            free(daemon->unsettled);
+            snapshot_unmap(&daemon->table);
+            return false;
+        }
+        daemon->unsettled_head = 0;
+        daemon->unsettled_count = 0;
+        daemon->wal_failed = false;
+        if (pipe2(daemon->settle_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            log_warn("No settle pipe, replies wait for the log on the reactor: %s", strerror(errno));
+            daemon->settle_fds[0] = daemon->settle_fds[1] = 0;
+        }
+        wal_on_flush(&daemon->wal, on_wal_flush, daemon);
+        if (!wal_replay(&daemon->wal, daemon->table.header.wal_lsn, apply_wal_record, daemon) ||
+            !wal_start(&daemon->wal)) {
+            wal_close(&daemon->wal);
+            close_settle_pipe(daemon);
+            free(daemon->unsettled);
+            snapshot_unmap(&daemon->table);
+            return false;
+        }
+        daemon->durable_lsn = wal_last_lsn(&daemon->wal);
+        daemon->wal_enabled = true;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &load_end);
+    if (config->wal_path || config->snapshot_path) {
+        log_info("Loaded %zu accounts (capacity %zu) in %.3f ms",
+               daemon->account_count, daemon->capacity,
+               (load_end.tv_sec - load_start.tv_sec) * 1e3 +
+               (load_end.tv_nsec - load_start.tv_nsec) / 1e6);
+    }
+    
+    // Start streaming to replicas, or following a primary
+    daemon->replication.role = REPL_NONE;
+    if (config->replication_port &&
+        !replication_start_primary(daemon, config->replication_port)) {
+        close_wal(daemon);
+        snapshot_unmap(&daemon->table);
+        return false;
+    }
+    if (config->primary_host &&
+        !replication_start_replica(daemon, config->primary_host, config->primary_port)) {
+        close_wal(daemon);
+        snapshot_unmap(&daemon->table);
+        return false;
+    }
+    
+    // Start periodic checkpoints
+    daemon->checkpoint_running = false;
+    pthread_mutex_init(&daemon->checkpoint_lock, NULL);
+    pthread_cond_init(&daemon->checkpoint_cond, NULL);
+    if (daemon->snapshot_path) {
+        daemon->checkpoint_running = true;
+        if (pthread_create(&daemon->checkpointer, NULL, checkpoint_thread, daemon) != 0) {
+            daemon->checkpoint_running = false;
+            replication_stop(daemon);
+            close_wal(daemon);
+            snapshot_unmap(&daemon->table);
+            return false;
+        }
+    }
+    
+    // Serve latency histograms and table gauges to Prometheus
+    if (config->metrics_port && !metrics_serve(config->metrics_port, scrape_gauges, daemon)) {
+        phantom_cleanup(daemon);
+        return false;
+    }
+    
+    // Build the client command table
+    command_init(&daemon->commands, daemon);
+    if (!command_register_all(&daemon->commands, phantom_commands,
+                              sizeof(phantom_commands) / sizeof(phantom_commands[0]))) {
+        phantom_cleanup(daemon);
+        return false;
+    }
+    if (daemon->replication.role == REPL_REPLICA) {
+        daemon->commands.write_denied = "\nRead-only replica, send writes to the primary\n";
+    }
+    memcpy(daemon->commands.limits, config->rate_limits, sizeof(daemon->commands.limits));
+    daemon->commands.rate_reject = config->rate_reject;
+    if (config->lanes) daemon->network.classify = classify_request;
+    memcpy(daemon->network.lane_weights, config->lane_weights, sizeof(daemon->network.lane_weights));
+    
+    // Request handling; net_run calls these for socket clients, and
+    // benchmarks call net_serve with memory-pipe endpoints
+    daemon->network.on_connect = on_client_connect;
+    daemon->network.on_disconnect = on_client_disconnect;
+    daemon->network.on_receive = on_client_data;
+    daemon->network.busy_poll_us = config->busy_poll_us;
+    daemon->network.line_requests = true;
+    daemon->network.settle = settle_reply;
+    daemon->network.on_held_failed = on_held_failed;
+    daemon->network.settle_fd = daemon->settle_fds[0];
+    
+    // Without a port the store runs on its own, as in the benchmarks
+    if (config->port == 0) return true;
+    
     // Initialize network server with provided port
     NetworkEndpoint server = {
         .address = "0.0.0.0",
-        .port = port,
+        .port = config->port,
         .protocol = NET_TCP,
         .role = NET_SERVER,
-        .mode = NET_BLOCKING
+        .mode = NET_NONBLOCKING,
+        .tuning = config->socket_tuning
     };
     
     daemon->network.endpoints = malloc(sizeof(NetworkEndpoint));
     if (!daemon->network.endpoints) {
-        free(daemon->accounts);
+        phantom_cleanup(daemon);
         return false;
     }
     
     memcpy(daemon->network.endpoints, &server, sizeof(NetworkEndpoint));
     daemon->network.count = 1;
-    daemon->network.on_connect = on_client_connect;
-    daemon->network.on_disconnect = on_client_disconnect;
-    daemon->network.on_receive = on_client_data;
     
+    if (config->tls_cert_path) {
+        daemon->tls = net_tls_create(config->tls_cert_path, config->tls_key_path,
+                                     config->tls_ticket_key_path);
+        if (!daemon->tls) {
+            phantom_cleanup(daemon);
+            return false;
+        }
+        daemon->network.endpoints[0].tls = daemon->tls;
+        log_info("Serving clients over TLS with certificate %s", config->tls_cert_path);
+    }
+    
+    // A hot restart keeps serving the listener of the daemon it replaces
+    if (config->listen_fd > 0) {
+        return net_adopt(daemon->network.endpoints, config->listen_fd);
+    }
     return net_init(daemon->network.endpoints);
 }
 
 void phantom_cleanup(PhantomDaemon* daemon) {
-    pthread_mutex_lock(&daemon->state_lock);
+    metrics_stop();
+    
+    // Stop replication before the table it reads from goes away
+    replication_stop(daemon);
+    
+    // Stop the checkpoint thread and capture anything it has not seen yet
+    lock_acquire(&daemon->checkpoint_lock, LOCK_CHECKPOINT);
+    bool checkpointing = daemon->checkpoint_running;
+    daemon->checkpoint_running = false;
+    pthread_cond_signal(&daemon->checkpoint_cond);
+    lock_release(&daemon->checkpoint_lock);
+    
+    if (checkpointing) {
+        pthread_join(daemon->checkpointer, NULL);
+        if (daemon->version != daemon->checkpoint_version) {
+            phantom_checkpoint(daemon);
+        }
+    }
+    pthread_cond_destroy(&daemon->checkpoint_cond);
+    pthread_mutex_destroy(&daemon->checkpoint_lock);
+    
+    // An export builder lets go of the table at its next chunk
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    while (daemon->export) {
+        __atomic_store_n(&daemon->export->abandoned, true, __ATOMIC_RELEASE);
+        lock_release(&daemon->state_lock);
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+        lock_acquire(&daemon->state_lock, LOCK_STATE);
+    }
     daemon->running = false;
+    lock_release(&daemon->state_lock);
+    
+    // Flush and close the log before the table goes away. The flusher
+    // takes state_lock to roll back a batch it fails to write.
+    close_wal(daemon);
+    pthread_mutex_destroy(&daemon->settle_lock);
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
     
     // Cleanup accounts
-    for (size_t i = 0; i < MAX_ACCOUNTS; i++) {
-        pthread_mutex_lock(&daemon->accounts[i].lock);
-        memset(&daemon->accounts[i], 0, sizeof(PhantomAccount));
-        pthread_mutex_unlock(&daemon->accounts[i].lock);
-        pthread_mutex_destroy(&daemon->accounts[i].lock);
+    snapshot_unmap(&daemon->table);
+    daemon->accounts = NULL;
+    daemon->account_count = 0;
+    for (int i = 0; i < PHANTOM_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&daemon->account_locks[i]);
     }
     
     // Cleanup network endpoints
@@ -177,66 +1075,469 @@ void phantom_cleanup(PhantomDaemon* daemon) {
             net_close(&daemon->network.endpoints[i]);
         }
         free(daemon->network.endpoints);
+        daemon->network.endpoints = NULL;
     }
+    net_tls_free(daemon->tls);
+    daemon->tls = NULL;
     
-    free(daemon->accounts);
-    pthread_mutex_unlock(&daemon->state_lock);
+    lock_release(&daemon->state_lock);
     pthread_mutex_destroy(&daemon->state_lock);
     
     g_daemon = NULL;
 }
 
+// Write a snapshot of the table and drop the log records it covers
+bool phantom_checkpoint(PhantomDaemon* daemon) {
+    if (!daemon->snapshot_path) return false;
+    
+    // Every record up to start_lsn is already applied to the table
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    uint64_t version = daemon->version;
+    uint64_t start_lsn = daemon->wal_enabled ? wal_last_lsn(&daemon->wal) : 0;
+    lock_release(&daemon->state_lock);
+    
+    if (!snapshot_write(daemon->snapshot_path, sizeof(PhantomAccount), daemon->capacity,
+                        start_lsn, copy_accounts, daemon)) {
+        return false;
+    }
+    daemon->checkpoint_version = version;
+    
+    if (daemon->wal_enabled) {
+        wal_compact(&daemon->wal, start_lsn);
+    }
+    return true;
+}
 
-bool phantom_create_account(PhantomDaemon* daemon, PhantomAccount* account) {
-    bool success = false;
-    
-    pthread_mutex_lock(&daemon->state_lock);
-    if (daemon->account_count < MAX_ACCOUNTS) {
-        for (size_t i = 0; i < MAX_ACCOUNTS; i++) {
-            pthread_mutex_lock(&daemon->accounts[i].lock);
-            if (daemon->accounts[i].creation_time == 0) {  // Found empty slot
-                // Generate new account
-                generate_seed(account->seed);
-                generate_id(account->seed, account->id);
-                account->creation_time = time(NULL);
-                account->expiry_time = account->creation_time + (90 * 24 * 60 * 60); // 90 days
-                
-                // Copy to daemon storage
-                memcpy(&daemon->accounts[i], account, sizeof(PhantomAccount));
-                daemon->account_count++;
-                success = true;
-                pthread_mutex_unlock(&daemon->accounts[i].lock);
-                break;
+// Take state_lock on a request path, tracing the wait
+static void lock_state(PhantomDaemon* daemon) {
+    uint64_t span = trace_begin();
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    trace_end(TRACE_STATE_LOCK, span);
+}
+
+// Wait for the group commit covering lsn, tracing the wait. A reply the
+// reactor holds waits instead, so the loop goes on to other requests and
+// they join the same commit.
+static bool wait_durable(PhantomDaemon* daemon, uint64_t lsn) {
+    if (reply_lsn) {
+        if (lsn > *reply_lsn) *reply_lsn = lsn;
+        return true;
+    }
+    
+    uint64_t span = trace_begin();
+    bool success = wal_wait(&daemon->wal, lsn);
+    trace_end(TRACE_WAL_WAIT, span);
+    return success;
+}
+
+// Place a fully generated account in the first free slot, log it and queue
+// it for replicas.
+// Called with state_lock held; *lsn receives the log position to wait for.
+static bool store_account_locked(PhantomDaemon* daemon, const PhantomAccount* account, uint64_t* lsn) {
+    if (daemon->account_count >= daemon->capacity) return false;
+    
+    for (size_t i = daemon->next_free; i < daemon->capacity; i++) {
+        lock_acquire(account_lock(daemon, i), LOCK_ACCOUNT);
+        if (daemon->accounts[i].creation_time == 0) {  // Found empty slot
+            WalRecord record = {
+                .type = WAL_CREATE,
+                .slot = (uint32_t)i,
+                .creation_time = account->creation_time,
+                .expiry_time = account->expiry_time
+            };
+            memcpy(record.seed, account->seed, sizeof(record.seed));
+            memcpy(record.id, account->id, sizeof(record.id));
+            
+            // Log before applying so LSN order matches table order
+            if (daemon->wal_enabled) {
+                *lsn = wal_append(&daemon->wal, &record);
+                if (*lsn == 0) {
+                    lock_release(account_lock(daemon, i));
+                    return false;
+                }
             }
-            pthread_mutex_unlock(&daemon->accounts[i].lock);
+            
+            // Copy to daemon storage
+            export_preserve(daemon, i);
+            memcpy(&daemon->accounts[i], account, sizeof(PhantomAccount));
+            daemon->account_count++;
+            daemon->next_free = i + 1;
+            note_mutation(daemon, i);
+            settle_mutation(daemon, &record);
+            lock_release(account_lock(daemon, i));
+            return true;
         }
+        lock_release(account_lock(daemon, i));
+    }
+    return false;
+}
+
+static bool store_account(PhantomDaemon* daemon, const PhantomAccount* account) {
+    uint64_t lsn = 0;
+    
+    lock_state(daemon);
+    uint64_t span = trace_begin();
+    bool success = store_account_locked(daemon, account, &lsn);
+    trace_end(TRACE_STORE, span);
+    lock_release(&daemon->state_lock);
+    
+    // Wait for the group commit outside state_lock so concurrent
+    // mutations can share the same fdatasync
+    if (success && daemon->wal_enabled) {
+        success = wait_durable(daemon, lsn);
     }
-    pthread_mutex_unlock(&daemon->state_lock);
     
     return success;
 }
 
-bool phantom_delete_account(PhantomDaemon* daemon, const char* id) {
-    bool success = false;
+// Ring position of an account: the first 64 bits of its SHA-256 ID
+uint64_t phantom_ring_position(const char* id) {
+    uint64_t position = 0;
+    for (int i = 0; i < 16 && id[i]; i++) {
+        char c = id[i];
+        uint64_t nibble = c >= 'a' ? (uint64_t)(c - 'a' + 10) :
+                          c >= 'A' ? (uint64_t)(c - 'A' + 10) : (uint64_t)(c - '0');
+        position = (position << 4) | (nibble & 0xf);
+    }
+    return position;
+}
+
+// Half-open ring arc [lo, hi), wrapping when lo > hi; lo == hi is the whole ring
+bool phantom_in_range(uint64_t position, uint64_t lo, uint64_t hi) {
+    if (lo == hi) return true;
+    if (lo < hi) return position >= lo && position < hi;
+    return position >= lo || position < hi;
+}
+
+bool phantom_create_account(PhantomDaemon* daemon, PhantomAccount* account) {
+    return phantom_create_account_in_range(daemon, account, 0, 0);
+}
+
+// Create several accounts under one hold of state_lock and wait once for
+// the log; returns how many were stored, in order, at the front of accounts
+size_t phantom_create_accounts(PhantomDaemon* daemon, PhantomAccount* accounts, size_t count) {
+    uint64_t lsn = 0;
+    size_t created = 0;
+    
+    uint64_t span = trace_begin();
+    for (size_t i = 0; i < count; i++) {
+        generate_seed(accounts[i].seed);
+        generate_id(accounts[i].seed, accounts[i].id);
+        accounts[i].creation_time = time(NULL);
+        accounts[i].expiry_time = accounts[i].creation_time + (90 * 24 * 60 * 60); // 90 days
+    }
+    trace_end(TRACE_CRYPTO, span);
+    
+    lock_state(daemon);
+    span = trace_begin();
+    while (created < count && store_account_locked(daemon, &accounts[created], &lsn)) {
+        created++;
+    }
+    trace_end(TRACE_STORE, span);
+    lock_release(&daemon->state_lock);
+    
+    if (created > 0 && daemon->wal_enabled && !wait_durable(daemon, lsn)) {
+        return 0;
+    }
+    return created;
+}
+
+// Create an account whose ID falls on the given ring arc. Seeds are redrawn
+// until the ID lands in range, which takes 1/(arc share) tries on average.
+bool phantom_create_account_in_range(PhantomDaemon* daemon, PhantomAccount* account,
+                                     uint64_t lo, uint64_t hi) {
+    size_t attempts = 0;
+    uint64_t start = metrics_start();
+    uint64_t span = trace_begin();
+    
+    do {
+        if (attempts++ == PHANTOM_MAX_ID_ATTEMPTS) return false;
+        generate_seed(account->seed);
+        generate_id(account->seed, account->id);
+    } while (!phantom_in_range(phantom_ring_position(account->id), lo, hi));
+    trace_end(TRACE_CRYPTO, span);
+    
+    account->creation_time = time(NULL);
+    account->expiry_time = account->creation_time + (90 * 24 * 60 * 60); // 90 days
+    
+    bool success = store_account(daemon, account);
+    metrics_record(METRIC_CREATE, start);
+    return success;
+}
+
+// Store an account migrated from another shard; its ID is re-derived from
+// the seed, and importing an account that already exists succeeds
+bool phantom_import_account(PhantomDaemon* daemon, PhantomAccount* account) {
+    uint64_t lsn = 0;
+    bool success = true;
+
+    generate_id(account->seed, account->id);
+    
+    // Check and insert under one hold so concurrent imports of the same
+    // account cannot both find it missing
+    lock_state(daemon);
+    bool present = false;
+    for (size_t i = 0; i < daemon->capacity && !present; i++) {
+        present = daemon->accounts[i].creation_time != 0 &&
+                  strcmp(daemon->accounts[i].id, account->id) == 0;
+    }
+    if (!present) {
+        uint64_t span = trace_begin();
+        success = store_account_locked(daemon, account, &lsn);
+        trace_end(TRACE_STORE, span);
+    }
+    lock_release(&daemon->state_lock);
+    
+    if (success && lsn && daemon->wal_enabled) {
+        success = wait_durable(daemon, lsn);
+    }
+    
+    return success;
+}
+
+// Copy up to max accounts whose IDs fall on the ring arc [lo, hi)
+size_t phantom_export_range(PhantomDaemon* daemon, uint64_t lo, uint64_t hi,
+                            PhantomAccount* out, size_t max) {
+    size_t found = 0;
     
-    pthread_mutex_lock(&daemon->state_lock);
-    for (size_t i = 0; i < MAX_ACCOUNTS; i++) {
-        pthread_mutex_lock(&daemon->accounts[i].lock);
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    for (size_t i = 0; i < daemon->capacity && found < max; i++) {
+        lock_acquire(account_lock(daemon, i), LOCK_ACCOUNT);
+        if (daemon->accounts[i].creation_time != 0 &&
+            phantom_in_range(phantom_ring_position(daemon->accounts[i].id), lo, hi)) {
+            out[found++] = daemon->accounts[i];
+        }
+        lock_release(account_lock(daemon, i));
+    }
+    lock_release(&daemon->state_lock);
+    
+    return found;
+}
+
+static void export_unref(PhantomExport* export) {
+    if (__atomic_sub_fetch(&export->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    close(export->stream.fd);
+    free(export->done);
+    free(export);
+}
+
+static size_t export_ready(NetworkStream* stream) {
+    PhantomExport* export = (PhantomExport*)stream;
+    if (__atomic_load_n(&export->failed, __ATOMIC_ACQUIRE)) return NET_STREAM_FAILED;
+    return __atomic_load_n(&export->published, __ATOMIC_ACQUIRE);
+}
+
+static void export_release(NetworkStream* stream, bool sent) {
+    PhantomExport* export = (PhantomExport*)stream;
+    if (sent) {
+        log_info("Export of %zu bytes sent", stream->length);
+    } else {
+        log_warn("Export abandoned after %zu of %zu bytes", export_ready(stream), stream->length);
+    }
+    __atomic_store_n(&export->abandoned, true, __ATOMIC_RELEASE);
+    export_unref(export);
+}
+
+// Copy the table into the dump one chunk per hold of state_lock, so
+// writers wait for at most one chunk
+static void* build_export(void* arg) {
+    PhantomExport* export = arg;
+    PhantomDaemon* daemon = export->daemon;
+    PhantomExportRecord* batch = malloc(SNAPSHOT_CHUNK_RECORDS * sizeof(PhantomExportRecord));
+    
+    for (size_t first = 0; batch && first < daemon->capacity; first += SNAPSHOT_CHUNK_RECORDS) {
+        if (__atomic_load_n(&export->abandoned, __ATOMIC_ACQUIRE)) break;
+        size_t end = first + SNAPSHOT_CHUNK_RECORDS < daemon->capacity ?
+                     first + SNAPSHOT_CHUNK_RECORDS : daemon->capacity;
+        size_t count = 0;
+        
+        lock_acquire(&daemon->state_lock, LOCK_STATE);
+        for (size_t i = first; i < end; i++) {
+            if (!(export->done[i / 64] & (1ull << (i % 64))) &&
+                export_encode(&daemon->accounts[i], &batch[count])) {
+                count++;
+            }
+        }
+        export_write(export, batch, count);
+        export->cursor = end;
+        lock_release(&daemon->state_lock);
+    }
+    free(batch);
+    
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    if (export->written != export->stream.length && !export->abandoned) {
+        log_error("Export wrote %zu of %zu bytes", export->written, export->stream.length);
+        __atomic_store_n(&export->failed, true, __ATOMIC_RELEASE);
+    }
+    daemon->export = NULL;
+    lock_release(&daemon->state_lock);
+    
+    export_unref(export);
+    return NULL;
+}
+
+// Start a snapshot dump of every account for `export`. Returns the stream
+// that sends it, or NULL if an export is already running or resources ran
+// out; *count receives the number of records.
+NetworkStream* phantom_export(PhantomDaemon* daemon, uint64_t* count) {
+    PhantomExport* export = calloc(1, sizeof(PhantomExport));
+    if (!export) return NULL;
+    export->daemon = daemon;
+    export->refs = 2;
+    export->done = calloc(daemon->capacity / 64 + 1, sizeof(uint64_t));
+    export->stream.fd = memfd_create("phantomid-export", MFD_CLOEXEC);
+    export->stream.ready = export_ready;
+    export->stream.release = export_release;
+    if (!export->done || export->stream.fd < 0) {
+        log_error("Cannot start export: %s", strerror(errno));
+        if (export->stream.fd >= 0) close(export->stream.fd);
+        free(export->done);
+        free(export);
+        return NULL;
+    }
+    
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    if (daemon->export) {
+        lock_release(&daemon->state_lock);
+        close(export->stream.fd);
+        free(export->done);
+        free(export);
+        return NULL;
+    }
+    
+    // The header fixes the snapshot point: the table as of this version
+    PhantomExportHeader header = {
+        .magic = PHANTOM_EXPORT_MAGIC,
+        .record_size = sizeof(PhantomExportRecord),
+        .count = daemon->account_count,
+        .version = daemon->version
+    };
+    *count = header.count;
+    export->stream.length = sizeof(header) + header.count * sizeof(PhantomExportRecord);
+    bool started = pwrite(export->stream.fd, &header, sizeof(header), 0) == sizeof(header);
+    if (started) {
+        export->written = export->published = sizeof(header);
+        daemon->export = export;
+        started = pthread_create(&export->builder, NULL, build_export, export) == 0;
+        if (started) {
+            pthread_detach(export->builder);
+        } else {
+            daemon->export = NULL;
+        }
+    }
+    lock_release(&daemon->state_lock);
+    
+    if (!started) {
+        log_error("Cannot start export: %s", strerror(errno));
+        close(export->stream.fd);
+        free(export->done);
+        free(export);
+        return NULL;
+    }
+    return &export->stream;
+}
+
+// Remove the account with the given ID, logging the removal and queueing it
+// for replicas.
+// Called with state_lock held; *lsn receives the log position to wait for.
+static bool delete_account_locked(PhantomDaemon* daemon, const char* id, uint64_t* lsn) {
+    for (size_t i = 0; i < daemon->capacity; i++) {
+        lock_acquire(account_lock(daemon, i), LOCK_ACCOUNT);
         if (daemon->accounts[i].creation_time != 0 && strcmp(daemon->accounts[i].id, id) == 0) {
+            // The whole account is logged so a failed write can restore it
+            WalRecord record = {
+                .type = WAL_DELETE,
+                .slot = (uint32_t)i,
+                .creation_time = daemon->accounts[i].creation_time,
+                .expiry_time = daemon->accounts[i].expiry_time
+            };
+            memcpy(record.seed, daemon->accounts[i].seed, sizeof(record.seed));
+            memcpy(record.id, daemon->accounts[i].id, sizeof(record.id));
+            
+            if (daemon->wal_enabled) {
+                *lsn = wal_append(&daemon->wal, &record);
+                if (*lsn == 0) {
+                    lock_release(account_lock(daemon, i));
+                    return false;
+                }
+            }
+            
+            export_preserve(daemon, i);
             memset(&daemon->accounts[i], 0, sizeof(PhantomAccount));
             daemon->account_count--;
-            success = true;
-            pthread_mutex_unlock(&daemon->accounts[i].lock);
-            break;
+            if (i < daemon->next_free) {
+                daemon->next_free = i;
+            }
+            note_mutation(daemon, i);
+            settle_mutation(daemon, &record);
+            lock_release(account_lock(daemon, i));
+            return true;
         }
-        pthread_mutex_unlock(&daemon->accounts[i].lock);
+        lock_release(account_lock(daemon, i));
     }
-    pthread_mutex_unlock(&daemon->state_lock);
+    return false;
+}
+
+bool phantom_delete_account(PhantomDaemon* daemon, const char* id) {
+    uint64_t lsn = 0;
+    uint64_t start = metrics_start();
+    
+    lock_state(daemon);
+    uint64_t span = trace_begin();
+    bool success = delete_account_locked(daemon, id, &lsn);
+    trace_end(TRACE_STORE, span);
+    lock_release(&daemon->state_lock);
     
+    if (success && daemon->wal_enabled) {
+        success = wait_durable(daemon, lsn);
+    }
+    
+    metrics_record(METRIC_DELETE, start);
     return success;
 }
 
+// Delete several accounts and wait once for the log; returns how many existed
+size_t phantom_delete_accounts(PhantomDaemon* daemon, const char* const* ids, size_t count) {
+    uint64_t lsn = 0;
+    size_t deleted = 0;
+    
+    lock_state(daemon);
+    uint64_t span = trace_begin();
+    for (size_t i = 0; i < count; i++) {
+        if (delete_account_locked(daemon, ids[i], &lsn)) {
+            deleted++;
+        }
+    }
+    trace_end(TRACE_STORE, span);
+    lock_release(&daemon->state_lock);
+    
+    if (deleted > 0 && daemon->wal_enabled && !wait_durable(daemon, lsn)) {
+        return 0;
+    }
+    return deleted;
+}
+
+// Copy the account with the given ID into out
+bool phantom_lookup_account(PhantomDaemon* daemon, const char* id, PhantomAccount* out) {
+    bool found = false;
+    
+    lock_state(daemon);
+    uint64_t span = trace_begin();
+    for (size_t i = 0; i < daemon->capacity && !found; i++) {
+        lock_acquire(account_lock(daemon, i), LOCK_ACCOUNT);
+        if (daemon->accounts[i].creation_time != 0 && strcmp(daemon->accounts[i].id, id) == 0) {
+            *out = daemon->accounts[i];
+            found = true;
+        }
+        lock_release(account_lock(daemon, i));
+    }
+    trace_end(TRACE_STORE, span);
+    lock_release(&daemon->state_lock);
+    
+    return found;
+}
+
 void phantom_run(PhantomDaemon* daemon) {
-    printf("PhantomID daemon starting...\n");
+    log_info("PhantomID daemon starting...");
     net_run(&daemon->network);
 }
\ No newline at end of file
@@ -5,31 +5,143 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "network.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "replication.h"
+#include "command.h"
+#include "metrics.h"
 
-// PhantomID account structure
+#define PHANTOM_DEFAULT_CAPACITY 1000
+#define PHANTOM_LOCK_STRIPES 1024
+#define PHANTOM_MAX_ID_ATTEMPTS 1000000
+#define PHANTOM_EXPORT_BATCH 6     // Exported accounts that fit one response
+#define PHANTOM_BULK_MAX 32        // Accounts per bulk-create request
+#define PHANTOM_RESPONSE_SIZE 4096
+#define PHANTOM_UNSETTLED_RECORDS (2 * WAL_BUFFER_RECORDS) // Most logged mutations not yet durable: pending plus the batch being written
+
+// PhantomID account structure (plain fixed-size record, mapped from snapshots)
 typedef struct {
     uint8_t seed[32];          // Cryptographic seed
-    char id[64];               // Anonymous ID
+    char id[65];               // Anonymous ID (64 hex chars + NUL)
     uint64_t creation_time;    // Account creation timestamp
     uint64_t expiry_time;      // Account expiry timestamp
-    pthread_mutex_t lock;      // Thread safety for account operations
 } PhantomAccount;
 
-// PhantomID daemon state
+// Binary dump that follows the reply to `export`: this header, then count
+// records in host byte order
+#define PHANTOM_EXPORT_MAGIC "PHEXP001"
+
+typedef struct {
+    char magic[8];             // PHANTOM_EXPORT_MAGIC
+    uint32_t record_size;      // sizeof(PhantomExportRecord)
+    uint32_t reserved;
+    uint64_t count;            // Records that follow
+    uint64_t version;          // Table version the dump is a snapshot of
+} PhantomExportHeader;
+
+typedef struct {
+    uint8_t seed[32];          // The ID is the hex SHA-256 of the seed
+    uint64_t creation_time;
+    uint64_t expiry_time;
+} PhantomExportRecord;
+
+struct PhantomExport;
+
+// PhantomID daemon configuration
+typedef struct {
+    uint16_t port;             // Port to listen on, 0 for no listener
+    size_t max_accounts;       // Account table capacity, 0 selects the default
+    bool huge_pages;           // Back the account table with huge pages if the system has them
+    const char* wal_path;      // Write-ahead log path, NULL disables persistence
+    uint32_t wal_commit_window_us; // Group-commit window in microseconds
+    const char* snapshot_path; // Snapshot path, NULL disables checkpoints
+    uint32_t checkpoint_interval_s; // Seconds between background checkpoints
+    uint16_t replication_port; // Serve replicas on this port, 0 disables
+    const char* primary_host;  // Follow this primary as a read-only replica
+    uint16_t primary_port;     // Replication port of the primary
+    uint16_t metrics_port;     // Prometheus listener port, 0 disables
+    const char* trace_path;    // Where `trace stop` writes, NULL selects the default
+    uint32_t busy_poll_us;     // Reactor spins this long on readiness before blocking, 0 disables
+    const NetworkTuning* socket_tuning; // Listener and client socket options, NULL keeps kernel defaults
+    int listen_fd;             // Inherited client listener, 0 opens a new one on port
+    RateLimit rate_limits[RATE_CLASS_COUNT]; // Per-connection limits by command class
+    bool rate_reject;          // Refuse over-limit requests rather than pacing the connection
+    bool lanes;                // Serve requests by priority lane rather than in arrival order
+    uint32_t lane_weights[NET_LANE_COUNT]; // Requests each lane serves per reactor pass, 0 for no limit
+    const char* tls_cert_path; // PEM certificate chain, NULL serves plaintext
+    const char* tls_key_path;  // PEM private key of the certificate
+    const char* tls_ticket_key_path; // Session ticket keys shared across restarts, NULL for random ones
+} PhantomConfig;
+
+// Serialized account records of the last `list`, reused until a mutation
+// touches a slot it covers. Protected by state_lock.
 typedef struct {
+    char body[PHANTOM_RESPONSE_SIZE]; // Records as `list` prints them, without the header
+    size_t length;             // Bytes of body in use
+    size_t scanned;            // Slots below this are serialized in body
+    bool complete;             // body holds every account, not a truncated page
+    bool valid;                // body matches the table at version
+    uint64_t version;          // Daemon version body was built or last patched at
+    uint64_t hits;             // Listings served from body
+    uint64_t misses;           // Listings that rebuilt body
+    uint64_t patches;          // Mutations applied without a rebuild
+} ListCache;
+
+// PhantomID daemon state
+typedef struct PhantomDaemon {
     NetworkProgram network;    // Network program for handling connections
     PhantomAccount* accounts;  // Array of phantom accounts
+    size_t capacity;           // Number of account slots
     size_t account_count;      // Number of active accounts
+    size_t next_free;          // No free slot exists below this index
+    uint64_t version;          // Incremented by every mutation
     pthread_mutex_t state_lock;// Thread safety for daemon state
+    pthread_mutex_t account_locks[PHANTOM_LOCK_STRIPES]; // Striped slot locks
     bool running;             // Daemon running state
+    bool wal_enabled;          // Mutations are logged to wal
+    WriteAheadLog wal;         // Durable log of account mutations
+    pthread_mutex_t settle_lock; // Protects the unsettled ring and durable_lsn
+    WalRecord* unsettled;      // Applied mutations the log has not made durable, oldest first
+    size_t unsettled_head;     // Ring index of the oldest
+    size_t unsettled_count;
+    uint64_t durable_lsn;      // Last log position the flusher reported durable
+    bool wal_failed;           // The log failed and unlogged mutations were rolled back
+    int settle_fds[2];         // Written by the flusher so the reactor sends replies held on the log
+    SnapshotMap table;         // Mapping that backs accounts
+    const char* snapshot_path; // Checkpoint target, NULL if disabled
+    uint32_t checkpoint_interval_s; // Seconds between background checkpoints
+    uint64_t checkpoint_version; // Version captured by the last checkpoint
+    bool checkpoint_running;   // Checkpoint thread running state
+    pthread_t checkpointer;    // Background checkpoint thread
+    pthread_mutex_t checkpoint_lock; // Protects checkpoint_running
+    pthread_cond_t checkpoint_cond;  // Wakes the checkpoint thread early
+    Replication replication;   // Primary/replica streaming state
+    CommandRegistry commands;  // Client command table
+    const char* trace_path;    // Chrome trace output of the trace command
+    ListCache list_cache;      // Last serialized listing
+    struct PhantomExport* export; // Dump being built, NULL if none; state_lock
+    NetworkTls* tls;           // TLS context of the client listener, NULL for plaintext
 } PhantomDaemon;
 
 // Function declarations
-// Update the function declaration to include port
-bool phantom_init(PhantomDaemon* daemon, uint16_t port);
+bool phantom_init(PhantomDaemon* daemon, const PhantomConfig* config);
 void phantom_cleanup(PhantomDaemon* daemon);
 bool phantom_create_account(PhantomDaemon* daemon, PhantomAccount* account);
 bool phantom_delete_account(PhantomDaemon* daemon, const char* id);
+size_t phantom_create_accounts(PhantomDaemon* daemon, PhantomAccount* accounts, size_t count);
+size_t phantom_delete_accounts(PhantomDaemon* daemon, const char* const* ids, size_t count);
+bool phantom_lookup_account(PhantomDaemon* daemon, const char* id, PhantomAccount* out);
+bool phantom_create_account_in_range(PhantomDaemon* daemon, PhantomAccount* account,
+                                     uint64_t lo, uint64_t hi);
+bool phantom_import_account(PhantomDaemon* daemon, PhantomAccount* account);
+size_t phantom_export_range(PhantomDaemon* daemon, uint64_t lo, uint64_t hi,
+                            PhantomAccount* out, size_t max);
+NetworkStream* phantom_export(PhantomDaemon* daemon, uint64_t* count);
+uint64_t phantom_ring_position(const char* id);
+bool phantom_in_range(uint64_t position, uint64_t lo, uint64_t hi);
+bool phantom_checkpoint(PhantomDaemon* daemon);
+void phantom_apply_record(PhantomDaemon* daemon, const WalRecord* record);
+void phantom_reset_accounts(PhantomDaemon* daemon);
 void phantom_run(PhantomDaemon* daemon);
 
 #endif // PHANTOMID_H
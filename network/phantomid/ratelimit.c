@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ratelimit.h"
+
+static const char* class_names[RATE_CLASS_COUNT] = { "read", "write", "bulk" };
+
+const char* ratelimit_class_name(RateClass rate_class) {
+    return class_names[rate_class];
+}
+
+bool ratelimit_parse(const char* spec, RateClass* rate_class, RateLimit* limit) {
+    const char* equals = strchr(spec, '=');
+    if (!equals) return false;
+
+    size_t length = (size_t)(equals - spec);
+    int found = -1;
+    for (int i = 0; i < RATE_CLASS_COUNT; i++) {
+        if (strlen(class_names[i]) == length && strncmp(spec, class_names[i], length) == 0) found = i;
+    }
+    if (found < 0) return false;
+
+    char* end;
+    unsigned long rate = strtoul(equals + 1, &end, 10);
+    unsigned long burst = 0;
+    if (end == equals + 1 || rate > UINT32_MAX) return false;
+    if (*end == '/') {
+        const char* start = end + 1;
+        burst = strtoul(start, &end, 10);
+        if (end == start || burst == 0 || burst > UINT32_MAX) return false;
+    }
+    if (*end != '\0') return false;
+
+    *rate_class = (RateClass)found;
+    limit->rate = (uint32_t)rate;
+    limit->burst = (uint32_t)burst;
+    return true;
+}
+
+static double burst_of(const RateLimit* limit) {
+    return limit->burst ? limit->burst : limit->rate;
+}
+
+bool ratelimit_take(RateBuckets* buckets, RateClass rate_class, const RateLimit* limit, uint64_t now_ns) {
+    if (limit->rate == 0) return true;
+
+    double burst = burst_of(limit);
+    double* tokens = &buckets->tokens[rate_class];
+    uint64_t* refilled = &buckets->refilled_ns[rate_class];
+    if (*refilled == 0) {
+        *tokens = burst;
+    } else if (now_ns > *refilled) {
+        *tokens += (now_ns - *refilled) * (limit->rate / 1e9);
+        if (*tokens > burst) *tokens = burst;
+    }
+    *refilled = now_ns;
+
+    if (*tokens < 1.0) return false;
+    *tokens -= 1.0;
+    return true;
+}
+
+uint64_t ratelimit_wait_ns(const RateBuckets* buckets, RateClass rate_class, const RateLimit* limit) {
+    double tokens = buckets->tokens[rate_class];
+    if (limit->rate == 0 || buckets->refilled_ns[rate_class] == 0 || tokens >= 1.0) return 0;
+    return (uint64_t)((1.0 - tokens) * 1e9 / limit->rate) + 1;
+}
@@ -0,0 +1,41 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Command classes, each with its own bucket per connection
+typedef enum {
+    RATE_READ,                 // Lookups, reports and unknown verbs
+    RATE_WRITE,                // Single mutations
+    RATE_BULK,                 // Commands that touch many accounts per call
+    RATE_CLASS_COUNT
+} RateClass;
+
+// Requests per second and the burst a connection may bank. A rate of 0
+// leaves the class unlimited.
+typedef struct {
+    uint32_t rate;
+    uint32_t burst;            // 0 means one second's worth
+} RateLimit;
+
+// One connection's buckets. All zero is a fresh connection with full
+// buckets. Only the thread serving the connection touches them.
+typedef struct {
+    double tokens[RATE_CLASS_COUNT];
+    uint64_t refilled_ns[RATE_CLASS_COUNT]; // 0 until the first request of the class
+    uint64_t resume_ns;        // Connection is not read before this CLOCK_MONOTONIC time
+} RateBuckets;
+
+// Parse "write=100" or "write=100/20" (class, rate, burst)
+bool ratelimit_parse(const char* spec, RateClass* rate_class, RateLimit* limit);
+const char* ratelimit_class_name(RateClass rate_class);
+
+// Spend one token of rate_class. False when the bucket is empty, and the
+// request should be turned away.
+bool ratelimit_take(RateBuckets* buckets, RateClass rate_class, const RateLimit* limit, uint64_t now_ns);
+
+// Nanoseconds until rate_class has a whole token again, 0 if it has one
+uint64_t ratelimit_wait_ns(const RateBuckets* buckets, RateClass rate_class, const RateLimit* limit);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,584 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/rand.h>
+#include "phantomid.h"
+#include "log.h"
+#include "lockprof.h"
+#include "affinity.h"
+
+#define REPL_SEND_BATCH 256
+#define REPL_RECONNECT_MS 1000
+#define REPL_ACK_RECORDS 1024      // A replica acks at least this often under load
+#define REPL_ACK_MS 50             // ...and at least this often in milliseconds
+
+static uint64_t monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static bool send_all(int fd, const void* data, size_t size) {
+    const uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t sent = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        ptr += sent;
+        size -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t size) {
+    uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t got = recv(fd, ptr, size, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        ptr += got;
+        size -= (size_t)got;
+    }
+    return true;
+}
+
+static void set_recv_timeout(int fd, uint32_t ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static bool send_control(int fd, uint32_t type, uint32_t slot, uint64_t seq) {
+    WalRecord record = { .type = type, .slot = slot, .lsn = seq };
+    return send_all(fd, &record, sizeof(record));
+}
+
+// Wait until every mutation applied so far is durable. False once the log
+// has failed: the table may then hold mutations that are being rolled back,
+// so no image is started, and one in flight never completes.
+static bool wait_logged(PhantomDaemon* daemon) {
+    if (!daemon->wal_enabled) return true;
+    uint64_t lsn = wal_last_lsn(&daemon->wal);
+    return lsn == 0 || wal_wait(&daemon->wal, lsn);
+}
+
+// Stream a fuzzy image of the table. Records published after start_seq are
+// streamed afterwards and re-applying them on top of the image is idempotent.
+static bool send_full_image(PhantomDaemon* daemon, int fd, uint64_t start_seq) {
+    WalRecord* batch = malloc(SNAPSHOT_CHUNK_RECORDS * sizeof(WalRecord));
+    PhantomAccount* chunk = malloc(SNAPSHOT_CHUNK_RECORDS * sizeof(PhantomAccount));
+    bool ok = batch && chunk && wait_logged(daemon) &&
+              send_control(fd, REPL_RESET, (uint32_t)daemon->capacity, start_seq);
+
+    for (size_t first = 0; ok && first < daemon->capacity; first += SNAPSHOT_CHUNK_RECORDS) {
+        size_t count = daemon->capacity - first;
+        size_t occupied = 0;
+        if (count > SNAPSHOT_CHUNK_RECORDS) count = SNAPSHOT_CHUNK_RECORDS;
+
+        lock_acquire(&daemon->state_lock, LOCK_STATE);
+        memcpy(chunk, &daemon->accounts[first], count * sizeof(PhantomAccount));
+        lock_release(&daemon->state_lock);
+
+        for (size_t i = 0; i < count; i++) {
+            if (chunk[i].creation_time == 0) continue;
+            WalRecord* record = &batch[occupied++];
+            memset(record, 0, sizeof(*record));
+            record->type = WAL_CREATE;
+            record->slot = (uint32_t)(first + i);
+            record->lsn = start_seq;
+            memcpy(record->seed, chunk[i].seed, sizeof(record->seed));
+            memcpy(record->id, chunk[i].id, sizeof(record->id));
+            record->creation_time = chunk[i].creation_time;
+            record->expiry_time = chunk[i].expiry_time;
+        }
+        ok = send_all(fd, batch, occupied * sizeof(WalRecord));
+    }
+
+    ok = ok && wait_logged(daemon) && send_control(fd, REPL_SYNC_DONE, 0, start_seq);
+    free(batch);
+    free(chunk);
+    return ok;
+}
+
+// Drain any acknowledgements the replica has sent without blocking
+static void read_acks(Replication* repl, ReplicaLink* link) {
+    WalRecord ack;
+    while (recv(link->socket_fd, &ack, sizeof(ack), MSG_DONTWAIT | MSG_PEEK) == (ssize_t)sizeof(ack)) {
+        if (!recv_all(link->socket_fd, &ack, sizeof(ack))) return;
+        if (ack.type == REPL_ACK) {
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            link->acked_seq = ack.lsn;
+            lock_release(&repl->lock);
+        }
+    }
+}
+
+typedef struct {
+    PhantomDaemon* daemon;
+    ReplicaLink* link;
+} SenderArgs;
+
+// Primary: serve one replica until it disconnects or falls out of the backlog
+static void* replica_sender(void* arg) {
+    SenderArgs* args = arg;
+    PhantomDaemon* daemon = args->daemon;
+    Replication* repl = &daemon->replication;
+    ReplicaLink* link = args->link;
+    ReplicationHello hello;
+    affinity_apply(THREAD_REPLICATION);
+    WalRecord batch[REPL_SEND_BATCH];
+    uint64_t cursor;
+    free(args);
+
+    set_recv_timeout(link->socket_fd, REPL_HEARTBEAT_MS * 3);
+    if (!recv_all(link->socket_fd, &hello, sizeof(hello)) ||
+        memcmp(hello.magic, REPL_MAGIC, sizeof(hello.magic)) != 0) {
+        goto done;
+    }
+
+    // Stream from the replica's position if the backlog still covers it,
+    // otherwise start over from a full image
+    lock_acquire(&daemon->state_lock, LOCK_STATE);
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    bool partial = hello.epoch == repl->epoch &&
+                   hello.seq >= repl->base_seq &&
+                   hello.seq <= repl->head_seq &&
+                   repl->head_seq - hello.seq < REPL_BACKLOG_RECORDS;
+    cursor = partial ? hello.seq : repl->head_seq;
+    lock_release(&repl->lock);
+    lock_release(&daemon->state_lock);
+
+    ReplicationHello reply = { .epoch = repl->epoch, .seq = cursor, .full_sync = !partial };
+    memcpy(reply.magic, REPL_MAGIC, sizeof(reply.magic));
+    if (!send_all(link->socket_fd, &reply, sizeof(reply))) goto done;
+    if (!partial && !send_full_image(daemon, link->socket_fd, cursor)) goto done;
+
+    uint64_t idle_since = monotonic_ms();
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    while (repl->running) {
+        link->sent_seq = cursor;
+
+        // While caught up, wake every REPL_ACK_MS to take the acks for
+        // the last batches, and send a heartbeat once idle for long enough
+        if (cursor == repl->head_seq) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)REPL_ACK_MS * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            if (lock_cond_timedwait(&repl->published, &repl->lock, &deadline) == ETIMEDOUT) {
+                uint64_t head = repl->head_seq;
+                bool beat = monotonic_ms() - idle_since >= REPL_HEARTBEAT_MS;
+                lock_release(&repl->lock);
+                bool ok = !beat || send_control(link->socket_fd, REPL_HEARTBEAT, 0, head);
+                read_acks(repl, link);
+                lock_acquire(&repl->lock, LOCK_REPLICATION);
+                if (!ok) break;
+                if (beat) idle_since = monotonic_ms();
+            }
+            continue;
+        }
+
+        // A replica that fell out of the backlog must resync from an image
+        if (repl->head_seq - cursor > REPL_BACKLOG_RECORDS) {
+            log_warn("Replica fell %lu records behind, dropping it",
+                    repl->head_seq - cursor);
+            break;
+        }
+
+        size_t count = 0;
+        while (cursor + count < repl->head_seq && count < REPL_SEND_BATCH) {
+            batch[count] = repl->backlog[(cursor + count + 1) % REPL_BACKLOG_RECORDS];
+            count++;
+        }
+        lock_release(&repl->lock);
+
+        bool ok = send_all(link->socket_fd, batch, count * sizeof(WalRecord));
+        read_acks(repl, link);
+
+        lock_acquire(&repl->lock, LOCK_REPLICATION);
+        if (!ok) break;
+        cursor += count;
+        idle_since = monotonic_ms();
+    }
+    lock_release(&repl->lock);
+
+done:
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    close(link->socket_fd);
+    link->socket_fd = -1;
+    link->active = false;
+    lock_release(&repl->lock);
+    return NULL;
+}
+
+// Primary: accept replica connections
+static void* replica_acceptor(void* arg) {
+    PhantomDaemon* daemon = arg;
+    Replication* repl = &daemon->replication;
+    affinity_apply(THREAD_REPLICATION);
+
+    while (repl->running) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(repl->listen_fd, (struct sockaddr*)&addr, &addr_len);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        lock_acquire(&repl->lock, LOCK_REPLICATION);
+        ReplicaLink* link = NULL;
+        for (int i = 0; i < REPL_MAX_REPLICAS; i++) {
+            if (!repl->replicas[i].active) {
+                link = &repl->replicas[i];
+                break;
+            }
+        }
+
+        if (link) {
+            // Reap the previous sender before reusing its slot
+            if (link->socket_fd == -1) {
+                pthread_join(link->thread, NULL);
+            }
+            memset(link, 0, sizeof(*link));
+            link->active = true;
+            link->socket_fd = fd;
+            link->addr = addr;
+
+            SenderArgs* args = malloc(sizeof(SenderArgs));
+            if (args) {
+                args->daemon = daemon;
+                args->link = link;
+            }
+            if (!args || pthread_create(&link->thread, NULL, replica_sender, args) != 0) {
+                free(args);
+                close(fd);
+                link->active = false;
+                link->socket_fd = 0;
+            }
+        } else {
+            log_warn("Replica limit reached, refusing connection");
+            close(fd);
+        }
+        lock_release(&repl->lock);
+    }
+    return NULL;
+}
+
+bool replication_start_primary(PhantomDaemon* daemon, uint16_t port) {
+    Replication* repl = &daemon->replication;
+    int opt = 1;
+
+    memset(repl, 0, sizeof(*repl));
+    repl->backlog = calloc(REPL_BACKLOG_RECORDS, sizeof(WalRecord));
+    if (!repl->backlog) return false;
+
+    repl->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (repl->listen_fd < 0) {
+        log_error("Replication socket creation failed: %s", strerror(errno));
+        free(repl->backlog);
+        return false;
+    }
+    setsockopt(repl->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(repl->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(repl->listen_fd, REPL_MAX_REPLICAS) < 0) {
+        log_error("Replication listen failed: %s", strerror(errno));
+        close(repl->listen_fd);
+        free(repl->backlog);
+        return false;
+    }
+
+    RAND_bytes((uint8_t*)&repl->epoch, sizeof(repl->epoch));
+    repl->base_seq = daemon->version;
+    repl->head_seq = daemon->version;
+    repl->role = REPL_PRIMARY;
+    repl->running = true;
+    pthread_mutex_init(&repl->lock, NULL);
+    pthread_cond_init(&repl->published, NULL);
+
+    if (pthread_create(&repl->acceptor, NULL, replica_acceptor, daemon) != 0) {
+        repl->running = false;
+        repl->role = REPL_NONE;
+        close(repl->listen_fd);
+        free(repl->backlog);
+        return false;
+    }
+    return true;
+}
+
+// Replica: stop following a primary whose table does not fit ours, rather
+// than serve a copy that silently lacks its upper slots
+static bool outgrown(Replication* repl, const char* what, size_t capacity) {
+    log_error("%s beyond this replica's capacity of %zu; stopped following, "
+              "restart with a larger --max-accounts", what, capacity);
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    repl->outgrown = true;
+    lock_release(&repl->lock);
+    return false;
+}
+
+// Replica: apply one streamed record
+static bool follow_record(PhantomDaemon* daemon, const WalRecord* record) {
+    Replication* repl = &daemon->replication;
+
+    switch (record->type) {
+        case REPL_RESET:
+            if (record->slot > daemon->capacity) {
+                return outgrown(repl, "The primary's table extends", daemon->capacity);
+            }
+            phantom_reset_accounts(daemon);
+
+            // Until SYNC_DONE the table matches no sequence, so a link lost
+            // partway through the image must ask for a full sync again
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            repl->syncing = true;
+            repl->applied_seq = 0;
+            repl->primary_epoch = 0;
+            repl->full_syncs++;
+            lock_release(&repl->lock);
+            return true;
+
+        case WAL_CREATE:
+        case WAL_DELETE:
+            if (record->slot >= daemon->capacity) {
+                return outgrown(repl, "The primary wrote a slot", daemon->capacity);
+            }
+            phantom_apply_record(daemon, record);
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            if (!repl->syncing && record->lsn > repl->applied_seq) repl->applied_seq = record->lsn;
+            if (record->lsn > repl->primary_seq) repl->primary_seq = record->lsn;
+            lock_release(&repl->lock);
+            return true;
+
+        case REPL_SYNC_DONE:
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            repl->syncing = false;
+            repl->applied_seq = record->lsn;
+            repl->primary_epoch = repl->stream_epoch;
+            if (record->lsn > repl->primary_seq) repl->primary_seq = record->lsn;
+            lock_release(&repl->lock);
+            return true;
+
+        case REPL_HEARTBEAT: {
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            repl->primary_seq = record->lsn;
+            uint64_t applied = repl->applied_seq;
+            lock_release(&repl->lock);
+            return send_control(repl->primary_fd, REPL_ACK, 0, applied);
+        }
+
+        default:
+            log_error("Unknown replication record type %u", record->type);
+            return false;
+    }
+}
+
+// Replica: connect to the primary, follow its stream, reconnect on failure
+static void* replica_follower(void* arg) {
+    PhantomDaemon* daemon = arg;
+    Replication* repl = &daemon->replication;
+    affinity_apply(THREAD_REPLICATION);
+
+    while (repl->running) {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(repl->primary_port);
+        inet_pton(AF_INET, repl->primary_host, &addr.sin_addr);
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            if (fd >= 0) close(fd);
+            usleep(REPL_RECONNECT_MS * 1000);
+            continue;
+        }
+        set_recv_timeout(fd, REPL_HEARTBEAT_MS * 3);
+
+        lock_acquire(&repl->lock, LOCK_REPLICATION);
+        repl->primary_fd = fd;
+        ReplicationHello hello = { .epoch = repl->primary_epoch, .seq = repl->applied_seq };
+        lock_release(&repl->lock);
+        memcpy(hello.magic, REPL_MAGIC, sizeof(hello.magic));
+
+        ReplicationHello reply;
+        if (send_all(fd, &hello, sizeof(hello)) && recv_all(fd, &reply, sizeof(reply)) &&
+            memcmp(reply.magic, REPL_MAGIC, sizeof(reply.magic)) == 0) {
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            repl->connected = true;
+            repl->stream_epoch = reply.epoch;
+            if (!reply.full_sync) repl->primary_epoch = reply.epoch;
+            repl->last_contact_ms = monotonic_ms();
+            lock_release(&repl->lock);
+            log_info("Following primary %s:%u from sequence %lu%s",
+                   repl->primary_host, repl->primary_port, reply.seq,
+                   reply.full_sync ? " (full sync)" : "");
+
+            // Applied records are acked once the stream pauses, and every
+            // REPL_ACK_RECORDS or REPL_ACK_MS while it does not, so the
+            // primary's view of the lag stays current under load
+            WalRecord record;
+            uint64_t acked = 0, unacked = 0, acked_ms = monotonic_ms();
+            while (repl->running && recv_all(fd, &record, sizeof(record))) {
+                if (!follow_record(daemon, &record)) break;
+                uint64_t now = monotonic_ms();
+                lock_acquire(&repl->lock, LOCK_REPLICATION);
+                repl->last_contact_ms = now;
+                uint64_t applied = repl->syncing ? 0 : repl->applied_seq;
+                lock_release(&repl->lock);
+
+                if (applied <= acked) continue;
+                unacked++;
+                WalRecord next;
+                bool paused = recv(fd, &next, sizeof(next), MSG_PEEK | MSG_DONTWAIT) <= 0;
+                if (paused || unacked >= REPL_ACK_RECORDS || now - acked_ms >= REPL_ACK_MS) {
+                    if (!send_control(fd, REPL_ACK, 0, applied)) break;
+                    acked = applied;
+                    unacked = 0;
+                    acked_ms = now;
+                }
+            }
+        }
+
+        lock_acquire(&repl->lock, LOCK_REPLICATION);
+        repl->connected = false;
+        repl->primary_fd = -1;
+        lock_release(&repl->lock);
+        close(fd);
+
+        if (repl->outgrown) break;
+        if (repl->running) {
+            log_warn("Lost primary %s:%u, reconnecting", repl->primary_host, repl->primary_port);
+            usleep(REPL_RECONNECT_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+bool replication_start_replica(PhantomDaemon* daemon, const char* host, uint16_t port) {
+    Replication* repl = &daemon->replication;
+    struct in_addr parsed;
+
+    memset(repl, 0, sizeof(*repl));
+    if (inet_pton(AF_INET, host, &parsed) != 1) {
+        log_error("Invalid primary address %s", host);
+        return false;
+    }
+
+    snprintf(repl->primary_host, sizeof(repl->primary_host), "%s", host);
+    repl->primary_port = port;
+    repl->primary_fd = -1;
+    repl->role = REPL_REPLICA;
+    repl->running = true;
+    pthread_mutex_init(&repl->lock, NULL);
+    pthread_cond_init(&repl->published, NULL);
+
+    if (pthread_create(&repl->follower, NULL, replica_follower, daemon) != 0) {
+        repl->running = false;
+        repl->role = REPL_NONE;
+        return false;
+    }
+    return true;
+}
+
+void replication_stop(PhantomDaemon* daemon) {
+    Replication* repl = &daemon->replication;
+    if (repl->role == REPL_NONE) return;
+
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    repl->running = false;
+    pthread_cond_broadcast(&repl->published);
+    lock_release(&repl->lock);
+
+    if (repl->role == REPL_PRIMARY) {
+        shutdown(repl->listen_fd, SHUT_RDWR);
+        pthread_join(repl->acceptor, NULL);
+        close(repl->listen_fd);
+
+        for (int i = 0; i < REPL_MAX_REPLICAS; i++) {
+            lock_acquire(&repl->lock, LOCK_REPLICATION);
+            bool started = repl->replicas[i].active || repl->replicas[i].socket_fd == -1;
+            if (repl->replicas[i].active) {
+                shutdown(repl->replicas[i].socket_fd, SHUT_RDWR);
+            }
+            lock_release(&repl->lock);
+            if (started) {
+                pthread_join(repl->replicas[i].thread, NULL);
+            }
+        }
+        free(repl->backlog);
+    } else {
+        lock_acquire(&repl->lock, LOCK_REPLICATION);
+        if (repl->primary_fd >= 0) {
+            shutdown(repl->primary_fd, SHUT_RDWR);
+        }
+        lock_release(&repl->lock);
+        pthread_join(repl->follower, NULL);
+    }
+
+    pthread_cond_destroy(&repl->published);
+    pthread_mutex_destroy(&repl->lock);
+    repl->role = REPL_NONE;
+}
+
+void replication_publish(Replication* repl, const WalRecord* record) {
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    uint64_t seq = repl->head_seq + 1;
+    WalRecord* slot = &repl->backlog[seq % REPL_BACKLOG_RECORDS];
+    *slot = *record;
+    slot->lsn = seq;
+    repl->head_seq = seq;
+    pthread_cond_broadcast(&repl->published);
+    lock_release(&repl->lock);
+}
+
+size_t replication_status(PhantomDaemon* daemon, char* out, size_t size) {
+    Replication* repl = &daemon->replication;
+    size_t offset = 0;
+
+    if (repl->role == REPL_NONE) {
+        return (size_t)snprintf(out, size, "\nReplication: disabled\n");
+    }
+
+    lock_acquire(&repl->lock, LOCK_REPLICATION);
+    if (repl->role == REPL_PRIMARY) {
+        offset += snprintf(out, size, "\nRole: primary\nEpoch: %016lx\nSequence: %lu\n",
+                           repl->epoch, repl->head_seq);
+        for (int i = 0; i < REPL_MAX_REPLICAS && offset < size; i++) {
+            ReplicaLink* link = &repl->replicas[i];
+            if (!link->active) continue;
+            char addr[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &link->addr.sin_addr, addr, sizeof(addr));
+            offset += snprintf(out + offset, size - offset,
+                               "Replica %s:%u sent %lu acked %lu lag %lu\n",
+                               addr, ntohs(link->addr.sin_port), link->sent_seq,
+                               link->acked_seq, repl->head_seq - link->acked_seq);
+        }
+    } else {
+        uint64_t behind = repl->primary_seq > repl->applied_seq ?
+                          repl->primary_seq - repl->applied_seq : 0;
+        offset += snprintf(out, size,
+                           "\nRole: replica\nPrimary: %s:%u (%s)\nApplied: %lu\nPrimary sequence: %lu\n"
+                           "Lag: %lu records, last contact %lu ms ago\nFull syncs: %lu\n",
+                           repl->primary_host, repl->primary_port,
+                           repl->outgrown ? "stopped, capacity below the primary's" :
+                           !repl->connected ? "disconnected" : repl->syncing ? "syncing" : "streaming",
+                           repl->applied_seq, repl->primary_seq, behind,
+                           repl->last_contact_ms ? monotonic_ms() - repl->last_contact_ms : 0,
+                           repl->full_syncs);
+    }
+    lock_release(&repl->lock);
+
+    return offset < size ? offset : size - 1;
+}
@@ -0,0 +1,95 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "wal.h"
+
+#define REPL_MAGIC "PHREPL01"
+#define REPL_BACKLOG_RECORDS 65536
+#define REPL_MAX_REPLICAS 8
+#define REPL_HEARTBEAT_MS 1000
+
+struct PhantomDaemon;
+
+typedef enum {
+    REPL_NONE,
+    REPL_PRIMARY,
+    REPL_REPLICA
+} ReplicationRole;
+
+// Control records, carried in WalRecord.type next to WAL_CREATE/WAL_DELETE
+typedef enum {
+    REPL_RESET = 16,           // Full image follows; slot holds the primary's capacity
+    REPL_SYNC_DONE = 17,       // Full image complete; lsn holds its sequence
+    REPL_HEARTBEAT = 18,       // lsn holds the primary's latest sequence
+    REPL_ACK = 19              // Replica to primary; lsn holds the applied sequence
+} ReplicationControl;
+
+// Handshake exchanged once in each direction when a replica connects
+typedef struct {
+    char magic[8];             // REPL_MAGIC
+    uint64_t epoch;            // Primary run the sequence numbers belong to
+    uint64_t seq;              // Replica: last applied; primary: stream start
+    uint32_t full_sync;        // Primary reply: a full image follows
+    uint32_t reserved;
+} ReplicationHello;
+
+// Primary-side state for one connected replica
+typedef struct {
+    bool active;               // Slot in use
+    int socket_fd;             // Replica connection
+    struct sockaddr_in addr;   // Replica address
+    uint64_t sent_seq;         // Last sequence streamed
+    uint64_t acked_seq;        // Last sequence the replica reported applied
+    pthread_t thread;          // Sender thread
+} ReplicaLink;
+
+// Replication state for either role
+typedef struct {
+    ReplicationRole role;      // Primary, replica or disabled
+    uint64_t epoch;            // Primary: random id of this run
+    volatile bool running;     // Replication threads running state
+    pthread_mutex_t lock;      // Protects everything below
+    pthread_cond_t published;  // Signalled when head_seq advances
+
+    // Primary
+    int listen_fd;             // Replica listener
+    WalRecord* backlog;        // Ring of the last REPL_BACKLOG_RECORDS mutations
+    uint64_t base_seq;         // Sequence when replication started
+    uint64_t head_seq;         // Sequence of the newest published mutation
+    ReplicaLink replicas[REPL_MAX_REPLICAS]; // Connected replicas
+    pthread_t acceptor;        // Accepts replica connections
+
+    // Replica
+    char primary_host[INET_ADDRSTRLEN]; // Primary replication address
+    uint16_t primary_port;     // Primary replication port
+    int primary_fd;            // Connection to the primary
+    bool connected;            // Stream established
+    bool syncing;              // Receiving a full image
+    bool outgrown;             // Stopped following: the primary has more slots than our table
+    uint64_t primary_epoch;    // Epoch applied_seq belongs to, 0 until a full sync completes
+    uint64_t stream_epoch;     // Epoch of the primary on the current connection
+    uint64_t applied_seq;      // Last sequence applied locally
+    uint64_t primary_seq;      // Latest sequence the primary reported
+    uint64_t last_contact_ms;  // Monotonic time of the last message
+    uint64_t full_syncs;       // Number of full images received
+    pthread_t follower;        // Receives and applies the stream
+} Replication;
+
+// Lifecycle
+bool replication_start_primary(struct PhantomDaemon* daemon, uint16_t port);
+bool replication_start_replica(struct PhantomDaemon* daemon, const char* host, uint16_t port);
+void replication_stop(struct PhantomDaemon* daemon);
+
+// Primary: queue a mutation for every replica under the next sequence.
+// Mutations are published in log order, once they are durable.
+void replication_publish(Replication* repl, const WalRecord* record);
+
+// Human-readable role, position and lag
+size_t replication_status(struct PhantomDaemon* daemon, char* out, size_t size);
+
+#endif // REPLICATION_H
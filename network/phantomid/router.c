@@ -0,0 +1,558 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include "router.h"
+#include "log.h"
+#include "metrics.h"
+
+static void register_commands(ShardRouter* router);
+
+// Ring point of a shard's virtual node: the first 64 bits of
+// SHA-256("host:port#vnode"), the same space account IDs live in
+static uint64_t vnode_point(const ShardNode* node, int vnode) {
+    char key[64];
+    uint8_t hash[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    uint64_t point = 0;
+
+    int key_len = snprintf(key, sizeof(key), "%s:%u#%d", node->host, node->port, vnode);
+    EVP_Digest(key, (size_t)key_len, hash, &len, EVP_sha256(), NULL);
+    for (int i = 0; i < 8; i++) {
+        point = (point << 8) | hash[i];
+    }
+    return point;
+}
+
+static int compare_points(const void* a, const void* b) {
+    uint64_t pa = ((const RingPoint*)a)->point;
+    uint64_t pb = ((const RingPoint*)b)->point;
+    return pa < pb ? -1 : pa > pb;
+}
+
+// Build a ring over the first node_count shards
+static bool ring_build(HashRing* ring, const ShardNode* nodes, size_t node_count) {
+    ring->count = node_count * ROUTER_VNODES;
+    ring->points = malloc(ring->count * sizeof(RingPoint));
+    if (!ring->points) {
+        ring->count = 0;
+        return false;
+    }
+
+    for (size_t n = 0; n < node_count; n++) {
+        for (int v = 0; v < ROUTER_VNODES; v++) {
+            RingPoint* point = &ring->points[n * ROUTER_VNODES + v];
+            point->point = vnode_point(&nodes[n], v);
+            point->node = (uint32_t)n;
+        }
+    }
+    qsort(ring->points, ring->count, sizeof(RingPoint), compare_points);
+    return true;
+}
+
+// Shard owning a position: the first ring point strictly after it
+size_t ring_owner(const HashRing* ring, uint64_t position) {
+    size_t lo = 0, hi = ring->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].point <= position) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return ring->points[lo == ring->count ? 0 : lo].node;
+}
+
+uint64_t ring_position(const char* id) {
+    uint64_t position = 0;
+    for (int i = 0; i < 16 && id[i]; i++) {
+        char c = id[i];
+        uint64_t nibble = c >= 'a' ? (uint64_t)(c - 'a' + 10) :
+                          c >= 'A' ? (uint64_t)(c - 'A' + 10) : (uint64_t)(c - '0');
+        position = (position << 4) | (nibble & 0xf);
+    }
+    return position;
+}
+
+// Largest arc a shard owns, so range-constrained creates need the fewest tries
+static void ring_largest_arc(const HashRing* ring, size_t node, uint64_t* lo, uint64_t* hi) {
+    uint64_t best = 0;
+    *lo = *hi = 0;
+
+    for (size_t i = 0; i < ring->count; i++) {
+        if (ring->points[i].node != node) continue;
+        uint64_t start = ring->points[i == 0 ? ring->count - 1 : i - 1].point;
+        uint64_t length = ring->points[i].point - start;  // Wraps for the first arc
+        if (length >= best) {
+            best = length;
+            *lo = start;
+            *hi = ring->points[i].point;
+        }
+    }
+}
+
+// Read one NUL-framed reply. Bytes past size - 1 are read and dropped, so
+// the next reply starts where it should. Returns 1 for a reply, 0 if the
+// shard closed the connection before sending anything, -1 otherwise.
+static int read_reply(int fd, char* reply, size_t size) {
+    size_t length = 0;
+    bool started = false;
+    char spill[512];
+
+    for (;;) {
+        bool full = length == size - 1;
+        char* into = full ? spill : reply + length;
+        size_t room = full ? sizeof(spill) : size - 1 - length;
+        ssize_t got = recv(fd, into, room, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return !started && (got == 0 || errno == ECONNRESET) ? 0 : -1;
+        started = true;
+
+        char* end = memchr(into, '\0', (size_t)got);
+        if (!full) length += end ? (size_t)(end - into) : (size_t)got;
+        if (end) {
+            reply[length] = '\0';
+            return 1;
+        }
+    }
+}
+
+static int shard_connect(const ShardNode* node) {
+    struct sockaddr_in addr = {0};
+    struct timeval tv = { .tv_sec = ROUTER_SHARD_TIMEOUT_S, .tv_usec = 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(node->port);
+    inet_pton(AF_INET, node->host, &addr.sin_addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Framed replies, so one split across segments is read whole
+    char reply[128];
+    const char* pipeline = "pipeline\n";
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        send(fd, pipeline, strlen(pipeline), MSG_NOSIGNAL) != (ssize_t)strlen(pipeline) ||
+        read_reply(fd, reply, sizeof(reply)) != 1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send one command to a shard and read its reply. A connection that fails
+// or times out mid-reply is closed, so a late reply is never taken for the
+// answer to the next command. Only a send on a connection the shard has
+// already closed is retried, as the command cannot have run.
+static bool shard_request(const ShardNode* node, int* fd, const char* command,
+                          char* reply, size_t size) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool fresh = *fd < 0;
+        if (fresh && (*fd = shard_connect(node)) < 0) return false;
+
+        size_t length = strlen(command);
+        bool sent = send(*fd, command, length, MSG_NOSIGNAL) == (ssize_t)length;
+        int read = sent ? read_reply(*fd, reply, size) : 0;
+        if (read == 1) return true;
+
+        bool stale = !fresh && read == 0;
+        close(*fd);
+        *fd = -1;
+        if (!stale) return false;
+    }
+    return false;
+}
+
+void router_init(ShardRouter* router) {
+    memset(router, 0, sizeof(*router));
+    pthread_mutex_init(&router->lock, NULL);
+    register_commands(router);
+}
+
+void router_cleanup(ShardRouter* router) {
+    __atomic_store_n(&router->stopping, true, __ATOMIC_RELEASE);
+    if (router->migrator_started) {
+        pthread_join(router->migrator, NULL);
+    }
+
+    for (size_t i = 0; i < router->node_count; i++) {
+        if (router->nodes[i].socket_fd >= 0) {
+            close(router->nodes[i].socket_fd);
+        }
+    }
+    free(router->ring.points);
+    free(router->previous.points);
+    pthread_mutex_destroy(&router->lock);
+}
+
+// Read "Active accounts: N" from a shard's list reply
+static size_t parse_account_count(const char* reply) {
+    const char* field = strstr(reply, "Active accounts:");
+    return field ? (size_t)strtoull(field + 16, NULL, 10) : 0;
+}
+
+static bool append_node(ShardRouter* router, const char* host, uint16_t port) {
+    struct in_addr parsed;
+    if (router->node_count == ROUTER_MAX_NODES || inet_pton(AF_INET, host, &parsed) != 1) {
+        return false;
+    }
+
+    ShardNode* node = &router->nodes[router->node_count];
+    memset(node, 0, sizeof(*node));
+    snprintf(node->host, sizeof(node->host), "%s", host);
+    node->port = port;
+    node->socket_fd = -1;
+
+    char reply[ROUTER_RESPONSE_SIZE];
+    if (!shard_request(node, &node->socket_fd, "list\n", reply, sizeof(reply))) {
+        log_error("Shard %s:%u is unreachable", host, port);
+        return false;
+    }
+    node->accounts = parse_account_count(reply);
+    router->node_count++;
+    return true;
+}
+
+// Add a shard before any traffic is routed; nothing is migrated
+bool router_add_node(ShardRouter* router, const char* host, uint16_t port) {
+    if (!append_node(router, host, port)) return false;
+
+    free(router->ring.points);
+    return ring_build(&router->ring, router->nodes, router->node_count);
+}
+
+// Move every account on [lo, hi) from one shard to another. Each account is
+// imported before it is deleted, so a lookup always finds it somewhere.
+// Returns true once the source exports nothing more on the arc; false if a
+// step failed, leaving the rest for the next pass.
+static bool migrate_arc(ShardRouter* router, size_t from, size_t to,
+                        int* from_fd, int* to_fd, uint64_t lo, uint64_t hi) {
+    char command[256];
+    char reply[ROUTER_RESPONSE_SIZE];
+    char answer[ROUTER_RESPONSE_SIZE];
+
+    for (;;) {
+        snprintf(command, sizeof(command), "export-range %016" PRIx64 " %016" PRIx64 "\n", lo, hi);
+        if (!shard_request(&router->nodes[from], from_fd, command, reply, sizeof(reply))) return false;
+
+        char* line = strstr(reply, "Exported: ");
+        if (!line) return false;
+        if (strtoul(line + 10, NULL, 10) == 0) return true;
+
+        size_t moved = 0;
+        for (line = strchr(line, '\n'); line && line[1]; line = strchr(line + 1, '\n')) {
+            char seed[65], id[65];
+            unsigned long long created, expiry;
+            if (sscanf(line + 1, "%64s %llu %llu", seed, &created, &expiry) != 3) continue;
+
+            snprintf(command, sizeof(command), "import %s %llu %llu\n", seed, created, expiry);
+            if (!shard_request(&router->nodes[to], to_fd, command, answer, sizeof(answer))) return false;
+            char* imported = strstr(answer, "Account imported: ");
+            if (!imported || sscanf(imported + 18, "%64s", id) != 1) return false;
+
+            snprintf(command, sizeof(command), "delete %s\n", id);
+            if (!shard_request(&router->nodes[from], from_fd, command, answer, sizeof(answer))) return false;
+            if (strstr(answer, "Account deleted")) {
+                pthread_mutex_lock(&router->lock);
+                if (router->nodes[from].accounts > 0) router->nodes[from].accounts--;
+                router->nodes[to].accounts++;
+                router->migrated++;
+                pthread_mutex_unlock(&router->lock);
+                moved++;
+                continue;
+            }
+
+            // A client deleted the account on the source, through the
+            // fallback, after it was exported; the import brought it back.
+            // Nothing would export the copy again, so its delete is retried
+            // until the new shard answers. If the source failed instead, the
+            // account is still there and is exported again.
+            while (!shard_request(&router->nodes[to], to_fd, command, answer, sizeof(answer))) {
+                if (__atomic_load_n(&router->stopping, __ATOMIC_ACQUIRE)) return false;
+                usleep(ROUTER_RETRY_MS * 1000);
+            }
+        }
+
+        // A batch that moved nothing may come back unchanged; leave it to
+        // the next pass rather than spin on it
+        if (moved == 0) return false;
+    }
+}
+
+// Background rebalance: the new shard's arcs were all owned by a single old
+// shard each, so every arc is one export/import/delete loop. Passes repeat
+// until one finds every arc empty on its old owner; until then lookups keep
+// falling back to the previous ring.
+static void* migration_thread(void* arg) {
+    ShardRouter* router = arg;
+    int fds[ROUTER_MAX_NODES];
+    bool complete = false;
+
+    for (int i = 0; i < ROUTER_MAX_NODES; i++) fds[i] = -1;
+
+    pthread_mutex_lock(&router->lock);
+    size_t joined = router->node_count - 1;
+    HashRing ring = router->ring;
+    HashRing previous = router->previous;
+    pthread_mutex_unlock(&router->lock);
+
+    for (int pass = 1; !__atomic_load_n(&router->stopping, __ATOMIC_ACQUIRE); pass++) {
+        complete = true;
+        for (size_t i = 0; i < ring.count; i++) {
+            if (ring.points[i].node != joined) continue;
+            uint64_t lo = ring.points[i == 0 ? ring.count - 1 : i - 1].point;
+            uint64_t hi = ring.points[i].point;
+            size_t from = ring_owner(&previous, hi);
+            if (!migrate_arc(router, from, joined, &fds[from], &fds[joined], lo, hi)) {
+                complete = false;
+            }
+        }
+        if (complete) break;
+
+        log_warn("Rebalance pass %d left accounts behind, retrying in %d ms", pass, ROUTER_RETRY_MS);
+        usleep(ROUTER_RETRY_MS * 1000);
+    }
+
+    for (int i = 0; i < ROUTER_MAX_NODES; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    if (!complete) {
+        log_warn("Rebalance to %s:%u stopped before it finished",
+                 router->nodes[joined].host, router->nodes[joined].port);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&router->lock);
+    free(router->previous.points);
+    router->previous.points = NULL;
+    router->previous.count = 0;
+    router->rebalancing = false;
+    size_t moved = router->migrated;
+    pthread_mutex_unlock(&router->lock);
+
+    log_info("Rebalance complete: moved %zu accounts to %s:%u", moved,
+           router->nodes[joined].host, router->nodes[joined].port);
+    return NULL;
+}
+
+// Add a shard while serving traffic. The new ring takes effect immediately;
+// until migration finishes, misses fall back to the previous owner.
+bool router_join_node(ShardRouter* router, const char* host, uint16_t port) {
+    HashRing ring;
+
+    pthread_mutex_lock(&router->lock);
+    if (router->rebalancing || !append_node(router, host, port)) {
+        pthread_mutex_unlock(&router->lock);
+        return false;
+    }
+    if (router->migrator_started) {
+        // The previous rebalance has finished; reap its thread
+        pthread_join(router->migrator, NULL);
+        router->migrator_started = false;
+    }
+    if (!ring_build(&ring, router->nodes, router->node_count)) {
+        router->node_count--;
+        pthread_mutex_unlock(&router->lock);
+        return false;
+    }
+
+    free(router->previous.points);
+    router->previous = router->ring;
+    router->ring = ring;
+    router->migrated = 0;
+    router->rebalancing = router->previous.count > 0;
+    if (router->rebalancing) {
+        router->migrator_started =
+            pthread_create(&router->migrator, NULL, migration_thread, router) == 0;
+        router->rebalancing = router->migrator_started;
+    }
+    pthread_mutex_unlock(&router->lock);
+    return true;
+}
+
+// Forward a command about one ID to its owner, falling back to the previous
+// owner while the ID's arc may still be migrating
+static void route_by_id(ShardRouter* router, const char* command, const char* id,
+                        CommandOutput* out, bool is_delete) {
+    uint64_t position = ring_position(id);
+    size_t size;
+    char* response = command_space(out, &size);
+    if (size == 0) return;
+
+    pthread_mutex_lock(&router->lock);
+    if (router->ring.count == 0) {
+        pthread_mutex_unlock(&router->lock);
+        command_printf(out, "\nNo shards configured\n");
+        return;
+    }
+    size_t owner = ring_owner(&router->ring, position);
+    size_t fallback = router->rebalancing ? ring_owner(&router->previous, position) : owner;
+    pthread_mutex_unlock(&router->lock);
+
+    ShardNode* node = &router->nodes[owner];
+    bool ok = shard_request(node, &node->socket_fd, command, response, size);
+    if (fallback != owner && (!ok || strstr(response, "not found") || strstr(response, "Failed"))) {
+        node = &router->nodes[fallback];
+        ok = shard_request(node, &node->socket_fd, command, response, size);
+    }
+
+    if (!ok) {
+        response[0] = '\0';
+        command_printf(out, "\nShard %s:%u unavailable\n", node->host, node->port);
+        return;
+    }
+    command_advance(out, strlen(response));
+    if (is_delete && strstr(response, "Account deleted")) {
+        pthread_mutex_lock(&router->lock);
+        if (node->accounts > 0) node->accounts--;
+        pthread_mutex_unlock(&router->lock);
+    }
+}
+
+static void cmd_create(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    // Least-loaded shard mints an ID on its own largest arc
+    ShardRouter* router = ctx;
+    char command[64];
+    uint64_t lo, hi;
+    size_t target = 0;
+
+    pthread_mutex_lock(&router->lock);
+    if (router->ring.count == 0) {
+        pthread_mutex_unlock(&router->lock);
+        command_printf(out, "\nNo shards configured\n");
+        return;
+    }
+    for (size_t i = 1; i < router->node_count; i++) {
+        if (router->nodes[i].accounts < router->nodes[target].accounts) target = i;
+    }
+    ring_largest_arc(&router->ring, target, &lo, &hi);
+    pthread_mutex_unlock(&router->lock);
+
+    ShardNode* node = &router->nodes[target];
+    size_t size;
+    char* response = command_space(out, &size);
+    snprintf(command, sizeof(command), "create %016" PRIx64 " %016" PRIx64 "\n", lo, hi);
+    if (size == 0) return;
+    if (!shard_request(node, &node->socket_fd, command, response, size)) {
+        response[0] = '\0';
+        command_printf(out, "\nShard %s:%u unavailable\n", node->host, node->port);
+        return;
+    }
+    command_advance(out, strlen(response));
+    if (strstr(response, "Account created")) {
+        pthread_mutex_lock(&router->lock);
+        node->accounts++;
+        pthread_mutex_unlock(&router->lock);
+    }
+}
+
+static void cmd_delete(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    char command[128];
+    snprintf(command, sizeof(command), "delete %s\n", args[0].text);
+    route_by_id(ctx, command, args[0].text, out, true);
+}
+
+static void cmd_lookup(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    char command[128];
+    snprintf(command, sizeof(command), "lookup %s\n", args[0].text);
+    route_by_id(ctx, command, args[0].text, out, false);
+}
+
+static void cmd_list(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    // Fan out and label each shard's reply
+    ShardRouter* router = ctx;
+    char* reply = arena_alloc(out->arena, ROUTER_RESPONSE_SIZE);
+    if (!reply) {
+        command_printf(out, "\nOut of request memory\n");
+        return;
+    }
+
+    for (size_t i = 0; i < router->node_count && !command_full(out); i++) {
+        ShardNode* node = &router->nodes[i];
+        bool ok = shard_request(node, &node->socket_fd, "list\n", reply, ROUTER_RESPONSE_SIZE);
+        command_printf(out, "\n[shard %s:%u]%s", node->host, node->port,
+                       ok ? reply : "\nunavailable\n");
+    }
+}
+
+static void cmd_nodes(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    ShardRouter* router = ctx;
+
+    pthread_mutex_lock(&router->lock);
+    command_printf(out, "\nShards: %zu%s\n", router->node_count,
+                   router->rebalancing ? " (rebalancing)" : "");
+    for (size_t n = 0; n < router->node_count; n++) {
+        // Ring share is the summed length of the shard's arcs
+        long double share = 0;
+        for (size_t i = 0; i < router->ring.count; i++) {
+            if (router->ring.points[i].node != n) continue;
+            uint64_t start = router->ring.points[i == 0 ? router->ring.count - 1 : i - 1].point;
+            share += (long double)(uint64_t)(router->ring.points[i].point - start);
+        }
+        command_printf(out, "%s:%u accounts %zu ring share %.1f%%\n",
+                       router->nodes[n].host, router->nodes[n].port,
+                       router->nodes[n].accounts,
+                       (double)(share * 100.0L / 18446744073709551616.0L));
+    }
+    command_printf(out, "Migrated: %zu\n", router->migrated);
+    pthread_mutex_unlock(&router->lock);
+}
+
+static void cmd_addnode(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    if (strlen(args[0].text) >= INET_ADDRSTRLEN) {
+        command_printf(out, "\nUsage: addnode <host>:<port>\n");
+    } else if (router_join_node(ctx, args[0].text, (uint16_t)args[0].value)) {
+        command_printf(out, "\nShard %s:%" PRIu64 " added, rebalancing in background\n",
+                       args[0].text, args[0].value);
+    } else {
+        command_printf(out, "\nFailed to add shard (unreachable, full, or a rebalance is running)\n");
+    }
+}
+
+static void cmd_stats(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    command_printf(out, "\n");
+    command_stats(&((ShardRouter*)ctx)->commands, out);
+    command_printf(out, "arena_high_water %zu\narena_failures %" PRIu64 "\n",
+                   out->arena->high_water, out->arena->failures);
+
+    size_t available;
+    char* tail = command_space(out, &available);
+    command_advance(out, metrics_report(tail, available));
+}
+
+static void cmd_help(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    command_help(&((ShardRouter*)ctx)->commands, out);
+}
+
+static void cmd_pipeline(void* ctx, const CommandArg* args, size_t argc, CommandOutput* out) {
+    command_pipeline(out);
+}
+
+static const CommandSpec router_commands[] = {
+    { "create", "", NULL, "Create an account on the least-loaded shard", 0, cmd_create },
+    { "lookup", "i", "<id>", "Look an account up on its owning shard", 0, cmd_lookup },
+    { "delete", "i", "<id>", "Delete an account on its owning shard", 0, cmd_delete },
+    { "list", "", NULL, "List accounts on every shard", 0, cmd_list },
+    { "nodes", "", NULL, "Show shards, load and ring share", 0, cmd_nodes },
+    { "addnode", "e", "<host>:<port>", "Add a shard and rebalance online", 0, cmd_addnode },
+    { "stats", "", NULL, "Show command counters and latency percentiles", 0, cmd_stats },
+    { "pipeline", "", NULL, "End every reply with a NUL byte so requests can be pipelined",
+      0, cmd_pipeline },
+    { "help", "", NULL, "Show this help message", 0, cmd_help },
+};
+
+static void register_commands(ShardRouter* router) {
+    command_init(&router->commands, router);
+    command_register_all(&router->commands, router_commands,
+                         sizeof(router_commands) / sizeof(router_commands[0]));
+}
+
+void router_handle(ShardRouter* router, char* command, CommandOutput* out) {
+    command_dispatch(&router->commands, command, out);
+}
@@ -0,0 +1,65 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "command.h"
+
+#define ROUTER_MAX_NODES 32
+#define ROUTER_VNODES 64           // Ring points per shard
+#define ROUTER_RESPONSE_SIZE 4096
+#define ROUTER_SHARD_TIMEOUT_S 2   // Longest wait for a shard's reply
+#define ROUTER_RETRY_MS 500        // Pause before retrying a rebalance pass that failed
+
+// One phantomid daemon in the cluster
+typedef struct {
+    char host[INET_ADDRSTRLEN];    // Shard address
+    uint16_t port;                 // Shard client port
+    size_t accounts;               // Accounts the router believes it holds
+    int socket_fd;                 // Connection used by the router's event loop
+} ShardNode;
+
+// A shard's point on the ring; it owns IDs in [previous point, point)
+typedef struct {
+    uint64_t point;                // Ring position
+    uint32_t node;                 // Index into ShardRouter.nodes
+} RingPoint;
+
+// Consistent-hash ring, points sorted by position
+typedef struct {
+    RingPoint* points;
+    size_t count;
+} HashRing;
+
+// Router state shared by the event loop and the migration thread
+typedef struct {
+    ShardNode nodes[ROUTER_MAX_NODES]; // Known shards
+    size_t node_count;             // Number of shards
+    HashRing ring;                 // Current ownership
+    HashRing previous;             // Ownership before an in-progress rebalance
+    bool rebalancing;              // Migration thread is moving arcs
+    size_t migrated;               // Accounts moved by the current rebalance
+    bool migrator_started;         // migrator has been created and not joined
+    pthread_t migrator;            // Background migration thread
+    pthread_mutex_t lock;          // Protects everything above
+    bool stopping;                 // Tells the migration thread to give up; atomic
+    CommandRegistry commands;      // Client command table
+} ShardRouter;
+
+// Ring primitives
+size_t ring_owner(const HashRing* ring, uint64_t position);
+uint64_t ring_position(const char* id);
+
+// Router lifecycle
+void router_init(ShardRouter* router);
+void router_cleanup(ShardRouter* router);
+bool router_add_node(ShardRouter* router, const char* host, uint16_t port);
+bool router_join_node(ShardRouter* router, const char* host, uint16_t port);
+
+// Route one client command and append the reply to out
+void router_handle(ShardRouter* router, char* command, CommandOutput* out);
+
+#endif // ROUTER_H
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "network.h"
+#include "router.h"
+#include "log.h"
+#include "metrics.h"
+
+static ShardRouter router;
+
+static void on_client_data(NetworkEndpoint* endpoint, NetworkPacket* packet) {
+    char* data = (char*)packet->data;
+    data[packet->size] = '\0';
+
+    Arena* arena = arena_thread();
+    char* response = arena ? arena_alloc(arena, ROUTER_RESPONSE_SIZE) : NULL;
+    if (!response) {
+        log_error("No request arena available");
+        return;
+    }
+
+    CommandOutput out = {
+        .data = response,
+        .size = ROUTER_RESPONSE_SIZE,
+        .length = 0,
+        .arena = arena,
+        .rate = endpoint->client ? &endpoint->client->rate : NULL,
+        .session = endpoint->client ? &endpoint->client->session : NULL
+    };
+    response[0] = '\0';
+    uint64_t start = metrics_start();
+    router_handle(&router, data, &out);
+    metrics_record(METRIC_DISPATCH, start);
+
+    NetworkPacket resp = {
+        .data = response,
+        .size = out.length,
+        .flags = 0
+    };
+    if (net_send(endpoint, &resp) < 0) {
+        log_warn("Failed to send response to client");
+    }
+    arena_reset(arena);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [OPTIONS]\n", program_name);
+    printf("Options:\n");
+    printf("  -p, --port PORT         Port to listen on (default: 8800)\n");
+    printf("  -s, --shard HOST:PORT   Add a phantomid shard (repeatable)\n");
+    printf("  --socket-profile NAME   latency, throughput or none (default: latency)\n");
+    printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char* argv[]) {
+    uint16_t port = 8800;
+    const NetworkTuning* tuning = &net_tuning_latency;
+
+    router_init(&router);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        }
+        else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) {
+            int temp_port = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            if (temp_port > 0 && temp_port < 65536) {
+                port = (uint16_t)temp_port;
+                i++;
+            } else {
+                fprintf(stderr, "Invalid port number. Must be between 1 and 65535\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--shard") == 0) {
+            char* colon = i + 1 < argc ? strrchr(argv[i + 1], ':') : NULL;
+            int shard_port = colon ? atoi(colon + 1) : 0;
+            if (!colon || shard_port <= 0 || shard_port > 65535) {
+                fprintf(stderr, "Shards must be given as HOST:PORT\n");
+                return 1;
+            }
+            *colon = '\0';
+            if (!router_add_node(&router, argv[i + 1], (uint16_t)shard_port)) {
+                fprintf(stderr, "Failed to add shard %s:%d\n", argv[i + 1], shard_port);
+                return 1;
+            }
+            i++;
+        }
+        else if (strcmp(argv[i], "--socket-profile") == 0) {
+            const char* name = i + 1 < argc ? argv[++i] : "";
+            tuning = net_tuning_find(name);
+            if (!tuning && strcmp(name, "none") != 0) {
+                fprintf(stderr, "Unknown socket profile: %s\n", name);
+                return 1;
+            }
+        }
+    }
+
+    if (!log_start(LOG_LEVEL_INFO)) {
+        fprintf(stderr, "Failed to start logger\n");
+        return 1;
+    }
+
+    NetworkEndpoint server = {
+        .address = "0.0.0.0",
+        .port = port,
+        .protocol = NET_TCP,
+        .role = NET_SERVER,
+        .mode = NET_NONBLOCKING,
+        .tuning = tuning
+    };
+
+    NetworkProgram program = {
+        .endpoints = &server,
+        .count = 1,
+        .on_receive = on_client_data,
+        .line_requests = true
+    };
+
+    if (!net_init(&server)) {
+        log_error("Failed to initialize router");
+        log_stop();
+        return 1;
+    }
+
+    log_info("PhantomID router on port %d with %zu shards", port, router.node_count);
+    net_run(&program);
+
+    router_cleanup(&router);
+    log_stop();
+    return 0;
+}
@@ -0,0 +1,197 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "wal.h"
+#include "log.h"
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t written = write(fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        ptr += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t size, off_t offset) {
+    uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t got = pread(fd, ptr, size, offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        ptr += got;
+        offset += got;
+        size -= (size_t)got;
+    }
+    return true;
+}
+
+// Map a record table of at least min_capacity slots. If a snapshot exists at
+// path it is mapped copy-on-write over the start of the table, so records are
+// paged in on first touch instead of being parsed at startup. On huge pages
+// the snapshot is read in instead, since a file mapping would split them.
+bool snapshot_map(const char* path, uint32_t record_size, size_t min_capacity,
+                  bool huge_pages, SnapshotMap* map) {
+    SnapshotHeader header = {0};
+    size_t file_length = 0;
+    int fd = -1;
+
+    memset(map, 0, sizeof(*map));
+
+    if (path) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0 && errno != ENOENT) {
+            log_error("Snapshot open failed: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    if (fd >= 0) {
+        struct stat st;
+        if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != SNAPSHOT_VERSION ||
+            header.record_size != record_size) {
+            log_error("Snapshot %s is not a compatible snapshot file", path);
+            close(fd);
+            return false;
+        }
+
+        file_length = SNAPSHOT_HEADER_SIZE + header.capacity * record_size;
+        if (fstat(fd, &st) < 0 || (size_t)st.st_size < file_length) {
+            log_error("Snapshot %s is truncated", path);
+            close(fd);
+            return false;
+        }
+    }
+
+    map->capacity = header.capacity > min_capacity ? header.capacity : min_capacity;
+    map->length = SNAPSHOT_HEADER_SIZE + map->capacity * record_size;
+
+    // Reserve the whole table as zeroed anonymous memory first
+    map->base = arena_map(&map->length, huge_pages, &map->pages);
+    if (!map->base) {
+        log_error("Snapshot table reservation failed: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    if (fd >= 0 && map->pages != ARENA_PAGES_DEFAULT) {
+        bool copied = read_all(fd, map->base, file_length, 0);
+        close(fd);
+        if (!copied) {
+            log_error("Snapshot read failed: %s", strerror(errno));
+            arena_unmap(map->base, map->length);
+            map->base = NULL;
+            return false;
+        }
+    } else if (fd >= 0) {
+        // Then overlay the file; private writes never reach the snapshot
+        void* file_map = mmap(map->base, file_length, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_FIXED, fd, 0);
+        close(fd);
+        if (file_map == MAP_FAILED) {
+            log_error("Snapshot mmap failed: %s", strerror(errno));
+            arena_unmap(map->base, map->length);
+            map->base = NULL;
+            return false;
+        }
+        madvise(map->base, file_length, MADV_RANDOM);
+    }
+
+    map->records = (uint8_t*)map->base + SNAPSHOT_HEADER_SIZE;
+    map->header = header;
+    return true;
+}
+
+void snapshot_unmap(SnapshotMap* map) {
+    if (map->base) {
+        arena_unmap(map->base, map->length);
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+// Write a snapshot chunk by chunk through copy, then atomically replace path.
+// Each chunk is only consistent with itself; replaying the log from wal_lsn
+// on top of the file restores a consistent table.
+bool snapshot_write(const char* path, uint32_t record_size, size_t capacity,
+                    uint64_t wal_lsn, SnapshotCopyFn copy, void* ctx) {
+    char tmp_path[PATH_MAX];
+    uint8_t header_page[SNAPSHOT_HEADER_SIZE] = {0};
+    SnapshotHeader header = {0};
+    size_t next_free = SIZE_MAX;
+    bool ok = false;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return false;
+    }
+
+    uint8_t* chunk = malloc((size_t)SNAPSHOT_CHUNK_RECORDS * record_size);
+    if (!chunk) return false;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        log_error("Snapshot create failed: %s", strerror(errno));
+        free(chunk);
+        return false;
+    }
+
+    // Placeholder header; the real one is written once counts are known
+    if (!write_all(fd, header_page, sizeof(header_page))) goto cleanup;
+
+    for (size_t first = 0; first < capacity; first += SNAPSHOT_CHUNK_RECORDS) {
+        size_t count = capacity - first;
+        size_t chunk_free = SIZE_MAX;
+        if (count > SNAPSHOT_CHUNK_RECORDS) count = SNAPSHOT_CHUNK_RECORDS;
+
+        size_t occupied = copy(ctx, first, count, chunk, &chunk_free);
+        if (occupied == SNAPSHOT_COPY_FAILED) {
+            errno = EIO;
+            goto cleanup;
+        }
+        header.record_count += occupied;
+        if (next_free == SIZE_MAX) next_free = chunk_free;
+
+        if (!write_all(fd, chunk, count * record_size)) goto cleanup;
+    }
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.record_size = record_size;
+    header.capacity = capacity;
+    header.wal_lsn = wal_lsn;
+    header.next_free = next_free == SIZE_MAX ? capacity : next_free;
+    memcpy(header_page, &header, sizeof(header));
+
+    if (pwrite(fd, header_page, sizeof(header_page), 0) != (ssize_t)sizeof(header_page)) goto cleanup;
+    if (fdatasync(fd) < 0) goto cleanup;
+    ok = true;
+
+cleanup:
+    if (!ok) log_error("Snapshot write failed: %s", strerror(errno));
+    close(fd);
+    free(chunk);
+
+    if (ok && rename(tmp_path, path) < 0) {
+        log_error("Snapshot rename failed: %s", strerror(errno));
+        ok = false;
+    }
+    if (ok) {
+        wal_sync_parent_dir(path);
+    } else {
+        unlink(tmp_path);
+    }
+    return ok;
+}
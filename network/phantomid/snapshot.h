@@ -0,0 +1,50 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+
+#define SNAPSHOT_MAGIC "PHSNAP01"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 4096  // Records start page aligned
+#define SNAPSHOT_CHUNK_RECORDS 4096
+
+// On-disk header, padded out to SNAPSHOT_HEADER_SIZE
+typedef struct {
+    char magic[8];             // SNAPSHOT_MAGIC
+    uint32_t version;          // SNAPSHOT_VERSION
+    uint32_t record_size;      // Size of one fixed record
+    uint64_t capacity;         // Number of record slots in the file
+    uint64_t record_count;     // Number of occupied slots
+    uint64_t wal_lsn;          // Log records up to this LSN are included
+    uint64_t next_free;        // Lowest free slot at checkpoint time
+} SnapshotHeader;
+
+// A table of fixed records, optionally backed by a snapshot file
+typedef struct {
+    void* base;                // Start of the mapping
+    size_t length;             // Length of the mapping
+    void* records;             // First record slot
+    size_t capacity;           // Number of record slots mapped
+    ArenaPages pages;          // Page backing of the table
+    SnapshotHeader header;     // Header of the loaded file (zeroed if none)
+} SnapshotMap;
+
+// Copies slots [first, first + count) into dst and reports how many are
+// occupied and the lowest free slot seen (or SIZE_MAX if none). Returns
+// SNAPSHOT_COPY_FAILED when what it copied must not be saved, which
+// abandons the snapshot and keeps the old file.
+#define SNAPSHOT_COPY_FAILED SIZE_MAX
+typedef size_t (*SnapshotCopyFn)(void* ctx, size_t first, size_t count,
+                                 void* dst, size_t* first_free);
+
+// Mapping and checkpointing
+bool snapshot_map(const char* path, uint32_t record_size, size_t min_capacity,
+                  bool huge_pages, SnapshotMap* map);
+void snapshot_unmap(SnapshotMap* map);
+bool snapshot_write(const char* path, uint32_t record_size, size_t capacity,
+                    uint64_t wal_lsn, SnapshotCopyFn copy, void* ctx);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "log.h"
+
+// One finished span
+typedef struct {
+    uint64_t start_ns;             // CLOCK_MONOTONIC
+    uint64_t duration_ns;
+    uint64_t request;              // Number of the sampled request
+    uint8_t event;                 // TraceEvent
+} TraceRecord;
+
+// Append-only buffer owned by one thread. Full buffers drop rather than
+// wrap, so the dump never reads a record while it is being overwritten.
+typedef struct {
+    TraceRecord* records;          // TRACE_RING_EVENTS slots, kept for reuse
+    uint64_t count;                // Records published to the dump
+    uint64_t dropped;              // Records lost because the buffer was full
+    uint32_t generation;           // Capture the records belong to
+    pid_t tid;                     // Owner's kernel thread ID
+    char name[16];                 // Owner's thread name
+    bool in_use;                   // Claimed by a live thread
+} TraceRing;
+
+static struct {
+    TraceRing rings[TRACE_MAX_THREADS];
+    pthread_mutex_t lock;          // Claiming rings, starting and dumping
+    pthread_key_t ring_key;        // Releases a ring when its thread exits
+    bool key_created;
+    volatile bool active;
+    uint32_t generation;           // Bumped by every trace_start
+    uint32_t sample_every;
+    uint64_t requests;             // Requests seen by the current capture
+    uint64_t base_ns;              // Start of the current capture
+} g_trace = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sample_every = 1
+};
+
+static __thread TraceRing* tls_ring;
+static __thread bool tls_sampled;
+static __thread uint64_t tls_request;
+static __thread uint64_t tls_request_start;
+
+static const char* event_names[TRACE_EVENT_COUNT] = {
+    "request", "ready", "recv", "dispatch", "crypto", "state_lock", "store", "wal_wait", "send"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The records stay behind for the dump; only the claim is given up
+static void release_ring(void* ring) {
+    pthread_mutex_lock(&g_trace.lock);
+    ((TraceRing*)ring)->in_use = false;
+    pthread_mutex_unlock(&g_trace.lock);
+}
+
+// Claim a ring for the calling thread, skipping free rings that still hold
+// records of the current capture
+static TraceRing* claim_ring(void) {
+    TraceRing* ring = NULL;
+
+    pthread_mutex_lock(&g_trace.lock);
+    if (!g_trace.key_created) {
+        g_trace.key_created = pthread_key_create(&g_trace.ring_key, release_ring) == 0;
+    }
+    for (size_t i = 0; i < TRACE_MAX_THREADS && !ring; i++) {
+        TraceRing* candidate = &g_trace.rings[i];
+        if (candidate->in_use) continue;
+        if (candidate->generation == g_trace.generation && candidate->count > 0) continue;
+        if (!candidate->records) {
+            candidate->records = malloc(TRACE_RING_EVENTS * sizeof(TraceRecord));
+            if (!candidate->records) break;
+        }
+        candidate->in_use = true;
+        candidate->count = 0;
+        candidate->dropped = 0;
+        candidate->generation = g_trace.generation;
+        candidate->tid = (pid_t)syscall(SYS_gettid);
+        if (pthread_getname_np(pthread_self(), candidate->name, sizeof(candidate->name)) != 0) {
+            snprintf(candidate->name, sizeof(candidate->name), "thread");
+        }
+        ring = candidate;
+    }
+    pthread_mutex_unlock(&g_trace.lock);
+
+    if (ring && g_trace.key_created) {
+        pthread_setspecific(g_trace.ring_key, ring);
+    }
+    return ring;
+}
+
+static void record(TraceEvent event, uint64_t start, uint64_t end) {
+    TraceRing* ring = tls_ring;
+    if (ring->count == TRACE_RING_EVENTS) {
+        ring->dropped++;
+        return;
+    }
+
+    ring->records[ring->count] = (TraceRecord){
+        .start_ns = start,
+        .duration_ns = end > start ? end - start : 0,
+        .request = tls_request,
+        .event = (uint8_t)event
+    };
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+void trace_start(uint32_t sample_every) {
+    pthread_mutex_lock(&g_trace.lock);
+    g_trace.generation++;
+    g_trace.sample_every = sample_every > 0 ? sample_every : 1;
+    g_trace.base_ns = now_ns();
+    __atomic_store_n(&g_trace.requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_trace.active, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_trace.lock);
+
+    log_info("Tracing 1 in %u requests", g_trace.sample_every);
+}
+
+bool trace_active(void) {
+    return __atomic_load_n(&g_trace.active, __ATOMIC_ACQUIRE);
+}
+
+uint32_t trace_sample_every(void) {
+    return g_trace.sample_every;
+}
+
+uint64_t trace_clock(void) {
+    return trace_active() ? now_ns() : 0;
+}
+
+bool trace_request_begin(uint64_t ready) {
+    tls_sampled = false;
+    if (!trace_active()) return false;
+
+    uint64_t n = __atomic_fetch_add(&g_trace.requests, 1, __ATOMIC_RELAXED);
+    if (n % g_trace.sample_every != 0) return false;
+
+    // A ring from an earlier capture starts over
+    if (tls_ring && tls_ring->generation != g_trace.generation) {
+        pthread_mutex_lock(&g_trace.lock);
+        tls_ring->dropped = 0;
+        tls_ring->generation = g_trace.generation;
+        __atomic_store_n(&tls_ring->count, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&g_trace.lock);
+    }
+    if (!tls_ring && !(tls_ring = claim_ring())) return false;
+
+    tls_sampled = true;
+    tls_request = n + 1;
+    tls_request_start = ready ? ready : now_ns();
+    if (ready) record(TRACE_READY, ready, now_ns());
+    return true;
+}
+
+void trace_request_end(void) {
+    if (!tls_sampled) return;
+    record(TRACE_REQUEST, tls_request_start, now_ns());
+    tls_sampled = false;
+}
+
+uint64_t trace_begin(void) {
+    return tls_sampled ? now_ns() : 0;
+}
+
+void trace_end(TraceEvent event, uint64_t start) {
+    if (start == 0 || !tls_sampled) return;
+    record(event, start, now_ns());
+}
+
+// Microseconds since the capture started, as Chrome trace expects
+static double trace_us(uint64_t ns) {
+    return ns > g_trace.base_ns ? (ns - g_trace.base_ns) / 1e3 : 0.0;
+}
+
+bool trace_stop(const char* path, size_t* events) {
+    uint64_t dropped = 0;
+    pid_t pid = getpid();
+    *events = 0;
+
+    pthread_mutex_lock(&g_trace.lock);
+    if (!g_trace.active) {
+        pthread_mutex_unlock(&g_trace.lock);
+        return false;
+    }
+    __atomic_store_n(&g_trace.active, false, __ATOMIC_RELEASE);
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        pthread_mutex_unlock(&g_trace.lock);
+        log_error("Cannot write trace to %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (size_t i = 0; i < TRACE_MAX_THREADS; i++) {
+        TraceRing* ring = &g_trace.rings[i];
+        if (!ring->records || ring->generation != g_trace.generation) continue;
+
+        // Requests still in flight may append while this runs; only the
+        // records published before this load are read
+        uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        if (count == 0) continue;
+        dropped += ring->dropped;
+
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", pid, ring->tid, ring->name);
+        first = false;
+
+        for (uint64_t j = 0; j < count; j++) {
+            const TraceRecord* r = &ring->records[j];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"phantomid\",\"ph\":\"X\",\"pid\":%d,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%lu}}",
+                    event_names[r->event], pid, ring->tid, trace_us(r->start_ns),
+                    r->duration_ns / 1e3, r->request);
+        }
+        *events += count;
+    }
+    fprintf(file, "\n],\"otherData\":{\"sample_every\":%u,\"requests\":%lu,\"dropped\":%lu}}\n",
+            g_trace.sample_every, g_trace.requests, dropped);
+
+    bool success = fflush(file) == 0;
+    success = fclose(file) == 0 && success;
+    pthread_mutex_unlock(&g_trace.lock);
+
+    if (!success) {
+        log_error("Failed to write trace to %s", path);
+        return false;
+    }
+    log_info("Wrote %zu trace events to %s", *events, path);
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_RING_EVENTS 16384    // Events kept per thread per capture
+#define TRACE_MAX_THREADS 64
+#define TRACE_DEFAULT_PATH "phantomid-trace.json"
+
+// Spans recorded for a sampled request
+typedef enum {
+    TRACE_REQUEST,             // Readiness to response sent
+    TRACE_READY,               // select() returning until the socket is read
+    TRACE_RECV,                // Reading the request
+    TRACE_DISPATCH,            // Parsing and running the command
+    TRACE_CRYPTO,              // Seed and ID generation
+    TRACE_STATE_LOCK,          // Waiting for state_lock
+    TRACE_STORE,               // Table access under state_lock
+    TRACE_WAL_WAIT,            // Waiting for the group commit
+    TRACE_SEND,                // Writing the response
+    TRACE_EVENT_COUNT
+} TraceEvent;
+
+// Begin a capture that records every sample_every-th request (1 traces
+// all of them). Restarting discards the previous capture.
+void trace_start(uint32_t sample_every);
+
+// End the capture and write it to path as Chrome trace JSON, loadable in
+// chrome://tracing or ui.perfetto.dev; *events receives the count written
+bool trace_stop(const char* path, size_t* events);
+
+bool trace_active(void);
+uint32_t trace_sample_every(void);
+
+// Timestamp while a capture runs, 0 otherwise. Taken when readiness is
+// reported, before it is known which request will be sampled.
+uint64_t trace_clock(void);
+
+// Decide whether the calling thread's next request is sampled; ready is
+// the trace_clock() value from when its socket became readable
+bool trace_request_begin(uint64_t ready);
+void trace_request_end(void);
+
+// Span timing within a sampled request: trace_begin returns 0 when the
+// current request is not sampled, and trace_end ignores a 0 start
+uint64_t trace_begin(void);
+void trace_end(TraceEvent event, uint64_t start);
+
+#endif // TRACE_H
@@ -0,0 +1,380 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include "wal.h"
+#include "log.h"
+#include "lockprof.h"
+#include "affinity.h"
+
+// FNV-1a over the record body, excluding the checksum itself
+static uint32_t wal_checksum(const WalRecord* record) {
+    const uint8_t* bytes = (const uint8_t*)record;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < offsetof(WalRecord, checksum); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    const uint8_t* ptr = data;
+    while (size > 0) {
+        ssize_t written = write(fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        ptr += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// Group-commit thread: batches everything appended during the commit
+// window into a single write and a single fdatasync
+static void* wal_flusher(void* arg) {
+    WriteAheadLog* wal = arg;
+    affinity_apply(THREAD_WAL);
+
+    lock_acquire(&wal->lock, LOCK_WAL);
+    while (wal->running || wal->pending_count > 0) {
+        while (wal->running && wal->pending_count == 0) {
+            lock_cond_wait(&wal->appended, &wal->lock);
+        }
+        if (wal->pending_count == 0) break;
+
+        // Give concurrent committers a chance to join this batch
+        if (wal->commit_window_us > 0 && wal->running) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)wal->commit_window_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+
+            while (wal->running && wal->pending_count < WAL_BUFFER_RECORDS) {
+                if (lock_cond_timedwait(&wal->appended, &wal->lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+
+        // Take ownership of the batch so appenders can keep going
+        WalRecord* batch = wal->pending;
+        size_t count = wal->pending_count;
+        uint64_t last_lsn = batch[count - 1].lsn;
+        wal->pending = wal->writing;
+        wal->writing = batch;
+        wal->pending_count = 0;
+        wal->flushing = true;
+        bool failed = wal->failed;
+        pthread_cond_broadcast(&wal->drained);
+        lock_release(&wal->lock);
+
+        // Nothing is written after a failure, so durable_lsn never skips
+        // over the records that were lost. A batch that failed is cut off
+        // again, so a restart cannot replay mutations that were rolled back.
+        off_t start = failed ? -1 : lseek(wal->fd, 0, SEEK_END);
+        bool ok = start >= 0 && write_all(wal->fd, batch, count * sizeof(WalRecord)) &&
+                  fdatasync(wal->fd) == 0;
+        if (!ok && !failed) {
+            log_error("WAL write failed: %s", strerror(errno));
+            if (start >= 0 && ftruncate(wal->fd, start) < 0) {
+                log_error("WAL truncate after failed write failed: %s", strerror(errno));
+            }
+        }
+
+        lock_acquire(&wal->lock, LOCK_WAL);
+        wal->flushing = false;
+        if (ok) {
+            wal->durable_lsn = last_lsn;
+            wal->sync_count++;
+            wal->record_count += count;
+        } else {
+            wal->failed = true;
+        }
+        pthread_cond_broadcast(&wal->flushed);
+        pthread_cond_broadcast(&wal->drained);
+
+        if (wal->on_flush) {
+            uint64_t durable_lsn = wal->durable_lsn;
+            lock_release(&wal->lock);
+            wal->on_flush(wal->flush_ctx, durable_lsn, !ok);
+            lock_acquire(&wal->lock, LOCK_WAL);
+        }
+    }
+    lock_release(&wal->lock);
+
+    return NULL;
+}
+
+// Open (or create) the log file
+bool wal_open(WriteAheadLog* wal, const char* path, uint32_t commit_window_us) {
+    memset(wal, 0, sizeof(*wal));
+
+    wal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (wal->fd < 0) {
+        log_error("WAL open failed: %s", strerror(errno));
+        return false;
+    }
+
+    wal->path = strdup(path);
+    wal->pending = calloc(WAL_BUFFER_RECORDS, sizeof(WalRecord));
+    wal->writing = calloc(WAL_BUFFER_RECORDS, sizeof(WalRecord));
+    if (!wal->path || !wal->pending || !wal->writing) {
+        free(wal->path);
+        free(wal->pending);
+        free(wal->writing);
+        close(wal->fd);
+        return false;
+    }
+
+    wal->commit_window_us = commit_window_us;
+    wal->next_lsn = 1;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->appended, NULL);
+    pthread_cond_init(&wal->flushed, NULL);
+    pthread_cond_init(&wal->drained, NULL);
+
+    return true;
+}
+
+// Apply every valid record newer than after_lsn; a torn or corrupt tail is
+// truncated away
+bool wal_replay(WriteAheadLog* wal, uint64_t after_lsn, WalApplyFn apply, void* ctx) {
+    WalRecord record;
+    off_t offset = 0;
+
+    if (lseek(wal->fd, 0, SEEK_SET) < 0) {
+        log_error("WAL seek failed: %s", strerror(errno));
+        return false;
+    }
+
+    for (;;) {
+        ssize_t got = 0;
+        while (got < (ssize_t)sizeof(record)) {
+            ssize_t n = read(wal->fd, (uint8_t*)&record + got, sizeof(record) - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += n;
+        }
+
+        if (got == 0) break;
+        if (got < (ssize_t)sizeof(record) || record.checksum != wal_checksum(&record) ||
+            record.lsn < wal->next_lsn) {
+            log_warn("WAL: discarding damaged tail at offset %lld", (long long)offset);
+            if (ftruncate(wal->fd, offset) < 0) {
+                log_error("WAL truncate failed: %s", strerror(errno));
+                return false;
+            }
+            break;
+        }
+
+        if (record.lsn > after_lsn) {
+            apply(&record, ctx);
+        }
+        wal->next_lsn = record.lsn + 1;
+        wal->durable_lsn = record.lsn;
+        offset += sizeof(record);
+    }
+
+    // A compacted log may be empty; never reuse LSNs a checkpoint covers
+    if (wal->next_lsn <= after_lsn) {
+        wal->next_lsn = after_lsn + 1;
+        wal->durable_lsn = after_lsn;
+    }
+
+    return true;
+}
+
+// Start the group-commit thread
+bool wal_start(WriteAheadLog* wal) {
+    wal->running = true;
+    if (pthread_create(&wal->flusher, NULL, wal_flusher, wal) != 0) {
+        wal->running = false;
+        return false;
+    }
+    return true;
+}
+
+// Register the flush listener; must precede wal_start
+void wal_on_flush(WriteAheadLog* wal, WalFlushFn fn, void* ctx) {
+    wal->on_flush = fn;
+    wal->flush_ctx = ctx;
+}
+
+// Flush anything still pending and release the log
+void wal_close(WriteAheadLog* wal) {
+    lock_acquire(&wal->lock, LOCK_WAL);
+    bool started = wal->running;
+    wal->running = false;
+    pthread_cond_signal(&wal->appended);
+    lock_release(&wal->lock);
+
+    if (started) {
+        pthread_join(wal->flusher, NULL);
+    }
+
+    close(wal->fd);
+    free(wal->path);
+    free(wal->pending);
+    free(wal->writing);
+    pthread_cond_destroy(&wal->drained);
+    pthread_cond_destroy(&wal->flushed);
+    pthread_cond_destroy(&wal->appended);
+    pthread_mutex_destroy(&wal->lock);
+}
+
+// Queue a record for the next group commit; returns its LSN or 0 on failure
+uint64_t wal_append(WriteAheadLog* wal, WalRecord* record) {
+    uint64_t lsn = 0;
+
+    lock_acquire(&wal->lock, LOCK_WAL);
+    while (!wal->failed && wal->pending_count == WAL_BUFFER_RECORDS) {
+        lock_cond_wait(&wal->drained, &wal->lock);
+    }
+
+    if (!wal->failed) {
+        lsn = wal->next_lsn++;
+        record->lsn = lsn;
+        record->reserved = 0;
+        record->checksum = wal_checksum(record);
+        wal->pending[wal->pending_count++] = *record;
+        pthread_cond_signal(&wal->appended);
+    }
+    lock_release(&wal->lock);
+
+    return lsn;
+}
+
+// Block until the record with the given LSN is durable
+bool wal_wait(WriteAheadLog* wal, uint64_t lsn) {
+    bool durable;
+
+    if (lsn == 0) return false;
+
+    lock_acquire(&wal->lock, LOCK_WAL);
+    while (!wal->failed && wal->durable_lsn < lsn) {
+        lock_cond_wait(&wal->flushed, &wal->lock);
+    }
+    durable = wal->durable_lsn >= lsn;
+    lock_release(&wal->lock);
+
+    return durable;
+}
+
+// LSN of the most recently appended record
+uint64_t wal_last_lsn(WriteAheadLog* wal) {
+    lock_acquire(&wal->lock, LOCK_WAL);
+    uint64_t lsn = wal->next_lsn - 1;
+    lock_release(&wal->lock);
+    return lsn;
+}
+
+// Copy whole records in [from, to) newer than after_lsn from src to dst
+static bool copy_records(int src, off_t from, off_t to, int dst, uint64_t after_lsn) {
+    WalRecord records[256];
+
+    while (from < to) {
+        size_t want = (size_t)(to - from);
+        if (want > sizeof(records)) want = sizeof(records);
+
+        ssize_t got = pread(src, records, want, from);
+        if (got <= 0) return false;
+        got -= got % (ssize_t)sizeof(WalRecord);
+        if (got == 0) return false;
+
+        size_t count = (size_t)got / sizeof(WalRecord);
+        size_t keep = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (records[i].lsn > after_lsn) {
+                records[keep++] = records[i];
+            }
+        }
+        if (!write_all(dst, records, keep * sizeof(WalRecord))) return false;
+        from += got;
+    }
+    return true;
+}
+
+// Make a rename durable by syncing the containing directory
+bool wal_sync_parent_dir(const char* path) {
+    char dir[PATH_MAX];
+    const char* slash = strrchr(path, '/');
+
+    if (!slash) {
+        strcpy(dir, ".");
+    } else if (slash == path) {
+        strcpy(dir, "/");
+    } else {
+        size_t len = (size_t)(slash - path);
+        if (len >= sizeof(dir)) return false;
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Rewrite the log without records at or below after_lsn. The bulk of the copy
+// happens without the lock; appenders are only held up while the short tail
+// written in the meantime is copied and the new file swapped in.
+bool wal_compact(WriteAheadLog* wal, uint64_t after_lsn) {
+    char tmp_path[PATH_MAX];
+    bool ok = false;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.compact", wal->path) >= (int)sizeof(tmp_path)) {
+        return false;
+    }
+
+    int tmp_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (tmp_fd < 0) {
+        log_error("WAL compact failed: %s", strerror(errno));
+        return false;
+    }
+
+    // Only the flusher appends, so the record-aligned prefix is stable
+    off_t stable = lseek(wal->fd, 0, SEEK_END);
+    stable -= stable % (off_t)sizeof(WalRecord);
+    if (stable < 0 || !copy_records(wal->fd, 0, stable, tmp_fd, after_lsn)) {
+        goto fail;
+    }
+
+    lock_acquire(&wal->lock, LOCK_WAL);
+    while (wal->flushing) {
+        lock_cond_wait(&wal->flushed, &wal->lock);
+    }
+
+    off_t end = lseek(wal->fd, 0, SEEK_END);
+    ok = end >= stable &&
+         copy_records(wal->fd, stable, end, tmp_fd, after_lsn) &&
+         fdatasync(tmp_fd) == 0 &&
+         rename(tmp_path, wal->path) == 0;
+    if (ok) {
+        close(wal->fd);
+        wal->fd = tmp_fd;
+    }
+    lock_release(&wal->lock);
+
+    // Until the directory is synced, a crash can bring the old file back
+    if (ok && !wal_sync_parent_dir(wal->path)) {
+        log_warn("WAL compact: directory sync failed: %s", strerror(errno));
+    }
+    if (ok) return true;
+
+fail:
+    log_error("WAL compact failed: %s", strerror(errno));
+    close(tmp_fd);
+    unlink(tmp_path);
+    return false;
+}
@@ -0,0 +1,81 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define WAL_BUFFER_RECORDS 4096
+
+// Logged account mutations
+typedef enum {
+    WAL_CREATE = 1,
+    WAL_DELETE = 2
+} WalRecordType;
+
+// Fixed-size on-disk record (136 bytes, no padding)
+typedef struct {
+    uint32_t type;             // WalRecordType
+    uint32_t slot;             // Account table slot the mutation applies to
+    uint64_t lsn;              // Log sequence number, assigned by wal_append
+    uint8_t seed[32];          // Cryptographic seed (create only)
+    char id[64];               // Anonymous ID, not NUL terminated
+    uint64_t creation_time;    // Account creation timestamp
+    uint64_t expiry_time;      // Account expiry timestamp
+    uint32_t checksum;         // FNV-1a over every preceding byte
+    uint32_t reserved;         // Keeps the record 8-byte aligned
+} WalRecord;
+
+// Called by the flusher after each batch, outside the log lock, with the
+// highest durable LSN. Once failed is set, no record past that LSN will
+// ever reach the disk.
+typedef void (*WalFlushFn)(void* ctx, uint64_t durable_lsn, bool failed);
+
+// Append-only log with group commit
+typedef struct {
+    char* path;                // Log file path
+    int fd;                    // Log file descriptor
+    uint32_t commit_window_us; // How long the flusher waits for more records
+    WalRecord* pending;        // Records appended but not yet written
+    size_t pending_count;      // Number of records in pending
+    WalRecord* writing;        // Batch currently owned by the flusher
+    uint64_t next_lsn;         // LSN handed to the next appended record
+    uint64_t durable_lsn;      // Highest LSN known to be on disk
+    uint64_t sync_count;       // Number of fdatasync calls issued
+    uint64_t record_count;     // Number of records made durable
+    bool flushing;             // Flusher is writing a batch outside the lock
+    bool failed;               // Set once a write or sync fails
+    bool running;              // Flusher thread running state
+    pthread_t flusher;         // Background group-commit thread
+    WalFlushFn on_flush;       // Told of every batch, NULL if nobody listens
+    void* flush_ctx;           // Passed to on_flush
+    pthread_mutex_t lock;      // Protects every field above
+    pthread_cond_t appended;   // Signalled when pending gains records
+    pthread_cond_t flushed;    // Signalled when durable_lsn advances
+    pthread_cond_t drained;    // Signalled when pending has room again
+} WriteAheadLog;
+
+// Replay callback, invoked once per valid record in log order
+typedef void (*WalApplyFn)(const WalRecord* record, void* ctx);
+
+// Log lifecycle
+bool wal_open(WriteAheadLog* wal, const char* path, uint32_t commit_window_us);
+bool wal_replay(WriteAheadLog* wal, uint64_t after_lsn, WalApplyFn apply, void* ctx);
+bool wal_start(WriteAheadLog* wal);
+void wal_on_flush(WriteAheadLog* wal, WalFlushFn fn, void* ctx);
+void wal_close(WriteAheadLog* wal);
+
+// Appending and group commit
+uint64_t wal_append(WriteAheadLog* wal, WalRecord* record);
+bool wal_wait(WriteAheadLog* wal, uint64_t lsn);
+uint64_t wal_last_lsn(WriteAheadLog* wal);
+
+// Drop records already captured by a checkpoint
+bool wal_compact(WriteAheadLog* wal, uint64_t after_lsn);
+
+// Make a rename durable by syncing the directory that holds path; shared
+// with snapshots
+bool wal_sync_parent_dir(const char* path);
+
+#endif // WAL_H